@@ -18,6 +18,7 @@
 
 #include <stdio.h>
 #include <ctype.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
@@ -25,6 +26,10 @@
 #include <unistd.h>
 #include <sys/types.h>
 
+#ifndef WIN32
+#include <fcntl.h>
+#endif
+
 #include "compat.h"
 #include "deviceapi.h"
 #ifdef USE_LIBMICROHTTPD
@@ -60,7 +65,7 @@ static const char SEPARATOR = '|';
 #define SEPSTR "|"
 static const char GPUSEP = ',';
 
-static const char *APIVERSION = "2.3";
+static const char *APIVERSION = "2.4";
 static const char *DEAD = "Dead";
 static const char *SICK = "Sick";
 static const char *NOSTART = "NoStart";
@@ -136,6 +141,7 @@ static const char *OSINFO =
 #define _MINECOIN	"COIN"
 #define _DEBUGSET	"DEBUG"
 #define _SETCONFIG	"SETCONFIG"
+#define _LOCKSTATS	"LOCKSTATS"
 
 static const char ISJSON = '{';
 #define JSON0		"{"
@@ -177,10 +183,12 @@ static const char ISJSON = '{';
 #define JSON_MINECOIN	JSON1 _MINECOIN JSON2
 #define JSON_DEBUGSET	JSON1 _DEBUGSET JSON2
 #define JSON_SETCONFIG	JSON1 _SETCONFIG JSON2
+#define JSON_LOCKSTATS	JSON1 _LOCKSTATS JSON2
 #define JSON_END	JSON4 JSON5
 #define JSON_END_TRUNCATED	JSON4_TRUNCATED JSON5
 
 static const char *JSON_COMMAND = "command";
+static const char *JSON_KEEPALIVE = "keepalive";
 static const char *JSON_PARAMETER = "parameter";
 
 #define MSG_INVGPU 1
@@ -306,6 +314,10 @@ static const char *JSON_PARAMETER = "parameter";
 
 #define MSG_INVNEG 121
 #define MSG_SETQUOTA 122
+#define MSG_SUBSCRIBE 123
+#define MSG_INVEVENT 124
+#define MSG_LOCKSTATS 125
+#define MSG_NOLOCKSTATS 126
 
 #define USE_ALTMSG 0x4000
 
@@ -494,6 +506,10 @@ struct CODES {
  { SEVERITY_SUCC,  MSG_ZERSUM,	PARAM_STR,	"Zeroed %s stats with summary" },
  { SEVERITY_SUCC,  MSG_ZERNOSUM, PARAM_STR,	"Zeroed %s stats without summary" },
  { SEVERITY_SUCC,  MSG_DEVSCAN, PARAM_COUNT,	"Added %d new device(s)" },
+ { SEVERITY_SUCC,  MSG_SUBSCRIBE, PARAM_STR,	"Subscribed to %s events" },
+ { SEVERITY_ERR,   MSG_INVEVENT, PARAM_STR,	"Invalid event type '%s'" },
+ { SEVERITY_SUCC,  MSG_LOCKSTATS, PARAM_NONE,	"Lock stats" },
+ { SEVERITY_ERR,   MSG_NOLOCKSTATS, PARAM_NONE,	"Lock stats are only collected with --lock-stats" },
  { SEVERITY_FAIL, 0, 0, NULL }
 };
 
@@ -508,8 +524,70 @@ static pthread_mutex_t quit_restart_lock;
 static bool do_a_quit;
 static bool do_a_restart;
 
-static time_t when = 0;	// when the request occurred
-static bool per_proc;
+// Per-request state, kept per thread since API workers run commands concurrently
+struct api_request_state {
+	time_t when;	// when the request occurred
+	bool per_proc;
+	struct stats_snapshot *snap;  // counters as of the request, see api_snapshot
+	unsigned subscribe;  // event types asked for by the "subscribe" command
+	unsigned long event_next;  // first event the subscriber gets
+};
+
+static pthread_key_t key_api_request_state;
+static pthread_once_t api_request_state_once = PTHREAD_ONCE_INIT;
+
+static void api_request_state_init(void)
+{
+	if (pthread_key_create(&key_api_request_state, free))
+		quithere(1, "pthread_key_create failed");
+}
+
+static struct api_request_state *api_request_state(void)
+{
+	struct api_request_state *state;
+
+	pthread_once(&api_request_state_once, api_request_state_init);
+	state = pthread_getspecific(key_api_request_state);
+	if (likely(state))
+		return state;
+
+	state = calloc(1, sizeof(*state));
+	if (unlikely(!state))
+		quithere(1, "Failed to calloc api_request_state");
+	if (pthread_setspecific(key_api_request_state, state))
+		quithere(1, "pthread_setspecific failed");
+	return state;
+}
+
+/* Counters are served from the last published snapshot, so that the same
+ * request sees the same point in time throughout */
+static struct stats_snapshot *api_snapshot(void)
+{
+	struct api_request_state * const state = api_request_state();
+
+	if (!state->snap)
+		state->snap = stats_snapshot_get();
+	return state->snap;
+}
+
+static const struct cgpu_snapshot *api_cgpu_snapshot(const struct cgpu_info * const cgpu)
+{
+	struct stats_snapshot * const snap = api_snapshot();
+
+	if (cgpu->cgminer_id >= snap->total_devices)
+		return NULL;
+	return &snap->devices[cgpu->cgminer_id];
+}
+
+static void api_snapshot_release(void)
+{
+	struct api_request_state * const state = api_request_state();
+
+	if (state->snap) {
+		stats_snapshot_put(state->snap);
+		state->snap = NULL;
+	}
+}
 
 struct IP4ACCESS {
 	in_addr_t ip;
@@ -549,7 +627,6 @@ struct io_data {
 	// Whether to add various things
 	bool close;
 };
-static struct io_data *rpc_io_data;
 
 static void io_reinit(struct io_data *io_data)
 {
@@ -617,7 +694,7 @@ size_t io_flush(struct io_data *io_data, bool complete)
 static bool io_add(struct io_data *io_data, char *buf)
 {
 	size_t len = strlen(buf);
-	if (bytes_len(&io_data->data) + len > SOCKBUFSIZ)
+	if (io_data->sock != INVSOCK && bytes_len(&io_data->data) + len > SOCKBUFSIZ)
 		io_flush(io_data, false);
 	bytes_append(&io_data->data, buf, len);
 	return true;
@@ -634,11 +711,259 @@ static void io_close(struct io_data *io_data)
 	io_data->close = true;
 }
 
-static void io_free()
+static void io_free(struct io_data *io_data)
+{
+	bytes_free(&io_data->data);
+	free(io_data);
+}
+
+/* Each connection is served by the API thread, which multiplexes all of them
+ * and hands requests to a small pool of workers, so that a slow client or
+ * command holds up nobody else.  A connection carries one request as always,
+ * unless the client asks to keep it alive; then every \n terminated line is a
+ * request, and each reply is \0 terminated as usual */
+#define API_WORKERS  4
+#define API_CONN_TIMEOUT  30
+#ifdef WIN32
+#define API_MAX_CONNS  (FD_SETSIZE - 2)
+#else
+#define API_MAX_CONNS  256
+#endif
+
+struct api_conn {
+	SOCKETTYPE sock;
+	char connectaddr[16];
+	char group;
+	bytes_t rbuf;
+	bytes_t wbuf;
+	time_t last_active;
+	bool served;   // has made a request
+	bool eof;      // will send nothing more
+	bool closing;  // close once all replies are sent
+	bool busy;     // request is with a worker
+	unsigned event_mask;  // subscribed to, once the subscribe reply is sent
+	unsigned long event_next;
+
+	// Only touched by the worker while busy
+	char *request;
+	bool keepalive;
+	unsigned subscribe;
+	bytes_t reply;
+
+	struct api_conn *qnext;
+	struct api_conn *prev;
+	struct api_conn *next;
+};
+
+static struct api_conn *api_conns;
+static int api_conn_count;
+
+// Requests waiting for a worker, and those done, linked by qnext
+static pthread_mutex_t api_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t api_queue_cond = PTHREAD_COND_INITIALIZER;
+static struct api_conn *api_queue_head, *api_queue_tail;
+static struct api_conn *api_done;
+static notifier_t api_notifier;
+
+// Privileged commands run alone, everything else may run concurrently
+static cglock_t api_cmd_lock;
+
+/* Events are written by whichever thread they happen on into a ring that
+ * the API thread copies out to each subscriber in its own time; a subscriber
+ * that falls more than a ring behind is told how many it missed, and never
+ * holds up the writers.  Nor does one writer wait for another: an event whose
+ * slot is still being written a lap earlier is dropped, and reported to
+ * subscribers the same way */
+#define API_EVENT_RING  1024
+#define API_EVENT_SIZE  256
+// Stop taking events for a subscriber with this much unsent
+#define API_EVENT_BACKLOG  0x10000
+
+struct api_event_slot {
+	/* 2n+1 while event n is being written, 2n+2 once it is complete; a writer
+	 * only takes the slot once the previous lap's event is complete, so the
+	 * sequence never goes backwards */
+	volatile unsigned long seq;
+	// n+1 once event n has been dropped without taking the slot
+	volatile unsigned long lost;
+	enum api_event_type type;
+	char msg[API_EVENT_SIZE];
+};
+
+volatile unsigned api_event_mask;
+/* Subscribes that have not reached their connection yet are counted here, so
+ * recomputing api_event_mask from the connections can't drop their types */
+static pthread_mutex_t api_event_mask_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned api_event_mask_pending;
+static int api_subscribes_pending;
+static struct api_event_slot api_events[API_EVENT_RING];
+static volatile unsigned long api_event_head;
+static volatile int api_events_pending;
+
+static const char *api_event_name(const enum api_event_type type)
+{
+	switch (type) {
+		case API_EVENT_SHARE:
+			return "share";
+		case API_EVENT_BLOCK:
+			return "block";
+		case API_EVENT_POOL:
+			return "pool";
+		case API_EVENT_DEVICE:
+			return "device";
+		case API_EVENT_HWERROR:
+			return "hwerror";
+	}
+	return "unknown";
+}
+
+const char *api_event_str(char * const buf, const size_t bufsz, const char * const str)
 {
-	bytes_free(&rpc_io_data->data);
-	free(rpc_io_data);
-	rpc_io_data = NULL;
+	const char *p;
+	size_t len = 0;
+	char esc[7];
+	int esclen;
+
+	buf[len++] = '"';
+	for (p = str; *p; ++p) {
+		const unsigned char c = *p;
+		if (c == '"' || c == '\\')
+			esclen = snprintf(esc, sizeof(esc), "\\%c", c);
+		else
+		if (c < 0x20)
+			esclen = snprintf(esc, sizeof(esc), "\\u%04x", c);
+		else {
+			esc[0] = c;
+			esclen = 1;
+		}
+		// Leave room for the closing quote
+		if (len + esclen + 2 > bufsz)
+			break;
+		memcpy(&buf[len], esc, esclen);
+		len += esclen;
+	}
+	buf[len++] = '"';
+	buf[len] = '\0';
+	return buf;
+}
+
+void _api_event(const enum api_event_type type, const char * const fmt, ...)
+{
+	const unsigned long n = __sync_fetch_and_add(&api_event_head, 1);
+	struct api_event_slot * const slot = &api_events[n % API_EVENT_RING];
+	char * const msg = slot->msg;
+	static const char truncated[] = "\"truncated\":true}";
+	const unsigned long seq = slot->seq;
+	va_list ap;
+	int len, fmtlen;
+
+	// Lapped by a newer event before getting the slot: this one is lost anyway
+	if ((long)(seq - (n * 2)) > 0)
+		return;
+	// Still taken by the previous lap's writer: drop this event rather than wait
+	if ((seq & 1) || !__sync_bool_compare_and_swap(&slot->seq, seq, (n * 2) + 1)) {
+		slot->lost = n + 1;
+		__sync_synchronize();
+		goto wake;
+	}
+	__sync_synchronize();
+
+	slot->type = type;
+	len = snprintf(msg, API_EVENT_SIZE, "{\"event\":\"%s\",\"when\":%lu,",
+	               api_event_name(type), (unsigned long)time(NULL));
+	va_start(ap, fmt);
+	// Leave room for the closing }
+	fmtlen = vsnprintf(&msg[len], API_EVENT_SIZE - 1 - len, fmt, ap);
+	va_end(ap);
+	if (fmtlen < 0 || fmtlen >= API_EVENT_SIZE - 1 - len)
+		// Cut short it would not be valid JSON, so send only that it was too long
+		strcpy(&msg[len], truncated);
+	else
+		strcat(msg, "}");
+
+	__sync_synchronize();
+	slot->seq = (n * 2) + 2;
+
+wake:
+	// One wakeup is enough until the API thread has caught up
+	if (__sync_bool_compare_and_swap(&api_events_pending, 0, 1))
+		notifier_wake(api_notifier);
+}
+
+static void api_conn_dropped_events(struct api_conn * const conn, const unsigned long count)
+{
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "{\"event\":\"dropped\",\"count\":%lu}\n", count);
+	bytes_append(&conn->wbuf, buf, strlen(buf));
+}
+
+// Copies out the events a subscriber hasn't had yet
+static void api_conn_events(struct api_conn * const conn, const time_t now)
+{
+	const unsigned long head = api_event_head;
+	struct api_event_slot *slot;
+	char msg[API_EVENT_SIZE];
+	enum api_event_type type;
+	unsigned long n, seq;
+
+	// Time out clients that stop reading, not quiet event streams
+	if (!bytes_len(&conn->wbuf))
+		conn->last_active = now;
+
+	while (conn->event_next != head && bytes_len(&conn->wbuf) < API_EVENT_BACKLOG) {
+		n = conn->event_next;
+		if (head - n > API_EVENT_RING) {
+			api_conn_dropped_events(conn, head - n - API_EVENT_RING);
+			conn->event_next = head - API_EVENT_RING;
+			continue;
+		}
+
+		slot = &api_events[n % API_EVENT_RING];
+		seq = slot->seq;
+		__sync_synchronize();
+		if (seq != (n * 2) + 2) {
+			// Still being written, unless its writer gave up on the slot
+			if ((long)(seq - ((n * 2) + 2)) < 0 && (seq == (n * 2) + 1 || slot->lost != n + 1))
+				break;
+			// Already written over, or dropped
+			api_conn_dropped_events(conn, 1);
+			++conn->event_next;
+			continue;
+		}
+		type = slot->type;
+		memcpy(msg, slot->msg, sizeof(msg));
+		__sync_synchronize();
+		if (slot->seq != seq) {
+			api_conn_dropped_events(conn, 1);
+			++conn->event_next;
+			continue;
+		}
+		++conn->event_next;
+
+		if (!(type & conn->event_mask))
+			continue;
+		msg[sizeof(msg) - 1] = '\0';
+		bytes_append(&conn->wbuf, msg, strlen(msg));
+		bytes_append(&conn->wbuf, "\n", 1);
+	}
+}
+
+// Recomputes api_event_mask, once subscribes_collected more subscribes have reached their connections
+static void api_update_event_mask(const int subscribes_collected)
+{
+	struct api_conn *conn;
+	unsigned mask;
+
+	mutex_lock(&api_event_mask_lock);
+	api_subscribes_pending -= subscribes_collected;
+	if (!api_subscribes_pending)
+		api_event_mask_pending = 0;
+	mask = api_event_mask_pending;
+	DL_FOREACH(api_conns, conn)
+		mask |= conn->event_mask;
+	api_event_mask = mask;
+	mutex_unlock(&api_event_mask_lock);
 }
 
 // This is only called when expected to be needed (rarely)
@@ -1104,6 +1429,7 @@ static struct api_data *print_data(struct api_data *root, char *buf, bool isjson
 #ifdef HAVE_AN_FPGA
 static int numpgas()
 {
+	struct api_request_state * const state = api_request_state();
 	int count = 0;
 	int i;
 
@@ -1117,7 +1443,7 @@ static int numpgas()
 		if (devices[i]->drv == &cpu_drv)
 			continue;
 #endif
-		if (devices[i]->device != devices[i] && !per_proc)
+		if (devices[i]->device != devices[i] && !state->per_proc)
 			continue;
 		++count;
 	}
@@ -1127,6 +1453,7 @@ static int numpgas()
 
 static int pgadevice(int pgaid)
 {
+	struct api_request_state * const state = api_request_state();
 	int count = 0;
 	int i;
 
@@ -1140,7 +1467,7 @@ static int pgadevice(int pgaid)
 		if (devices[i]->drv == &cpu_drv)
 			continue;
 #endif
-		if (devices[i]->device != devices[i] && !per_proc)
+		if (devices[i]->device != devices[i] && !state->per_proc)
 			continue;
 		++count;
 		if (count == (pgaid + 1))
@@ -1162,6 +1489,7 @@ foundit:
 //  and send_result() adds JSON_END at the end
 static void message(struct io_data * const io_data, const int messageid2, const int paramid, const char * const param2, const bool isjson)
 {
+	struct api_request_state * const state = api_request_state();
 	struct api_data *root = NULL;
 	char buf[TMPBUFSIZ];
 	char buf2[TMPBUFSIZ];
@@ -1280,7 +1608,7 @@ static void message(struct io_data * const io_data, const int messageid2, const
 			}
 
 			root = api_add_string(root, _STATUS, severity, false);
-			root = api_add_time(root, "When", &when, false);
+			root = api_add_time(root, "When", &state->when, false);
 			root = api_add_int(root, "Code", &messageid, false);
 			root = api_add_escape(root, "Msg", buf, false);
 			root = api_add_escape(root, "Description", opt_api_description, false);
@@ -1294,7 +1622,7 @@ static void message(struct io_data * const io_data, const int messageid2, const
 	}
 
 	root = api_add_string(root, _STATUS, "F", false);
-	root = api_add_time(root, "When", &when, false);
+	root = api_add_time(root, "When", &state->when, false);
 	int id = -1;
 	root = api_add_int(root, "Code", &id, false);
 	sprintf(buf, "%d", messageid);
@@ -1437,9 +1765,10 @@ static const char *status2str(enum alive status)
 static
 struct api_data *api_add_device_identifier(struct api_data *root, struct cgpu_info *cgpu)
 {
+	struct api_request_state * const state = api_request_state();
 	root = api_add_string(root, "Name", cgpu->drv->name, false);
 	root = api_add_int(root, "ID", &(cgpu->device_id), false);
-	if (per_proc)
+	if (state->per_proc)
 		root = api_add_int(root, "ProcID", &(cgpu->proc_id), false);
 	return root;
 }
@@ -1447,6 +1776,7 @@ struct api_data *api_add_device_identifier(struct api_data *root, struct cgpu_in
 static
 int find_index_by_cgpu(struct cgpu_info *cgpu)
 {
+	struct api_request_state * const state = api_request_state();
 	int n = 0, i;
 	
 	rd_lock(&devices_lock);
@@ -1454,7 +1784,7 @@ int find_index_by_cgpu(struct cgpu_info *cgpu)
 	{
 		if (devices[i] == cgpu)
 			break;
-		if (devices[i]->device != devices[i] && !per_proc)
+		if (devices[i]->device != devices[i] && !state->per_proc)
 			continue;
 		if (cgpu->devtype == devices[i]->devtype)
 			++n;
@@ -1465,6 +1795,7 @@ int find_index_by_cgpu(struct cgpu_info *cgpu)
 
 static void devdetail_an(struct io_data *io_data, struct cgpu_info *cgpu, bool isjson, bool precom)
 {
+	struct api_request_state * const state = api_request_state();
 	struct api_data *root = NULL;
 	char buf[TMPBUFSIZ];
 	int n;
@@ -1475,7 +1806,7 @@ static void devdetail_an(struct io_data *io_data, struct cgpu_info *cgpu, bool i
 
 	root = api_add_int(root, "DEVDETAILS", &n, true);
 	root = api_add_device_identifier(root, cgpu);
-	if (!per_proc)
+	if (!state->per_proc)
 		root = api_add_int(root, "Processors", &cgpu->procs, false);
 	root = api_add_string(root, "Driver", cgpu->drv->dname, false);
 	if (cgpu->kname)
@@ -1504,6 +1835,7 @@ static void devdetail_an(struct io_data *io_data, struct cgpu_info *cgpu, bool i
 static
 void devstatus_an(struct io_data *io_data, struct cgpu_info *cgpu, bool isjson, bool precom)
 {
+	struct api_request_state * const state = api_request_state();
 	struct cgpu_info *proc;
 	struct api_data *root = NULL;
 	char buf[TMPBUFSIZ];
@@ -1511,10 +1843,11 @@ void devstatus_an(struct io_data *io_data, struct cgpu_info *cgpu, bool isjson,
 
 	n = find_index_by_cgpu(cgpu);
 
-	double runtime = cgpu_runtime(cgpu);
+	const struct cgpu_snapshot *ds = api_cgpu_snapshot(cgpu);
+	double runtime = ds ? ds->runtime : cgpu_runtime(cgpu);
 	bool enabled = false;
 	double total_mhashes = 0, rolling = 0, utility = 0;
-	enum alive status = cgpu->status;
+	enum alive status = ds ? ds->status : cgpu->status;
 	float temp = -1;
 	int accepted = 0, rejected = 0, stale = 0, hw_errors = 0;
 	double diff1 = 0, bad_diff1 = 0;
@@ -1522,37 +1855,39 @@ void devstatus_an(struct io_data *io_data, struct cgpu_info *cgpu, bool isjson,
 	int last_share_pool = -1;
 	time_t last_share_pool_time = -1, last_device_valid_work = -1;
 	double last_share_diff = -1;
-	int procs = per_proc ? 1 : cgpu->procs, i;
+	int procs = state->per_proc ? 1 : cgpu->procs, i;
 	for (i = 0, proc = cgpu; i < procs; ++i, proc = proc->next_proc)
 	{
-		cgpu_utility(proc);
-		if (proc->deven != DEV_DISABLED)
+		// Not published yet (just hotplugged)
+		if (!(ds = api_cgpu_snapshot(proc)))
+			continue;
+		if (ds->deven != DEV_DISABLED)
 			enabled = true;
-		total_mhashes += proc->total_mhashes;
-		rolling += proc->rolling;
-		utility += proc->utility;
-		accepted += proc->accepted;
-		rejected += proc->rejected;
-		stale += proc->stale;
-		hw_errors += proc->hw_errors;
-		diff1 += proc->diff1;
-		diff_accepted += proc->diff_accepted;
-		diff_rejected += proc->diff_rejected;
-		diff_stale += proc->diff_stale;
-		bad_diff1 += proc->bad_diff1;
-		if (status != proc->status)
+		total_mhashes += ds->total_mhashes;
+		rolling += ds->rolling;
+		utility += ds->utility;
+		accepted += ds->accepted;
+		rejected += ds->rejected;
+		stale += ds->stale;
+		hw_errors += ds->hw_errors;
+		diff1 += ds->diff1;
+		diff_accepted += ds->diff_accepted;
+		diff_rejected += ds->diff_rejected;
+		diff_stale += ds->diff_stale;
+		bad_diff1 += ds->bad_diff1;
+		if (status != ds->status)
 			status = LIFE_MIXED;
-		if (proc->temp > temp)
-			temp = proc->temp;
-		if (proc->last_share_pool_time > last_share_pool_time)
+		if (ds->temp > temp)
+			temp = ds->temp;
+		if (ds->last_share_pool_time > last_share_pool_time)
 		{
-			last_share_pool_time = proc->last_share_pool_time;
-			last_share_pool = proc->last_share_pool;
-			last_share_diff = proc->last_share_diff;
+			last_share_pool_time = ds->last_share_pool_time;
+			last_share_pool = ds->last_share_pool;
+			last_share_diff = ds->last_share_diff;
 		}
-		if (proc->last_device_valid_work > last_device_valid_work)
-			last_device_valid_work = proc->last_device_valid_work;
-		if (per_proc)
+		if (ds->last_device_valid_work > last_device_valid_work)
+			last_device_valid_work = ds->last_device_valid_work;
+		if (state->per_proc)
 			break;
 	}
 
@@ -1597,7 +1932,7 @@ void devstatus_an(struct io_data *io_data, struct cgpu_info *cgpu, bool isjson,
 			(double)(diff_rejected) / (double)(diff1) : 0;
 	root = api_add_percent(root, "Device Rejected%", &rejp, false);
 
-	if ((per_proc || cgpu->procs <= 1) && cgpu->drv->get_api_extra_device_status)
+	if ((state->per_proc || cgpu->procs <= 1) && cgpu->drv->get_api_extra_device_status)
 		root = api_add_extra(root, cgpu->drv->get_api_extra_device_status(cgpu));
 
 	root = print_data(root, buf, isjson, precom);
@@ -1635,6 +1970,7 @@ static void cpustatus(struct io_data *io_data, int cpu, bool isjson, bool precom
 static void
 devinfo_internal(void (*func)(struct io_data *, struct cgpu_info*, bool, bool), int msg, struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
+	struct api_request_state * const state = api_request_state();
 	struct cgpu_info *cgpu;
 	bool io_open = false;
 	int i;
@@ -1651,7 +1987,7 @@ devinfo_internal(void (*func)(struct io_data *, struct cgpu_info*, bool, bool),
 
 	for (i = 0; i < total_devices; ++i) {
 		cgpu = get_devices(i);
-		if (per_proc || cgpu->device == cgpu)
+		if (state->per_proc || cgpu->device == cgpu)
 			func(io_data, cgpu, isjson, isjson && i > 0);
 	}
 
@@ -1764,6 +2100,7 @@ static void pgadev(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *p
 
 static void pgaenable(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
 {
+	struct api_request_state * const state = api_request_state();
 	struct cgpu_info *cgpu, *proc;
 	int numpga = numpgas();
 	int id;
@@ -1794,10 +2131,10 @@ static void pgaenable(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char
 	cgpu = get_devices(dev);
 
 	applog(LOG_DEBUG, "API: request to pgaenable %s id %d device %d %s",
-			per_proc ? "proc" : "dev", id, dev, cgpu->proc_repr_ns);
+			state->per_proc ? "proc" : "dev", id, dev, cgpu->proc_repr_ns);
 
 	already = true;
-	int procs = per_proc ? 1 : cgpu->procs, i;
+	int procs = state->per_proc ? 1 : cgpu->procs, i;
 	for (i = 0, proc = cgpu; i < procs; ++i, proc = proc->next_proc)
 	{
 		if (proc->deven == DEV_DISABLED)
@@ -1825,6 +2162,7 @@ static void pgaenable(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char
 
 static void pgadisable(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
 {
+	struct api_request_state * const state = api_request_state();
 	struct cgpu_info *cgpu, *proc;
 	int numpga = numpgas();
 	int id;
@@ -1855,10 +2193,10 @@ static void pgadisable(struct io_data *io_data, __maybe_unused SOCKETTYPE c, cha
 	cgpu = get_devices(dev);
 
 	applog(LOG_DEBUG, "API: request to pgadisable %s id %d device %d %s",
-			per_proc ? "proc" : "dev", id, dev, cgpu->proc_repr_ns);
+			state->per_proc ? "proc" : "dev", id, dev, cgpu->proc_repr_ns);
 
 	already = true;
-	int procs = per_proc ? 1 : cgpu->procs, i;
+	int procs = state->per_proc ? 1 : cgpu->procs, i;
 	for (i = 0, proc = cgpu; i < procs; ++i, proc = proc->next_proc)
 	{
 		if (proc->deven != DEV_DISABLED)
@@ -1955,10 +2293,11 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 	struct api_data *root = NULL;
 	char buf[TMPBUFSIZ];
 	bool io_open = false;
+	struct stats_snapshot * const snap = api_snapshot();
 	char *status, *lp;
 	int i;
 
-	if (total_pools == 0) {
+	if (snap->total_pools == 0) {
 		message(io_data, MSG_NOPOOL, 0, NULL, isjson);
 		return;
 	}
@@ -1968,8 +2307,9 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 	if (isjson)
 		io_open = io_add(io_data, COMSTR JSON_POOLS);
 
-	for (i = 0; i < total_pools; i++) {
-		struct pool *pool = pools[i];
+	for (i = 0; i < snap->total_pools; i++) {
+		struct pool_snapshot * const ps = &snap->pools[i];
+		struct pool *pool = ps->pool;
 
 		if (pool->removed)
 			continue;
@@ -2003,40 +2343,40 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		root = api_add_int(root, "Priority", &(pool->prio), false);
 		root = api_add_int(root, "Quota", &pool->quota, false);
 		root = api_add_string(root, "Long Poll", lp, false);
-		root = api_add_uint(root, "Getworks", &(pool->getwork_requested), false);
-		root = api_add_int(root, "Accepted", &(pool->accepted), false);
-		root = api_add_int(root, "Rejected", &(pool->rejected), false);
-		root = api_add_int(root, "Works", &pool->works, false);
-		root = api_add_uint(root, "Discarded", &(pool->discarded_work), false);
-		root = api_add_uint(root, "Stale", &(pool->stale_shares), false);
-		root = api_add_uint(root, "Get Failures", &(pool->getfail_occasions), false);
-		root = api_add_uint(root, "Remote Failures", &(pool->remotefail_occasions), false);
+		root = api_add_uint(root, "Getworks", &ps->getwork_requested, false);
+		root = api_add_int(root, "Accepted", &ps->accepted, false);
+		root = api_add_int(root, "Rejected", &ps->rejected, false);
+		root = api_add_int(root, "Works", &ps->works, false);
+		root = api_add_uint(root, "Discarded", &ps->discarded_work, false);
+		root = api_add_uint(root, "Stale", &ps->stale_shares, false);
+		root = api_add_uint(root, "Get Failures", &ps->getfail_occasions, false);
+		root = api_add_uint(root, "Remote Failures", &ps->remotefail_occasions, false);
 		root = api_add_escape(root, "User", pool->rpc_user, false);
-		root = api_add_time(root, "Last Share Time", &(pool->last_share_time), false);
-		root = api_add_diff(root, "Diff1 Shares", &(pool->diff1), false);
+		root = api_add_time(root, "Last Share Time", &ps->last_share_time, false);
+		root = api_add_diff(root, "Diff1 Shares", &ps->diff1, false);
 		if (pool->rpc_proxy) {
 			root = api_add_escape(root, "Proxy", pool->rpc_proxy, false);
 		} else {
 			root = api_add_const(root, "Proxy", BLANK, false);
 		}
-		root = api_add_diff(root, "Difficulty Accepted", &(pool->diff_accepted), false);
-		root = api_add_diff(root, "Difficulty Rejected", &(pool->diff_rejected), false);
-		root = api_add_diff(root, "Difficulty Stale", &(pool->diff_stale), false);
-		root = api_add_diff(root, "Last Share Difficulty", &(pool->last_share_diff), false);
+		root = api_add_diff(root, "Difficulty Accepted", &ps->diff_accepted, false);
+		root = api_add_diff(root, "Difficulty Rejected", &ps->diff_rejected, false);
+		root = api_add_diff(root, "Difficulty Stale", &ps->diff_stale, false);
+		root = api_add_diff(root, "Last Share Difficulty", &ps->last_share_diff, false);
 		root = api_add_bool(root, "Has Stratum", &(pool->has_stratum), false);
 		root = api_add_bool(root, "Stratum Active", &(pool->stratum_active), false);
 		if (pool->stratum_active)
 			root = api_add_escape(root, "Stratum URL", pool->stratum_url, false);
 		else
 			root = api_add_const(root, "Stratum URL", BLANK, false);
-		root = api_add_uint64(root, "Best Share", &(pool->best_diff), true);
+		root = api_add_uint64(root, "Best Share", &ps->best_diff, true);
 		if (pool->admin_msg)
 			root = api_add_escape(root, "Message", pool->admin_msg, true);
-		double rejp = (pool->diff_accepted + pool->diff_rejected + pool->diff_stale) ?
-				(double)(pool->diff_rejected) / (double)(pool->diff_accepted + pool->diff_rejected + pool->diff_stale) : 0;
+		double rejp = (ps->diff_accepted + ps->diff_rejected + ps->diff_stale) ?
+				(double)(ps->diff_rejected) / (double)(ps->diff_accepted + ps->diff_rejected + ps->diff_stale) : 0;
 		root = api_add_percent(root, "Pool Rejected%", &rejp, false);
-		double stalep = (pool->diff_accepted + pool->diff_rejected + pool->diff_stale) ?
-				(double)(pool->diff_stale) / (double)(pool->diff_accepted + pool->diff_rejected + pool->diff_stale) : 0;
+		double stalep = (ps->diff_accepted + ps->diff_rejected + ps->diff_stale) ?
+				(double)(ps->diff_stale) / (double)(ps->diff_accepted + ps->diff_rejected + ps->diff_stale) : 0;
 		root = api_add_percent(root, "Pool Stale%", &stalep, false);
 
 		root = print_data(root, buf, isjson, isjson && (i > 0));
@@ -2052,6 +2392,7 @@ static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __mayb
 	struct api_data *root = NULL;
 	char buf[TMPBUFSIZ];
 	bool io_open;
+	struct stats_snapshot * const snap = api_snapshot();
 	double utility, mhs, work_utility;
 
 #ifdef WANT_CPUMINE
@@ -2063,14 +2404,11 @@ static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __mayb
 	message(io_data, MSG_SUMM, 0, NULL, isjson);
 	io_open = io_add(io_data, isjson ? COMSTR JSON_SUMMARY : _SUMMARY COMSTR);
 
-	// stop hashmeter() changing some while copying
-	mutex_lock(&hash_lock);
+	utility = snap->total_accepted / ( snap->total_secs ? snap->total_secs : 1 ) * 60;
+	mhs = snap->total_mhashes_done / snap->total_secs;
+	work_utility = snap->total_diff1 / ( snap->total_secs ? snap->total_secs : 1 ) * 60;
 
-	utility = total_accepted / ( total_secs ? total_secs : 1 ) * 60;
-	mhs = total_mhashes_done / total_secs;
-	work_utility = total_diff1 / ( total_secs ? total_secs : 1 ) * 60;
-
-	root = api_add_elapsed(root, "Elapsed", &(total_secs), true);
+	root = api_add_elapsed(root, "Elapsed", &snap->total_secs, true);
 #ifdef WANT_CPUMINE
 	if (opt_n_threads)
 	root = api_add_string(root, "Algorithm", algo, false);
@@ -2078,41 +2416,39 @@ static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __mayb
 	root = api_add_mhs(root, "MHS av", &(mhs), false);
 	char mhsname[27];
 	sprintf(mhsname, "MHS %ds", opt_log_interval);
-	root = api_add_mhs(root, mhsname, &(total_rolling), false);
-	root = api_add_uint(root, "Found Blocks", &(found_blocks), true);
-	root = api_add_int(root, "Getworks", &(total_getworks), true);
-	root = api_add_int(root, "Accepted", &(total_accepted), true);
-	root = api_add_int(root, "Rejected", &(total_rejected), true);
-	root = api_add_int(root, "Hardware Errors", &(hw_errors), true);
+	root = api_add_mhs(root, mhsname, &snap->total_rolling, false);
+	root = api_add_uint(root, "Found Blocks", &snap->found_blocks, true);
+	root = api_add_int(root, "Getworks", &snap->total_getworks, true);
+	root = api_add_int(root, "Accepted", &snap->total_accepted, true);
+	root = api_add_int(root, "Rejected", &snap->total_rejected, true);
+	root = api_add_int(root, "Hardware Errors", &snap->hw_errors, true);
 	root = api_add_utility(root, "Utility", &(utility), false);
-	root = api_add_int(root, "Discarded", &(total_discarded), true);
-	root = api_add_int(root, "Stale", &(total_stale), true);
-	root = api_add_uint(root, "Get Failures", &(total_go), true);
-	root = api_add_uint(root, "Local Work", &(local_work), true);
-	root = api_add_uint(root, "Remote Failures", &(total_ro), true);
-	root = api_add_uint(root, "Network Blocks", &(new_blocks), true);
-	root = api_add_mhtotal(root, "Total MH", &(total_mhashes_done), true);
-	root = api_add_diff(root, "Diff1 Work", &total_diff1, true);
+	root = api_add_int(root, "Discarded", &snap->total_discarded, true);
+	root = api_add_int(root, "Stale", &snap->total_stale, true);
+	root = api_add_uint(root, "Get Failures", &snap->total_go, true);
+	root = api_add_uint(root, "Local Work", &snap->local_work, true);
+	root = api_add_uint(root, "Remote Failures", &snap->total_ro, true);
+	root = api_add_uint(root, "Network Blocks", &snap->new_blocks, true);
+	root = api_add_mhtotal(root, "Total MH", &snap->total_mhashes_done, true);
+	root = api_add_diff(root, "Diff1 Work", &snap->total_diff1, true);
 	root = api_add_utility(root, "Work Utility", &(work_utility), false);
-	root = api_add_diff(root, "Difficulty Accepted", &(total_diff_accepted), true);
-	root = api_add_diff(root, "Difficulty Rejected", &(total_diff_rejected), true);
-	root = api_add_diff(root, "Difficulty Stale", &(total_diff_stale), true);
-	root = api_add_uint64(root, "Best Share", &(best_diff), true);
-	double hwp = (total_bad_diff1 + total_diff1) ?
-			(double)(total_bad_diff1) / (double)(total_bad_diff1 + total_diff1) : 0;
+	root = api_add_diff(root, "Difficulty Accepted", &snap->total_diff_accepted, true);
+	root = api_add_diff(root, "Difficulty Rejected", &snap->total_diff_rejected, true);
+	root = api_add_diff(root, "Difficulty Stale", &snap->total_diff_stale, true);
+	root = api_add_uint64(root, "Best Share", &snap->best_diff, true);
+	double hwp = (snap->total_bad_diff1 + snap->total_diff1) ?
+			(double)(snap->total_bad_diff1) / (double)(snap->total_bad_diff1 + snap->total_diff1) : 0;
 	root = api_add_percent(root, "Device Hardware%", &hwp, false);
-	double rejp = total_diff1 ?
-			(double)(total_diff_rejected) / (double)(total_diff1) : 0;
+	double rejp = snap->total_diff1 ?
+			(double)(snap->total_diff_rejected) / (double)(snap->total_diff1) : 0;
 	root = api_add_percent(root, "Device Rejected%", &rejp, false);
-	double prejp = (total_diff_accepted + total_diff_rejected + total_diff_stale) ?
-			(double)(total_diff_rejected) / (double)(total_diff_accepted + total_diff_rejected + total_diff_stale) : 0;
+	double prejp = (snap->total_diff_accepted + snap->total_diff_rejected + snap->total_diff_stale) ?
+			(double)(snap->total_diff_rejected) / (double)(snap->total_diff_accepted + snap->total_diff_rejected + snap->total_diff_stale) : 0;
 	root = api_add_percent(root, "Pool Rejected%", &prejp, false);
-	double stalep = (total_diff_accepted + total_diff_rejected + total_diff_stale) ?
-			(double)(total_diff_stale) / (double)(total_diff_accepted + total_diff_rejected + total_diff_stale) : 0;
+	double stalep = (snap->total_diff_accepted + snap->total_diff_rejected + snap->total_diff_stale) ?
+			(double)(snap->total_diff_stale) / (double)(snap->total_diff_accepted + snap->total_diff_rejected + snap->total_diff_stale) : 0;
 	root = api_add_percent(root, "Pool Stale%", &stalep, false);
-	root = api_add_time(root, "Last getwork", &last_getwork, false);
-
-	mutex_unlock(&hash_lock);
+	root = api_add_time(root, "Last getwork", &snap->last_getwork, false);
 
 	root = print_data(root, buf, isjson, false);
 	io_add(io_data, buf);
@@ -2866,6 +3202,7 @@ void privileged(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_un
 
 void notifystatus(struct io_data *io_data, int device, struct cgpu_info *cgpu, bool isjson, __maybe_unused char group)
 {
+	struct api_request_state * const state = api_request_state();
 	struct cgpu_info *proc;
 	struct api_data *root = NULL;
 	char buf[TMPBUFSIZ];
@@ -2877,7 +3214,7 @@ void notifystatus(struct io_data *io_data, int device, struct cgpu_info *cgpu, b
 	int dev_sick_idle_60_count = 0, dev_dead_idle_600_count = 0;
 	int dev_nostart_count = 0, dev_over_heat_count = 0, dev_thermal_cutoff_count = 0, dev_comms_error_count = 0, dev_throttle_count = 0;
 
-	int procs = per_proc ? 1 : cgpu->procs, i;
+	int procs = state->per_proc ? 1 : cgpu->procs, i;
 	for (i = 0, proc = cgpu; i < procs; ++i, proc = proc->next_proc)
 	{
 		if (proc->device_last_not_well > last_not_well)
@@ -2895,7 +3232,7 @@ void notifystatus(struct io_data *io_data, int device, struct cgpu_info *cgpu, b
 			dev_comms_error_count    += proc->dev_comms_error_count;
 			dev_throttle_count       += proc->dev_throttle_count;
 		}
-		if (per_proc)
+		if (state->per_proc)
 			break;
 	}
 	
@@ -2940,7 +3277,7 @@ void notifystatus(struct io_data *io_data, int device, struct cgpu_info *cgpu, b
 	// Simplifies future external support for identifying new counters
 	root = api_add_int(root, "NOTIFY", &device, false);
 	root = api_add_device_identifier(root, cgpu);
-	if (per_proc)
+	if (state->per_proc)
 		root = api_add_time(root, "Last Well", &(cgpu->device_last_well), false);
 	root = api_add_time(root, "Last Not Well", &last_not_well, false);
 	root = api_add_string(root, "Reason Not Well", reason, false);
@@ -2962,6 +3299,7 @@ void notifystatus(struct io_data *io_data, int device, struct cgpu_info *cgpu, b
 static
 void notify(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, char group)
 {
+	struct api_request_state * const state = api_request_state();
 	struct cgpu_info *cgpu;
 	bool io_open = false;
 	int i, n = 0;
@@ -2978,7 +3316,7 @@ void notify(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused
 
 	for (i = 0; i < total_devices; i++) {
 		cgpu = get_devices(i);
-		if (cgpu->device == cgpu || per_proc)
+		if (cgpu->device == cgpu || state->per_proc)
 			notifystatus(io_data, n++, cgpu, isjson, group);
 	}
 
@@ -3021,7 +3359,9 @@ static int itemstats(struct io_data *io_data, int i, char *id, struct cgminer_st
 {
 	struct api_data *root = NULL;
 	char buf[TMPBUFSIZ];
+	char name[32];
 	double elapsed;
+	int k;
 
 	root = api_add_int(root, "STATS", &i, false);
 	root = api_add_string(root, "ID", id, false);
@@ -3032,6 +3372,25 @@ static int itemstats(struct io_data *io_data, int i, char *id, struct cgminer_st
 	root = api_add_timeval(root, "Max", &(stats->getwork_wait_max), false);
 	root = api_add_timeval(root, "Min", &(stats->getwork_wait_min), false);
 
+	for (k = 0; k < LATENCY_KINDS; k++) {
+		const struct latency_hist * const hist = &stats->latency[k];
+		double p50, p99;
+
+		// Devices don't fetch work themselves
+		if (k == LATENCY_GETWORK && !pool_stats)
+			continue;
+		p50 = latency_hist_percentile(hist, 50) / 1000000.;
+		p99 = latency_hist_percentile(hist, 99) / 1000000.;
+		snprintf(name, sizeof(name), "%s Count", latency_kind_names[k]);
+		root = api_add_uint32(root, name, (uint32_t *)&hist->count, true);
+		snprintf(name, sizeof(name), "%s P50", latency_kind_names[k]);
+		root = api_add_double(root, name, &p50, true);
+		snprintf(name, sizeof(name), "%s P99", latency_kind_names[k]);
+		root = api_add_double(root, name, &p99, true);
+		snprintf(name, sizeof(name), "%s Overflow", latency_kind_names[k]);
+		root = api_add_uint32(root, name, (uint32_t *)&hist->overflow, true);
+	}
+
 	if (pool_stats) {
 		root = api_add_uint32(root, "Pool Calls", &(pool_stats->getwork_calls), false);
 		root = api_add_uint32(root, "Pool Attempts", &(pool_stats->getwork_attempts), false);
@@ -3099,6 +3458,22 @@ static void minerstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		i = itemstats(io_data, i, id, &(pool->cgminer_stats), &(pool->cgminer_pool_stats), NULL, isjson);
 	}
 
+	{
+		struct api_data *root = NULL;
+		char buf[TMPBUFSIZ];
+		int pooled = work_pool_size();
+
+		root = api_add_int(root, "STATS", &i, false);
+		root = api_add_const(root, "ID", "WORK", false);
+		root = api_add_uint64(root, "Work Allocs", &work_pool_allocs, true);
+		root = api_add_uint64(root, "Work Reuses", &work_pool_reuses, true);
+		root = api_add_uint64(root, "Work Frees", &work_pool_frees, true);
+		root = api_add_int(root, "Work Pooled", &pooled, true);
+		root = print_data(root, buf, isjson, isjson && (i > 0));
+		io_add(io_data, buf);
+		++i;
+	}
+
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -3160,6 +3535,51 @@ static void minecoin(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 		io_close(io_data);
 }
 
+static void lockstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
+{
+	struct lock_stats_snapshot locks[0x10];
+	struct thread_role_snapshot roles[0x40];
+	struct api_data *root;
+	char buf[TMPBUFSIZ];
+	bool io_open;
+	int i, j, n;
+
+	if (!opt_lock_stats) {
+		message(io_data, MSG_NOLOCKSTATS, 0, NULL, isjson);
+		return;
+	}
+
+	message(io_data, MSG_LOCKSTATS, 0, NULL, isjson);
+	io_open = io_add(io_data, isjson ? COMSTR JSON_LOCKSTATS : _LOCKSTATS COMSTR);
+
+	i = 0;
+	n = lock_stats_get(locks, ARRAY_SIZE(locks));
+	for (j = 0; j < n; ++j, ++i) {
+		root = NULL;
+		root = api_add_const(root, "Lock", locks[j].name, false);
+		root = api_add_uint64(root, "Acquisitions", &locks[j].acquisitions, false);
+		root = api_add_uint64(root, "Waits", &locks[j].waits, false);
+		root = api_add_double(root, "Wait Time", &locks[j].wait_secs, false);
+		root = api_add_double(root, "Max Wait", &locks[j].max_wait_secs, false);
+		root = print_data(root, buf, isjson, isjson && (i > 0));
+		io_add(io_data, buf);
+	}
+
+	n = thread_role_stats_get(roles, ARRAY_SIZE(roles));
+	for (j = 0; j < n; ++j, ++i) {
+		root = NULL;
+		root = api_add_string(root, "Thread Role", roles[j].role, false);
+		root = api_add_int(root, "Threads", &roles[j].threads, false);
+		if (roles[j].cpu_secs >= 0)
+			root = api_add_double(root, "CPU Time", &roles[j].cpu_secs, false);
+		root = print_data(root, buf, isjson, isjson && (i > 0));
+		io_add(io_data, buf);
+	}
+
+	if (isjson && io_open)
+		io_close(io_data);
+}
+
 static void debugstate(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
@@ -3419,6 +3839,58 @@ static void dozero(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *p
 		message(io_data, MSG_ZERNOSUM, 0, all ? "All" : "BestShare", isjson);
 }
 
+static void dosubscribe(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
+{
+	static const enum api_event_type types[] = {
+		API_EVENT_SHARE,
+		API_EVENT_BLOCK,
+		API_EVENT_POOL,
+		API_EVENT_DEVICE,
+		API_EVENT_HWERROR,
+	};
+	struct api_request_state * const state = api_request_state();
+	char buf[TMPBUFSIZ];
+	char *name, *next;
+	unsigned mask = 0;
+	int i;
+
+	if (param == NULL || *param == '\0' || strcasecmp(param, "all") == 0) {
+		for (i = 0; i < (int)(sizeof(types) / sizeof(*types)); i++)
+			mask |= types[i];
+		param = "all";
+	}
+	else {
+		snprintf(buf, sizeof(buf), "%s", param);
+		for (name = buf; name; name = next) {
+			next = strchr(name, ',');
+			if (next)
+				*(next++) = '\0';
+			for (i = 0; i < (int)(sizeof(types) / sizeof(*types)); i++)
+				if (strcasecmp(name, api_event_name(types[i])) == 0)
+					break;
+			if (i == (int)(sizeof(types) / sizeof(*types))) {
+				message(io_data, MSG_INVEVENT, 0, name, isjson);
+				return;
+			}
+			mask |= types[i];
+		}
+	}
+
+	/* Start formatting events now, so none are missed before the reply goes
+	 * out; the subscriber gets everything from before the mask is raised */
+	state->event_next = api_event_head;
+	__sync_synchronize();
+	mutex_lock(&api_event_mask_lock);
+	if (!state->subscribe)
+		++api_subscribes_pending;
+	api_event_mask_pending |= mask;
+	api_event_mask |= mask;
+	mutex_unlock(&api_event_mask_lock);
+	state->subscribe = mask;
+
+	message(io_data, MSG_SUBSCRIBE, 0, param, isjson);
+}
+
 static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, char group);
 
 struct CMDS {
@@ -3485,6 +3957,7 @@ struct CMDS {
 	{ "check",		checkcommand,	false },
 	{ "failover-only",	failoveronly,	true },
 	{ "coin",		minecoin,	false },
+	{ "lockstats",		lockstats,	false },
 	{ "debug",		debugstate,	true },
 	{ "setconfig",		setconfig,	true },
 #ifdef HAVE_AN_FPGA
@@ -3492,6 +3965,7 @@ struct CMDS {
 	{ "procset",		pgaset,		true },
 #endif
 	{ "zero",		dozero,		true },
+	{ "subscribe",		dosubscribe,	false },
 	{ NULL,			NULL,		false }
 };
 
@@ -3551,6 +4025,10 @@ static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
 	       bytes_buf(&io_data->data),
 	       bytes_len(&io_data->data) > 10 ? "..." : BLANK);
 	
+	// Replies built by API workers are sent by the connection thread
+	if (io_data->sock == INVSOCK)
+		return;
+	
 	io_flush(io_data, true);
 	
 	if (bytes_len(&io_data->data))
@@ -3578,7 +4056,10 @@ static void tidyup(__maybe_unused void *arg)
 		ipaccess = NULL;
 	}
 
-	io_free();
+	// Let idle workers see bye
+	mutex_lock(&api_queue_lock);
+	pthread_cond_broadcast(&api_queue_cond);
+	mutex_unlock(&api_queue_lock);
 
 	mutex_unlock(&quit_restart_lock);
 }
@@ -4044,33 +4525,513 @@ void mcast_init()
 		quit(1, "API mcast thread create failed");
 }
 
-void api(int api_thr_id)
+static void api_run_request(struct io_data * const io_data, char * const buf, const char group, const char * const connectaddr, bool * const keepalive)
 {
-	struct io_data *io_data;
-	struct thr_info bye_thr;
-	char buf[TMPBUFSIZ];
+	struct api_request_state * const state = api_request_state();
 	char param_buf[TMPBUFSIZ];
-	SOCKETTYPE c;
-	int n, bound;
-	char *connectaddr;
-	const char *binderror;
-	struct timeval bindstart;
-	short int port = opt_api_port;
-	struct sockaddr_in serv;
-	struct sockaddr_in cli;
-	socklen_t clisiz;
 	char cmdbuf[100];
-	char *cmd;
+	char *cmd = NULL;
 	char *param;
-	bool addrok;
-	char group;
 	json_error_t json_err;
-	json_t *json_config;
+	json_t *json_config = NULL;
 	json_t *json_val;
 	bool isjson;
 	bool did;
 	int i;
 
+	// the time of the request in now
+	state->when = time(NULL);
+	state->subscribe = 0;
+
+	did = false;
+
+	if (*buf != ISJSON) {
+		isjson = false;
+
+		param = strchr(buf, SEPARATOR);
+		if (param != NULL)
+			*(param++) = '\0';
+
+		cmd = buf;
+	}
+	else {
+		isjson = true;
+
+		param = NULL;
+
+#if JANSSON_MAJOR_VERSION > 2 || (JANSSON_MAJOR_VERSION == 2 && JANSSON_MINOR_VERSION > 0)
+		json_config = json_loadb(buf, strlen(buf), 0, &json_err);
+#elif JANSSON_MAJOR_VERSION > 1
+		json_config = json_loads(buf, 0, &json_err);
+#else
+		json_config = json_loads(buf, &json_err);
+#endif
+
+		if (!json_is_object(json_config)) {
+			message(io_data, MSG_INVJSON, 0, NULL, isjson);
+			send_result(io_data, INVSOCK, isjson);
+			did = true;
+		}
+		else {
+			json_val = json_object_get(json_config, JSON_KEEPALIVE);
+			if (json_is_true(json_val))
+				*keepalive = true;
+			else if (json_is_false(json_val))
+				*keepalive = false;
+
+			json_val = json_object_get(json_config, JSON_COMMAND);
+			if (json_val == NULL) {
+				message(io_data, MSG_MISCMD, 0, NULL, isjson);
+				send_result(io_data, INVSOCK, isjson);
+				did = true;
+			}
+			else {
+				if (!json_is_string(json_val)) {
+					message(io_data, MSG_INVCMD, 0, NULL, isjson);
+					send_result(io_data, INVSOCK, isjson);
+					did = true;
+				}
+				else {
+					cmd = (char *)json_string_value(json_val);
+					json_val = json_object_get(json_config, JSON_PARAMETER);
+					if (json_is_string(json_val))
+						param = (char *)json_string_value(json_val);
+					else if (json_is_integer(json_val)) {
+						sprintf(param_buf, "%d", (int)json_integer_value(json_val));
+						param = param_buf;
+					} else if (json_is_real(json_val)) {
+						sprintf(param_buf, "%f", (double)json_real_value(json_val));
+						param = param_buf;
+					}
+				}
+			}
+		}
+	}
+
+	if (!did)
+		for (i = 0; cmds[i].name != NULL; i++) {
+			if (strcmp(cmd, cmds[i].name) == 0) {
+				sprintf(cmdbuf, "|%s|", cmd);
+				if (ISPRIVGROUP(group) || strstr(COMMANDS(group), cmdbuf))
+				{
+					state->per_proc = !strncmp(cmds[i].name, "proc", 4);
+					if (cmds[i].iswritemode)
+						cg_wlock(&api_cmd_lock);
+					else
+						cg_rlock(&api_cmd_lock);
+					(cmds[i].func)(io_data, INVSOCK, param, isjson, group);
+					if (cmds[i].iswritemode) {
+						cg_wunlock(&api_cmd_lock);
+						// Don't leave the next request reporting what was just changed
+						stats_snapshot_publish();
+					}
+					else
+						cg_runlock(&api_cmd_lock);
+				}
+				else {
+					message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
+					applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", connectaddr, cmds[i].name);
+				}
+
+				send_result(io_data, INVSOCK, isjson);
+				did = true;
+				break;
+			}
+		}
+
+	if (isjson)
+		json_decref(json_config);
+
+	if (!did) {
+		message(io_data, MSG_INVCMD, 0, NULL, isjson);
+		send_result(io_data, INVSOCK, isjson);
+	}
+
+	api_snapshot_release();
+}
+
+static void *api_worker_thread(__maybe_unused void *userdata)
+{
+	struct io_data * const io_data = sock_io_new();
+	struct api_conn *conn;
+
+	pthread_detach(pthread_self());
+	RenameThread("api_worker");
+
+	mutex_lock(&api_queue_lock);
+	while (!bye) {
+		conn = api_queue_head;
+		if (!conn) {
+			pthread_cond_wait(&api_queue_cond, &api_queue_lock);
+			continue;
+		}
+		api_queue_head = conn->qnext;
+		if (!api_queue_head)
+			api_queue_tail = NULL;
+		mutex_unlock(&api_queue_lock);
+
+		io_reinit(io_data);
+		api_run_request(io_data, conn->request, conn->group, conn->connectaddr, &conn->keepalive);
+		conn->subscribe = api_request_state()->subscribe;
+		// An existing subscriber carries on from where it was
+		if (conn->subscribe && !conn->event_mask)
+			conn->event_next = api_request_state()->event_next;
+		bytes_cat(&conn->reply, &io_data->data);
+		free(conn->request);
+		conn->request = NULL;
+
+		mutex_lock(&api_queue_lock);
+		conn->qnext = api_done;
+		api_done = conn;
+		notifier_wake(api_notifier);
+	}
+	mutex_unlock(&api_queue_lock);
+
+	io_free(io_data);
+	return NULL;
+}
+
+static void api_set_nonblocking(SOCKETTYPE sock)
+{
+#ifndef WIN32
+	int flags = fcntl(sock, F_GETFL, 0);
+
+	fcntl(sock, F_SETFL, O_NONBLOCK | flags);
+#else
+	u_long flags = 1;
+
+	ioctlsocket(sock, FIONBIO, &flags);
+#endif
+}
+
+static void api_accept(SOCKETTYPE apisock, time_t now)
+{
+	struct sockaddr_in cli;
+	socklen_t clisiz = sizeof(cli);
+	struct api_conn *conn;
+	char *connectaddr;
+	SOCKETTYPE c;
+	bool addrok;
+	char group;
+
+	if (SOCKETFAIL(c = accept(apisock, (struct sockaddr *)(&cli), &clisiz))) {
+		if (!sock_blocks())
+			applog(LOG_WARNING, "API accept failed (%s)", SOCKERRMSG);
+		return;
+	}
+
+	addrok = check_connect(&cli, &connectaddr, &group);
+	applog(LOG_DEBUG, "API: connection from %s - %s",
+				connectaddr, addrok ? "Accepted" : "Ignored");
+	if (!addrok) {
+		CLOSESOCKET(c);
+		return;
+	}
+#ifndef WIN32
+	if (c >= FD_SETSIZE) {
+		applog(LOG_WARNING, "API: too many open files to serve %s", connectaddr);
+		CLOSESOCKET(c);
+		return;
+	}
+#endif
+
+	api_set_nonblocking(c);
+
+	conn = calloc(1, sizeof(*conn));
+	if (unlikely(!conn))
+		quit(1, "Failed to calloc API connection");
+	conn->sock = c;
+	snprintf(conn->connectaddr, sizeof(conn->connectaddr), "%s", connectaddr);
+	conn->group = group;
+	bytes_init(&conn->rbuf);
+	bytes_init(&conn->wbuf);
+	bytes_init(&conn->reply);
+	conn->last_active = now;
+	DL_APPEND(api_conns, conn);
+	++api_conn_count;
+}
+
+static void api_conn_free(struct api_conn * const conn)
+{
+	DL_DELETE(api_conns, conn);
+	--api_conn_count;
+	if (conn->event_mask)
+		api_update_event_mask(0);
+	CLOSESOCKET(conn->sock);
+	bytes_free(&conn->rbuf);
+	bytes_free(&conn->wbuf);
+	bytes_free(&conn->reply);
+	free(conn);
+}
+
+static void api_conn_read(struct api_conn * const conn, time_t now)
+{
+	void * const buf = bytes_preappend(&conn->rbuf, TMPBUFSIZ);
+	ssize_t n;
+
+	n = recv(conn->sock, buf, TMPBUFSIZ, 0);
+	if (SOCKETFAIL(n)) {
+		if (sock_blocks())
+			return;
+		applog(LOG_DEBUG, "API: recv failed: %s", SOCKERRMSG);
+		bytes_reset(&conn->rbuf);
+		conn->eof = conn->closing = true;
+		return;
+	}
+	if (!n) {
+		conn->eof = true;
+		return;
+	}
+	bytes_postappend(&conn->rbuf, n);
+	conn->last_active = now;
+
+	if (bytes_len(&conn->rbuf) > SOCKBUFSIZ) {
+		applog(LOG_DEBUG, "API: request from %s too long", conn->connectaddr);
+		bytes_reset(&conn->rbuf);
+		conn->closing = true;
+	}
+}
+
+static void api_conn_write(struct api_conn * const conn, time_t now)
+{
+	const size_t tosend = bytes_len(&conn->wbuf);
+	ssize_t n;
+
+	n = send(conn->sock, (void *)bytes_buf(&conn->wbuf), tosend, 0);
+	if (SOCKETFAIL(n)) {
+		if (sock_blocks())
+			return;
+		applog(LOG_WARNING, "API: send (%lu) failed: %s", (unsigned long)tosend, SOCKERRMSG);
+		bytes_reset(&conn->wbuf);
+		conn->closing = true;
+		return;
+	}
+	bytes_shift(&conn->wbuf, n);
+	conn->last_active = now;
+}
+
+/* Takes the next request a client has sent: the first thing received on a
+ * new connection (with or without \n), and then only complete lines */
+static char *api_conn_next_request(struct api_conn * const conn)
+{
+	bytes_t * const rbuf = &conn->rbuf;
+	size_t len, skip;
+	char *request;
+	ssize_t eol;
+
+	while (bytes_len(rbuf)) {
+		eol = bytes_find(rbuf, '\n');
+		if (eol >= 0) {
+			len = eol;
+			skip = eol + 1;
+		}
+		else
+		if (!conn->served || conn->eof)
+			len = skip = bytes_len(rbuf);
+		else
+			return NULL;
+
+		while (len && bytes_buf(rbuf)[len - 1] == '\r')
+			--len;
+
+		request = NULL;
+		if (len) {
+			request = malloc(len + 1);
+			if (unlikely(!request))
+				quit(1, "Failed to malloc API request");
+			memcpy(request, bytes_buf(rbuf), len);
+			request[len] = '\0';
+		}
+		bytes_shift(rbuf, skip);
+		if (request)
+			return request;
+	}
+	return NULL;
+}
+
+static void api_conn_dispatch(struct api_conn * const conn)
+{
+	char *request;
+
+	// Subscribers only listen
+	if (conn->event_mask) {
+		bytes_reset(&conn->rbuf);
+		return;
+	}
+
+	request = api_conn_next_request(conn);
+	if (!request)
+		return;
+
+	if (opt_debug)
+		applog(LOG_DEBUG, "API: recv command: (%d) '%s'", (int)strlen(request), request);
+
+	conn->request = request;
+	conn->busy = conn->served = true;
+	conn->qnext = NULL;
+
+	mutex_lock(&api_queue_lock);
+	if (api_queue_tail)
+		api_queue_tail->qnext = conn;
+	else
+		api_queue_head = conn;
+	api_queue_tail = conn;
+	pthread_cond_signal(&api_queue_cond);
+	mutex_unlock(&api_queue_lock);
+}
+
+// Picks up replies from the workers
+static void api_conns_collect(time_t now)
+{
+	struct api_conn *conn, *next;
+	int subscribed = 0;
+
+	mutex_lock(&api_queue_lock);
+	conn = api_done;
+	api_done = NULL;
+	mutex_unlock(&api_queue_lock);
+
+	for ( ; conn; conn = next) {
+		next = conn->qnext;
+		conn->busy = false;
+		bytes_cat(&conn->wbuf, &conn->reply);
+		bytes_reset(&conn->reply);
+		if (conn->subscribe) {
+			conn->event_mask = conn->subscribe;
+			conn->subscribe = 0;
+			++subscribed;
+		}
+		else
+		if (!conn->keepalive)
+			conn->closing = true;
+		conn->last_active = now;
+	}
+
+	if (subscribed)
+		api_update_event_mask(subscribed);
+}
+
+static void api_conns_service(SOCKETTYPE apisock)
+{
+	struct api_conn *conn, *tmp;
+	struct timeval tv = {1, 0};
+	fd_set rfds, wfds;
+	int maxfd = -1;
+	time_t now;
+
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+	if (api_conn_count < API_MAX_CONNS) {
+		FD_SET(apisock, &rfds);
+		set_maxfd(&maxfd, apisock);
+	}
+	FD_SET(api_notifier[0], &rfds);
+	set_maxfd(&maxfd, api_notifier[0]);
+	DL_FOREACH(api_conns, conn) {
+		if (conn->busy)
+			continue;
+		// Stop reading from clients that aren't reading their replies
+		if (bytes_len(&conn->wbuf))
+			FD_SET(conn->sock, &wfds);
+		else
+		if (!(conn->closing || conn->eof))
+			FD_SET(conn->sock, &rfds);
+		else
+			continue;
+		set_maxfd(&maxfd, conn->sock);
+	}
+
+	if (select(maxfd + 1, &rfds, &wfds, NULL, &tv) < 0) {
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+	}
+	if (FD_ISSET(api_notifier[0], &rfds))
+		notifier_read(api_notifier);
+
+	// Any event from here on needs a new wakeup
+	api_events_pending = 0;
+	__sync_synchronize();
+
+	now = time(NULL);
+	api_conns_collect(now);
+
+	DL_FOREACH_SAFE(api_conns, conn, tmp) {
+		if (conn->busy)
+			continue;
+
+		if (FD_ISSET(conn->sock, &wfds))
+			api_conn_write(conn, now);
+		else
+		if (FD_ISSET(conn->sock, &rfds))
+			api_conn_read(conn, now);
+
+		if (conn->event_mask && !(conn->closing || conn->eof))
+			api_conn_events(conn, now);
+		if (!(bytes_len(&conn->wbuf) || conn->closing))
+			api_conn_dispatch(conn);
+		if (conn->busy)
+			continue;
+
+		if (!bytes_len(&conn->wbuf) && (conn->closing || (conn->eof && !bytes_len(&conn->rbuf))))
+			api_conn_free(conn);
+		else
+		if (now - conn->last_active > API_CONN_TIMEOUT && (bytes_len(&conn->wbuf) || !conn->event_mask)) {
+			applog(LOG_DEBUG, "API: connection from %s timed out", conn->connectaddr);
+			api_conn_free(conn);
+		}
+	}
+
+	if (FD_ISSET(apisock, &rfds))
+		api_accept(apisock, now);
+}
+
+// Gives replies still on their way (such as to quit or restart) a chance to go out
+static void api_conns_drain(void)
+{
+	struct api_conn *conn, *tmp;
+	struct timeval tv;
+	fd_set wfds;
+	bool busy;
+	int i;
+
+	for (i = 0; i < 100; ++i) {
+		api_conns_collect(time(NULL));
+		busy = false;
+		DL_FOREACH(api_conns, conn)
+			if (conn->busy)
+				busy = true;
+		if (!busy)
+			break;
+		cgsleep_ms(10);
+	}
+
+	DL_FOREACH_SAFE(api_conns, conn, tmp) {
+		// A worker still has it
+		if (conn->busy)
+			continue;
+		for (i = 0; i < 20 && bytes_len(&conn->wbuf); ++i) {
+			FD_ZERO(&wfds);
+			FD_SET(conn->sock, &wfds);
+			tv = (struct timeval){0, 50000};
+			if (select(conn->sock + 1, NULL, &wfds, NULL, &tv) < 1)
+				break;
+			api_conn_write(conn, time(NULL));
+		}
+		api_conn_free(conn);
+	}
+}
+
+void api(int api_thr_id)
+{
+	struct thr_info bye_thr;
+	pthread_t pth;
+	int bound;
+	const char *binderror;
+	struct timeval bindstart;
+	short int port = opt_api_port;
+	struct sockaddr_in serv;
+	int i;
+
 	SOCKETTYPE *apisock;
 
 	if (!opt_api_listen) {
@@ -4081,10 +5042,9 @@ void api(int api_thr_id)
 	apisock = malloc(sizeof(*apisock));
 	*apisock = INVSOCK;
 
-	rpc_io_data =
-	io_data = sock_io_new();
-
 	mutex_init(&quit_restart_lock);
+	cglock_init(&api_cmd_lock);
+	notifier_init(api_notifier);
 
 	pthread_cleanup_push(tidyup, (void *)apisock);
 	my_thr_id = api_thr_id;
@@ -4170,135 +5130,20 @@ void api(int api_thr_id)
 			applog(LOG_WARNING, "API running in local read access mode on port %d", port);
 	}
 
+	api_set_nonblocking(*apisock);
+
 	if (opt_api_mcast)
 		mcast_init();
 
-	while (!bye) {
-		clisiz = sizeof(cli);
-		if (SOCKETFAIL(c = accept(*apisock, (struct sockaddr *)(&cli), &clisiz))) {
-			applog(LOG_ERR, "API failed (%s)%s", SOCKERRMSG, UNAVAILABLE);
-			goto die;
-		}
-
-		addrok = check_connect(&cli, &connectaddr, &group);
-		applog(LOG_DEBUG, "API: connection from %s - %s",
-					connectaddr, addrok ? "Accepted" : "Ignored");
-
-		if (addrok) {
-			n = recv(c, &buf[0], TMPBUFSIZ-1, 0);
-			if (SOCKETFAIL(n))
-				buf[0] = '\0';
-			else
-				buf[n] = '\0';
-
-			if (opt_debug) {
-				if (SOCKETFAIL(n))
-					applog(LOG_DEBUG, "API: recv failed: %s", SOCKERRMSG);
-				else
-					applog(LOG_DEBUG, "API: recv command: (%d) '%s'", n, buf);
-			}
-
-			if (!SOCKETFAIL(n)) {
-				// the time of the request in now
-				when = time(NULL);
-				io_reinit(io_data);
-				io_data->sock = c;
-
-				did = false;
-
-				if (*buf != ISJSON) {
-					isjson = false;
-
-					param = strchr(buf, SEPARATOR);
-					if (param != NULL)
-						*(param++) = '\0';
-
-					cmd = buf;
-				}
-				else {
-					isjson = true;
-
-					param = NULL;
-
-#if JANSSON_MAJOR_VERSION > 2 || (JANSSON_MAJOR_VERSION == 2 && JANSSON_MINOR_VERSION > 0)
-					json_config = json_loadb(buf, n, 0, &json_err);
-#elif JANSSON_MAJOR_VERSION > 1
-					json_config = json_loads(buf, 0, &json_err);
-#else
-					json_config = json_loads(buf, &json_err);
-#endif
-
-					if (!json_is_object(json_config)) {
-						message(io_data, MSG_INVJSON, 0, NULL, isjson);
-						send_result(io_data, c, isjson);
-						did = true;
-					}
-					else {
-						json_val = json_object_get(json_config, JSON_COMMAND);
-						if (json_val == NULL) {
-							message(io_data, MSG_MISCMD, 0, NULL, isjson);
-							send_result(io_data, c, isjson);
-							did = true;
-						}
-						else {
-							if (!json_is_string(json_val)) {
-								message(io_data, MSG_INVCMD, 0, NULL, isjson);
-								send_result(io_data, c, isjson);
-								did = true;
-							}
-							else {
-								cmd = (char *)json_string_value(json_val);
-								json_val = json_object_get(json_config, JSON_PARAMETER);
-								if (json_is_string(json_val))
-									param = (char *)json_string_value(json_val);
-								else if (json_is_integer(json_val)) {
-									sprintf(param_buf, "%d", (int)json_integer_value(json_val));
-									param = param_buf;
-								} else if (json_is_real(json_val)) {
-									sprintf(param_buf, "%f", (double)json_real_value(json_val));
-									param = param_buf;
-								}
-							}
-						}
-					}
-				}
+	for (i = 0; i < API_WORKERS; ++i)
+		if (unlikely(pthread_create(&pth, NULL, api_worker_thread, NULL)))
+			quit(1, "API worker thread create failed");
 
-				if (!did)
-					for (i = 0; cmds[i].name != NULL; i++) {
-						if (strcmp(cmd, cmds[i].name) == 0) {
-							sprintf(cmdbuf, "|%s|", cmd);
-							if (ISPRIVGROUP(group) || strstr(COMMANDS(group), cmdbuf))
-							{
-								per_proc = !strncmp(cmds[i].name, "proc", 4);
-								(cmds[i].func)(io_data, c, param, isjson, group);
-							}
-							else {
-								message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
-								applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", connectaddr, cmds[i].name);
-							}
-
-							send_result(io_data, c, isjson);
-							did = true;
-							break;
-						}
-					}
+	while (!bye)
+		api_conns_service(*apisock);
 
-				if (isjson)
-					json_decref(json_config);
+	api_conns_drain();
 
-				if (!did) {
-					message(io_data, MSG_INVCMD, 0, NULL, isjson);
-					send_result(io_data, c, isjson);
-				}
-			}
-		}
-		CLOSESOCKET(c);
-	}
-die:
-	/* Blank line fix for older compilers since pthread_cleanup_pop is a
-	 * macro that gets confused by a label existing immediately before it
-	 */
-	;
 	pthread_cleanup_pop(true);
 
 	if (opt_debug)
@@ -187,25 +187,59 @@ int restart_wait(struct thr_info *thr, unsigned int mstime)
 }
 
 static
-struct work *get_and_prepare_work(struct thr_info *thr)
+bool prepare_work(struct thr_info * const thr, struct work * const work)
 {
 	struct cgpu_info *proc = thr->cgpu;
 	struct device_drv *api = proc->drv;
-	struct work *work;
 	
-	work = get_work(thr);
-	if (!work)
-		return NULL;
 	if (api->prepare_work && !api->prepare_work(thr, work)) {
 		free_work(work);
 		applog(LOG_ERR, "%"PRIpreprv": Work prepare failed, disabling!", proc->proc_repr);
 		proc->deven = DEV_RECOVER_ERR;
 		run_cmd(cmd_idle);
-		return NULL;
+		return false;
 	}
+	return true;
+}
+
+static
+struct work *get_and_prepare_work(struct thr_info *thr)
+{
+	struct work *work;
+	
+	work = get_work(thr);
+	if (!work)
+		return NULL;
+	if (!prepare_work(thr, work))
+		return NULL;
 	return work;
 }
 
+// Non-blocking version of get_and_prepare_work for the asynchronous minerloops
+// Leaves *workp NULL if nothing is staged yet; notify_thr is woken when there is
+// Returns false only if work was obtained, but could not be prepared
+static
+bool try_get_and_prepare_work(struct thr_info * const thr, struct thr_info * const notify_thr, struct work ** const workp)
+{
+	struct work *work;
+	
+	if (!thr->_work_wanted)
+	{
+		request_work(thr);
+		thr->_work_wanted = true;
+	}
+	*workp = work = try_get_work(thr, notify_thr);
+	if (!work)
+		return true;
+	thr->_work_wanted = false;
+	if (!prepare_work(thr, work))
+	{
+		*workp = NULL;
+		return false;
+	}
+	return true;
+}
+
 // Miner loop to manage a single processor (with possibly multiple threads per processor)
 void minerloop_scanhash(struct thr_info *mythr)
 {
@@ -232,6 +266,7 @@ void minerloop_scanhash(struct thr_info *mythr)
 		if (!work)
 			break;
 		timer_set_now(&work->tv_work_start);
+		record_latency(cgpu, work->pool, LATENCY_STAGE_TO_START, &work->tv_staged, &work->tv_work_start);
 		
 		do {
 			thread_reportin(mythr);
@@ -282,9 +317,12 @@ void mt_disable_start__async(struct thr_info * const mythr)
 	mythr->prev_work = mythr->work;
 	mythr->work = NULL;
 	mythr->_job_transition_in_progress = false;
+	mythr->_work_wanted = false;
 }
 
-bool do_job_prepare(struct thr_info *mythr, struct timeval *tvp_now)
+// If notify_thr is NULL, blocks until new work is available
+static
+bool _do_job_prepare(struct thr_info * const mythr, struct thr_info * const notify_thr, struct timeval * const tvp_now)
 {
 	struct cgpu_info *proc = mythr->cgpu;
 	struct device_drv *api = proc->drv;
@@ -297,13 +335,29 @@ bool do_job_prepare(struct thr_info *mythr, struct timeval *tvp_now)
 	if ((!mythr->work) || abandon_work(mythr->work, &tv_worktime, proc->max_hashes))
 	{
 		mythr->work_restart = false;
-		request_work(mythr);
-		// FIXME: Allow get_work to return NULL to retry on notification
 		if (mythr->next_work)
+		{
 			free_work(mythr->next_work);
-		mythr->next_work = get_and_prepare_work(mythr);
-		if (!mythr->next_work)
-			return false;
+			mythr->next_work = NULL;
+		}
+		if (notify_thr)
+		{
+			if (!try_get_and_prepare_work(mythr, notify_thr, &mythr->next_work))
+				return false;
+			if (!mythr->next_work)
+			{
+				// Nothing staged yet; minerloop_async retries once notify_thr is woken
+				mythr->_job_transition_in_progress = false;
+				return true;
+			}
+		}
+		else
+		{
+			request_work(mythr);
+			mythr->next_work = get_and_prepare_work(mythr);
+			if (!mythr->next_work)
+				return false;
+		}
 		mythr->starting_next_work = true;
 		api->job_prepare(mythr, mythr->next_work, mythr->_max_nonce);
 	}
@@ -316,6 +370,11 @@ bool do_job_prepare(struct thr_info *mythr, struct timeval *tvp_now)
 	return true;
 }
 
+bool do_job_prepare(struct thr_info *mythr, struct timeval *tvp_now)
+{
+	return _do_job_prepare(mythr, NULL, tvp_now);
+}
+
 void job_prepare_complete(struct thr_info *mythr)
 {
 	if (unlikely(mythr->busy_state == TBS_GETTING_RESULTS))
@@ -382,6 +441,7 @@ void mt_job_transition(struct thr_info *mythr)
 	if (mythr->starting_next_work)
 	{
 		mythr->next_work->tv_work_start = tv_now;
+		record_latency(mythr->cgpu, mythr->next_work->pool, LATENCY_STAGE_TO_START, &mythr->next_work->tv_staged, &tv_now);
 		if (mythr->prev_work)
 			free_work(mythr->prev_work);
 		mythr->prev_work = mythr->work;
@@ -546,6 +606,13 @@ void minerloop_async(struct thr_info *mythr)
 			
 			if (should_be_running)
 			{
+				if (unlikely(mythr->_work_wanted))
+				{
+					// Retry once hash_push has woken us
+					if (!try_get_work_waiting(thr))
+						goto djp;
+				}
+				else
 				if (unlikely(!(is_running || mythr->_job_transition_in_progress)))
 				{
 					mt_disable_finish(mythr);
@@ -576,7 +643,7 @@ disabled: ;
 			if (timer_passed(&mythr->tv_morework, &tv_now))
 			{
 djp: ;
-				if (!do_job_prepare(mythr, &tv_now))
+				if (!_do_job_prepare(mythr, thr, &tv_now))
 					goto disabled;
 			}
 			
@@ -621,7 +688,7 @@ void minerloop_queue(struct thr_info *thr)
 	struct timeval tv_now;
 	struct timeval tv_timeout;
 	struct cgpu_info *proc;
-	bool should_be_running;
+	bool should_be_running, starved;
 	struct work *work;
 	
 	_minerloop_setup(thr);
@@ -632,6 +699,7 @@ void minerloop_queue(struct thr_info *thr)
 		for (proc = cgpu; proc; proc = proc->next_proc)
 		{
 			mythr = proc->thr[0];
+			starved = false;
 			
 			should_be_running = (proc->deven == DEV_ENABLED && !mythr->pause);
 redo:
@@ -654,15 +722,24 @@ redo:
 						mythr->next_work = NULL;
 					}
 					else
-					{
-						request_work(mythr);
-						// FIXME: Allow get_work to return NULL to retry on notification
-						work = get_and_prepare_work(mythr);
-					}
+						try_get_and_prepare_work(mythr, thr, &work);
 					if (!work)
+					{
+						// Either nothing is staged yet (we get woken when it is), or prepare failed
+						starved = true;
 						break;
+					}
+					// Queued work is as good as started; the driver may be done with it once appended
+					struct pool * const pool = work->pool;
+					const struct timeval tv_staged = work->tv_staged;
 					if (!api->queue_append(mythr, work))
 						mythr->next_work = work;
+					else
+					{
+						struct timeval tv_queued;
+						timer_set_now(&tv_queued);
+						record_latency(proc, pool, LATENCY_STAGE_TO_START, &tv_staged, &tv_queued);
+					}
 				}
 			}
 			else
@@ -670,6 +747,7 @@ redo:
 			{
 				do_queue_flush(mythr);
 				mt_disable_start(mythr);
+				mythr->_work_wanted = false;
 			}
 			
 			if (timer_passed(&mythr->tv_poll, &tv_now))
@@ -682,7 +760,7 @@ redo:
 			}
 			
 			should_be_running = (proc->deven == DEV_ENABLED && !mythr->pause);
-			if (should_be_running && !mythr->queue_full)
+			if (should_be_running && !(mythr->queue_full || starved))
 				goto redo;
 			
 			reduce_timeout_to(&tv_timeout, &mythr->tv_poll);
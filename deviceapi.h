@@ -44,6 +44,8 @@ extern bool bfg_need_detect_rescan;
 
 extern void request_work(struct thr_info *);
 extern struct work *get_work(struct thr_info *);
+extern struct work *try_get_work(struct thr_info *, struct thr_info *notify_thr);
+extern bool try_get_work_waiting(struct thr_info *notify_thr);
 extern bool hashes_done(struct thr_info *, int64_t hashes, struct timeval *tvp_hashes, uint32_t *max_nonce);
 extern bool hashes_done2(struct thr_info *, int64_t hashes, uint32_t *max_nonce);
 extern void mt_disable_start(struct thr_info *);
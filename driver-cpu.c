@@ -28,12 +28,20 @@
 #include <sys/resource.h>
 #endif
 #include <libgen.h>
+#include <limits.h>
+#include <math.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
 
 #include "compat.h"
 #include "deviceapi.h"
 #include "miner.h"
 #include "bench_block.h"
 #include "logging.h"
+#include "scrypt.h"
+#include "sha2.h"
 #include "util.h"
 #include "driver-cpu.h"
 
@@ -135,6 +143,23 @@ extern bool scanhash_sse2_32(struct thr_info*, const unsigned char *pmidstate, u
 	uint32_t max_nonce, uint32_t *last_nonce,
 	uint32_t nonce);
 
+extern bool scanhash_avx2_8way(struct thr_info*, const unsigned char *pmidstate, unsigned char *pdata,
+	unsigned char *phash1, unsigned char *phash,
+	const unsigned char *ptarget,
+	uint32_t max_nonce, uint32_t *last_nonce,
+	uint32_t nonce);
+
+extern bool scanhash_avx512_16way(struct thr_info*, const unsigned char *pmidstate, unsigned char *pdata,
+	unsigned char *phash1, unsigned char *phash,
+	const unsigned char *ptarget,
+	uint32_t max_nonce, uint32_t *last_nonce,
+	uint32_t nonce);
+
+extern bool scanhash_shani(struct thr_info*, const unsigned char *midstate, unsigned char *data,
+	      unsigned char *hash1, unsigned char *hash,
+	      const unsigned char *target,
+	      uint32_t max_nonce, uint32_t *last_nonce, uint32_t n);
+
 extern bool scanhash_scrypt(struct thr_info *thr, int thr_id, unsigned char *pdata, unsigned char *scratchbuf,
 	const unsigned char *ptarget,
 	uint32_t max_nonce, unsigned long *hashes_done);
@@ -168,6 +193,15 @@ const char *algo_names[] = {
 #ifdef WANT_ALTIVEC_4WAY
     [ALGO_ALTIVEC_4WAY] = "altivec_4way",
 #endif
+#ifdef WANT_AVX2_8WAY
+	[ALGO_AVX2_8WAY]	= "avx2_8way",
+#endif
+#ifdef WANT_AVX512_16WAY
+	[ALGO_AVX512_16WAY]	= "avx512_16way",
+#endif
+#ifdef WANT_SHANI
+	[ALGO_SHANI]		= "shani",
+#endif
 #ifdef WANT_SCRYPT
     [ALGO_SCRYPT] = "scrypt",
 #endif
@@ -199,6 +233,15 @@ static const sha256_func sha256_funcs[] = {
 #ifdef WANT_X8664_SSE4
 	[ALGO_SSE4_64]		= (sha256_func)scanhash_sse4_64,
 #endif
+#ifdef WANT_AVX2_8WAY
+	[ALGO_AVX2_8WAY]	= (sha256_func)scanhash_avx2_8way,
+#endif
+#ifdef WANT_AVX512_16WAY
+	[ALGO_AVX512_16WAY]	= (sha256_func)scanhash_avx512_16way,
+#endif
+#ifdef WANT_SHANI
+	[ALGO_SHANI]		= (sha256_func)scanhash_shani,
+#endif
 #ifdef WANT_SCRYPT
 	[ALGO_SCRYPT]		= (sha256_func)scanhash_scrypt
 #endif
@@ -564,6 +607,62 @@ static double bench_algo_stage2(
 	return rate;
 }
 
+// Reckon number of cores in the box
+static void cpu_detect_num_processors(void)
+{
+	#if defined(WIN32)
+	{
+		DWORD_PTR system_am;
+		DWORD_PTR process_am;
+		BOOL ok = GetProcessAffinityMask(
+			GetCurrentProcess(),
+			&system_am,
+			&process_am
+		);
+		if (!ok) {
+			applog(LOG_ERR, "couldn't figure out number of processors :(");
+			num_processors = 1;
+		} else {
+			size_t n = 32;
+			num_processors = 0;
+			while (n--)
+				if (process_am & (1<<n))
+					++num_processors;
+		}
+	}
+	#elif defined(_SC_NPROCESSORS_ONLN)
+		num_processors = sysconf(_SC_NPROCESSORS_ONLN);
+	#elif defined(HW_NCPU)
+		int req[] = { CTL_HW, HW_NCPU };
+		size_t len = sizeof(num_processors);
+		sysctl(req, 2, &num_processors, &len, NULL, 0);
+	#else
+		num_processors = 1;
+	#endif /* !WIN32 */
+}
+
+// Check the running CPU has the instructions needed by an algorithm
+static bool algo_supported(const enum sha256_algos algo)
+{
+	switch (algo)
+	{
+#ifdef WANT_AVX2_8WAY
+		case ALGO_AVX2_8WAY:
+			return __builtin_cpu_supports("avx2");
+#endif
+#ifdef WANT_AVX512_16WAY
+		case ALGO_AVX512_16WAY:
+			return __builtin_cpu_supports("avx512f");
+#endif
+#ifdef WANT_SHANI
+		case ALGO_SHANI:
+			return sha256_shani_available();
+#endif
+		default:
+			return true;
+	}
+}
+
 static void bench_algo(
 	double            *best_rate,
 	enum sha256_algos *best_algo,
@@ -574,6 +673,16 @@ static void bench_algo(
 	memset(name_spaces_pad, ' ', n);
 	name_spaces_pad[n] = 0;
 
+	if (!algo_supported(algo)) {
+		applog(
+			LOG_ERR,
+			"\"%s\"%s : algorithm not supported by this CPU",
+			algo_names[algo],
+			name_spaces_pad
+		);
+		return;
+	}
+
 	applog(
 		LOG_ERR,
 		"\"%s\"%s : benchmarking algorithm ...",
@@ -623,46 +732,300 @@ void init_max_name_len()
 	}
 }
 
-// Pick the fastest CPU hasher
-static enum sha256_algos pick_fastest_algo()
+// Every sha256 algorithm built in, in the order they are benchmarked
+static const enum sha256_algos bench_algos[] = {
+	ALGO_C,
+#if defined(WANT_SSE2_4WAY)
+	ALGO_4WAY,
+#endif
+#if defined(WANT_VIA_PADLOCK)
+	ALGO_VIA,
+#endif
+	ALGO_CRYPTOPP,
+#if defined(WANT_CRYPTOPP_ASM32)
+	ALGO_CRYPTOPP_ASM32,
+#endif
+#if defined(WANT_X8632_SSE2)
+	ALGO_SSE2_32,
+#endif
+#if defined(WANT_X8664_SSE2)
+	ALGO_SSE2_64,
+#endif
+#if defined(WANT_X8664_SSE4)
+	ALGO_SSE4_64,
+#endif
+#if defined(WANT_ALTIVEC_4WAY)
+	ALGO_ALTIVEC_4WAY,
+#endif
+#if defined(WANT_AVX2_8WAY)
+	ALGO_AVX2_8WAY,
+#endif
+#if defined(WANT_AVX512_16WAY)
+	ALGO_AVX512_16WAY,
+#endif
+#if defined(WANT_SHANI)
+	ALGO_SHANI,
+#endif
+};
+
+// Number of timed runs per algorithm in a full benchmark sweep
+#define BENCH_ALGO_TRIALS  5
+
+struct algo_bench {
+	int trials;
+	double mean;      // single thread, MH/s
+	double stddev;
+	double variance;
+	double full_rate; // all processors at once, MH/s
+};
+
+struct bench_algo_thread_info {
+	pthread_t pth;
+	enum sha256_algos algo;
+	double rate;
+};
+
+static void *bench_algo_thread(void *userp)
 {
-	double best_rate = -1.0;
-	enum sha256_algos best_algo = 0;
-	applog(LOG_ERR, "benchmarking all sha256 algorithms ...");
+	struct bench_algo_thread_info * const info = userp;
+	info->rate = bench_algo_stage3(info->algo);
+	return NULL;
+}
+
+/* Runs threads copies of an algorithm concurrently and returns their
+ * combined rate; the algorithm must already be known not to crash */
+static double bench_algo_threads(const enum sha256_algos algo, const int threads)
+{
+	struct bench_algo_thread_info info[threads];
+	double rate = 0.0;
+	int i, started;
+
+	for (started = 0; started < threads; ++started) {
+		info[started].algo = algo;
+		info[started].rate = -1.0;
+		if (unlikely(pthread_create(&info[started].pth, NULL, bench_algo_thread, &info[started])))
+			break;
+	}
+	for (i = 0; i < started; ++i) {
+		pthread_join(info[i].pth, NULL);
+		if (info[i].rate < 0.0)
+			return -1.0;
+		rate += info[i].rate;
+	}
+	if (started < threads)
+		return -1.0;
+	return rate;
+}
+
+// Crash-safe timed runs of one algorithm, and its rate across all processors
+static bool bench_algo_sweep(const enum sha256_algos algo, struct algo_bench * const res)
+{
+	double rates[BENCH_ALGO_TRIALS], sum = 0.0, sqsum = 0.0;
+	int i;
+
+	for (i = 0; i < BENCH_ALGO_TRIALS; ++i) {
+		rates[i] = bench_algo_stage2(algo);
+		if (rates[i] < 0.0)
+			return false;
+		sum += rates[i];
+	}
+	res->trials = BENCH_ALGO_TRIALS;
+	res->mean = sum / BENCH_ALGO_TRIALS;
+	for (i = 0; i < BENCH_ALGO_TRIALS; ++i)
+		sqsum += (rates[i] - res->mean) * (rates[i] - res->mean);
+	res->variance = sqsum / (BENCH_ALGO_TRIALS - 1);
+	res->stddev = sqrt(res->variance);
+
+	res->full_rate = res->mean;
+	if (num_processors > 1) {
+		res->full_rate = bench_algo_threads(algo, num_processors);
+		if (res->full_rate < 0.0)
+			return false;
+	}
+	return true;
+}
+
+/* Identifies the CPU, as far as benchmark results are concerned: model,
+ * instruction set flags, processor count and our own version */
+static void cpu_bench_key(char * const buf, const size_t bufsz)
+{
+	char model[49] = "unknown";
+	uint32_t flags[3] = {0, 0, 0};
+	char *p;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	unsigned int regs[4];
+	int i;
+
+	if (__get_cpuid_max(0x80000000, NULL) >= 0x80000004) {
+		for (i = 0; i < 3; ++i) {
+			__cpuid(0x80000002 + i, regs[0], regs[1], regs[2], regs[3]);
+			memcpy(&model[i * 0x10], regs, 0x10);
+		}
+		model[48] = '\0';
+	}
+	if (__get_cpuid(1, &regs[0], &regs[1], &regs[2], &regs[3])) {
+		flags[0] = regs[2];
+		flags[1] = regs[3];
+	}
+	if (__get_cpuid_max(0, NULL) >= 7) {
+		__cpuid_count(7, 0, regs[0], regs[1], regs[2], regs[3]);
+		flags[2] = regs[1];
+	}
+#endif
+
+	for (p = model; *p; ++p)
+		if (*p == '\t' || *p == '\n' || *p == '\r')
+			*p = ' ';
+	p = model;
+	while (*p == ' ')
+		++p;
+
+	snprintf(buf, bufsz, "%s|%08lx%08lx%08lx|%d|%s", p,
+	         (unsigned long)flags[0], (unsigned long)flags[1], (unsigned long)flags[2],
+	         num_processors, VERSION);
+}
 
-	bench_algo(&best_rate, &best_algo, ALGO_C);
+static void cpu_bench_cache_path(char * const filename)
+{
+#if defined(unix) || defined(__APPLE__)
+	if (getenv("HOME") && *getenv("HOME")) {
+		strcpy(filename, getenv("HOME"));
+		strcat(filename, "/");
+	}
+	else
+		strcpy(filename, "");
+	strcat(filename, ".bfgminer/");
+	mkdir(filename, 0777);
+#else
+	strcpy(filename, "");
+#endif
+	strcat(filename, "cpu_algo.cache");
+}
+
+/* The cache holds one line per CPU: key, algorithm name and combined rate,
+ * separated by tabs */
+static bool cpu_bench_cache_load(const char * const key, enum sha256_algos * const out)
+{
+	char filename[PATH_MAX], line[0x200], *name, *p;
+	enum sha256_algos i;
+	bool rv = false;
+	FILE *f;
+
+	cpu_bench_cache_path(filename);
+	f = fopen(filename, "r");
+	if (!f)
+		return false;
+	while (!rv && fgets(line, sizeof(line), f)) {
+		name = strchr(line, '\t');
+		if (!name)
+			continue;
+		*(name++) = '\0';
+		if (strcmp(line, key))
+			continue;
+		p = strpbrk(name, "\t\r\n");
+		if (p)
+			*p = '\0';
+		for (i = 0; i < ARRAY_SIZE(bench_algos); ++i) {
+			if (strcmp(name, algo_names[bench_algos[i]]))
+				continue;
+			if (algo_supported(bench_algos[i])) {
+				*out = bench_algos[i];
+				rv = true;
+			}
+			break;
+		}
+	}
+	fclose(f);
+	return rv;
+}
 
-	#if defined(WANT_SSE2_4WAY)
-		bench_algo(&best_rate, &best_algo, ALGO_4WAY);
-	#endif
+static void cpu_bench_cache_store(const char * const key, const enum sha256_algos algo, const double rate)
+{
+	char filename[PATH_MAX], line[0x200];
+	const size_t keylen = strlen(key);
+	char *others = NULL;
+	size_t others_sz = 0, len;
+	FILE *f;
+
+	cpu_bench_cache_path(filename);
+
+	// Keep results for any other CPUs sharing the home directory
+	f = fopen(filename, "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			if (!strncmp(line, key, keylen) && line[keylen] == '\t')
+				continue;
+			len = strlen(line);
+			others = realloc(others, others_sz + len + 1);
+			if (unlikely(!others))
+				quit(1, "Failed to realloc in %s", __func__);
+			memcpy(&others[others_sz], line, len + 1);
+			others_sz += len;
+		}
+		fclose(f);
+	}
 
-	#if defined(WANT_VIA_PADLOCK)
-		bench_algo(&best_rate, &best_algo, ALGO_VIA);
-	#endif
+	f = fopen(filename, "w");
+	if (!f) {
+		applog(LOG_WARNING, "Failed to save CPU benchmark results to %s", filename);
+		free(others);
+		return;
+	}
+	if (others)
+		fputs(others, f);
+	fprintf(f, "%s\t%s\t%.5f\n", key, algo_names[algo], rate);
+	fclose(f);
+	free(others);
+	applog(LOG_DEBUG, "Saved CPU benchmark results to %s", filename);
+}
 
-	bench_algo(&best_rate, &best_algo, ALGO_CRYPTOPP);
+// Pick the fastest CPU hasher
+static enum sha256_algos pick_fastest_algo()
+{
+	double best_rate = -1.0;
+	enum sha256_algos best_algo = 0;
+	struct algo_bench res;
+	char key[0x100];
+	size_t i, n;
+
+	cpu_bench_key(key, sizeof(key));
+	if (cpu_bench_cache_load(key, &best_algo)) {
+		applog(LOG_NOTICE, "Using \"%s\" sha256 algorithm from saved benchmark results", algo_names[best_algo]);
+		return best_algo;
+	}
 
-	#if defined(WANT_CRYPTOPP_ASM32)
-		bench_algo(&best_rate, &best_algo, ALGO_CRYPTOPP_ASM32);
-	#endif
+	applog(LOG_ERR, "benchmarking all sha256 algorithms ...");
 
-	#if defined(WANT_X8632_SSE2)
-		bench_algo(&best_rate, &best_algo, ALGO_SSE2_32);
-	#endif
+	// A quick benchmark is too noisy to be worth remembering
+	for (i = 0; i < ARRAY_SIZE(bench_algos); ++i) {
+		const enum sha256_algos algo = bench_algos[i];
 
-	#if defined(WANT_X8664_SSE2)
-		bench_algo(&best_rate, &best_algo, ALGO_SSE2_64);
-	#endif
+		if (opt_algo == ALGO_FASTAUTO) {
+			bench_algo(&best_rate, &best_algo, algo);
+			continue;
+		}
 
-	#if defined(WANT_X8664_SSE4)
-		bench_algo(&best_rate, &best_algo, ALGO_SSE4_64);
-	#endif
+		n = max_name_len - strlen(algo_names[algo]);
+		memset(name_spaces_pad, ' ', n);
+		name_spaces_pad[n] = 0;
 
-        #if defined(WANT_ALTIVEC_4WAY)
-                bench_algo(&best_rate, &best_algo, ALGO_ALTIVEC_4WAY);
-        #endif
+		if (!algo_supported(algo))
+			continue;
+		applog(LOG_ERR, "\"%s\"%s : benchmarking algorithm ...", algo_names[algo], name_spaces_pad);
+		if (!bench_algo_sweep(algo, &res)) {
+			applog(LOG_ERR, "\"%s\"%s : algorithm fails on this platform", algo_names[algo], name_spaces_pad);
+			continue;
+		}
+		applog(LOG_ERR, "\"%s\"%s : algorithm runs at %.5f MH/s (+/- %.5f), %.5f MH/s on %d processors",
+		       algo_names[algo], name_spaces_pad, res.mean, res.stddev, res.full_rate, num_processors);
+		if (best_rate < res.full_rate) {
+			best_rate = res.full_rate;
+			best_algo = algo;
+		}
+	}
 
-	size_t n = max_name_len - strlen(algo_names[best_algo]);
+	n = max_name_len - strlen(algo_names[best_algo]);
 	memset(name_spaces_pad, ' ', n);
 	name_spaces_pad[n] = 0;
 	applog(
@@ -672,9 +1035,72 @@ static enum sha256_algos pick_fastest_algo()
 		name_spaces_pad,
 		best_rate
 	);
+	if (opt_algo != ALGO_FASTAUTO && best_rate > 0.0)
+		cpu_bench_cache_store(key, best_algo, best_rate);
 	return best_algo;
 }
 
+// --benchmark-algos: report on every algorithm, and remember the fastest
+void cpu_benchmark_algos(void)
+{
+	double best_rate = -1.0, rate;
+	enum sha256_algos best_algo = 0;
+	struct algo_bench res;
+	char key[0x100];
+	size_t i;
+	int threads;
+
+	opt_algo = ALGO_AUTO;
+	cpu_detect_num_processors();
+	if (num_processors < 1)
+		num_processors = 1;
+	cpu_bench_key(key, sizeof(key));
+
+	printf("CPU: %s\n", key);
+	printf("%d runs of %d nonces per algorithm, then scaling over up to %d threads\n\n",
+	       BENCH_ALGO_TRIALS, 1 << 22, num_processors);
+
+	for (i = 0; i < ARRAY_SIZE(bench_algos); ++i) {
+		const enum sha256_algos algo = bench_algos[i];
+		const int namew = max_name_len;
+
+		if (!algo_supported(algo)) {
+			printf("%-*s  not supported by this CPU\n", namew, algo_names[algo]);
+			continue;
+		}
+		if (!bench_algo_sweep(algo, &res)) {
+			printf("%-*s  fails on this platform\n", namew, algo_names[algo]);
+			continue;
+		}
+		printf("%-*s  %10.5f MH/s per thread, stddev %.5f (%.2f%%), variance %.7f\n",
+		       namew, algo_names[algo], res.mean, res.stddev,
+		       res.mean > 0.0 ? (res.stddev * 100. / res.mean) : 0.0, res.variance);
+
+		for (threads = 1; threads < num_processors; threads *= 2) {
+			rate = (threads == 1) ? res.mean : bench_algo_threads(algo, threads);
+			if (rate < 0.0)
+				break;
+			printf("%*s  %4d threads: %10.5f MH/s, %5.2fx, %5.1f%% per core\n",
+			       namew, "", threads, rate, rate / res.mean, rate * 100. / (res.mean * threads));
+		}
+		printf("%*s  %4d threads: %10.5f MH/s, %5.2fx, %5.1f%% per core\n",
+		       namew, "", num_processors, res.full_rate, res.full_rate / res.mean,
+		       res.full_rate * 100. / (res.mean * num_processors));
+
+		if (best_rate < res.full_rate) {
+			best_rate = res.full_rate;
+			best_algo = algo;
+		}
+	}
+
+	if (best_rate <= 0.0) {
+		printf("\nNo working algorithm found\n");
+		return;
+	}
+	printf("\nFastest: %s at %.5f MH/s on %d threads\n", algo_names[best_algo], best_rate, num_processors);
+	cpu_bench_cache_store(key, best_algo, best_rate);
+}
+
 /* FIXME: Use asprintf for better errors. */
 char *set_algo(const char *arg, enum sha256_algos *algo)
 {
@@ -685,6 +1111,8 @@ char *set_algo(const char *arg, enum sha256_algos *algo)
 
 	for (i = 0; i < ARRAY_SIZE(algo_names); i++) {
 		if (algo_names[i] && !strcmp(arg, algo_names[i])) {
+			if (!algo_supported(i))
+				return "Algorithm not supported by this CPU";
 			*algo = i;
 			return NULL;
 		}
@@ -720,36 +1148,7 @@ static int cpu_autodetect()
 	
 	int i;
 
-	// Reckon number of cores in the box
-	#if defined(WIN32)
-	{
-		DWORD_PTR system_am;
-		DWORD_PTR process_am;
-		BOOL ok = GetProcessAffinityMask(
-			GetCurrentProcess(),
-			&system_am,
-			&process_am
-		);
-		if (!ok) {
-			applog(LOG_ERR, "couldn't figure out number of processors :(");
-			num_processors = 1;
-		} else {
-			size_t n = 32;
-			num_processors = 0;
-			while (n--)
-				if (process_am & (1<<n))
-					++num_processors;
-		}
-	}
-	#elif defined(_SC_NPROCESSORS_ONLN)
-		num_processors = sysconf(_SC_NPROCESSORS_ONLN);
-	#elif defined(HW_NCPU)
-		int req[] = { CTL_HW, HW_NCPU };
-		size_t len = sizeof(num_processors);
-		v = sysctl(req, 2, &num_processors, &len, NULL, 0);
-	#else
-		num_processors = 1;
-	#endif /* !WIN32 */
+	cpu_detect_num_processors();
 
 	if (opt_n_threads < 0 || !forced_n_threads) {
 			opt_n_threads = num_processors;
@@ -757,6 +1156,11 @@ static int cpu_autodetect()
 	if (num_processors < 1)
 		return 0;
 
+#ifdef WANT_SHANI
+	if (sha256_shani_available())
+		applog(LOG_DEBUG, "%s: CPU supports SHA extensions", cpu_drv.dname);
+#endif
+
 	cpus = calloc(opt_n_threads, sizeof(struct cgpu_info));
 	if (unlikely(!cpus))
 		quit(1, "Failed to calloc cpus");
@@ -874,6 +1278,13 @@ CPUSearch:
 	return last_nonce - first_nonce + 1;
 }
 
+static void cpu_thread_shutdown(struct thr_info * const thr)
+{
+#ifdef WANT_SCRYPT
+	scrypt_free_scratchpad(thr);
+#endif
+}
+
 struct device_drv cpu_drv = {
 	.dname = "cpu",
 	.name = "CPU",
@@ -884,6 +1295,7 @@ struct device_drv cpu_drv = {
 	.can_limit_work = cpu_can_limit_work,
 	.thread_init = cpu_thread_init,
 	.scanhash = cpu_scanhash,
+	.thread_shutdown = cpu_thread_shutdown,
 };
 #endif
 
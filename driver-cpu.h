@@ -46,6 +46,16 @@
 #define WANT_X8664_SSE4 1
 #endif
 
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#define WANT_AVX2_8WAY 1
+#endif
+#if __GNUC__ >= 5
+#define WANT_AVX512_16WAY 1
+#define WANT_SHANI 1
+#endif
+#endif
+
 #ifdef USE_SCRYPT
 #define WANT_SCRYPT
 #endif
@@ -60,6 +70,9 @@ enum sha256_algos {
 	ALGO_SSE2_64,		/* SSE2 for x86_64 */
 	ALGO_SSE4_64,		/* SSE4 for x86_64 */
 	ALGO_ALTIVEC_4WAY,	/* parallel Altivec */
+	ALGO_AVX2_8WAY,		/* parallel AVX2 */
+	ALGO_AVX512_16WAY,	/* parallel AVX-512 */
+	ALGO_SHANI,		/* x86 SHA extensions */
 	ALGO_SCRYPT,		/* scrypt */
 	
 	ALGO_FASTAUTO,		/* fast autodetect */
@@ -75,6 +88,7 @@ extern void show_algo(char buf[OPT_SHOW_LEN], const enum sha256_algos *algo);
 extern char *force_nthreads_int(const char *arg, int *i);
 extern void init_max_name_len();
 extern double bench_algo_stage3(enum sha256_algos algo);
+extern void cpu_benchmark_algos(void);
 extern void set_scrypt_algo(enum sha256_algos *algo);
 
 #endif /* __DEVICE_CPU_H__ */
@@ -503,12 +503,16 @@ bool hashfast_poll_msg(struct thr_info * const master_thr)
 				hashfast_submit_nonce(thr, work, nonce, false);
 				if (search)
 				{
+					uint32_t nonces2[0x80];
+					enum test_nonce2_result res[0x80];
 					for (int noffset = 1; noffset <= 0x80; ++noffset)
+						nonces2[noffset - 1] = nonce + noffset;
+					_test_nonces2(work, nonces2, 0x80, false, res);
+					for (int j = 0; j < 0x80; ++j)
 					{
-						const uint32_t nonce2 = nonce + noffset;
-						if (test_nonce(work, nonce2, false))
+						if (res[j] == TNR_GOOD)
 						{
-							hashfast_submit_nonce(thr, work, nonce2, true);
+							hashfast_submit_nonce(thr, work, nonces2[j], true);
 							++nonces_found;
 						}
 					}
@@ -983,8 +983,11 @@ static void klondike_check_nonce(struct cgpu_info *klncgpu, KLIST *kitem)
 	if (work) {
 		if (unlikely(!klninfo->nonce_offset))
 		{
-			bool test_c0  = test_nonce(work, nonce -  0xc0, false);
-			bool test_180 = test_nonce(work, nonce - 0x180, false);
+			const uint32_t candidates[2] = { nonce - 0xc0, nonce - 0x180, };
+			enum test_nonce2_result res[2];
+			_test_nonces2(work, candidates, 2, false, res);
+			bool test_c0  = (res[0] == TNR_GOOD);
+			bool test_180 = (res[1] == TNR_GOOD);
 			if (test_c0)
 			{
 				if (unlikely(test_180))
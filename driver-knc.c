@@ -52,6 +52,8 @@
 
  */
 
+#define KNC_NONCE_BATCH_MAX  0x20
+
 #define KNC_MAX_HWERR_IN_ROW    10
 #define KNC_HWERR_DISABLE_SECS (10)
 #define KNC_MAX_DISABLE_SECS   (15 * 60)
@@ -105,6 +107,14 @@ struct knc_core {
 	struct timeval first_hwerr;
 };
 
+// Nonces found in one poll, verified together by submit_nonces
+struct knc_nonce_batch {
+	unsigned count;
+	struct thr_info *thr[KNC_NONCE_BATCH_MAX];
+	struct work *work[KNC_NONCE_BATCH_MAX];
+	uint32_t nonce[KNC_NONCE_BATCH_MAX];
+};
+
 static
 bool knc_detect_one(const char *devpath)
 {
@@ -442,6 +452,26 @@ uint32_t get_u32be(const void * const p)
 	     |             b[3];
 }
 
+static
+void knc_flush_nonces(struct knc_nonce_batch * const batch)
+{
+	struct knc_core *knccore;
+	bool results[KNC_NONCE_BATCH_MAX];
+	unsigned i;
+	
+	if (!batch->count)
+		return;
+	
+	submit_nonces(batch->thr, batch->work, batch->nonce, batch->count, results);
+	for (i = 0; i < batch->count; ++i)
+		if (results[i])
+		{
+			knccore = batch->thr[i]->cgpu_data;
+			knccore->hwerr_in_row = 0;
+		}
+	batch->count = 0;
+}
+
 static
 void knc_poll(struct thr_info * const thr)
 {
@@ -458,6 +488,7 @@ void knc_poll(struct thr_info * const thr)
 	uint32_t nonce, coreno;
 	size_t spi_req_sz = 0x1000;
 	unsigned long delay_usecs = KNC_POLL_INTERVAL_US;
+	struct knc_nonce_batch nonces = { .count = 0, };
 	
 	knc_prune_local_queue(thr);
 	
@@ -552,16 +583,22 @@ void knc_poll(struct thr_info * const thr)
 			case KNC_REPLY_NONCE_FOUND:
 				nonce = get_u32be(&rxbuf[4]);
 				nonce = le32toh(nonce);
-				if (submit_nonce(mythr, work, nonce))
-					knccore->hwerr_in_row = 0;
+				nonces.thr[nonces.count] = mythr;
+				nonces.work[nonces.count] = work;
+				nonces.nonce[nonces.count] = nonce;
+				if (++nonces.count == KNC_NONCE_BATCH_MAX)
+					knc_flush_nonces(&nonces);
 				break;
 			case KNC_REPLY_WORK_DONE:
+				// Pending nonces may refer to this work, so submit them first
+				knc_flush_nonces(&nonces);
 				HASH_DEL(knc->devicework, work);
 				free_work(work);
 				hashes_done2(mythr, 0x100000000, NULL);
 				break;
 		}
 	}
+	knc_flush_nonces(&nonces);
 	
 	if (knc->need_flush)
 	{
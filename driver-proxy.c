@@ -110,6 +110,7 @@ struct proxy_client *proxy_find_or_create_client(const char *username)
 			.username = user,
 			.cgpu = cgpu,
 		};
+		mutex_init(&client->mutex);
 		
 		b = HASH_COUNT(proxy_clients);
 		HASH_ADD_KEYPTR(hh, proxy_clients, client->username, strlen(user), client);
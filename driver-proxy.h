@@ -10,6 +10,8 @@ struct proxy_client {
 	struct cgpu_info *cgpu;
 	struct work *work;
 	struct timeval tv_hashes_done;
+	// Serialises share accounting for servers handling clients on many threads
+	pthread_mutex_t mutex;
 	
 	UT_hash_handle hh;
 };
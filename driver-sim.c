@@ -0,0 +1,498 @@
+/*
+ * Copyright 2026 agent
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Simulated devices for end-to-end throughput benchmarks.  No scanning is
+ * done: each processor reports hashes at its configured rate and submits
+ * random nonces through the normal share path, which hashes each one as it
+ * would a real share, but takes the simulated result; so the shares are only
+ * accepted by --stratum-replay (or ignored by --benchmark).
+ *
+ * "sim" devices run on minerloop_async and "simqueue" devices on
+ * minerloop_queue.  Enable them with -S sim:auto or -S simqueue:auto, and
+ * configure them with --set-device, eg:
+ *   --set-device sim:procs=64 --set-device sim:hashrate=5000 */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <utlist.h>
+
+#include "deviceapi.h"
+#include "logging.h"
+#include "miner.h"
+#include "util.h"
+
+#define SIM_POLL_US  10000
+#define SIM_MAX_PROCS  0x100
+#define SIM_NONCE_RANGE  0x100000000LL
+
+BFG_REGISTER_DRIVER(sim_drv)
+BFG_REGISTER_DRIVER(simqueue_drv)
+const struct bfg_set_device_definition sim_set_device_funcs[];
+
+struct sim_config {
+	int devices;
+	int procs;
+	// Per processor, in MH/s
+	double hashrate;
+	// Nonces returned per second; 0 means one per 2^32 hashes (difficulty 1)
+	double nonce_rate;
+	// Fraction of nonces that meet the share target; 0 means 1/work difficulty
+	double share_ratio;
+	// Fraction of nonces that are hardware errors
+	double hw_errors;
+	// Delay before results are read (sim) or queued work starts (simqueue)
+	int latency_ms;
+	int queue_depth;
+};
+
+static const struct sim_config sim_config_defaults = {
+	.devices = 1,
+	.procs = 1,
+	.hashrate = 1000,
+	.queue_depth = 2,
+};
+
+struct sim_state {
+	uint64_t rng;
+	double nonce_credit;
+	struct timeval tv_last;
+
+	// sim
+	struct timeval tv_results_due;
+
+	// simqueue
+	struct work *queue;
+	int queue_size;
+	struct timeval tv_job_start;
+	int64_t job_hashes;
+};
+
+static
+int sim_detect_drv(struct device_drv * const drv)
+{
+	struct sim_config cfg = sim_config_defaults;
+	struct sim_config *devcfg;
+	struct cgpu_info *cgpu;
+	int i;
+
+	// Their shares are fake, so never send them to a real pool
+	if (!(opt_benchmark || stratum_replay_active()))
+	{
+		applog(LOG_ERR, "%s: Simulated devices only run with --benchmark or --stratum-replay, ignoring",
+		       drv->dname);
+		return 0;
+	}
+
+	drv_set_defaults(drv, sim_set_device_funcs, &cfg, NULL, NULL, 1);
+
+	applog(LOG_WARNING, "%s: Simulating %d device(s) of %d processor(s) at %g MH/s each",
+	       drv->dname, cfg.devices, cfg.procs, cfg.hashrate);
+
+	for (i = 0; i < cfg.devices; ++i)
+	{
+		devcfg = malloc(sizeof(*devcfg));
+		if (unlikely(!devcfg))
+			quithere(1, "malloc failed");
+		*devcfg = cfg;
+		cgpu = malloc(sizeof(*cgpu));
+		if (unlikely(!cgpu))
+			quithere(1, "malloc failed");
+		*cgpu = (struct cgpu_info){
+			.drv = drv,
+			.procs = cfg.procs,
+			.threads = 1,
+			.device_data = devcfg,
+			.set_device_funcs = &sim_set_device_funcs[2],
+		};
+		add_cgpu(cgpu);
+	}
+
+	return cfg.devices;
+}
+
+static
+int sim_autodetect()
+{
+	RUNONCE(0);
+
+	return sim_detect_drv(&sim_drv);
+}
+
+static
+int simqueue_autodetect()
+{
+	RUNONCE(0);
+
+	return sim_detect_drv(&simqueue_drv);
+}
+
+static
+void sim_detect()
+{
+	noserial_detect_manual(&sim_drv, sim_autodetect);
+}
+
+static
+void simqueue_detect()
+{
+	noserial_detect_manual(&simqueue_drv, simqueue_autodetect);
+}
+
+static
+bool sim_thread_init(struct thr_info * const master_thr)
+{
+	struct cgpu_info * const dev = master_thr->cgpu, *proc;
+	struct sim_state *state;
+	struct thr_info *thr;
+	struct timeval tv_now;
+
+	timer_set_now(&tv_now);
+	for (proc = dev; proc; proc = proc->next_proc)
+	{
+		thr = proc->thr[0];
+		state = malloc(sizeof(*state));
+		if (unlikely(!state))
+			quithere(1, "malloc failed");
+		*state = (struct sim_state){
+			// xorshift must not start at zero
+			.rng = ((uint64_t)tv_now.tv_usec << 0x20) ^ (thr->id + 1),
+		};
+		timer_unset(&state->tv_results_due);
+		timer_unset(&state->tv_job_start);
+		thr->cgpu_data = state;
+		timer_set_now(&thr->tv_poll);
+	}
+
+	return true;
+}
+
+static
+uint64_t sim_random(struct sim_state * const state)
+{
+	uint64_t x = state->rng;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	state->rng = x;
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+static
+double sim_random_fraction(struct sim_state * const state)
+{
+	return (sim_random(state) >> 11) / (double)(1ULL << 53);
+}
+
+// Microseconds to search a whole nonce range
+static
+long sim_job_us(const struct sim_config * const cfg)
+{
+	return SIM_NONCE_RANGE / cfg->hashrate;
+}
+
+static
+int64_t sim_hashes_since(const struct sim_config * const cfg, const struct timeval * const tvp_start, const struct timeval * const tvp_now)
+{
+	const double hashes = timer_elapsed_us(tvp_start, tvp_now) * cfg->hashrate;
+
+	if (hashes <= 0)
+		return 0;
+	if (hashes >= SIM_NONCE_RANGE)
+		return SIM_NONCE_RANGE;
+	return hashes;
+}
+
+// Submits whatever nonces were "found" for work since the last call
+static
+void sim_find_nonces(struct thr_info * const thr, struct work * const work, const struct timeval * const tvp_now)
+{
+	const struct sim_config * const cfg = thr->cgpu->device_data;
+	struct sim_state * const state = thr->cgpu_data;
+	enum test_nonce2_result res;
+	double secs, nonce_rate, share_ratio;
+
+	secs = timer_elapsed_us(&state->tv_last, tvp_now) / 1e6;
+	if (secs <= 0)
+		return;
+	state->tv_last = *tvp_now;
+	// After a stall, don't flood the share path with everything missed
+	if (secs > 1)
+		secs = 1;
+
+	nonce_rate = cfg->nonce_rate;
+	if (!nonce_rate)
+		nonce_rate = cfg->hashrate * 1e6 / SIM_NONCE_RANGE;
+	share_ratio = cfg->share_ratio;
+	if (!share_ratio && work->work_difficulty > 0)
+		share_ratio = 1. / work->work_difficulty;
+
+	for (state->nonce_credit += nonce_rate * secs; state->nonce_credit >= 1; --state->nonce_credit)
+	{
+		if (sim_random_fraction(state) < cfg->hw_errors)
+			res = TNR_BAD;
+		else
+		if (sim_random_fraction(state) < share_ratio)
+			res = TNR_GOOD;
+		else
+			res = TNR_HIGH;
+		submit_simulated_nonce(thr, work, (uint32_t)sim_random(state), res);
+	}
+}
+
+static
+bool sim_running(const struct thr_info * const thr)
+{
+	return thr->cgpu->deven == DEV_ENABLED && !thr->pause;
+}
+
+static
+bool sim_job_prepare(struct thr_info * const thr, struct work * const work, __maybe_unused const uint64_t max_nonce)
+{
+	work->blk.nonce = 0xffffffff;
+	return true;
+}
+
+static
+void sim_job_start(struct thr_info * const thr)
+{
+	const struct sim_config * const cfg = thr->cgpu->device_data;
+	struct sim_state * const state = thr->cgpu_data;
+	struct timeval tv_now;
+
+	mt_job_transition(thr);
+	timer_set_now(&tv_now);
+	state->tv_last = tv_now;
+	timer_set_delay(&thr->tv_morework, &tv_now, sim_job_us(cfg));
+	job_start_complete(thr);
+}
+
+static
+void sim_job_get_results(struct thr_info * const thr, struct work * const work)
+{
+	const struct sim_config * const cfg = thr->cgpu->device_data;
+	struct sim_state * const state = thr->cgpu_data;
+	struct timeval tv_now;
+
+	timer_set_now(&tv_now);
+	sim_find_nonces(thr, work, &tv_now);
+	if (!cfg->latency_ms)
+	{
+		job_results_fetched(thr);
+		return;
+	}
+
+	// The job keeps running until its results arrive; sim_poll finishes up
+	timer_set_delay(&state->tv_results_due, &tv_now, cfg->latency_ms * 1000L);
+	if (timercmp(&state->tv_results_due, &thr->tv_poll, <))
+		thr->tv_poll = state->tv_results_due;
+}
+
+static
+int64_t sim_job_process_results(struct thr_info * const thr, __maybe_unused struct work * const work, __maybe_unused const bool stopping)
+{
+	const struct sim_config * const cfg = thr->cgpu->device_data;
+
+	return sim_hashes_since(cfg, &thr->tv_results_jobstart, NULL);
+}
+
+static
+void sim_poll(struct thr_info * const thr)
+{
+	struct sim_state * const state = thr->cgpu_data;
+	struct timeval tv_now;
+
+	timer_set_now(&tv_now);
+	if (thr->work && sim_running(thr))
+		sim_find_nonces(thr, thr->work, &tv_now);
+	timer_set_delay(&thr->tv_poll, &tv_now, SIM_POLL_US);
+
+	if (timer_isset(&state->tv_results_due))
+	{
+		if (timer_passed(&state->tv_results_due, &tv_now))
+		{
+			timer_unset(&state->tv_results_due);
+			job_results_fetched(thr);
+		}
+		else
+		if (timercmp(&state->tv_results_due, &thr->tv_poll, <))
+			thr->tv_poll = state->tv_results_due;
+	}
+}
+
+static
+bool simq_queue_append(struct thr_info * const thr, struct work * const work)
+{
+	const struct sim_config * const cfg = thr->cgpu->device_data;
+	struct sim_state * const state = thr->cgpu_data;
+
+	if (state->queue_size >= cfg->queue_depth)
+	{
+		thr->queue_full = true;
+		return false;
+	}
+
+	DL_APPEND(state->queue, work);
+	if (++state->queue_size >= cfg->queue_depth)
+		thr->queue_full = true;
+
+	return true;
+}
+
+static
+void simq_queue_flush(struct thr_info * const thr)
+{
+	struct sim_state * const state = thr->cgpu_data;
+	struct work *work, *tmp;
+
+	DL_FOREACH_SAFE(state->queue, work, tmp)
+	{
+		DL_DELETE(state->queue, work);
+		free_work(work);
+	}
+	state->queue_size = 0;
+	timer_unset(&state->tv_job_start);
+	thr->queue_full = false;
+}
+
+static
+void simq_poll(struct thr_info * const thr)
+{
+	const struct sim_config * const cfg = thr->cgpu->device_data;
+	struct sim_state * const state = thr->cgpu_data;
+	struct timeval tv_now, tv_end;
+	struct work *work;
+	int64_t hashes;
+
+	timer_set_now(&tv_now);
+	while ((work = state->queue))
+	{
+		if (!timer_isset(&state->tv_job_start))
+		{
+			// An idle device only starts once the work has reached it
+			timer_set_delay(&state->tv_job_start, &tv_now, cfg->latency_ms * 1000L);
+			state->tv_last = state->tv_job_start;
+			state->job_hashes = 0;
+		}
+		if (!timer_passed(&state->tv_job_start, &tv_now))
+			break;
+
+		timer_set_delay(&tv_end, &state->tv_job_start, sim_job_us(cfg));
+		if (timercmp(&tv_end, &tv_now, >))
+			tv_end = tv_now;
+		sim_find_nonces(thr, work, &tv_end);
+		hashes = sim_hashes_since(cfg, &state->tv_job_start, &tv_end);
+		if (hashes > state->job_hashes)
+		{
+			hashes_done2(thr, hashes - state->job_hashes, NULL);
+			state->job_hashes = hashes;
+		}
+		if (hashes < SIM_NONCE_RANGE)
+			break;
+
+		// Nonce range exhausted; the next queued work is already loaded
+		DL_DELETE(state->queue, work);
+		--state->queue_size;
+		free_work(work);
+		thr->queue_full = false;
+		state->tv_job_start = tv_end;
+		state->tv_last = tv_end;
+		state->job_hashes = 0;
+		if (!state->queue)
+			timer_unset(&state->tv_job_start);
+	}
+
+	timer_set_delay(&thr->tv_poll, &tv_now, SIM_POLL_US);
+}
+
+static
+const char *sim_set_parse(const char * const optname, const char * const newvalue, char * const replybuf, const double min, const double max, double * const out)
+{
+	char *endptr;
+	const double d = strtod(newvalue, &endptr);
+
+	if (endptr == newvalue || endptr[0] || d < min || d > max)
+	{
+		sprintf(replybuf, "invalid %s: must be between %g and %g", optname, min, max);
+		return replybuf;
+	}
+	*out = d;
+	return NULL;
+}
+
+#define SIM_SET_FUNC(name, min, max, assign)  \
+static  \
+const char *sim_set_ ## name(struct cgpu_info * const proc, const char * const optname, const char * const newvalue, char * const replybuf, __maybe_unused enum bfg_set_device_replytype * const out_success)  \
+{  \
+	struct sim_config * const cfg = proc->device_data;  \
+	const char *rv;  \
+	double d;  \
+	  \
+	rv = sim_set_parse(optname, newvalue, replybuf, min, max, &d);  \
+	if (!rv)  \
+		cfg->name = assign;  \
+	return rv;  \
+}  \
+// END SIM_SET_FUNC
+
+SIM_SET_FUNC(devices, 1, 0x40, d)
+SIM_SET_FUNC(procs, 1, SIM_MAX_PROCS, d)
+SIM_SET_FUNC(hashrate, 1e-3, 1e9, d)
+SIM_SET_FUNC(nonce_rate, 0, 1e7, d)
+SIM_SET_FUNC(share_ratio, 0, 1, d)
+SIM_SET_FUNC(hw_errors, 0, 1, d)
+SIM_SET_FUNC(latency_ms, 0, 60000, d)
+SIM_SET_FUNC(queue_depth, 1, 0x100, d)
+
+const struct bfg_set_device_definition sim_set_device_funcs[] = {
+	// NOTE: only the options from hashrate on can be changed after probing
+	{"devices", sim_set_devices, "number of devices to simulate"},
+	{"procs", sim_set_procs, "processors per device"},
+	{"hashrate", sim_set_hashrate, "MH/s per processor"},
+	{"nonce_rate", sim_set_nonce_rate, "nonces returned per second per processor (0 for one per 2^32 hashes)"},
+	{"share_ratio", sim_set_share_ratio, "fraction of nonces meeting the share target (0 for 1/work difficulty)"},
+	{"hw_errors", sim_set_hw_errors, "fraction of nonces that are hardware errors"},
+	{"latency", sim_set_latency_ms, "milliseconds before results are read (sim) or work starts (simqueue)"},
+	{"queue_depth", sim_set_queue_depth, "work items queued per processor (simqueue)"},
+	{NULL},
+};
+
+struct device_drv sim_drv = {
+	.dname = "sim",
+	.name = "SIM",
+	.drv_detect = sim_detect,
+
+	.thread_init = sim_thread_init,
+
+	.minerloop = minerloop_async,
+	.job_prepare = sim_job_prepare,
+	.job_start = sim_job_start,
+	.job_get_results = sim_job_get_results,
+	.job_process_results = sim_job_process_results,
+	.poll = sim_poll,
+};
+
+struct device_drv simqueue_drv = {
+	.dname = "simqueue",
+	.name = "SIQ",
+	.drv_detect = simqueue_detect,
+
+	.thread_init = sim_thread_init,
+
+	.minerloop = minerloop_queue,
+	.queue_append = simq_queue_append,
+	.queue_flush = simq_queue_flush,
+	.poll = simq_poll,
+};
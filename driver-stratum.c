@@ -15,8 +15,13 @@
 #include <winsock2.h>
 #endif
 
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <event2/buffer.h>
@@ -31,47 +36,249 @@
 #include "miner.h"
 #include "util.h"
 
-#define MAX_CLIENTS 255
-
-static bool _ssm_xnonce1s[MAX_CLIENTS + 1] = { true };
 static uint8_t _ssm_client_octets;
 static uint8_t _ssm_client_xnonce2sz;
-static char *_ssm_notify;
-static int _ssm_notify_sz;
+
+/* A notify is built once, and referenced (not copied) by the output buffer of
+ * every connection it is sent to; the last to let go of it frees it */
+struct stratumsrv_notify {
+	int refs;
+	uint32_t job_id;
+	// Difficulty of the upstream pool, which per-miner difficulties never exceed
+	double pool_diff;
+	size_t sz;
+	char buf[];
+};
+
+// Extranonce1 slots in use, one bit each; slot 0 is never handed out
+static pthread_mutex_t _ssm_xnonce1s_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t *_ssm_xnonce1s;
+static uint32_t _ssm_xnonce1s_max;
+static uint32_t _ssm_xnonce1s_used;
+static uint32_t _ssm_xnonce1s_next;
+
+/* The current notify (or boot message) is built on the stratumsrv thread and
+ * sent by every worker thread to its own connections; the generation numbers
+ * tell a worker whether it has sent the latest one yet */
+static pthread_mutex_t _ssm_notify_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct stratumsrv_notify *_ssm_notify;
+static unsigned _ssm_notify_gen;
+static const char *_ssm_boot_msg;
+static unsigned _ssm_boot_gen;
 static struct event *ev_notify;
 static notifier_t _ssm_update_notifier;
 
+// How often (in seconds) --stratum-share-rate retargets each miner's difficulty
+#define SSM_VARDIFF_SECS  30
+// How many recent jobs each connection remembers the difficulty of
+#define SSM_CONN_JOB_DIFFS  8
+
+// Upstream work, shared by every job made from the same upstream notify
+struct stratumsrv_swork {
+	int refs;
+	struct stratum_work swork;
+};
+
 struct stratumsrv_job {
-	char *my_job_id;
+	uint32_t my_job_id;
 	
 	struct pool *pool;
 	uint8_t work_restart_id;
 	uint8_t n2size;
 	struct timeval tv_prepared;
-	struct stratum_work swork;
+	struct stratumsrv_swork *sswork;
 	char *nonce1;
-	
-	UT_hash_handle hh;
 };
 
-static struct stratumsrv_job *_ssm_jobs;
+/* Jobs live in the slot of their id modulo SSM_JOB_SLOTS (a power of two), so
+ * each new job replaces the oldest; older jobs are also refused once expired */
+#define SSM_JOB_SLOTS  0x40
+
+// Read locked to look up jobs for submits, write locked to add and remove them
+static pthread_rwlock_t _ssm_jobs_lock;
+static struct stratumsrv_job *_ssm_jobs[SSM_JOB_SLOTS];
 static struct work _ssm_cur_job_work;
-static uint64_t _ssm_jobid;
+static uint32_t _ssm_jobid;
 
 static struct event_base *_smm_evbase;
 static bool _smm_running;
 static struct evconnlistener *_smm_listener;
 
+// Each worker thread runs its own event loop for the connections given to it
+struct stratumsrv_worker {
+	int index;
+	pthread_t pth;
+	struct event_base *evbase;
+	notifier_t notifier;
+	
+	pthread_mutex_t mutex;
+	// Accepted sockets waiting to be set up by the worker
+	evutil_socket_t *pending;
+	int pending_count;
+	int pending_sz;
+	// Submits back from the verifier threads, waiting for their replies to be sent
+	struct stratumsrv_submit *verified;
+	
+	struct stratumsrv_conn *connections;
+	int connections_count;
+	unsigned notify_gen;
+	unsigned boot_gen;
+	struct stratumsrv_work_cache *work_cache;
+};
+
+static struct stratumsrv_worker *_ssm_workers;
+static int _ssm_workers_count;
+
+// Replies are sent in request order, so any after a submit wait for it to be verified
+struct stratumsrv_reply {
+	char *buf;
+	size_t bufsz;
+	bool ready;
+	// Could not be allocated, so the connection can't go on
+	bool lost;
+	
+	struct stratumsrv_reply *next;
+};
+
 struct stratumsrv_conn {
+	struct stratumsrv_worker *worker;
+	// NULL once closed, while submits are still being verified
 	struct bufferevent *bev;
 	uint32_t xnonce1_le;
 	struct timeval tv_hashes_done;
 	bool hashes_done_ext;
+	struct stratumsrv_reply *replies;
+	int submits_verifying;
+	// A reply was lost, so close it at the next safe point
+	bool replies_lost;
+	
+	double diff;
+	// Shares are checked at the difficulty their job was sent at (or any lower one set since)
+	struct {
+		uint32_t job_id;
+		double diff;
+	} job_diffs[SSM_CONN_JOB_DIFFS];
+	int job_diffs_next;
+	double pool_diff;
+	int vardiff_shares;
+	struct timeval tv_vardiff;
 	
 	struct stratumsrv_conn *next;
 };
 
-static struct stratumsrv_conn *_ssm_connections;
+// A submit parsed on a worker thread, for a verifier thread to check
+struct stratumsrv_submit {
+	struct stratumsrv_conn *conn;
+	struct stratumsrv_reply *reply;
+	struct thr_info *thr;
+	uint32_t xnonce1_le;
+	uint8_t ntime[4];
+	uint32_t nonce;
+	const char *idstr;
+	const char *job_id;
+	const char *extranonce2;
+	struct proxy_client *client;
+	double diff;
+	bool check_target;
+	unsigned char target[32];
+	bool accepted;
+	
+	struct stratumsrv_submit *prev;
+	struct stratumsrv_submit *next;
+};
+
+/* Miners usually find several nonces per extranonce2, so each verifier keeps
+ * the last work it generated to skip rebuilding the coinbase and merkle root */
+struct stratumsrv_work_cache {
+	char *job_id;
+	char *extranonce2;
+	uint32_t xnonce1_le;
+	uint8_t ntime[4];
+	struct work work;
+};
+
+#define SSM_VERIFY_BATCH  0x20
+
+static pthread_mutex_t _ssm_verify_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _ssm_verify_cond = PTHREAD_COND_INITIALIZER;
+static struct stratumsrv_submit *_ssm_verify_queue;
+
+static
+void stratumsrv_xnonce1s_init(void)
+{
+	_ssm_client_octets = opt_stratumsrv_xnonce1_size;
+	_ssm_xnonce1s_max = ((uint32_t)1 << (8 * _ssm_client_octets)) - 1;
+	_ssm_xnonce1s = calloc((_ssm_xnonce1s_max + 1) / 32, sizeof(*_ssm_xnonce1s));
+	if (unlikely(!_ssm_xnonce1s))
+		quit(1, "Failed to calloc %s", "_ssm_xnonce1s");
+	_ssm_xnonce1s[0] = 1;
+	_ssm_xnonce1s_next = 1;
+}
+
+// Returns an unused extranonce1 slot, or 0 if every slot is in use
+static
+uint32_t stratumsrv_xnonce1_alloc(void)
+{
+	const uint32_t words = (_ssm_xnonce1s_max + 1) / 32;
+	uint32_t i, free_bits, xnonce1 = 0;
+	
+	mutex_lock(&_ssm_xnonce1s_mutex);
+	if (_ssm_xnonce1s_used < _ssm_xnonce1s_max)
+	{
+		// Carry on from the last slot handed out, skipping full words
+		for (i = _ssm_xnonce1s_next / 32; !(free_bits = ~_ssm_xnonce1s[i]); i = (i + 1) % words)
+		{}
+		xnonce1 = (i * 32) + __builtin_ctz(free_bits);
+		_ssm_xnonce1s[i] |= (uint32_t)1 << (xnonce1 % 32);
+		++_ssm_xnonce1s_used;
+		_ssm_xnonce1s_next = xnonce1;
+	}
+	mutex_unlock(&_ssm_xnonce1s_mutex);
+	
+	return xnonce1;
+}
+
+static
+void stratumsrv_xnonce1_free(const uint32_t xnonce1)
+{
+	mutex_lock(&_ssm_xnonce1s_mutex);
+	_ssm_xnonce1s[xnonce1 / 32] &= ~((uint32_t)1 << (xnonce1 % 32));
+	--_ssm_xnonce1s_used;
+	mutex_unlock(&_ssm_xnonce1s_mutex);
+}
+
+static
+void stratumsrv_wake_workers(void)
+{
+	int i;
+	
+	for (i = 0; i < _ssm_workers_count; ++i)
+		notifier_wake(_ssm_workers[i].notifier);
+}
+
+static
+void stratumsrv_notify_unref(struct stratumsrv_notify * const notify)
+{
+	if (!__sync_sub_and_fetch(&notify->refs, 1))
+		free(notify);
+}
+
+static
+void stratumsrv_notify_sent_cb(__maybe_unused const void * const data, __maybe_unused const size_t datalen, void * const p)
+{
+	stratumsrv_notify_unref(p);
+}
+
+static
+void stratumsrv_send_notify(struct stratumsrv_conn * const conn, struct stratumsrv_notify * const notify)
+{
+	__sync_fetch_and_add(&notify->refs, 1);
+	if (unlikely(evbuffer_add_reference(bufferevent_get_output(conn->bev), notify->buf, notify->sz, stratumsrv_notify_sent_cb, notify)))
+	{
+		stratumsrv_notify_unref(notify);
+		bufferevent_write(conn->bev, notify->buf, notify->sz);
+	}
+}
 
 static
 void _ssm_gen_dummy_work(struct work *work, struct stratumsrv_job *ssj, const char * const extranonce2, uint32_t xnonce1)
@@ -96,7 +303,20 @@ void _ssm_gen_dummy_work(struct work *work, struct stratumsrv_job *ssj, const ch
 	memcpy(p, &xnonce1, _ssm_client_octets);
 	if (p != s)
 		memset(s, '\xbb', p - s);
-	gen_stratum_work2(work, &ssj->swork, ssj->nonce1);
+	gen_stratum_work2(work, &ssj->sswork->swork, ssj->nonce1);
+}
+
+// Only the thread holding _ssm_notify_mutex adds and removes jobs, so their shared work needs no atomics
+static
+void _ssj_free(struct stratumsrv_job * const ssj)
+{
+	if (!--ssj->sswork->refs)
+	{
+		stratum_work_clean(&ssj->sswork->swork);
+		free(ssj->sswork);
+	}
+	rcstr_free(ssj->nonce1);
+	free(ssj);
 }
 
 static
@@ -104,112 +324,187 @@ bool stratumsrv_update_notify_str(struct pool * const pool, bool clean)
 {
 	cg_rlock(&pool->data_lock);
 	
-	struct stratumsrv_conn *conn;
 	const struct stratum_work * const swork = &pool->swork;
 	const int n2size = pool->n2size;
-	char my_job_id[33];
+	const uint32_t job_id = _ssm_jobid++;
+	struct stratumsrv_job * const prev_ssj = _ssm_jobs[(job_id - 1) % SSM_JOB_SLOTS];
+	struct stratumsrv_job *ssj, *old_ssj;
+	char my_job_id[9];
 	int i;
-	struct stratumsrv_job *ssj;
 	ssize_t n2pad = n2size - _ssm_client_octets - _ssm_client_xnonce2sz;
 	if (n2pad < 0)
+	{
+		cg_runlock(&pool->data_lock);
 		return false;
+	}
+	sprintf(my_job_id, "%"PRIx32, job_id);
 	size_t coinb1in_lenx = swork->nonce2_offset * 2;
 	size_t n2padx = n2pad * 2;
 	size_t coinb1_lenx = coinb1in_lenx + n2padx;
 	size_t coinb2_len = bytes_len(&swork->coinbase) - swork->nonce2_offset - n2size;
 	size_t coinb2_lenx = coinb2_len * 2;
-	sprintf(my_job_id, "%"PRIx64"-%"PRIx64, (uint64_t)time(NULL), _ssm_jobid++);
 	size_t bufsz = 166 + strlen(my_job_id) + coinb1_lenx + coinb2_lenx + (swork->merkles * 67);
-	char * const buf = malloc(bufsz);
-	char *p = buf;
-	char prevhash[65], coinb1[coinb1_lenx + 1], coinb2[coinb2_lenx], version[9], nbits[9], ntime[9];
+	struct stratumsrv_notify * const notify = malloc(sizeof(*notify) + bufsz);
+	char *p;
 	uint32_t ntime_n;
-	bin2hex(prevhash, &swork->header1[4], 32);
-	bin2hex(coinb1, bytes_buf(&swork->coinbase), swork->nonce2_offset);
-	memset(&coinb1[coinb1in_lenx], 'B', n2padx);
-	coinb1[coinb1_lenx] = '\0';
-	bin2hex(coinb2, &bytes_buf(&swork->coinbase)[swork->nonce2_offset + n2size], coinb2_len);
-	p += sprintf(p, "{\"params\":[\"%s\",\"%s\",\"%s\",\"%s\",[", my_job_id, prevhash, coinb1, coinb2);
+	
+	if (unlikely(!notify))
+	{
+		cg_runlock(&pool->data_lock);
+		// Miners carry on with the previous job, rather than being booted
+		applog(LOG_ERR, "SSM: Failed to malloc %s, keeping the previous job", "notify");
+		return true;
+	}
+	p = notify->buf;
+	
+	// Hex goes straight into the notify, rather than through temporary strings
+#define SSM_APPEND_STR(s)  (memcpy(p, s, sizeof(s) - 1), p += sizeof(s) - 1)
+#define SSM_APPEND_HEX(data, len)  (bin2hex(p, data, len), p += (len) * 2)
+	p += sprintf(p, "{\"params\":[\"%s\",\"", my_job_id);
+	SSM_APPEND_HEX(&swork->header1[4], 32);
+	SSM_APPEND_STR("\",\"");
+	SSM_APPEND_HEX(bytes_buf(&swork->coinbase), swork->nonce2_offset);
+	memset(p, 'B', n2padx);
+	p += n2padx;
+	SSM_APPEND_STR("\",\"");
+	SSM_APPEND_HEX(&bytes_buf(&swork->coinbase)[swork->nonce2_offset + n2size], coinb2_len);
+	SSM_APPEND_STR("\",[");
 	for (i = 0; i < swork->merkles; ++i)
 	{
 		if (i)
 			*p++ = ',';
 		*p++ = '"';
-		bin2hex(p, &bytes_buf(&swork->merkle_bin)[i * 32], 32);
-		p += 64;
+		SSM_APPEND_HEX(&bytes_buf(&swork->merkle_bin)[i * 32], 32);
 		*p++ = '"';
 	}
-	bin2hex(version, swork->header1, 4);
-	bin2hex(nbits, swork->diffbits, 4);
+	SSM_APPEND_STR("],\"");
+	SSM_APPEND_HEX(swork->header1, 4);
+	SSM_APPEND_STR("\",\"");
+	SSM_APPEND_HEX(swork->diffbits, 4);
+	SSM_APPEND_STR("\",\"");
 	ntime_n = htobe32(swork->ntime + timer_elapsed(&swork->tv_received, NULL));
-	bin2hex(ntime, &ntime_n, 4);
-	p += sprintf(p, "],\"%s\",\"%s\",\"%s\",%s],\"method\":\"mining.notify\",\"id\":null}\n", version, nbits, ntime, clean ? "true" : "false");
+	SSM_APPEND_HEX(&ntime_n, 4);
+	p += sprintf(p, "\",%s],\"method\":\"mining.notify\",\"id\":null}\n", clean ? "true" : "false");
+#undef SSM_APPEND_STR
+#undef SSM_APPEND_HEX
 	
 	ssj = malloc(sizeof(*ssj));
+	if (unlikely(!ssj))
+		goto nomem;
 	*ssj = (struct stratumsrv_job){
-		.my_job_id = strdup(my_job_id),
+		.my_job_id = job_id,
 		
 		.pool = pool,
 		.work_restart_id = pool->work_restart_id,
 		.n2size = n2size,
-		.nonce1 = strdup(pool->nonce1),
+		.nonce1 = rcstr_ref(pool->nonce1),
 	};
 	timer_set_now(&ssj->tv_prepared);
-	stratum_work_cpy(&ssj->swork, swork);
+	
+	// Periodic refreshes only roll ntime, so share the previous job's copy of the same upstream work
+	if (prev_ssj && prev_ssj->my_job_id == job_id - 1 && prev_ssj->pool == pool
+	 && prev_ssj->sswork->swork.job_id == swork->job_id
+	 && !memcmp(&prev_ssj->sswork->swork.tv_received, &swork->tv_received, sizeof(swork->tv_received))
+	 && prev_ssj->sswork->swork.diff == swork->diff)
+	{
+		ssj->sswork = prev_ssj->sswork;
+		++ssj->sswork->refs;
+	}
+	else
+	{
+		ssj->sswork = malloc(sizeof(*ssj->sswork));
+		if (unlikely(!ssj->sswork))
+		{
+			rcstr_free(ssj->nonce1);
+			free(ssj);
+			goto nomem;
+		}
+		ssj->sswork->refs = 1;
+		stratum_work_cpy(&ssj->sswork->swork, swork);
+		ssj->sswork->swork.data_lock_p = NULL;
+	}
 	
 	cg_runlock(&pool->data_lock);
 	
-	ssj->swork.data_lock_p = NULL;
-	HASH_ADD_KEYPTR(hh, _ssm_jobs, ssj->my_job_id, strlen(ssj->my_job_id), ssj);
+	wr_lock(&_ssm_jobs_lock);
+	old_ssj = _ssm_jobs[job_id % SSM_JOB_SLOTS];
+	_ssm_jobs[job_id % SSM_JOB_SLOTS] = ssj;
+	wr_unlock(&_ssm_jobs_lock);
+	if (old_ssj)
+	{
+		applog(LOG_DEBUG, "SSM: Dropping job_id %"PRIx32, old_ssj->my_job_id);
+		_ssj_free(old_ssj);
+	}
 	
 	if (likely(_ssm_cur_job_work.pool))
 		clean_work(&_ssm_cur_job_work);
 	_ssm_gen_dummy_work(&_ssm_cur_job_work, ssj, NULL, 0);
 	
-	_ssm_notify_sz = p - buf;
-	assert(_ssm_notify_sz <= bufsz);
-	free(_ssm_notify);
-	_ssm_notify = buf;
-	
-	LL_FOREACH(_ssm_connections, conn)
-	{
-		if (unlikely(!conn->xnonce1_le))
-			continue;
-		bufferevent_write(conn->bev, _ssm_notify, _ssm_notify_sz);
-	}
+	*notify = (struct stratumsrv_notify){
+		.refs = 1,
+		.job_id = job_id,
+		.pool_diff = ssj->sswork->swork.diff,
+		.sz = p - notify->buf,
+	};
+	assert(notify->sz <= bufsz);
+	if (_ssm_notify)
+		stratumsrv_notify_unref(_ssm_notify);
+	_ssm_notify = notify;
+	++_ssm_notify_gen;
+	stratumsrv_wake_workers();
 	
 	return true;
+
+nomem:
+	// Nothing is published, so miners carry on with the previous job
+	cg_runlock(&pool->data_lock);
+	free(notify);
+	applog(LOG_ERR, "SSM: Failed to malloc %s, keeping the previous job", "job");
+	return true;
 }
 
 static
-void _ssj_free(struct stratumsrv_job * const ssj)
+bool stratumsrv_job_id_parse(const char * const job_id, uint32_t * const out)
 {
-	free(ssj->my_job_id);
-	stratum_work_clean(&ssj->swork);
-	free(ssj->nonce1);
-	free(ssj);
+	unsigned long id;
+	char *end;
+	
+	if (!isxdigit(job_id[0]))
+		return false;
+	id = strtoul(job_id, &end, 16);
+	if (*end || id > UINT32_MAX)
+		return false;
+	*out = id;
+	return true;
 }
 
+// Caller holds _ssm_jobs_lock
 static
-void stratumsrv_job_pruner()
+struct stratumsrv_job *stratumsrv_job_find(const char * const job_id, const struct timeval * const tvp_now)
 {
-	struct stratumsrv_job *ssj, *tmp_ssj;
-	struct timeval tv_now;
-	
-	timer_set_now(&tv_now);
+	struct stratumsrv_job *ssj;
+	uint32_t id;
 	
-	HASH_ITER(hh, _ssm_jobs, ssj, tmp_ssj)
-	{
-		if (timer_elapsed(&ssj->tv_prepared, &tv_now) <= opt_expiry)
-			break;
-		HASH_DEL(_ssm_jobs, ssj);
-		applog(LOG_DEBUG, "SSM: Pruning job_id %s", ssj->my_job_id);
-		_ssj_free(ssj);
-	}
+	if (!stratumsrv_job_id_parse(job_id, &id))
+		return NULL;
+	ssj = _ssm_jobs[id % SSM_JOB_SLOTS];
+	if (!(ssj && ssj->my_job_id == id))
+		return NULL;
+	if (timer_elapsed(&ssj->tv_prepared, tvp_now) > opt_expiry)
+		return NULL;
+	return ssj;
 }
 
 static void stratumsrv_client_close(struct stratumsrv_conn *);
 
+// A miner that missed a reply would be out of step, so it is dropped instead
+static
+void stratumsrv_conn_check_replies(struct stratumsrv_conn * const conn)
+{
+	if (unlikely(conn->replies_lost))
+		stratumsrv_client_close(conn);
+}
+
 static
 void stratumsrv_conn_close_completion_cb(struct bufferevent *bev, void *p)
 {
@@ -232,57 +527,174 @@ void stratumsrv_boot(struct stratumsrv_conn * const conn, const char * const msg
 	bufferevent_setcb(bev, NULL, stratumsrv_conn_close_completion_cb, stratumsrv_event, conn);
 }
 
+// Caller holds _ssm_notify_mutex
 static
 void stratumsrv_boot_all_subscribed(const char * const msg)
 {
-	struct stratumsrv_conn *conn, *tmp_conn;
-	
-	free(_ssm_notify);
+	if (_ssm_notify)
+		stratumsrv_notify_unref(_ssm_notify);
 	_ssm_notify = NULL;
 	
-	// Boot all connections
-	LL_FOREACH_SAFE(_ssm_connections, conn, tmp_conn)
+	// Have every worker boot all its connections
+	_ssm_boot_msg = msg;
+	++_ssm_boot_gen;
+	stratumsrv_wake_workers();
+}
+
+static
+int stratumsrv_set_difficulty_str(char * const buf, const size_t bufsz, const double diff)
+{
+	// Difficulty 1 only needs H-not-zero, a slightly easier target than stratum's own
+	if (diff <= 1)
+		return snprintf(buf, bufsz, "{\"params\":[0.9999847412109375],\"id\":null,\"method\":\"mining.set_difficulty\"}\n");
+	return snprintf(buf, bufsz, "{\"params\":[%.0f],\"id\":null,\"method\":\"mining.set_difficulty\"}\n", diff);
+}
+
+static void stratumsrv_reply(struct stratumsrv_conn *, const void *buf, size_t bufsz);
+
+// Sends a miner a job at its current difficulty; caller holds _ssm_notify_mutex
+static
+void stratumsrv_send_job(struct stratumsrv_conn * const conn, struct stratumsrv_notify * const notify)
+{
+	conn->job_diffs[conn->job_diffs_next].job_id = notify->job_id;
+	conn->job_diffs[conn->job_diffs_next].diff = conn->diff;
+	conn->job_diffs_next = (conn->job_diffs_next + 1) % SSM_CONN_JOB_DIFFS;
+	// Behind any replies still waiting, so it can't overtake a set_difficulty
+	if (conn->replies)
+		stratumsrv_reply(conn, notify->buf, notify->sz);
+	else
+		stratumsrv_send_notify(conn, notify);
+}
+
+// The difficulty a share for job_id is checked at; the lowest recent one, if the job is not known
+static
+double stratumsrv_job_diff(const struct stratumsrv_conn * const conn, const char * const job_id)
+{
+	double diff = 0;
+	uint32_t id;
+	int i;
+	const bool known = stratumsrv_job_id_parse(job_id, &id);
+	
+	for (i = 0; i < SSM_CONN_JOB_DIFFS; ++i)
 	{
-		if (!conn->xnonce1_le)
+		if (!conn->job_diffs[i].diff)
 			continue;
-		stratumsrv_boot(conn, msg);
+		if (known && conn->job_diffs[i].job_id == id)
+			return conn->job_diffs[i].diff;
+		if (!diff || conn->job_diffs[i].diff < diff)
+			diff = conn->job_diffs[i].diff;
 	}
+	return diff ?: 1;
 }
 
+/* Moves a miner's difficulty toward --stratum-share-rate, by at most a factor
+ * of 4 each time, and sends it the new difficulty if it changed much */
 static
-void _stratumsrv_update_notify(evutil_socket_t fd, short what, __maybe_unused void *p)
+void stratumsrv_vardiff_update(struct stratumsrv_conn * const conn)
 {
-	struct pool *pool = current_pool();
-	bool clean;
+	const double secs = timer_elapsed_us(&conn->tv_vardiff, NULL) / 1e6;
+	double diff;
+	char buf[0x80];
+	int bufsz, i;
 	
-	if (fd == _ssm_update_notifier[0])
+	if (!opt_stratumsrv_share_rate)
+		return;
+	// Wait for the retarget period, unless shares are flooding in
+	if (secs < SSM_VARDIFF_SECS && conn->vardiff_shares < opt_stratumsrv_share_rate * SSM_VARDIFF_SECS / 60 * 4)
+		return;
+	
+	if (conn->vardiff_shares)
+		diff = conn->diff * conn->vardiff_shares / (opt_stratumsrv_share_rate * secs / 60);
+	else
+		diff = conn->diff / 4;
+	if (diff > conn->diff * 4)
+		diff = conn->diff * 4;
+	if (diff < conn->diff / 4)
+		diff = conn->diff / 4;
+	if (conn->pool_diff && diff > conn->pool_diff)
+		diff = conn->pool_diff;
+	diff = floor(diff);
+	if (diff < 1)
+		diff = 1;
+	
+	conn->vardiff_shares = 0;
+	timer_set_now(&conn->tv_vardiff);
+	if (diff == conn->diff || (diff > conn->diff * 0.8 && diff < conn->diff * 1.25))
+		return;
+	
+	applog(LOG_DEBUG, "SSM: Changing difficulty of client %08lx from %.0f to %.0f",
+	       (unsigned long)le32toh(conn->xnonce1_le), conn->diff, diff);
+	// Miners apply a lower difficulty at once, so accept it for jobs already sent too
+	for (i = 0; i < SSM_CONN_JOB_DIFFS; ++i)
+		if (conn->job_diffs[i].diff > diff)
+			conn->job_diffs[i].diff = diff;
+	conn->diff = diff;
+	bufsz = stratumsrv_set_difficulty_str(buf, sizeof(buf), diff);
+	stratumsrv_reply(conn, buf, bufsz);
+}
+
+// Sends a worker's connections whatever they have missed; caller holds _ssm_notify_mutex
+static
+void stratumsrv_worker_sync(struct stratumsrv_worker * const worker)
+{
+	struct stratumsrv_conn *conn, *tmp_conn;
+	
+	if (worker->boot_gen != _ssm_boot_gen)
 	{
-		evtimer_del(ev_notify);
-		notifier_read(_ssm_update_notifier);
-		applog(LOG_DEBUG, "SSM: Update triggered by notifier");
+		worker->boot_gen = _ssm_boot_gen;
+		LL_FOREACH_SAFE(worker->connections, conn, tmp_conn)
+		{
+			if (!conn->xnonce1_le)
+				continue;
+			stratumsrv_boot(conn, _ssm_boot_msg);
+		}
+	}
+	
+	if (worker->notify_gen != _ssm_notify_gen)
+	{
+		worker->notify_gen = _ssm_notify_gen;
+		if (_ssm_notify)
+			LL_FOREACH_SAFE(worker->connections, conn, tmp_conn)
+			{
+				if (unlikely(!conn->xnonce1_le))
+					continue;
+				conn->pool_diff = _ssm_notify->pool_diff;
+				stratumsrv_vardiff_update(conn);
+				stratumsrv_send_job(conn, _ssm_notify);
+				stratumsrv_conn_check_replies(conn);
+			}
 	}
+}
+
+// Caller holds _ssm_notify_mutex
+static
+void stratumsrv_refresh_notify(void)
+{
+	struct pool *pool = current_pool();
+	bool clean;
 	
 	clean = _ssm_cur_job_work.pool ? stale_work(&_ssm_cur_job_work, true) : true;
 	if (clean)
 	{
-		struct stratumsrv_job *ssj, *tmp;
+		struct stratumsrv_job *old_jobs[SSM_JOB_SLOTS];
+		int i;
 		
 		applog(LOG_DEBUG, "SSM: Current replacing job stale, pruning all jobs");
-		HASH_ITER(hh, _ssm_jobs, ssj, tmp)
-		{
-			HASH_DEL(_ssm_jobs, ssj);
-			_ssj_free(ssj);
-		}
+		wr_lock(&_ssm_jobs_lock);
+		memcpy(old_jobs, _ssm_jobs, sizeof(old_jobs));
+		memset(_ssm_jobs, 0, sizeof(_ssm_jobs));
+		wr_unlock(&_ssm_jobs_lock);
+		for (i = 0; i < SSM_JOB_SLOTS; ++i)
+			if (old_jobs[i])
+				_ssj_free(old_jobs[i]);
 	}
-	else
-		stratumsrv_job_pruner();
 	
 	if (!pool->stratum_notify)
 	{
 		applog(LOG_WARNING, "SSM: Not using a stratum server upstream!");
 		if (clean)
 			stratumsrv_boot_all_subscribed("Current upstream pool does not have active stratum");
-		goto out;
+		return;
 	}
 	
 	if (!stratumsrv_update_notify_str(pool, clean))
@@ -291,8 +703,22 @@ void _stratumsrv_update_notify(evutil_socket_t fd, short what, __maybe_unused vo
 		if (clean)
 			stratumsrv_boot_all_subscribed("Current upstream pool does not have active stratum");
 	}
+}
+
+static
+void _stratumsrv_update_notify(evutil_socket_t fd, short what, __maybe_unused void *p)
+{
+	if (fd == _ssm_update_notifier[0])
+	{
+		evtimer_del(ev_notify);
+		notifier_read(_ssm_update_notifier);
+		applog(LOG_DEBUG, "SSM: Update triggered by notifier");
+	}
+	
+	mutex_lock(&_ssm_notify_mutex);
+	stratumsrv_refresh_notify();
+	mutex_unlock(&_ssm_notify_mutex);
 	
-out: ;
 	struct timeval tv_scantime = {
 		.tv_sec = opt_scantime,
 	};
@@ -324,22 +750,80 @@ struct proxy_client *_stratumsrv_find_or_create_client(const char *user)
 }
 
 static
-void _stratumsrv_failure(struct bufferevent * const bev, const char * const idstr, const int e, const char * const emsg)
+void stratumsrv_reply(struct stratumsrv_conn * const conn, const void * const buf, const size_t bufsz)
+{
+	struct stratumsrv_reply *reply;
+	
+	if (!conn->replies)
+	{
+		bufferevent_write(conn->bev, buf, bufsz);
+		return;
+	}
+	
+	reply = malloc(sizeof(*reply));
+	if (unlikely(!reply))
+		goto nomem;
+	*reply = (struct stratumsrv_reply){
+		.buf = malloc(bufsz),
+		.bufsz = bufsz,
+		.ready = true,
+	};
+	if (unlikely(!reply->buf))
+	{
+		free(reply);
+		goto nomem;
+	}
+	memcpy(reply->buf, buf, bufsz);
+	LL_APPEND(conn->replies, reply);
+	return;
+
+nomem:
+	applog(LOG_ERR, "SSM: Failed to malloc %s, closing connection", "reply");
+	conn->replies_lost = true;
+}
+
+// Sends every reply that is no longer waiting on a submit before it
+static
+void stratumsrv_replies_flush(struct stratumsrv_conn * const conn)
+{
+	struct stratumsrv_reply *reply;
+	
+	while ( (reply = conn->replies) && reply->ready)
+	{
+		if (unlikely(reply->lost))
+			conn->replies_lost = true;
+		if (conn->bev && reply->bufsz)
+			bufferevent_write(conn->bev, reply->buf, reply->bufsz);
+		LL_DELETE(conn->replies, reply);
+		free(reply->buf);
+		free(reply);
+	}
+}
+
+static
+size_t stratumsrv_failure_str(char * const buf, const size_t bufsz, const char * const idstr, const int e, const char * const emsg)
+{
+	const int n = snprintf(buf, bufsz, "{\"error\":[%d,\"%s\",null],\"id\":%s,\"result\":null}\n", e, emsg, idstr);
+	return (n < bufsz) ? n : (bufsz - 1);
+}
+
+static
+void _stratumsrv_failure(struct stratumsrv_conn * const conn, const char * const idstr, const int e, const char * const emsg)
 {
 	if (!idstr)
 		return;
 	
 	char buf[0x100];
-	size_t bufsz = snprintf(buf, sizeof(buf), "{\"error\":[%d,\"%s\",null],\"id\":%s,\"result\":null}\n", e, emsg, idstr);
-	bufferevent_write(bev, buf, bufsz);
+	size_t bufsz = stratumsrv_failure_str(buf, sizeof(buf), idstr, e, emsg);
+	stratumsrv_reply(conn, buf, bufsz);
 }
 #define return_stratumsrv_failure(e, emsg)  do{  \
-	_stratumsrv_failure(bev, idstr, e, emsg);    \
+	_stratumsrv_failure(conn, idstr, e, emsg);   \
 	return;                                      \
 }while(0)
 
 static
-void _stratumsrv_success(struct bufferevent * const bev, const char * const idstr)
+void _stratumsrv_success(struct stratumsrv_conn * const conn, const char * const idstr)
 {
 	if (!idstr)
 		return;
@@ -348,57 +832,309 @@ void _stratumsrv_success(struct bufferevent * const bev, const char * const idst
 	char buf[bufsz];
 	
 	bufsz = sprintf(buf, "{\"result\":true,\"id\":%s,\"error\":null}\n", idstr);
-	bufferevent_write(bev, buf, bufsz);
+	stratumsrv_reply(conn, buf, bufsz);
 }
 
 static
-void stratumsrv_mining_subscribe(struct bufferevent *bev, json_t *params, const char *idstr, uint32_t *xnonce1_p)
+void stratumsrv_mining_subscribe(struct bufferevent *bev, json_t *params, const char *idstr, struct stratumsrv_conn * const conn)
 {
+	uint32_t * const xnonce1_p = &conn->xnonce1_le;
 	char buf[90 + strlen(idstr) + (_ssm_client_octets * 2 * 2) + 0x10];
 	char xnonce1x[(_ssm_client_octets * 2) + 1];
 	int bufsz;
 	
+	mutex_lock(&_ssm_notify_mutex);
 	if (!_ssm_notify)
 	{
-		evtimer_del(ev_notify);
-		_stratumsrv_update_notify(-1, 0, NULL);
+		stratumsrv_refresh_notify();
 		if (!_ssm_notify)
+		{
+			mutex_unlock(&_ssm_notify_mutex);
 			return_stratumsrv_failure(20, "No notify set (upstream not stratum?)");
+		}
 	}
 	
+	// Catch up first, so this client is not booted or sent the notify twice
+	stratumsrv_worker_sync(conn->worker);
+	
 	if (!*xnonce1_p)
 	{
-		uint32_t xnonce1;
-		for (xnonce1 = MAX_CLIENTS; _ssm_xnonce1s[xnonce1]; --xnonce1)
-			if (!xnonce1)
-				return_stratumsrv_failure(20, "Maximum clients already connected");
+		const uint32_t xnonce1 = stratumsrv_xnonce1_alloc();
+		if (!xnonce1)
+		{
+			mutex_unlock(&_ssm_notify_mutex);
+			return_stratumsrv_failure(20, "Maximum clients already connected");
+		}
 		*xnonce1_p = htole32(xnonce1);
 	}
 	
 	bin2hex(xnonce1x, xnonce1_p, _ssm_client_octets);
 	bufsz = sprintf(buf, "{\"id\":%s,\"result\":[[[\"mining.set_difficulty\",\"x\"],[\"mining.notify\",\"%s\"]],\"%s\",%d],\"error\":null}\n", idstr, xnonce1x, xnonce1x, _ssm_client_xnonce2sz);
-	bufferevent_write(bev, buf, bufsz);
-	bufferevent_write(bev, "{\"params\":[0.9999847412109375],\"id\":null,\"method\":\"mining.set_difficulty\"}\n", 75);
-	bufferevent_write(bev, _ssm_notify, _ssm_notify_sz);
+	stratumsrv_reply(conn, buf, bufsz);
+	bufsz = stratumsrv_set_difficulty_str(buf, sizeof(buf), conn->diff);
+	stratumsrv_reply(conn, buf, bufsz);
+	conn->pool_diff = _ssm_notify->pool_diff;
+	stratumsrv_send_job(conn, _ssm_notify);
+	mutex_unlock(&_ssm_notify_mutex);
 }
 
 static
-void stratumsrv_mining_authorize(struct bufferevent *bev, json_t *params, const char *idstr, uint32_t *xnonce1_p)
+void stratumsrv_mining_authorize(struct bufferevent *bev, json_t *params, const char *idstr, struct stratumsrv_conn * const conn)
 {
 	struct proxy_client * const client = stratumsrv_find_or_create_client(__json_array_string(params, 0));
 	
 	if (unlikely(!client))
 		return_stratumsrv_failure(20, "Failed creating new cgpu");
 	
-	_stratumsrv_success(bev, idstr);
+	_stratumsrv_success(conn, idstr);
 }
 
 static
-void stratumsrv_mining_submit(struct bufferevent *bev, json_t *params, const char *idstr, struct stratumsrv_conn * const conn)
+bool stratumsrv_submit_same_work(const struct stratumsrv_submit * const sub, const uint32_t xnonce1_le, const char * const job_id, const char * const extranonce2, const uint8_t * const ntime)
 {
-	uint32_t * const xnonce1_p = &conn->xnonce1_le;
-	struct work _work, *work;
+	return sub->xnonce1_le == xnonce1_le && !memcmp(sub->ntime, ntime, 4) && !strcmp(sub->job_id, job_id) && !strcmp(sub->extranonce2, extranonce2);
+}
+
+static
+void stratumsrv_submit_reply(struct stratumsrv_submit * const sub, const int e, const char * const emsg)
+{
+	struct stratumsrv_reply * const reply = sub->reply;
+	const size_t bufsz = 0x100 + (sub->idstr ? strlen(sub->idstr) : 0);
+	
+	sub->accepted = !e;
+	if (!sub->idstr)
+		return;
+	reply->buf = malloc(bufsz);
+	if (unlikely(!reply->buf))
+	{
+		applog(LOG_ERR, "SSM: Failed to malloc %s, closing connection", "reply");
+		reply->lost = true;
+		return;
+	}
+	if (emsg)
+		reply->bufsz = stratumsrv_failure_str(reply->buf, bufsz, sub->idstr, e, emsg);
+	else
+		reply->bufsz = sprintf(reply->buf, "{\"result\":true,\"id\":%s,\"error\":null}\n", sub->idstr);
+}
+
+/* Checks count submits together, hashing them in one multi-lane pass, and
+ * prepares their replies; may run on any thread */
+static
+void stratumsrv_submits_verify(struct stratumsrv_work_cache * const cache, struct stratumsrv_submit ** const subs, const unsigned count)
+{
+	struct stratumsrv_submit *sub, *found[count], *gen_sub = NULL;
+	struct thr_info *thrs[count];
+	struct work *works[count], gen_works[count], *work;
 	struct stratumsrv_job *ssj;
+	uint32_t nonces[count];
+	unsigned char headers[count][80], hashbuf[count][32], *hashes[count];
+	const unsigned char *datas[count];
+	bool results[count], check_target = false;
+	unsigned i, n = 0, ngen = 0, m;
+	struct timeval tv_now;
+	
+	timer_set_now(&tv_now);
+	rd_lock(&_ssm_jobs_lock);
+	for (i = 0; i < count; ++i)
+	{
+		sub = subs[i];
+		
+		// Lookup job_id
+		ssj = stratumsrv_job_find(sub->job_id, &tv_now);
+		if (!ssj)
+		{
+			stratumsrv_submit_reply(sub, 21, "Job not found");
+			continue;
+		}
+		
+		// Generate dummy work, unless an earlier submit already did (job ids are never reused)
+		if (n && stratumsrv_submit_same_work(sub, found[n - 1]->xnonce1_le, found[n - 1]->job_id, found[n - 1]->extranonce2, found[n - 1]->ntime))
+			work = works[n - 1];
+		else
+		if (cache->work.pool && stratumsrv_submit_same_work(sub, cache->xnonce1_le, cache->job_id, cache->extranonce2, cache->ntime))
+			work = &cache->work;
+		else
+		{
+			work = &gen_works[ngen++];
+			gen_sub = sub;
+			_ssm_gen_dummy_work(work, ssj, sub->extranonce2, sub->xnonce1_le);
+			memcpy(&work->data[68], sub->ntime, 4);
+		}
+		
+		found[n] = sub;
+		thrs[n] = sub->thr;
+		works[n] = work;
+		nonces[n] = sub->nonce;
+		if (sub->check_target)
+			check_target = true;
+		++n;
+	}
+	rd_unlock(&_ssm_jobs_lock);
+	
+#ifdef USE_SCRYPT
+	// Only SHA256d hashes can be checked against miners' own difficulty here
+	if (opt_scrypt)
+		check_target = false;
+#endif
+	
+	if (check_target)
+	{
+		for (i = 0; i < n; ++i)
+		{
+			memcpy(headers[i], works[i]->data, 80);
+			*(uint32_t *)&headers[i][76] = htole32(nonces[i]);
+			datas[i] = headers[i];
+			hashes[i] = hashbuf[i];
+		}
+		hash_data_multi(hashes, datas, n);
+		
+		// Turn away shares below the miner's own difficulty before they count for anything
+		for (i = m = 0; i < n; ++i)
+		{
+			if (found[i]->check_target && !hash_target_check(hashes[i], found[i]->target))
+			{
+				stratumsrv_submit_reply(found[i], 23, "Low difficulty share");
+				continue;
+			}
+			found[m] = found[i];
+			thrs[m] = thrs[i];
+			works[m] = works[i];
+			nonces[m] = nonces[i];
+			hashes[m] = hashes[i];
+			++m;
+		}
+		n = m;
+		
+		// Submit nonces, reusing the hashes
+		submit_hashed_nonces(thrs, works, nonces, hashes, n, results);
+	}
+	else
+		submit_nonces(thrs, works, nonces, n, results);
+	
+	for (i = 0; i < n; ++i)
+	{
+		if (!results[i])
+			stratumsrv_submit_reply(found[i], 23, "H-not-zero");
+		else
+		if (stale_work(works[i], true))
+			stratumsrv_submit_reply(found[i], 21, "stale");
+		else
+			stratumsrv_submit_reply(found[i], 0, NULL);
+	}
+	
+	// Keep the last work generated for the next submits
+	if (ngen)
+	{
+		for (i = 0; i < ngen - 1; ++i)
+			clean_work(&gen_works[i]);
+		if (cache->work.pool)
+			clean_work(&cache->work);
+		cache->work = gen_works[ngen - 1];
+		free(cache->job_id);
+		free(cache->extranonce2);
+		cache->job_id = strdup(gen_sub->job_id);
+		cache->extranonce2 = strdup(gen_sub->extranonce2);
+		cache->xnonce1_le = gen_sub->xnonce1_le;
+		memcpy(cache->ntime, gen_sub->ntime, 4);
+	}
+}
+
+static void stratumsrv_conn_free(struct stratumsrv_conn *);
+
+// Sends a verified submit's reply (and any behind it); runs on the connection's worker thread
+static
+void stratumsrv_submit_done(struct stratumsrv_submit * const sub)
+{
+	struct stratumsrv_conn * const conn = sub->conn;
+	
+	// Only accepted shares count towards the miner's hashrate
+	if (sub->accepted && !conn->hashes_done_ext)
+	{
+		struct timeval tv_now, tv_delta;
+		timer_set_now(&tv_now);
+		timersub(&tv_now, &conn->tv_hashes_done, &tv_delta);
+		conn->tv_hashes_done = tv_now;
+		mutex_lock(&sub->client->mutex);
+		hashes_done(sub->thr, sub->diff * 0x100000000, &tv_delta, NULL);
+		mutex_unlock(&sub->client->mutex);
+	}
+	
+	sub->reply->ready = true;
+	free(sub);
+	--conn->submits_verifying;
+	if (!conn->bev)
+	{
+		if (!conn->submits_verifying)
+			stratumsrv_conn_free(conn);
+		return;
+	}
+	stratumsrv_replies_flush(conn);
+	stratumsrv_conn_check_replies(conn);
+}
+
+static
+void *stratumsrv_verifier_thread(__maybe_unused void * const p)
+{
+	struct stratumsrv_work_cache cache = {
+		.job_id = NULL,
+	};
+	struct stratumsrv_submit *batch, *sub, *tmp, *subs[SSM_VERIFY_BATCH];
+	struct stratumsrv_worker *worker;
+	bool wake;
+	int n;
+	
+	pthread_detach(pthread_self());
+	RenameThread("stratumsrv_vrfy");
+	
+	while (true)
+	{
+		// Take a batch at a time, leaving the rest for other verifiers
+		mutex_lock(&_ssm_verify_mutex);
+		while (!_ssm_verify_queue)
+			pthread_cond_wait(&_ssm_verify_cond, &_ssm_verify_mutex);
+		batch = NULL;
+		for (n = 0; n < SSM_VERIFY_BATCH && (sub = _ssm_verify_queue); ++n)
+		{
+			DL_DELETE(_ssm_verify_queue, sub);
+			DL_APPEND(batch, sub);
+			subs[n] = sub;
+		}
+		mutex_unlock(&_ssm_verify_mutex);
+		
+		stratumsrv_submits_verify(&cache, subs, n);
+		
+		// Hand each back to its worker, waking it only if it is not already due to run
+		DL_FOREACH_SAFE(batch, sub, tmp)
+		{
+			DL_DELETE(batch, sub);
+			worker = sub->conn->worker;
+			mutex_lock(&worker->mutex);
+			wake = !worker->verified;
+			DL_APPEND(worker->verified, sub);
+			mutex_unlock(&worker->mutex);
+			if (wake)
+				notifier_wake(worker->notifier);
+		}
+	}
+	
+	return NULL;
+}
+
+static
+void stratumsrv_verifiers_start(void)
+{
+	pthread_t pth;
+	int i;
+	
+	for (i = 0; i < opt_stratumsrv_verify_threads; ++i)
+		if (unlikely(pthread_create(&pth, NULL, stratumsrv_verifier_thread, NULL)))
+			quit(1, "stratumsrv verifier thread create failed");
+}
+
+static
+void stratumsrv_mining_submit(struct bufferevent *bev, json_t *params, const char *idstr, struct stratumsrv_conn * const conn)
+{
+	struct stratumsrv_submit *sub;
 	struct proxy_client *client = stratumsrv_find_or_create_client(__json_array_string(params, 0));
 	struct cgpu_info *cgpu;
 	struct thr_info *thr;
@@ -406,7 +1142,8 @@ void stratumsrv_mining_submit(struct bufferevent *bev, json_t *params, const cha
 	const char * const extranonce2 = __json_array_string(params, 2);
 	const char * const ntime = __json_array_string(params, 3);
 	const char * const nonce = __json_array_string(params, 4);
-	uint32_t nonce_n;
+	size_t idstr_sz, job_id_sz, extranonce2_sz;
+	char *p;
 	
 	if (unlikely(!client))
 		return_stratumsrv_failure(20, "Failed creating new cgpu");
@@ -419,40 +1156,69 @@ void stratumsrv_mining_submit(struct bufferevent *bev, json_t *params, const cha
 	if (unlikely(strlen(extranonce2) < _ssm_client_xnonce2sz * 2))
 		return_stratumsrv_failure(20, "extranonce2 too short");
 	
+	if (!opt_stratumsrv_verify_threads && unlikely(!conn->worker->work_cache))
+	{
+		conn->worker->work_cache = calloc(1, sizeof(*conn->worker->work_cache));
+		if (unlikely(!conn->worker->work_cache))
+			return_stratumsrv_failure(20, "Out of memory");
+	}
+	
 	cgpu = client->cgpu;
 	thr = cgpu->thr[0];
 	
-	// Lookup job_id
-	HASH_FIND_STR(_ssm_jobs, job_id, ssj);
-	if (!ssj)
-		return_stratumsrv_failure(21, "Job not found");
-	
-	// Generate dummy work
-	work = &_work;
-	_ssm_gen_dummy_work(work, ssj, extranonce2, *xnonce1_p);
-	
-	// Submit nonce
-	hex2bin(&work->data[68], ntime, 4);
-	hex2bin((void*)&nonce_n, nonce, 4);
-	nonce_n = le32toh(nonce_n);
-	if (!submit_nonce(thr, work, nonce_n))
-		_stratumsrv_failure(bev, idstr, 23, "H-not-zero");
-	else
-	if (stale_work(work, true))
-		_stratumsrv_failure(bev, idstr, 21, "stale");
-	else
-		_stratumsrv_success(bev, idstr);
+	// One allocation holds the submit along with the strings it needs
+	idstr_sz = idstr ? (strlen(idstr) + 1) : 0;
+	job_id_sz = strlen(job_id) + 1;
+	extranonce2_sz = strlen(extranonce2) + 1;
+	sub = malloc(sizeof(*sub) + idstr_sz + job_id_sz + extranonce2_sz);
+	if (unlikely(!sub))
+		return_stratumsrv_failure(20, "Out of memory");
+	p = (char*)&sub[1];
+	*sub = (struct stratumsrv_submit){
+		.conn = conn,
+		.thr = thr,
+		.xnonce1_le = conn->xnonce1_le,
+		.client = client,
+		.idstr = idstr ? memcpy(p, idstr, idstr_sz) : NULL,
+		.job_id = memcpy(&p[idstr_sz], job_id, job_id_sz),
+		.extranonce2 = memcpy(&p[idstr_sz + job_id_sz], extranonce2, extranonce2_sz),
+	};
+	hex2bin(sub->ntime, ntime, 4);
+	hex2bin((void*)&sub->nonce, nonce, 4);
+	sub->nonce = le32toh(sub->nonce);
+	
+	sub->reply = malloc(sizeof(*sub->reply));
+	if (unlikely(!sub->reply))
+	{
+		free(sub);
+		return_stratumsrv_failure(20, "Out of memory");
+	}
+	
+	++conn->vardiff_shares;
+	stratumsrv_vardiff_update(conn);
+	sub->diff = stratumsrv_job_diff(conn, job_id);
+	sub->check_target = (sub->diff > 1);
+	if (sub->check_target)
+		set_target(sub->target, sub->diff);
 	
-	clean_work(work);
+	// Hold the place of its reply, so later replies wait behind it
+	*sub->reply = (struct stratumsrv_reply){
+		.ready = false,
+	};
+	LL_APPEND(conn->replies, sub->reply);
+	++conn->submits_verifying;
 	
-	if (!conn->hashes_done_ext)
+	if (!opt_stratumsrv_verify_threads)
 	{
-		struct timeval tv_now, tv_delta;
-		timer_set_now(&tv_now);
-		timersub(&tv_now, &conn->tv_hashes_done, &tv_delta);
-		conn->tv_hashes_done = tv_now;
-		hashes_done(thr, 0x100000000, &tv_delta, NULL);
+		stratumsrv_submits_verify(conn->worker->work_cache, &sub, 1);
+		stratumsrv_submit_done(sub);
+		return;
 	}
+	
+	mutex_lock(&_ssm_verify_mutex);
+	DL_APPEND(_ssm_verify_queue, sub);
+	pthread_cond_signal(&_ssm_verify_cond);
+	mutex_unlock(&_ssm_verify_mutex);
 }
 
 static
@@ -466,6 +1232,8 @@ void stratumsrv_mining_hashes_done(struct bufferevent * const bev, json_t * cons
 	json_t *jduration = json_array_get(params, 1);
 	json_t *jhashcount = json_array_get(params, 2);
 	
+	if (unlikely(!client))
+		return_stratumsrv_failure(20, "Failed creating new cgpu");
 	if (!(json_is_number(jduration) && json_is_number(jhashcount)))
 		return_stratumsrv_failure(20, "mining.hashes_done(String username, Number duration-in-seconds, Number hashcount)");
 	
@@ -477,7 +1245,9 @@ void stratumsrv_mining_hashes_done(struct bufferevent * const bev, json_t * cons
 	tv_delta.tv_usec = (f - tv_delta.tv_sec) * 1e6;
 	
 	f = json_number_value(jhashcount);
+	mutex_lock(&client->mutex);
 	hashes_done(thr, f, &tv_delta, NULL);
+	mutex_unlock(&client->mutex);
 	
 	conn->hashes_done_ext = true;
 }
@@ -502,6 +1272,7 @@ bool stratumsrv_process_line(struct bufferevent * const bev, const char * const
 	if (!method)
 	{
 		applog(LOG_ERR, "SSM: JSON missing method: %s", ln);
+		json_decref(json);
 		return false;
 	}
 	
@@ -509,6 +1280,7 @@ bool stratumsrv_process_line(struct bufferevent * const bev, const char * const
 	if (!params)
 	{
 		applog(LOG_ERR, "SSM: JSON missing params: %s", ln);
+		json_decref(json);
 		return false;
 	}
 	
@@ -524,30 +1296,52 @@ bool stratumsrv_process_line(struct bufferevent * const bev, const char * const
 		stratumsrv_mining_hashes_done(bev, params, idstr, conn);
 	else
 	if (!strcasecmp(method, "mining.authorize"))
-		stratumsrv_mining_authorize(bev, params, idstr, &conn->xnonce1_le);
+		stratumsrv_mining_authorize(bev, params, idstr, conn);
 	else
 	if (!strcasecmp(method, "mining.subscribe"))
-		stratumsrv_mining_subscribe(bev, params, idstr, &conn->xnonce1_le);
+		stratumsrv_mining_subscribe(bev, params, idstr, conn);
 	else
-		_stratumsrv_failure(bev, idstr, -3, "Method not supported");
+		_stratumsrv_failure(conn, idstr, -3, "Method not supported");
 	
 	free(idstr);
+	json_decref(json);
 	return true;
 }
 
+static
+void stratumsrv_conn_free(struct stratumsrv_conn * const conn)
+{
+	struct stratumsrv_reply *reply, *tmp;
+	
+	LL_FOREACH_SAFE(conn->replies, reply, tmp)
+	{
+		free(reply->buf);
+		free(reply);
+	}
+	free(conn);
+}
+
 static
 void stratumsrv_client_close(struct stratumsrv_conn * const conn)
 {
+	struct stratumsrv_worker * const worker = conn->worker;
 	struct bufferevent * const bev = conn->bev;
 	
 	bufferevent_free(bev);
-	LL_DELETE(_ssm_connections, conn);
-	free(conn);
+	conn->bev = NULL;
+	if (conn->xnonce1_le)
+		stratumsrv_xnonce1_free(le32toh(conn->xnonce1_le));
+	LL_DELETE(worker->connections, conn);
+	__sync_fetch_and_sub(&worker->connections_count, 1);
+	// Submits still being verified refer to it, so the last one frees it
+	if (!conn->submits_verifying)
+		stratumsrv_conn_free(conn);
 }
 
 static
 void stratumsrv_read(struct bufferevent *bev, void *p)
 {
+	struct stratumsrv_conn * const conn = p;
 	struct evbuffer *input = bufferevent_get_input(bev);
 	char *ln;
 	bool rv;
@@ -556,9 +1350,9 @@ void stratumsrv_read(struct bufferevent *bev, void *p)
 	{
 		rv = stratumsrv_process_line(bev, ln, p);
 		free(ln);
-		if (unlikely(!rv))
+		if (unlikely(!rv || conn->replies_lost))
 		{
-			stratumsrv_client_close(p);
+			stratumsrv_client_close(conn);
 			break;
 		}
 	}
@@ -578,20 +1372,133 @@ void stratumsrv_event(struct bufferevent *bev, short events, void *p)
 }
 
 static
-void stratumlistener(struct evconnlistener *listener, evutil_socket_t sock, struct sockaddr *addr, int len, void *p)
+void stratumsrv_conn_new(struct stratumsrv_worker * const worker, const evutil_socket_t sock)
 {
 	struct stratumsrv_conn *conn;
-	struct event_base *evbase = evconnlistener_get_base(listener);
-	struct bufferevent *bev = bufferevent_socket_new(evbase, sock, BEV_OPT_CLOSE_ON_FREE);
+	struct bufferevent *bev;
+	
 	conn = malloc(sizeof(*conn));
+	if (unlikely(!conn))
+	{
+		applog(LOG_ERR, "SSM: Failed to malloc %s, dropping connection", "conn");
+		evutil_closesocket(sock);
+		return;
+	}
+	bev = bufferevent_socket_new(worker->evbase, sock, BEV_OPT_CLOSE_ON_FREE);
+	if (unlikely(!bev))
+	{
+		applog(LOG_ERR, "SSM: Failed to create bufferevent, dropping connection");
+		free(conn);
+		evutil_closesocket(sock);
+		return;
+	}
 	*conn = (struct stratumsrv_conn){
+		.worker = worker,
 		.bev = bev,
+		.diff = 1,
 	};
-	LL_PREPEND(_ssm_connections, conn);
+	timer_set_now(&conn->tv_vardiff);
+	LL_PREPEND(worker->connections, conn);
 	bufferevent_setcb(bev, stratumsrv_read, NULL, stratumsrv_event, conn);
 	bufferevent_enable(bev, EV_READ | EV_WRITE);
 }
 
+static
+void stratumsrv_worker_wake(__maybe_unused evutil_socket_t fd, __maybe_unused short what, void * const p)
+{
+	struct stratumsrv_worker * const worker = p;
+	struct stratumsrv_submit *verified, *sub, *tmp;
+	evutil_socket_t *pending;
+	int i, pending_count;
+	
+	notifier_read(worker->notifier);
+	
+	mutex_lock(&worker->mutex);
+	pending = worker->pending;
+	pending_count = worker->pending_count;
+	worker->pending = NULL;
+	worker->pending_count = worker->pending_sz = 0;
+	verified = worker->verified;
+	worker->verified = NULL;
+	mutex_unlock(&worker->mutex);
+	
+	for (i = 0; i < pending_count; ++i)
+		stratumsrv_conn_new(worker, pending[i]);
+	free(pending);
+	
+	DL_FOREACH_SAFE(verified, sub, tmp)
+		stratumsrv_submit_done(sub);
+	
+	mutex_lock(&_ssm_notify_mutex);
+	stratumsrv_worker_sync(worker);
+	mutex_unlock(&_ssm_notify_mutex);
+}
+
+static
+void *stratumsrv_worker_thread(void * const p)
+{
+	struct stratumsrv_worker * const worker = p;
+	char threadname[0x10];
+	
+	pthread_detach(pthread_self());
+	snprintf(threadname, sizeof(threadname), "stratumsrv_%d", worker->index);
+	RenameThread(threadname);
+	
+	event_base_dispatch(worker->evbase);
+	
+	return NULL;
+}
+
+static
+void stratumsrv_workers_start(void)
+{
+	struct stratumsrv_worker *worker;
+	struct event *ev_wake;
+	int i;
+	
+	_ssm_workers_count = opt_stratumsrv_threads;
+	_ssm_workers = calloc(_ssm_workers_count, sizeof(*_ssm_workers));
+	if (unlikely(!_ssm_workers))
+		quit(1, "Failed to calloc %s", "_ssm_workers");
+	for (i = 0; i < _ssm_workers_count; ++i)
+	{
+		worker = &_ssm_workers[i];
+		worker->index = i;
+		worker->evbase = event_base_new();
+		mutex_init(&worker->mutex);
+		notifier_init(worker->notifier);
+		ev_wake = event_new(worker->evbase, worker->notifier[0], EV_READ | EV_PERSIST, stratumsrv_worker_wake, worker);
+		event_add(ev_wake, NULL);
+		if (unlikely(pthread_create(&worker->pth, NULL, stratumsrv_worker_thread, worker)))
+			quit(1, "stratumsrv worker thread create failed");
+	}
+}
+
+// Accepts on the stratumsrv thread, then hands the socket to the least busy worker
+static
+void stratumlistener(struct evconnlistener *listener, evutil_socket_t sock, struct sockaddr *addr, int len, void *p)
+{
+	struct stratumsrv_worker *worker = &_ssm_workers[0];
+	int i;
+	
+	for (i = 1; i < _ssm_workers_count; ++i)
+		if (_ssm_workers[i].connections_count < worker->connections_count)
+			worker = &_ssm_workers[i];
+	__sync_fetch_and_add(&worker->connections_count, 1);
+	
+	mutex_lock(&worker->mutex);
+	if (worker->pending_count == worker->pending_sz)
+	{
+		worker->pending_sz = worker->pending_sz ? (worker->pending_sz * 2) : 0x10;
+		worker->pending = realloc(worker->pending, sizeof(*worker->pending) * worker->pending_sz);
+		if (unlikely(!worker->pending))
+			quit(1, "Failed to realloc %s", "stratumsrv pending sockets");
+	}
+	worker->pending[worker->pending_count++] = sock;
+	mutex_unlock(&worker->mutex);
+	notifier_wake(worker->notifier);
+}
+
 void stratumsrv_start();
 
 void stratumsrv_change_port()
@@ -623,9 +1530,13 @@ void *stratumsrv_thread(__maybe_unused void *p)
 	pthread_detach(pthread_self());
 	RenameThread("stratumsrv");
 	
-	for (uint64_t n = MAX_CLIENTS; n; n >>= 8)
-		++_ssm_client_octets;
+	stratumsrv_xnonce1s_init();
 	_ssm_client_xnonce2sz = 2;
+	rwlock_init(&_ssm_jobs_lock);
+	// Start job ids from the time, so miners still holding jobs from a previous run don't match new ones
+	_ssm_jobid = time(NULL);
+	stratumsrv_workers_start();
+	stratumsrv_verifiers_start();
 	
 	struct event_base *evbase = event_base_new();
 	_smm_evbase = evbase;
@@ -639,6 +1550,8 @@ void *stratumsrv_thread(__maybe_unused void *p)
 		event_add(ev_update_notifier, NULL);
 	}
 	stratumsrv_change_port();
+	if (opt_stratumsrv_loadtest_clients)
+		stratumsrv_loadtest_start();
 	event_base_dispatch(evbase);
 	
 	return NULL;
@@ -0,0 +1,365 @@
+/*
+ * Copyright 2026 agent
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Opt-in (--lock-stats) hot path instrumentation: how often the main shared
+ * locks are taken and waited for, and how much CPU time each kind of thread
+ * uses.  Reported by the "lockstats" API command and the curses display
+ * options */
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <utlist.h>
+
+#include "miner.h"
+#include "util.h"
+
+#if defined(HAVE_PTHREAD_GETCPUCLOCKID) && defined(HAVE_CLOCK_GETTIME_MONOTONIC)
+#define HAVE_THREAD_CPU_CLOCK
+#endif
+
+#define LOCK_STATS_MAX  0x10
+#define LOCK_STATS_HASH_SIZE  0x1000
+// Set on a cglock's rwlock: its acquisitions are already counted on the mutex
+#define LOCK_STATS_WAIT_ONLY  0x80
+
+bool opt_lock_stats;
+
+struct lock_stats {
+	const char *name;
+	uint64_t acquisitions;
+	uint64_t waits;
+	uint64_t wait_us;
+	uint64_t max_wait_us;
+} __attribute__((aligned(64)));
+
+static pthread_mutex_t lock_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct lock_stats lock_stats[LOCK_STATS_MAX];
+static int lock_stats_count;
+
+/* Maps lock addresses to 1 + their lock_stats index (0 if untracked).  Looked
+ * up without locking, and never deleted from, since registered locks last for
+ * the whole run */
+static struct {
+	const void *lock;
+	uint8_t entry;
+} lock_stats_hash[LOCK_STATS_HASH_SIZE];
+
+static
+size_t lock_stats_hash_index(const void * const lock)
+{
+	const uintptr_t p = (uintptr_t)lock;
+	return ((p >> 3) ^ (p >> 15)) % LOCK_STATS_HASH_SIZE;
+}
+
+static
+uint8_t lock_stats_lookup(const void * const lock)
+{
+	size_t i = lock_stats_hash_index(lock), n;
+
+	for (n = 0; n < LOCK_STATS_HASH_SIZE; ++n, i = (i + 1) % LOCK_STATS_HASH_SIZE)
+	{
+		if (lock_stats_hash[i].lock == lock)
+			return lock_stats_hash[i].entry;
+		if (!lock_stats_hash[i].lock)
+			break;
+	}
+	return 0;
+}
+
+static
+void _lock_stats_register(const void * const lock, const char * const name, const uint8_t flags)
+{
+	size_t i, n;
+	int j;
+
+	mutex_lock(&lock_stats_lock);
+	for (j = 0; j < lock_stats_count; ++j)
+		if (!strcmp(lock_stats[j].name, name))
+			break;
+	if (j == lock_stats_count)
+	{
+		if (j == LOCK_STATS_MAX)
+			goto out;
+		lock_stats[lock_stats_count++].name = name;
+	}
+
+	i = lock_stats_hash_index(lock);
+	for (n = 0; n < LOCK_STATS_HASH_SIZE; ++n, i = (i + 1) % LOCK_STATS_HASH_SIZE)
+	{
+		if (lock_stats_hash[i].lock && lock_stats_hash[i].lock != lock)
+			continue;
+		lock_stats_hash[i].entry = (j + 1) | flags;
+		// Lookups must not see the lock before its entry
+		__sync_synchronize();
+		lock_stats_hash[i].lock = lock;
+		break;
+	}
+out:
+	mutex_unlock(&lock_stats_lock);
+}
+
+void lock_stats_register(const void * const lock, const char * const name)
+{
+	_lock_stats_register(lock, name, 0);
+}
+
+void lock_stats_register_cglock(cglock_t * const lock, const char * const name)
+{
+	_lock_stats_register(&lock->mutex, name, 0);
+	_lock_stats_register(&lock->rwlock, name, LOCK_STATS_WAIT_ONLY);
+}
+
+static
+void lock_stats_account(const uint8_t entry, const struct timeval * const tvp_wait_start)
+{
+	struct lock_stats * const ls = &lock_stats[(entry & ~LOCK_STATS_WAIT_ONLY) - 1];
+	uint64_t us, max;
+
+	if (!(entry & LOCK_STATS_WAIT_ONLY))
+		__sync_fetch_and_add(&ls->acquisitions, 1);
+	if (!tvp_wait_start)
+		return;
+
+	us = timer_elapsed_us(tvp_wait_start, NULL);
+	__sync_fetch_and_add(&ls->waits, 1);
+	__sync_fetch_and_add(&ls->wait_us, us);
+	while (us > (max = ls->max_wait_us) && !__sync_bool_compare_and_swap(&ls->max_wait_us, max, us))
+	{}
+}
+
+// Only a lock that can't be taken straight away has its wait timed
+#define LOCK_STATS_LOCK_FUNC(funcname, locktype, trylockfunc, lockfunc, errmsg)  \
+void funcname(locktype * const lock)  \
+{  \
+	const uint8_t entry = lock_stats_lookup(lock);  \
+	struct timeval tv_start;  \
+	  \
+	if (entry)  \
+	{  \
+		if (!trylockfunc(lock))  \
+		{  \
+			lock_stats_account(entry, NULL);  \
+			return;  \
+		}  \
+		cgtime(&tv_start);  \
+	}  \
+	if (unlikely(lockfunc(lock)))  \
+		quit(1, errmsg);  \
+	if (entry)  \
+		lock_stats_account(entry, &tv_start);  \
+}  \
+// END LOCK_STATS_LOCK_FUNC
+
+LOCK_STATS_LOCK_FUNC(_lock_stats_mutex_lock, pthread_mutex_t, pthread_mutex_trylock, pthread_mutex_lock, "WTF MUTEX ERROR ON LOCK!")
+LOCK_STATS_LOCK_FUNC(_lock_stats_wr_lock, pthread_rwlock_t, pthread_rwlock_trywrlock, pthread_rwlock_wrlock, "WTF WRLOCK ERROR ON LOCK!")
+LOCK_STATS_LOCK_FUNC(_lock_stats_rd_lock, pthread_rwlock_t, pthread_rwlock_tryrdlock, pthread_rwlock_rdlock, "WTF RDLOCK ERROR ON LOCK!")
+
+int lock_stats_get(struct lock_stats_snapshot * const out, const int max)
+{
+	int i, n;
+
+	mutex_lock(&lock_stats_lock);
+	n = (lock_stats_count < max) ? lock_stats_count : max;
+	for (i = 0; i < n; ++i)
+		out[i] = (struct lock_stats_snapshot){
+			.name = lock_stats[i].name,
+			.acquisitions = lock_stats[i].acquisitions,
+			.waits = lock_stats[i].waits,
+			.wait_secs = lock_stats[i].wait_us / 1e6,
+			.max_wait_secs = lock_stats[i].max_wait_us / 1e6,
+		};
+	mutex_unlock(&lock_stats_lock);
+
+	return n;
+}
+
+// Threads are grouped into roles by their name, up to the first digit
+struct thread_role {
+	char role[0x10];
+	int index;
+	int threads;
+	// CPU time of threads that have since exited or changed role
+	double cpu_secs;
+	struct thread_role *next;
+};
+
+struct thread_role_thread {
+	struct thread_role *role;
+#ifdef HAVE_THREAD_CPU_CLOCK
+	clockid_t cid;
+	double cpu_base;
+#endif
+	struct thread_role_thread *prev;
+	struct thread_role_thread *next;
+};
+
+static pthread_mutex_t thread_roles_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_role *thread_roles;
+static int thread_roles_count;
+static struct thread_role_thread *thread_role_threads;
+static pthread_key_t thread_role_key;
+static pthread_once_t thread_role_once = PTHREAD_ONCE_INIT;
+
+#ifdef HAVE_THREAD_CPU_CLOCK
+static
+double thread_role_cpu(const struct thread_role_thread * const trt)
+{
+	struct timespec ts;
+
+	if (clock_gettime(trt->cid, &ts))
+		return trt->cpu_base;
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+#endif
+
+// Caller holds thread_roles_lock
+static
+void thread_role_leave(struct thread_role_thread * const trt)
+{
+#ifdef HAVE_THREAD_CPU_CLOCK
+	trt->role->cpu_secs += thread_role_cpu(trt) - trt->cpu_base;
+#endif
+	--trt->role->threads;
+}
+
+static
+void thread_role_exit(void * const p)
+{
+	struct thread_role_thread * const trt = p;
+
+	mutex_lock(&thread_roles_lock);
+	thread_role_leave(trt);
+	DL_DELETE(thread_role_threads, trt);
+	mutex_unlock(&thread_roles_lock);
+	free(trt);
+}
+
+static
+void thread_role_init(void)
+{
+	if (pthread_key_create(&thread_role_key, thread_role_exit))
+		quithere(1, "pthread_key_create failed");
+}
+
+void thread_role_start(const char * const name)
+{
+	struct thread_role_thread *trt;
+	struct thread_role *role;
+	char rolename[0x10];
+	size_t len;
+
+	if (!opt_lock_stats)
+		return;
+	pthread_once(&thread_role_once, thread_role_init);
+
+	len = strcspn(name, "0123456789");
+	if (len >= sizeof(rolename))
+		len = sizeof(rolename) - 1;
+	memcpy(rolename, name, len);
+	rolename[len] = '\0';
+
+	mutex_lock(&thread_roles_lock);
+	LL_FOREACH(thread_roles, role)
+		if (!strcmp(role->role, rolename))
+			break;
+	if (!role)
+	{
+		role = calloc(1, sizeof(*role));
+		if (unlikely(!role))
+			quithere(1, "calloc failed");
+		strcpy(role->role, rolename);
+		role->index = thread_roles_count++;
+		LL_APPEND(thread_roles, role);
+	}
+
+	trt = pthread_getspecific(thread_role_key);
+	if (trt)
+		thread_role_leave(trt);
+	else
+	{
+		trt = calloc(1, sizeof(*trt));
+		if (unlikely(!trt))
+			quithere(1, "calloc failed");
+#ifdef HAVE_THREAD_CPU_CLOCK
+		if (pthread_getcpuclockid(pthread_self(), &trt->cid))
+			trt->cid = CLOCK_THREAD_CPUTIME_ID;
+#endif
+		DL_APPEND(thread_role_threads, trt);
+		pthread_setspecific(thread_role_key, trt);
+	}
+	trt->role = role;
+#ifdef HAVE_THREAD_CPU_CLOCK
+	trt->cpu_base = thread_role_cpu(trt);
+#endif
+	++role->threads;
+	mutex_unlock(&thread_roles_lock);
+}
+
+int thread_role_stats_get(struct thread_role_snapshot * const out, const int max)
+{
+	__maybe_unused struct thread_role_thread *trt;
+	struct thread_role *role;
+	int n = 0;
+
+	mutex_lock(&thread_roles_lock);
+	LL_FOREACH(thread_roles, role)
+	{
+		if (role->index >= max)
+			continue;
+		out[role->index] = (struct thread_role_snapshot){
+			.threads = role->threads,
+#ifdef HAVE_THREAD_CPU_CLOCK
+			.cpu_secs = role->cpu_secs,
+#else
+			.cpu_secs = -1,
+#endif
+		};
+		strcpy(out[role->index].role, role->role);
+		++n;
+	}
+#ifdef HAVE_THREAD_CPU_CLOCK
+	DL_FOREACH(thread_role_threads, trt)
+		if (trt->role->index < max)
+			out[trt->role->index].cpu_secs += thread_role_cpu(trt) - trt->cpu_base;
+#endif
+	mutex_unlock(&thread_roles_lock);
+
+	return n;
+}
+
+void lock_stats_zero(void)
+{
+	__maybe_unused struct thread_role_thread *trt;
+	struct thread_role *role;
+	int i;
+
+	mutex_lock(&lock_stats_lock);
+	for (i = 0; i < lock_stats_count; ++i)
+		lock_stats[i] = (struct lock_stats){
+			.name = lock_stats[i].name,
+		};
+	mutex_unlock(&lock_stats_lock);
+
+	mutex_lock(&thread_roles_lock);
+	LL_FOREACH(thread_roles, role)
+		role->cpu_secs = 0;
+#ifdef HAVE_THREAD_CPU_CLOCK
+	DL_FOREACH(thread_role_threads, trt)
+		trt->cpu_base = thread_role_cpu(trt);
+#endif
+	mutex_unlock(&thread_roles_lock);
+}
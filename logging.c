@@ -11,7 +11,13 @@
 
 #include "config.h"
 
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "compat.h"
@@ -26,6 +32,43 @@ bool opt_log_microseconds;
 /* per default priorities higher than LOG_NOTICE are logged */
 int opt_log_level = LOG_NOTICE;
 
+/* Messages are queued to a logging thread once it is started, so callers
+ * never wait on the console or on disk.  The queue is a bounded MPSC ring:
+ * each slot's seq is its position when free and position + 1 once filled.
+ * Warnings and errors are queued too, but output before returning, along with
+ * whatever was queued ahead of them */
+#define LOG_RING_SIZE  0x400
+#define LOG_RECORD_INLINE  0xe0
+#define LOG_BATCH_MAX  0x40
+#define LOG_BATCH_FILES  4
+
+struct log_record {
+	volatile unsigned long seq;
+	int prio;
+	struct timeval tv;
+	// Written verbatim to this file instead of the log, if set
+	FILE *fp;
+	size_t len;
+	// Used if the message does not fit in msg
+	char *heap;
+	char msg[LOG_RECORD_INLINE];
+};
+
+static struct log_record log_ring[LOG_RING_SIZE];
+static volatile unsigned long log_ring_head;
+static unsigned long log_ring_tail;
+static volatile unsigned long log_dropped;
+
+static pthread_t log_pth;
+static volatile bool log_thread_running;
+// Held by whoever is taking records off the ring
+static pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile bool log_thread_idle;
+static pthread_mutex_t log_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wait_cond = PTHREAD_COND_INITIALIZER;
+
+static int log_stderr_is_file = -1;
+
 static void _my_log_curses(int prio, const char *datetime, const char *str)
 {
 #ifdef HAVE_CURSES
@@ -37,12 +80,55 @@ static void _my_log_curses(int prio, const char *datetime, const char *str)
 		printf(" %s %s%s", datetime, str, "                    \n");
 }
 
-/* high-level logging function, based on global opt_log_level */
+static
+bool log_writetofile(void)
+{
+	/* Only output to stderr if it's not going to the screen as well */
+	if (unlikely(log_stderr_is_file < 0))
+		log_stderr_is_file = !isatty(fileno((FILE *)stderr));
+	return log_stderr_is_file;
+}
 
-/*
- * log function
- */
-void _applog(int prio, const char *str)
+static
+bool log_writetocon(const int prio)
+{
+	return (opt_debug_console || (opt_log_output && prio != LOG_DEBUG) || prio <= LOG_NOTICE)
+	    && !(opt_quiet && prio != LOG_ERR);
+}
+
+/* Formats the timestamp for tv, only calling localtime_r when the second
+ * changes; the caller must hold the console lock */
+static
+void log_datetime(char * const buf, const size_t bufsz, const struct timeval * const tv)
+{
+	static time_t cached_sec = INVALID_TIMESTAMP;
+	static char cached[0x40];
+
+	if (tv->tv_sec != cached_sec)
+	{
+		struct tm tm;
+		
+		localtime_r(&tv->tv_sec, &tm);
+		snprintf(cached, sizeof(cached), "[%d-%02d-%02d %02d:%02d:%02d",
+			tm.tm_year + 1900,
+			tm.tm_mon + 1,
+			tm.tm_mday,
+			tm.tm_hour,
+			tm.tm_min,
+			tm.tm_sec);
+		cached_sec = tv->tv_sec;
+	}
+
+	if (opt_log_microseconds)
+		snprintf(buf, bufsz, "%s.%06ld]", cached, (long)tv->tv_usec);
+	else
+		snprintf(buf, bufsz, "%s]", cached);
+}
+
+/* Outputs one message; the caller must hold the console lock, and flush
+ * stderr afterward */
+static
+void log_output(const int prio, const struct timeval * const tv, const char * const str, const bool writetofile)
 {
 #ifdef HAVE_SYSLOG_H
 	if (use_syslog) {
@@ -52,49 +138,337 @@ void _applog(int prio, const char *str)
 	if (0) {}
 #endif
 	else {
-		bool writetocon =
-			(opt_debug_console || (opt_log_output && prio != LOG_DEBUG) || prio <= LOG_NOTICE)
-		 && !(opt_quiet && prio != LOG_ERR);
-		bool writetofile = !isatty(fileno((FILE *)stderr));
+		bool writetocon = log_writetocon(prio);
 		if (!(writetocon || writetofile))
 			return;
 
 		char datetime[64];
 
-		if (opt_log_microseconds)
+		log_datetime(datetime, sizeof(datetime), tv);
+
+		if (writetofile)
+			fprintf(stderr, " %s %s\n", datetime, str);
+
+		if (writetocon)
+			_my_log_curses(prio, datetime, str);
+	}
+}
+
+static
+void log_output_now(const int prio, const char * const str)
+{
+	const bool writetofile = log_writetofile();
+	struct timeval tv;
+
+	bfg_gettimeofday(&tv);
+	bfg_console_lock();
+	log_output(prio, &tv, str, writetofile);
+	if (writetofile)
+		fflush(stderr);
+	bfg_console_unlock();
+}
+
+// Queues a record, storing its ring position in *posp if set
+static
+bool log_enqueue(const int prio, FILE * const fp, const char * const str, size_t len, unsigned long * const posp)
+{
+	struct log_record *rec;
+	unsigned long pos = log_ring_head;
+	long diff;
+
+	while (true)
+	{
+		rec = &log_ring[pos % LOG_RING_SIZE];
+		diff = (long)(rec->seq - pos);
+		if (!diff)
 		{
-			struct timeval tv;
-			struct tm tm;
-			
-			bfg_gettimeofday(&tv);
-			localtime_r(&tv.tv_sec, &tm);
-			
-			snprintf(datetime, sizeof(datetime), "[%d-%02d-%02d %02d:%02d:%02d.%06ld]",
-				tm.tm_year + 1900,
-				tm.tm_mon + 1,
-				tm.tm_mday,
-				tm.tm_hour,
-				tm.tm_min,
-				tm.tm_sec,
-				(long)tv.tv_usec);
+			if (__sync_bool_compare_and_swap(&log_ring_head, pos, pos + 1))
+				break;
+		}
+		else
+		if (diff < 0)
+		{
+			// Full: the logging thread has not freed this slot yet
+			return false;
+		}
+		pos = log_ring_head;
+	}
+
+	rec->prio = prio;
+	rec->fp = fp;
+	bfg_gettimeofday(&rec->tv);
+	rec->heap = NULL;
+	if (len >= sizeof(rec->msg))
+	{
+		rec->heap = malloc(len + 1);
+		if (unlikely(!rec->heap))
+			len = sizeof(rec->msg) - 1;
+	}
+	memcpy(rec->heap ?: rec->msg, str, len);
+	(rec->heap ?: rec->msg)[len] = '\0';
+	rec->len = len;
+
+	__sync_synchronize();
+	rec->seq = pos + 1;
+	__sync_synchronize();
+	if (posp)
+		*posp = pos;
+
+	if (log_thread_idle)
+	{
+		mutex_lock(&log_wait_lock);
+		pthread_cond_signal(&log_wait_cond);
+		mutex_unlock(&log_wait_lock);
+	}
+	return true;
+}
+
+static
+bool log_ring_ready(void)
+{
+	return log_ring[log_ring_tail % LOG_RING_SIZE].seq == log_ring_tail + 1;
+}
+
+// Outputs up to LOG_BATCH_MAX queued records before position end, flushing once at the end
+static
+bool log_drain(const unsigned long end)
+{
+	FILE *files[LOG_BATCH_FILES];
+	int nfiles = 0, i, n;
+	struct log_record *rec;
+	unsigned long dropped;
+	bool writetofile, locked = false, filefail = false;
+	const char *str;
+
+	writetofile = log_writetofile();
+	for (n = 0; n < LOG_BATCH_MAX && (long)(end - log_ring_tail) > 0 && log_ring_ready(); ++n)
+	{
+		rec = &log_ring[log_ring_tail % LOG_RING_SIZE];
+		__sync_synchronize();
+		str = rec->heap ?: rec->msg;
+		if (rec->fp)
+		{
+			if (fwrite(str, rec->len, 1, rec->fp) != 1)
+				filefail = true;
+			for (i = 0; i < nfiles && files[i] != rec->fp; ++i)
+				{}
+			if (i == nfiles)
+			{
+				if (nfiles == LOG_BATCH_FILES)
+					fflush(rec->fp);
+				else
+					files[nfiles++] = rec->fp;
+			}
 		}
 		else
-			get_now_datestamp(datetime, sizeof(datetime));
+		{
+			if (!locked)
+			{
+				bfg_console_lock();
+				locked = true;
+			}
+			log_output(rec->prio, &rec->tv, str, writetofile);
+		}
+		free(rec->heap);
+		__sync_synchronize();
+		rec->seq = log_ring_tail + LOG_RING_SIZE;
+		++log_ring_tail;
+	}
+
+	if (locked)
+	{
+		if (writetofile)
+			fflush(stderr);
+		bfg_console_unlock();
+	}
+	for (i = 0; i < nfiles; ++i)
+		fflush(files[i]);
+
+	if (unlikely(filefail))
+		log_output_now(LOG_ERR, "Log file write error");
+	dropped = __sync_fetch_and_and(&log_dropped, 0);
+	if (unlikely(dropped))
+	{
+		char buf[0x40];
+		snprintf(buf, sizeof(buf), "Logging fell behind: %lu messages dropped", dropped);
+		log_output_now(LOG_WARNING, buf);
+	}
 
-		if (writetofile || writetocon)
+	return n;
+}
+
+static
+void *log_thread(__maybe_unused void * const userp)
+{
+	struct timespec ts;
+	struct timeval tv;
+
+	RenameThread("log");
+
+	bool drained;
+
+	while (log_thread_running)
+	{
+		mutex_lock(&log_drain_lock);
+		drained = log_drain(log_ring_head);
+		mutex_unlock(&log_drain_lock);
+		if (drained)
+			continue;
+
+		mutex_lock(&log_wait_lock);
+		log_thread_idle = true;
+		__sync_synchronize();
+		if (log_thread_running && !log_ring_ready())
 		{
-			bfg_console_lock();
-			
-			/* Only output to stderr if it's not going to the screen as well */
-			if (writetofile) {
-				fprintf(stderr, " %s %s\n", datetime, str);	/* atomic write to stderr */
-				fflush(stderr);
+			// The timeout only covers a wakeup missed between the checks
+			bfg_gettimeofday(&tv);
+			tv.tv_usec += 100000;
+			if (tv.tv_usec >= 1000000)
+			{
+				++tv.tv_sec;
+				tv.tv_usec -= 1000000;
 			}
+			timeval_to_spec(&ts, &tv);
+			pthread_cond_timedwait(&log_wait_cond, &log_wait_lock, &ts);
+		}
+		log_thread_idle = false;
+		mutex_unlock(&log_wait_lock);
+	}
+
+	return NULL;
+}
 
-			if (writetocon)
-				_my_log_curses(prio, datetime, str);
-			
-			bfg_console_unlock();
+void logging_start(void)
+{
+	unsigned long i;
+
+	for (i = 0; i < LOG_RING_SIZE; ++i)
+		log_ring[i].seq = i;
+	log_ring_head = log_ring_tail = 0;
+	log_thread_running = true;
+	if (unlikely(pthread_create(&log_pth, NULL, log_thread, NULL)))
+	{
+		log_thread_running = false;
+		applog(LOG_WARNING, "Failed to create logging thread, logging synchronously");
+	}
+}
+
+static
+bool log_on_log_thread(void)
+{
+	return log_thread_running && pthread_equal(pthread_self(), log_pth);
+}
+
+/* Outputs everything queued before position end, leaving the caller holding
+ * log_drain_lock so it can write something of its own in order after it.
+ * Records queued later are left to the logging thread, as is the rest if an
+ * earlier record is still being written */
+static
+void log_drain_until_lock(const unsigned long end)
+{
+	mutex_lock(&log_drain_lock);
+	while ((long)(end - log_ring_tail) > 0 && log_drain(end))
+		{}
+}
+
+// Outputs everything queued, for once nothing else is adding to it
+static
+void log_drain_all(void)
+{
+	mutex_lock(&log_drain_lock);
+	while (log_drain(log_ring_head))
+		{}
+	mutex_unlock(&log_drain_lock);
+}
+
+void logging_stop(void)
+{
+	if (!log_thread_running)
+		return;
+	if (log_on_log_thread())
+	{
+		// Quitting from the logging thread itself: it can't join itself
+		log_thread_running = false;
+		return;
+	}
+
+	log_thread_running = false;
+	mutex_lock(&log_wait_lock);
+	pthread_cond_signal(&log_wait_cond);
+	mutex_unlock(&log_wait_lock);
+	pthread_join(log_pth, NULL);
+
+	// Output whatever was queued before the thread noticed
+	log_drain_all();
+}
+
+/* high-level logging function, based on global opt_log_level */
+
+/*
+ * log function
+ */
+void _applog(int prio, const char *str)
+{
+#ifdef HAVE_SYSLOG_H
+	if (!use_syslog)
+#endif
+	{
+		if (!(log_writetocon(prio) || log_writetofile()))
+			return;
+	}
+
+	if (log_thread_running && !log_on_log_thread())
+	{
+		unsigned long pos;
+
+		if (log_enqueue(prio, NULL, str, strlen(str), &pos))
+		{
+			if (prio <= LOG_WARNING)
+			{
+				// Out before we return, in case we crash straight after
+				log_drain_until_lock(pos + 1);
+				mutex_unlock(&log_drain_lock);
+			}
+			return;
+		}
+
+		if (prio <= LOG_WARNING)
+		{
+			// Never lost: with the queue full, output it here after those queued
+			log_drain_until_lock(log_ring_head);
+			log_output_now(prio, str);
+			mutex_unlock(&log_drain_lock);
+			return;
 		}
+
+		// With the queue full, unimportant messages are dropped and counted
+		__sync_fetch_and_add(&log_dropped, 1);
+		return;
 	}
+
+	log_output_now(prio, str);
+}
+
+/* Appends len bytes to fp through the logging thread, which flushes it once
+ * per batch; returns false if an immediate write failed */
+bool log_file_write(FILE * const fp, const void * const buf, const size_t len)
+{
+	bool rv;
+
+	if (log_thread_running && !log_on_log_thread())
+	{
+		if (log_enqueue(LOG_INFO, fp, buf, len, NULL))
+			return true;
+
+		// Never drop records: if the queue is full, write it here, after those already queued
+		log_drain_until_lock(log_ring_head);
+		rv = (fwrite(buf, len, 1, fp) == 1);
+		fflush(fp);
+		mutex_unlock(&log_drain_lock);
+		return rv;
+	}
+
+	rv = (fwrite(buf, len, 1, fp) == 1);
+	fflush(fp);
+	return rv;
 }
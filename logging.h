@@ -46,6 +46,9 @@ extern int opt_log_level;
 #define LOGBUFSIZ 0x1000
 
 extern void _applog(int prio, const char *str);
+extern bool log_file_write(FILE *, const void *buf, size_t len);
+extern void logging_start(void);
+extern void logging_stop(void);
 
 #define IN_FMT_FFL " in %s %s():%d"
 
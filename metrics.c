@@ -0,0 +1,315 @@
+/*
+ * Copyright 2026 agent
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* OpenMetrics (Prometheus) exporter, served at /metrics by httpsrv and
+ * rendered from the published stats snapshot */
+
+#include "config.h"
+
+#ifdef WIN32
+#include <winsock2.h>
+#endif
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#endif
+
+#include <microhttpd.h>
+
+#include "deviceapi.h"
+#include "httpsrv.h"
+#include "miner.h"
+#include "util.h"
+
+#define METRICS_CONTENT_TYPE  "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+// The last rendering, reused until a new snapshot is published
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static bytes_t metrics_cache = BYTES_INIT;
+static struct timeval metrics_cache_tv;
+
+static
+void metrics_printf(bytes_t * const out, const char * const fmt, ...)
+{
+	char buf[0x100];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return;
+	if ((size_t)len >= sizeof(buf))
+		len = sizeof(buf) - 1;
+	bytes_append(out, buf, len);
+}
+
+static
+void metrics_family(bytes_t * const out, const char * const name, const char * const type, const char * const help)
+{
+	metrics_printf(out, "# TYPE bfgminer_%s %s\n# HELP bfgminer_%s %s\n", name, type, name, help);
+}
+
+// Appends s as a label value: \, " and newlines must be escaped
+static
+void metrics_label_value(bytes_t * const out, const char *s)
+{
+	for ( ; s[0]; ++s)
+	{
+		switch (s[0])
+		{
+			case '\\':
+				bytes_append(out, "\\\\", 2);
+				break;
+			case '"':
+				bytes_append(out, "\\\"", 2);
+				break;
+			case '\n':
+				bytes_append(out, "\\n", 2);
+				break;
+			default:
+				bytes_append(out, s, 1);
+		}
+	}
+}
+
+static
+void metrics_proc_labels(bytes_t * const out, const struct cgpu_snapshot * const ds)
+{
+	const struct cgpu_info * const cgpu = ds->cgpu;
+
+	bytes_append(out, "proc=\"", 6);
+	metrics_label_value(out, cgpu->proc_repr);
+	metrics_printf(out, "\",driver=\"%s\"", cgpu->drv->dname);
+}
+
+static
+void metrics_pool_labels(bytes_t * const out, const struct pool_snapshot * const ps)
+{
+	const struct pool * const pool = ps->pool;
+
+	metrics_printf(out, "pool=\"%d\",url=\"", pool->pool_no);
+	metrics_label_value(out, pool->rpc_url);
+	bytes_append(out, "\"", 1);
+}
+
+static
+void metrics_proc_sample(bytes_t * const out, const char * const name, const struct cgpu_snapshot * const ds, const char * const result, const double val)
+{
+	metrics_printf(out, "bfgminer_%s{", name);
+	metrics_proc_labels(out, ds);
+	if (result)
+		metrics_printf(out, ",result=\"%s\"", result);
+	metrics_printf(out, "} %.17g\n", val);
+}
+
+static
+void metrics_pool_sample(bytes_t * const out, const char * const name, const struct pool_snapshot * const ps, const char * const result, const double val)
+{
+	metrics_printf(out, "bfgminer_%s{", name);
+	metrics_pool_labels(out, ps);
+	if (result)
+		metrics_printf(out, ",result=\"%s\"", result);
+	metrics_printf(out, "} %.17g\n", val);
+}
+
+static const char * const metrics_latency_stages[LATENCY_KINDS] = {
+	[LATENCY_GETWORK] = "getwork",
+	[LATENCY_STAGE_TO_START] = "stage_to_start",
+	[LATENCY_FOUND_TO_SUBMIT] = "found_to_submit",
+	[LATENCY_SUBMIT_TO_REPLY] = "submit_to_reply",
+};
+
+// The samples of one stage's histogram, labelled with the already rendered labels of its processor or pool
+static
+void metrics_latency(bytes_t * const out, const char * const name, const bytes_t * const labels, const int kind, const struct latency_snapshot * const ls)
+{
+	const char * const stage = metrics_latency_stages[kind];
+	int j;
+
+	for (j = 0; j < LATENCY_SNAPSHOT_BOUNDS; ++j)
+	{
+		metrics_printf(out, "bfgminer_%s_bucket{", name);
+		bytes_cat(out, labels);
+		metrics_printf(out, ",stage=\"%s\",le=\"%g\"} %"PRIu64"\n", stage, latency_snapshot_bounds_us[j] / 1e6, ls->le[j]);
+	}
+	metrics_printf(out, "bfgminer_%s_bucket{", name);
+	bytes_cat(out, labels);
+	metrics_printf(out, ",stage=\"%s\",le=\"+Inf\"} %"PRIu64"\n", stage, ls->count);
+	metrics_printf(out, "bfgminer_%s_count{", name);
+	bytes_cat(out, labels);
+	metrics_printf(out, ",stage=\"%s\"} %"PRIu64"\n", stage, ls->count);
+	metrics_printf(out, "bfgminer_%s_sum{", name);
+	bytes_cat(out, labels);
+	metrics_printf(out, ",stage=\"%s\"} %.17g\n", stage, ls->sum_secs);
+}
+
+#define METRICS_FOREACH_PROC(ds)  \
+	for (i = 0; i < snap->total_devices && ((ds) = &snap->devices[i]); ++i)
+
+#define METRICS_FOREACH_POOL(ps)  \
+	for (i = 0; i < snap->total_pools && ((ps) = &snap->pools[i]); ++i)  \
+		if (!(ps)->pool->removed)
+
+static
+void metrics_render(bytes_t * const out, const struct stats_snapshot * const snap)
+{
+	const struct cgpu_snapshot *ds;
+	const struct pool_snapshot *ps;
+	bytes_t labels = BYTES_INIT;
+	int i, k;
+
+	metrics_family(out, "uptime_seconds", "gauge", "Time since mining started or stats were zeroed");
+	metrics_printf(out, "bfgminer_uptime_seconds %.17g\n", snap->total_secs);
+
+	metrics_family(out, "staged_work", "gauge", "Work items queued for the mining threads");
+	metrics_printf(out, "bfgminer_staged_work %d\n", snap->staged);
+
+	metrics_family(out, "found_blocks", "counter", "Blocks found");
+	metrics_printf(out, "bfgminer_found_blocks_total %u\n", snap->found_blocks);
+
+	metrics_family(out, "network_blocks", "counter", "Block changes seen on the network");
+	metrics_printf(out, "bfgminer_network_blocks_total %u\n", snap->new_blocks);
+
+	metrics_family(out, "hashrate", "gauge", "Recent hashrate per processor, in hashes per second");
+	METRICS_FOREACH_PROC(ds)
+		metrics_proc_sample(out, "hashrate", ds, NULL, ds->rolling * 1e6);
+
+	metrics_family(out, "hashes", "counter", "Hashes done per processor");
+	METRICS_FOREACH_PROC(ds)
+		metrics_proc_sample(out, "hashes_total", ds, NULL, ds->total_mhashes * 1e6);
+
+	metrics_family(out, "shares", "counter", "Shares submitted per processor, by result");
+	METRICS_FOREACH_PROC(ds)
+	{
+		metrics_proc_sample(out, "shares_total", ds, "accepted", ds->accepted);
+		metrics_proc_sample(out, "shares_total", ds, "rejected", ds->rejected);
+		metrics_proc_sample(out, "shares_total", ds, "stale", ds->stale);
+	}
+
+	metrics_family(out, "share_difficulty", "counter", "Difficulty of shares submitted per processor, by result");
+	METRICS_FOREACH_PROC(ds)
+	{
+		metrics_proc_sample(out, "share_difficulty_total", ds, "accepted", ds->diff_accepted);
+		metrics_proc_sample(out, "share_difficulty_total", ds, "rejected", ds->diff_rejected);
+		metrics_proc_sample(out, "share_difficulty_total", ds, "stale", ds->diff_stale);
+	}
+
+	metrics_family(out, "diff1_work", "counter", "Work done per processor, in difficulty 1 shares");
+	METRICS_FOREACH_PROC(ds)
+		metrics_proc_sample(out, "diff1_work_total", ds, NULL, ds->diff1);
+
+	metrics_family(out, "hardware_errors", "counter", "Hardware errors per processor");
+	METRICS_FOREACH_PROC(ds)
+		metrics_proc_sample(out, "hardware_errors_total", ds, NULL, ds->hw_errors);
+
+	metrics_family(out, "temperature_celsius", "gauge", "Processor temperature, where known");
+	METRICS_FOREACH_PROC(ds)
+		if (ds->temp > 0)
+			metrics_proc_sample(out, "temperature_celsius", ds, NULL, ds->temp);
+
+	metrics_family(out, "processor_alive", "gauge", "1 if the processor is enabled and working");
+	METRICS_FOREACH_PROC(ds)
+		metrics_proc_sample(out, "processor_alive", ds, NULL, (ds->deven == DEV_ENABLED && ds->status == LIFE_WELL) ? 1 : 0);
+
+	metrics_family(out, "latency_seconds", "histogram", "Time taken by each stage of work and shares on each processor");
+	METRICS_FOREACH_PROC(ds)
+		for (k = 0; k < LATENCY_KINDS; ++k)
+		{
+			if (!ds->latency[k].count)
+				continue;
+			bytes_reset(&labels);
+			metrics_proc_labels(&labels, ds);
+			metrics_latency(out, "latency_seconds", &labels, k, &ds->latency[k]);
+		}
+
+	metrics_family(out, "pool_shares", "counter", "Shares submitted per pool, by result");
+	METRICS_FOREACH_POOL(ps)
+	{
+		metrics_pool_sample(out, "pool_shares_total", ps, "accepted", ps->accepted);
+		metrics_pool_sample(out, "pool_shares_total", ps, "rejected", ps->rejected);
+		metrics_pool_sample(out, "pool_shares_total", ps, "stale", ps->stale_shares);
+	}
+
+	metrics_family(out, "pool_share_difficulty", "counter", "Difficulty of shares submitted per pool, by result");
+	METRICS_FOREACH_POOL(ps)
+	{
+		metrics_pool_sample(out, "pool_share_difficulty_total", ps, "accepted", ps->diff_accepted);
+		metrics_pool_sample(out, "pool_share_difficulty_total", ps, "rejected", ps->diff_rejected);
+		metrics_pool_sample(out, "pool_share_difficulty_total", ps, "stale", ps->diff_stale);
+	}
+
+	metrics_family(out, "pool_getworks", "counter", "Work requested from each pool");
+	METRICS_FOREACH_POOL(ps)
+		metrics_pool_sample(out, "pool_getworks_total", ps, NULL, ps->getwork_requested);
+
+	metrics_family(out, "pool_failures", "counter", "Failed work requests and submissions per pool");
+	METRICS_FOREACH_POOL(ps)
+	{
+		metrics_pool_sample(out, "pool_failures_total", ps, "get", ps->getfail_occasions);
+		metrics_pool_sample(out, "pool_failures_total", ps, "remote", ps->remotefail_occasions);
+	}
+
+	metrics_family(out, "pool_latency_seconds", "histogram", "Time taken by each stage of work and shares from each pool");
+	METRICS_FOREACH_POOL(ps)
+		for (k = 0; k < LATENCY_KINDS; ++k)
+		{
+			if (!ps->latency[k].count)
+				continue;
+			bytes_reset(&labels);
+			metrics_pool_labels(&labels, ps);
+			metrics_latency(out, "pool_latency_seconds", &labels, k, &ps->latency[k]);
+		}
+
+	bytes_free(&labels);
+
+	bytes_append(out, "# EOF\n", 6);
+}
+
+int handle_metrics(struct MHD_Connection * const conn)
+{
+	struct stats_snapshot * const snap = stats_snapshot_get();
+	struct MHD_Response *resp;
+	void *buf;
+	size_t len;
+	int ret;
+
+	mutex_lock(&metrics_lock);
+	if (!bytes_len(&metrics_cache) || timercmp(&metrics_cache_tv, &snap->tv_taken, !=))
+	{
+		bytes_reset(&metrics_cache);
+		metrics_render(&metrics_cache, snap);
+		metrics_cache_tv = snap->tv_taken;
+	}
+	len = bytes_len(&metrics_cache);
+	buf = malloc(len);
+	if (likely(buf))
+		memcpy(buf, bytes_buf(&metrics_cache), len);
+	mutex_unlock(&metrics_lock);
+	stats_snapshot_put(snap);
+
+	if (unlikely(!buf))
+		return MHD_NO;
+
+	resp = MHD_create_response_from_buffer(len, buf, MHD_RESPMEM_MUST_FREE);
+	httpsrv_prepare_resp(resp);
+	MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, METRICS_CONTENT_TYPE);
+	ret = MHD_queue_response(conn, MHD_HTTP_OK, resp);
+	MHD_destroy_response(resp);
+	return ret;
+}
@@ -123,7 +123,7 @@ static char packagename[256];
 
 bool opt_protocol;
 bool opt_dev_protocol;
-static bool opt_benchmark;
+bool opt_benchmark;
 static bool want_longpoll = true;
 static bool want_gbt = true;
 static bool want_getwork = true;
@@ -164,6 +164,9 @@ int opt_scantime = 60;
 int opt_expiry = 120;
 int opt_expiry_lp = 3600;
 int opt_bench_algo = -1;
+#ifdef WANT_CPUMINE
+static bool opt_benchmark_algos;
+#endif
 unsigned long long global_hashrate;
 static bool opt_unittest = false;
 unsigned long global_quota_gcd = 1;
@@ -188,6 +191,12 @@ int httpsrv_port = -1;
 #endif
 #ifdef USE_LIBEVENT
 int stratumsrv_port = -1;
+int opt_stratumsrv_threads = 1;
+int opt_stratumsrv_verify_threads = 1;
+int opt_stratumsrv_xnonce1_size = 1;
+int opt_stratumsrv_loadtest_clients;
+float opt_stratumsrv_share_rate;
+float opt_stratumsrv_loadtest_rate;
 #endif
 
 const
@@ -290,6 +299,9 @@ static struct timeval miner_started;
 cglock_t control_lock;
 pthread_mutex_t stats_lock;
 
+static pthread_mutex_t stats_snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_snapshot *cur_stats_snapshot;
+
 static pthread_mutex_t submitting_lock;
 static int total_submitting;
 static struct work *submit_waiting;
@@ -393,6 +405,7 @@ struct stratum_share {
 	bool block;
 	struct work *work;
 	int id;
+	struct timeval tv_submit;
 };
 
 static struct stratum_share *stratum_shares = NULL;
@@ -429,7 +442,19 @@ struct thread_q *getq;
 
 static int total_work;
 static bool staged_full;
+
+/* Staged work is kept in two FIFO lists (linked through work->prev/next) so
+ * that both pushing and popping are O(1) and insertion order is the staging
+ * order: staged_work holds clones and other work which cannot be rolled,
+ * while staged_rollable_work holds the master work items we can clone from.
+ * Both are protected by stgd_lock. */
 struct work *staged_work = NULL;
+static struct work *staged_rollable_work;
+static int staged_count;
+
+/* Threads which found nothing staged in try_get_work, to be woken by
+ * hash_push; linked through thr->_next_work_waiter under stgd_lock */
+static struct thr_info *work_waiters;
 
 struct schedtime {
 	bool enable;
@@ -881,7 +906,6 @@ int cgpu_search(const char * const pattern, const int first)
 	return -1;
 }
 
-static pthread_mutex_t sharelog_lock;
 static FILE *sharelog_file = NULL;
 
 struct thr_info *get_thread(int thr_id)
@@ -913,7 +937,6 @@ struct cgpu_info *get_devices(int id)
 	return cgpu;
 }
 
-static pthread_mutex_t noncelog_lock = PTHREAD_MUTEX_INITIALIZER;
 static FILE *noncelog_file = NULL;
 
 static
@@ -923,7 +946,6 @@ void noncelog(const struct work * const work)
 	const struct cgpu_info *proc = get_thr_cgpu(thr_id);
 	char buf[0x200], hash[65], data[161], midstate[65];
 	int rv;
-	size_t ret;
 	
 	bin2hex(hash, work->hash, 32);
 	bin2hex(data, work->data, 80);
@@ -940,12 +962,7 @@ void noncelog(const struct work * const work)
 		return;
 	}
 	
-	mutex_lock(&noncelog_lock);
-	ret = fwrite(buf, rv, 1, noncelog_file);
-	fflush(noncelog_file);
-	mutex_unlock(&noncelog_lock);
-	
-	if (ret != 1)
+	if (!log_file_write(noncelog_file, buf, rv))
 		applog(LOG_ERR, "noncelog fwrite error");
 }
 
@@ -959,7 +976,8 @@ static void sharelog(const char*disposition, const struct work*work)
 	struct pool *pool;
 	int thr_id, rv;
 	char s[1024];
-	size_t ret;
+
+	share_journal_share(disposition, work);
 
 	if (!sharelog_file)
 		return;
@@ -974,19 +992,15 @@ static void sharelog(const char*disposition, const struct work*work)
 
 	// timestamp,disposition,target,pool,dev,thr,sharehash,sharedata
 	rv = snprintf(s, sizeof(s), "%lu,%s,%s,%s,%s,%u,%s,%s\n", t, disposition, target, pool->rpc_url, cgpu->proc_repr_ns, thr_id, hash, data);
-	if (rv >= (int)(sizeof(s)))
-		s[sizeof(s) - 1] = '\0';
-	else if (rv < 0) {
+	if (rv >= (int)(sizeof(s))) {
+		s[sizeof(s) - 1] = '\n';
+		rv = sizeof(s);
+	} else if (rv < 0) {
 		applog(LOG_ERR, "sharelog printf error");
 		return;
 	}
 
-	mutex_lock(&sharelog_lock);
-	ret = fwrite(s, rv, 1, sharelog_file);
-	fflush(sharelog_file);
-	mutex_unlock(&sharelog_lock);
-
-	if (ret != 1)
+	if (!log_file_write(sharelog_file, s, rv))
 		applog(LOG_ERR, "sharelog fwrite error");
 }
 
@@ -1048,6 +1062,8 @@ struct pool *add_pool(void)
 		quit(1, "Failed to pthread_cond_init in add_pool");
 	cglock_init(&pool->data_lock);
 	mutex_init(&pool->stratum_lock);
+	lock_stats_register_cglock(&pool->data_lock, "data_lock");
+	lock_stats_register(&pool->stratum_lock, "stratum_lock");
 	timer_unset(&pool->swork.tv_transparency);
 
 	/* Make sure the pool doesn't think we've been idle since time 0 */
@@ -1669,6 +1685,64 @@ static char *set_noncelog(char *arg)
 	return _bfgopt_set_file(arg, &noncelog_file, "a", "nonce log");
 }
 
+static char *set_stratum_record(char *arg)
+{
+	return _bfgopt_set_file(arg, &stratum_record_file, "a", "stratum recording");
+}
+
+static char *set_stratum_replay(char *arg)
+{
+	char *err, url[0x40];
+	int port;
+
+	err = stratum_replay_prepare(arg, &port);
+	if (err)
+		return err;
+
+	snprintf(url, sizeof(url), "stratum+tcp://127.0.0.1:%d", port);
+	set_url(strdup(url));
+	return set_userpass("replay:x");
+}
+
+#ifdef USE_LIBEVENT
+static char *set_stratumsrv_threads(const char *arg, int *i)
+{
+	return set_int_range(arg, i, 1, 0x40);
+}
+
+static char *set_stratumsrv_verify_threads(const char *arg, int *i)
+{
+	return set_int_range(arg, i, 0, 0x40);
+}
+
+static char *set_stratumsrv_xnonce1_size(const char *arg, int *i)
+{
+	return set_int_range(arg, i, 1, 3);
+}
+
+static char *set_stratumsrv_loadtest(char *arg)
+{
+	char *p;
+
+	opt_stratumsrv_loadtest_clients = strtol(arg, &p, 0);
+	if (opt_stratumsrv_loadtest_clients < 1 || (*p && *p != ':'))
+		return "Invalid value passed to --stratum-loadtest";
+	opt_stratumsrv_loadtest_rate = 0;
+	if (*p == ':')
+	{
+		opt_stratumsrv_loadtest_rate = strtod(&p[1], &p);
+		if (opt_stratumsrv_loadtest_rate < 0 || *p)
+			return "Invalid submit rate passed to --stratum-loadtest";
+	}
+	return NULL;
+}
+#endif
+
+static char *set_share_journal(char *arg)
+{
+	return share_journal_open(arg);
+}
+
 static char *set_sharelog(char *arg)
 {
 	return _bfgopt_set_file(arg, &sharelog_file, "a", "share log");
@@ -1879,6 +1953,15 @@ static struct opt_table opt_config_table[] = {
 #endif
 #ifdef WANT_ALTIVEC_4WAY
     "\n\taltivec_4way\tAltivec implementation for PowerPC G4 and G5 machines"
+#endif
+#ifdef WANT_AVX2_8WAY
+		     "\n\tavx2_8way\t8-way AVX2 implementation for x86 machines"
+#endif
+#ifdef WANT_AVX512_16WAY
+		     "\n\tavx512_16way\t16-way AVX-512 implementation for x86 machines"
+#endif
+#ifdef WANT_SHANI
+		     "\n\tshani\t\tx86 SHA extensions implementation"
 #endif
 		),
 #endif
@@ -1929,6 +2012,11 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--benchmark",
 			opt_set_bool, &opt_benchmark,
 			"Run BFGMiner in benchmark mode - produces no shares"),
+#ifdef WANT_CPUMINE
+	OPT_WITHOUT_ARG("--benchmark-algos",
+			opt_set_bool, &opt_benchmark_algos,
+			"Benchmark every CPU sha256 algorithm, report rate, variance and per-core scaling, save the fastest and exit"),
+#endif
 #if defined(USE_BITFORCE)
 	OPT_WITHOUT_ARG("--bfl-range",
 			opt_set_bool, &opt_bfl_noncerange,
@@ -1997,7 +2085,7 @@ static struct opt_table opt_config_table[] = {
 #ifdef USE_LIBMICROHTTPD
 	OPT_WITH_ARG("--http-port",
 	             opt_set_intval, opt_show_intval, &httpsrv_port,
-	             "Port number to listen on for HTTP getwork miners (-1 means disabled)"),
+	             "Port number to listen on for HTTP getwork miners and /metrics (-1 means disabled)"),
 #endif
 #if defined(WANT_CPUMINE) && (defined(HAVE_OPENCL) || defined(USE_FPGA))
 	OPT_WITHOUT_ARG("--enable-cpu|-C",
@@ -2102,6 +2190,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--load-balance",
 		     set_loadbalance, &pool_strategy,
 		     "Change multipool strategy from failover to quota based balance"),
+	OPT_WITHOUT_ARG("--lock-stats",
+	                opt_set_bool, &opt_lock_stats,
+	                "Count waits on the main shared locks and CPU time per thread role (see the lockstats API command)"),
 	OPT_WITH_ARG("--log|-l",
 		     set_int_0_to_9999, opt_show_intval, &opt_log_interval,
 		     "Interval in seconds between log output"),
@@ -2260,6 +2351,11 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--scrypt",
 			opt_set_bool, &opt_scrypt,
 			"Use the scrypt algorithm for mining (non-bitcoin)"),
+#ifdef WANT_CPUMINE
+	OPT_WITHOUT_ARG("--scrypt-hugepages",
+			opt_set_bool, &opt_scrypt_hugepages,
+			"Allocate CPU scrypt scratchpads from 2 MiB huge pages, where supported"),
+#endif
 #endif
 	OPT_WITH_ARG("--set-device",
 			opt_string_elist_add, NULL, &opt_set_device_list,
@@ -2274,6 +2370,12 @@ static struct opt_table opt_config_table[] = {
                      opt_set_charp, NULL, &opt_setuid,
                      "Username of an unprivileged user to run as"),
 #endif
+	OPT_WITH_ARG("--share-journal",
+		     set_share_journal, NULL, NULL,
+		     "Append binary share journal to file (read it with bfgminer-journal)"),
+	OPT_WITHOUT_ARG("--share-journal-nonces",
+			opt_set_bool, &opt_share_journal_nonces,
+			"Also record every nonce found in the share journal"),
 	OPT_WITH_ARG("--sharelog",
 		     set_sharelog, NULL, NULL,
 		     "Append share log to file"),
@@ -2293,9 +2395,35 @@ static struct opt_table opt_config_table[] = {
 		     opt_set_charp, NULL, &opt_socks_proxy,
 		     "Set socks proxy (host:port)"),
 #ifdef USE_LIBEVENT
+	OPT_WITH_ARG("--stratum-loadtest",
+	             set_stratumsrv_loadtest, NULL, NULL,
+	             "Connect <clients>[:<submits per second each>] local test miners to --stratum-port"),
 	OPT_WITH_ARG("--stratum-port",
 	             opt_set_intval, opt_show_intval, &stratumsrv_port,
 	             "Port number to listen on for stratum miners (-1 means disabled)"),
+#endif
+	OPT_WITH_ARG("--stratum-record",
+		     set_stratum_record, NULL, NULL,
+		     "Record every line received from stratum pools to file, for --stratum-replay"),
+	OPT_WITH_ARG("--stratum-replay",
+		     set_stratum_replay, NULL, NULL,
+		     "Add a local pool that plays back a stratum recording"),
+	OPT_WITH_ARG("--stratum-replay-speed",
+		     opt_set_floatval, opt_show_floatval, &opt_stratum_replay_speed,
+		     "Speed multiplier for --stratum-replay (0 means as fast as possible)"),
+#ifdef USE_LIBEVENT
+	OPT_WITH_ARG("--stratum-share-rate",
+	             opt_set_floatval, opt_show_floatval, &opt_stratumsrv_share_rate,
+	             "Shares per minute to aim for from each --stratum-port miner by adjusting its difficulty (0 means always difficulty 1)"),
+	OPT_WITH_ARG("--stratum-threads",
+	             set_stratumsrv_threads, opt_show_intval, &opt_stratumsrv_threads,
+	             "Number of threads serving --stratum-port connections"),
+	OPT_WITH_ARG("--stratum-verify-threads",
+	             set_stratumsrv_verify_threads, opt_show_intval, &opt_stratumsrv_verify_threads,
+	             "Number of threads checking shares from --stratum-port miners (0 means check them on the connection threads)"),
+	OPT_WITH_ARG("--stratum-xnonce1-size",
+	             set_stratumsrv_xnonce1_size, opt_show_intval, &opt_stratumsrv_xnonce1_size,
+	             "Extranonce1 bytes given to each stratum miner: 1 allows 255 miners, 2 allows 65535, 3 allows 16777215"),
 #endif
 	OPT_WITHOUT_ARG("--submit-stale",
 			opt_set_bool, &opt_submit_stale,
@@ -2608,12 +2736,39 @@ static void calc_midstate(struct work *work)
 	swap32tole(work->midstate, work->midstate, 8);
 }
 
+/* Retired work structs are kept on a freelist (linked through work->next) and
+ * recycled by make_work, so the steady-state mining path doesn't need to touch
+ * the heap. Their nonce2 buffers are kept allocated for reuse. */
+#define WORK_POOL_MAX  0x400
+static pthread_mutex_t work_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct work *work_pool;
+static int work_pool_count;
+uint64_t work_pool_allocs, work_pool_reuses, work_pool_frees;
+
 static struct work *make_work(void)
 {
-	struct work *work = calloc(1, sizeof(struct work));
+	struct work *work;
 
-	if (unlikely(!work))
-		quit(1, "Failed to calloc work in make_work");
+	mutex_lock(&work_pool_lock);
+	work = work_pool;
+	if (work)
+	{
+		work_pool = work->next;
+		--work_pool_count;
+		++work_pool_reuses;
+	}
+	else
+		++work_pool_allocs;
+	mutex_unlock(&work_pool_lock);
+
+	if (work)
+		work->next = NULL;
+	else
+	{
+		work = calloc(1, sizeof(struct work));
+		if (unlikely(!work))
+			quit(1, "Failed to calloc work in make_work");
+	}
 
 	cg_wlock(&control_lock);
 	work->id = total_work++;
@@ -2622,13 +2777,30 @@ static struct work *make_work(void)
 	return work;
 }
 
-/* This is the central place all work that is about to be retired should be
- * cleaned to remove any dynamically allocated arrays within the struct */
-void clean_work(struct work *work)
+int work_pool_size(void)
+{
+	int rv;
+	
+	mutex_lock(&work_pool_lock);
+	rv = work_pool_count;
+	mutex_unlock(&work_pool_lock);
+	
+	return rv;
+}
+
+static void _clean_work(struct work * const work, const bool keep_nonce2)
 {
-	free(work->job_id);
-	bytes_free(&work->nonce2);
-	free(work->nonce1);
+	bytes_t nonce2 = BYTES_INIT;
+
+	rcstr_free(work->job_id);
+	if (keep_nonce2)
+	{
+		nonce2 = work->nonce2;
+		bytes_reset(&nonce2);
+	}
+	else
+		bytes_free(&work->nonce2);
+	rcstr_free(work->nonce1);
 
 	if (work->tmpl) {
 		struct pool *pool = work->pool;
@@ -2642,14 +2814,40 @@ void clean_work(struct work *work)
 	}
 
 	memset(work, 0, sizeof(struct work));
+	work->nonce2 = nonce2;
+}
+
+/* This is the central place all work that is about to be retired should be
+ * cleaned to remove any dynamically allocated arrays within the struct */
+void clean_work(struct work *work)
+{
+	_clean_work(work, false);
 }
 
 /* All dynamically allocated work structs should be freed here to not leak any
  * ram from arrays allocated within the work struct */
 void free_work(struct work *work)
 {
-	clean_work(work);
-	free(work);
+	bool pooled = false;
+
+	_clean_work(work, true);
+	mutex_lock(&work_pool_lock);
+	if (work_pool_count < WORK_POOL_MAX)
+	{
+		work->next = work_pool;
+		work_pool = work;
+		++work_pool_count;
+		pooled = true;
+	}
+	else
+		++work_pool_frees;
+	mutex_unlock(&work_pool_lock);
+
+	if (!pooled)
+	{
+		bytes_free(&work->nonce2);
+		free(work);
+	}
 }
 
 static const char *workpadding_bin = "\0\0\0\x80\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\x80\x02\0\0";
@@ -2887,7 +3085,7 @@ void decay_time(double *f, double fadd, double fsecs)
 
 static int __total_staged(void)
 {
-	return HASH_COUNT(staged_work);
+	return staged_count;
 }
 
 static int total_staged(void)
@@ -2988,6 +3186,22 @@ void tailsprintf(char *buf, size_t bufsz, const char *fmt, ...)
 	va_end(ap);
 }
 
+const char * const latency_kind_names[LATENCY_KINDS] = {
+	[LATENCY_GETWORK] = "Getwork",
+	[LATENCY_STAGE_TO_START] = "Stage To Start",
+	[LATENCY_FOUND_TO_SUBMIT] = "Found To Submit",
+	[LATENCY_SUBMIT_TO_REPLY] = "Submit To Reply",
+};
+
+// Either of cgpu or pool may be NULL
+void record_latency(struct cgpu_info * const cgpu, struct pool * const pool, const enum latency_kind kind, const struct timeval * const tvp_from, const struct timeval * const tvp_to)
+{
+	if (cgpu)
+		latency_hist_add_tv(&cgpu->cgminer_stats.latency[kind], tvp_from, tvp_to);
+	if (pool)
+		latency_hist_add_tv(&pool->cgminer_stats.latency[kind], tvp_from, tvp_to);
+}
+
 double stats_elapsed(struct cgminer_stats *stats)
 {
 	struct timeval now;
@@ -4094,6 +4308,7 @@ share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
 {
 	struct pool *pool = work->pool;
 	struct cgpu_info *cgpu;
+	char repr_json[API_EVENT_STR_SIZE];
 
 	cgpu = get_thr_cgpu(work->thr_id);
 
@@ -4107,6 +4322,9 @@ share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
 		pool->diff_accepted += work->work_difficulty;
 		mutex_unlock(&stats_lock);
 
+		api_event(API_EVENT_SHARE, "\"result\":\"accepted\",\"pool\":%d,\"device\":%s,\"difficulty\":%f",
+		          pool->pool_no, api_event_str(repr_json, sizeof(repr_json), cgpu->proc_repr), work->work_difficulty);
+
 		pool->seq_rejects = 0;
 		cgpu->last_share_pool = pool->pool_no;
 		cgpu->last_share_pool_time = time(NULL);
@@ -4160,6 +4378,9 @@ share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
 		pool->seq_rejects++;
 		mutex_unlock(&stats_lock);
 
+		api_event(API_EVENT_SHARE, "\"result\":\"rejected\",\"pool\":%d,\"device\":%s,\"difficulty\":%f",
+		          pool->pool_no, api_event_str(repr_json, sizeof(repr_json), cgpu->proc_repr), work->work_difficulty);
+
 		applog(LOG_DEBUG, "PROOF OF WORK RESULT: false (booooo)");
 		if (!QUIET) {
 			char where[20];
@@ -4280,6 +4501,12 @@ static bool submit_upstream_work_completed(struct work *work, bool resubmit, str
 	cgtime(&tv_submit_reply);
 	ts_submit_reply = time(NULL);
 
+	if (likely(val)) {
+		struct cgpu_info * const cgpu = get_thr_cgpu(thr_id);
+		record_latency(cgpu, pool, LATENCY_FOUND_TO_SUBMIT, &work->tv_work_found, ptv_submit);
+		record_latency(cgpu, pool, LATENCY_SUBMIT_TO_REPLY, ptv_submit, &tv_submit_reply);
+	}
+
 	if (unlikely(!val)) {
 		applog(LOG_INFO, "submit_upstream_work json_rpc_call failed");
 		if (!pool_tset(pool, &pool->submit_fail)) {
@@ -4738,6 +4965,7 @@ tryagain:
 		applog(LOG_DEBUG, "Failed json_rpc_call in get_upstream_work");
 
 	cgtime(&work->tv_getwork_reply);
+	record_latency(NULL, pool, LATENCY_GETWORK, &work->tv_getwork, &work->tv_getwork_reply);
 	timersub(&(work->tv_getwork_reply), &(work->tv_getwork), &tv_elapsed);
 	pool_stats->getwork_wait_rolling += ((double)tv_elapsed.tv_sec + ((double)tv_elapsed.tv_usec / 1000000)) * 0.63;
 	pool_stats->getwork_wait_rolling /= 1.63;
@@ -5076,17 +5304,21 @@ static void roll_work(struct work *work)
 static void _copy_work(struct work *work, const struct work *base_work, int noffset)
 {
 	int id = work->id;
+	bytes_t nonce2;
 
-	clean_work(work);
+	_clean_work(work, true);
+	nonce2 = work->nonce2;
 	memcpy(work, base_work, sizeof(struct work));
 	/* Keep the unique new id assigned during make_work to prevent copied
 	 * work from having the same id. */
 	work->id = id;
-	if (base_work->job_id)
-		work->job_id = strdup(base_work->job_id);
-	if (base_work->nonce1)
-		work->nonce1 = strdup(base_work->nonce1);
-	bytes_cpy(&work->nonce2, &base_work->nonce2);
+	work->job_id = rcstr_ref(base_work->job_id);
+	work->nonce1 = rcstr_ref(base_work->nonce1);
+	/* Reuse our own nonce2 buffer, if we already have one */
+	work->nonce2 = nonce2;
+	bytes_resize(&work->nonce2, bytes_len(&base_work->nonce2));
+	if (bytes_len(&work->nonce2))
+		memcpy(bytes_buf(&work->nonce2), bytes_buf(&base_work->nonce2), bytes_len(&work->nonce2));
 
 	if (base_work->tmpl) {
 		struct pool *pool = work->pool;
@@ -5147,7 +5379,7 @@ static bool clone_available(void)
 	if (!staged_rollable)
 		goto out_unlock;
 
-	HASH_ITER(hh, staged_work, work, tmp) {
+	DL_FOREACH_SAFE(staged_rollable_work, work, tmp) {
 		if (can_roll(work) && should_roll(work)) {
 			roll_work(work);
 			work_clone = make_clone(work);
@@ -5640,6 +5872,7 @@ next_write_sws_del:
 			/* Give the stratum share a unique id */
 			sshare_id =
 			sshare->id = swork_id++;
+			cgtime(&sshare->tv_submit);
 			HASH_ADD_INT(stratum_shares, id, sshare);
 			snprintf(s, 1024, "{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
 				pool->rpc_user, work->job_id, nonce2hex, ntimehex, noncehex, sshare->id);
@@ -5919,6 +6152,7 @@ void switch_pools(struct pool *selected)
 
 	if (pool != last_pool)
 	{
+		api_event(API_EVENT_POOL, "\"pool\":%d,\"from\":%d", pool->pool_no, last_pool->pool_no);
 		pool->block_id = 0;
 		if (pool_strategy != POOL_LOADBALANCE && pool_strategy != POOL_BALANCE) {
 			applog(LOG_WARNING, "Switching to pool %d %s", pool->pool_no, pool->rpc_url);
@@ -5948,6 +6182,21 @@ static void discard_work(struct work *work)
 	free_work(work);
 }
 
+static bool work_rollable(struct work *);
+
+/* Must be called with stgd_lock held */
+static void __unstage_work(struct work *work)
+{
+	if (work_rollable(work))
+	{
+		DL_DELETE(staged_rollable_work, work);
+		--staged_rollable;
+	}
+	else
+		DL_DELETE(staged_work, work);
+	--staged_count;
+}
+
 static void wake_gws(void)
 {
 	mutex_lock(stgd_lock);
@@ -5961,9 +6210,17 @@ static void discard_stale(void)
 	int stale = 0;
 
 	mutex_lock(stgd_lock);
-	HASH_ITER(hh, staged_work, work, tmp) {
+	DL_FOREACH_SAFE(staged_work, work, tmp) {
+		if (stale_work(work, false)) {
+			__unstage_work(work);
+			discard_work(work);
+			stale++;
+			staged_full = false;
+		}
+	}
+	DL_FOREACH_SAFE(staged_rollable_work, work, tmp) {
 		if (stale_work(work, false)) {
-			HASH_DEL(staged_work, work);
+			__unstage_work(work);
 			discard_work(work);
 			stale++;
 			staged_full = false;
@@ -6051,6 +6308,7 @@ static void set_curblock(char *hexstr, unsigned char *hash)
 	current_fullhash = malloc(65);
 	bin2hex(current_fullhash, hash_swap, 32);
 	get_timestamp(blocktime, sizeof(blocktime), block_time);
+	api_event(API_EVENT_BLOCK, "\"hash\":\"%s\"", current_fullhash);
 	cg_wunlock(&ch_lock);
 
 	applog(LOG_INFO, "New block: %s diff %s (%s)", current_hash, block_diff, net_hashrate);
@@ -6217,14 +6475,23 @@ out_free:
 	return ret;
 }
 
-static int tv_sort(struct work *worka, struct work *workb)
+static bool work_rollable(struct work *work)
 {
-	return worka->tv_staged.tv_sec - workb->tv_staged.tv_sec;
+	return (!work->clone && work->rolltime);
 }
 
-static bool work_rollable(struct work *work)
+/* Must be called with stgd_lock held */
+static void __wake_work_waiters(void)
 {
-	return (!work->clone && work->rolltime);
+	struct thr_info *thr;
+	
+	while ( (thr = work_waiters) )
+	{
+		work_waiters = thr->_next_work_waiter;
+		thr->_next_work_waiter = NULL;
+		thr->_work_waiter = false;
+		notifier_wake(thr->work_restart_notifier);
+	}
 }
 
 static bool hash_push(struct work *work)
@@ -6232,11 +6499,16 @@ static bool hash_push(struct work *work)
 	bool rc = true;
 
 	mutex_lock(stgd_lock);
-	if (work_rollable(work))
-		staged_rollable++;
 	if (likely(!getq->frozen)) {
-		HASH_ADD_INT(staged_work, id, work);
-		HASH_SORT(staged_work, tv_sort);
+		if (work_rollable(work))
+		{
+			DL_APPEND(staged_rollable_work, work);
+			++staged_rollable;
+		}
+		else
+			DL_APPEND(staged_work, work);
+		++staged_count;
+		__wake_work_waiters();
 	} else
 		rc = false;
 	pthread_cond_broadcast(&getq->cond);
@@ -6277,11 +6549,22 @@ static bool input_pool(bool live);
 #endif
 
 #ifdef HAVE_CURSES
+// Formats the p50/p99 of a latency histogram, in milliseconds
+static
+void latency_str(char * const buf, const size_t bufsz, const struct latency_hist * const hist)
+{
+	snprintf(buf, bufsz, "%.1f/%.1f",
+	         latency_hist_percentile(hist, 50) / 1000.,
+	         latency_hist_percentile(hist, 99) / 1000.);
+}
+
 static void display_pool_summary(struct pool *pool)
 {
 	double efficiency = 0.0;
 	char xfer[17], bw[19];
+	char lat[32];
 	int pool_secs;
+	int i;
 
 	if (curses_active_locked()) {
 		wlog("Pool: %s\n", pool->rpc_url);
@@ -6313,7 +6596,16 @@ static void display_pool_summary(struct pool *pool)
 		wlog(" Items worked on: %d\n", pool->works);
 		wlog(" Stale submissions discarded due to new blocks: %d\n", pool->stale_shares);
 		wlog(" Unable to get work from server occasions: %d\n", pool->getfail_occasions);
-		wlog(" Submitting work remotely delay occasions: %d\n\n", pool->remotefail_occasions);
+		wlog(" Submitting work remotely delay occasions: %d\n", pool->remotefail_occasions);
+		for (i = 0; i < LATENCY_KINDS; ++i)
+		{
+			const struct latency_hist * const hist = &pool->cgminer_stats.latency[i];
+			if (!hist->count)
+				continue;
+			latency_str(lat, sizeof(lat), hist);
+			wlog(" %s latency p50/p99: %s ms (%lu)\n", latency_kind_names[i], lat, (unsigned long)hist->count);
+		}
+		wlog("\n");
 		unlock_curses();
 	}
 }
@@ -6343,6 +6635,7 @@ void remove_pool(struct pool *pool)
 	pool->removed = true;
 	pool->has_stratum = false;
 	total_pools--;
+	share_journal_pools_renumbered();
 }
 
 /* add a mutex if this needs to be thread safe in the future */
@@ -6597,6 +6890,14 @@ void write_config(FILE *fcfg)
 #ifdef USE_LIBEVENT
 	if (stratumsrv_port != -1)
 		fprintf(fcfg, ",\n\"stratum-port\" : %d", stratumsrv_port);
+	if (opt_stratumsrv_share_rate)
+		fprintf(fcfg, ",\n\"stratum-share-rate\" : \"%g\"", opt_stratumsrv_share_rate);
+	if (opt_stratumsrv_threads != 1)
+		fprintf(fcfg, ",\n\"stratum-threads\" : %d", opt_stratumsrv_threads);
+	if (opt_stratumsrv_verify_threads != 1)
+		fprintf(fcfg, ",\n\"stratum-verify-threads\" : %d", opt_stratumsrv_verify_threads);
+	if (opt_stratumsrv_xnonce1_size != 1)
+		fprintf(fcfg, ",\n\"stratum-xnonce1-size\" : %d", opt_stratumsrv_xnonce1_size);
 #endif
 	_write_config_string_elist(fcfg, "device", opt_devices_enabled_list);
 	_write_config_string_elist(fcfg, "set-device", opt_set_device_list);
@@ -6683,6 +6984,7 @@ void zero_stats(void)
 		pool->diff_stale = 0;
 		pool->last_share_diff = 0;
 		pool->cgminer_stats.start_tv = total_tv_start;
+		memset(pool->cgminer_stats.latency, 0, sizeof(pool->cgminer_stats.latency));
 		pool->cgminer_stats.getwork_calls = 0;
 		pool->cgminer_stats.getwork_wait_min.tv_sec = MIN_SEC_UNSET;
 		pool->cgminer_stats.getwork_wait_max.tv_sec = 0;
@@ -6705,6 +7007,7 @@ void zero_stats(void)
 	}
 
 	zero_bestshare();
+	lock_stats_zero();
 
 	for (i = 0; i < total_devices; ++i) {
 		struct cgpu_info *cgpu = get_devices(i);
@@ -6739,10 +7042,208 @@ void zero_stats(void)
 		cgpu->cgminer_stats.getwork_wait_min.tv_sec = MIN_SEC_UNSET;
 		cgpu->cgminer_stats.getwork_wait_max.tv_sec = 0;
 		cgpu->cgminer_stats.getwork_wait_max.tv_usec = 0;
+		memset(cgpu->cgminer_stats.latency, 0, sizeof(cgpu->cgminer_stats.latency));
 		mutex_unlock(&hash_lock);
 	}
 }
 
+const uint64_t latency_snapshot_bounds_us[LATENCY_SNAPSHOT_BOUNDS] = {
+	100, 250, 500,
+	1000, 2500, 5000,
+	10000, 25000, 50000,
+	100000, 250000, 500000,
+	1000000, 2500000, 5000000,
+	10000000, 30000000,
+};
+
+static
+void latency_snapshot_take(struct latency_snapshot * const out, const struct latency_hist * const hists)
+{
+	int i;
+
+	for (i = 0; i < LATENCY_KINDS; ++i)
+	{
+		out[i].count = latency_hist_cumulative(&hists[i], latency_snapshot_bounds_us, LATENCY_SNAPSHOT_BOUNDS, out[i].le);
+		out[i].sum_secs = hists[i].sum_us / 1e6;
+	}
+}
+
+static
+void stats_snapshot_free(struct stats_snapshot * const snap)
+{
+	free(snap->devices);
+	free(snap->pools);
+	free(snap);
+}
+
+/* Copies all the counters at once, so the API can serve them without
+ * touching the locks the mining threads update them under */
+void stats_snapshot_publish(void)
+{
+	struct stats_snapshot *snap, *old;
+	struct cgpu_snapshot *ds;
+	struct pool_snapshot *ps;
+	struct cgpu_info *cgpu;
+	struct pool *pool;
+	int i;
+
+	snap = calloc(1, sizeof(*snap));
+	if (unlikely(!snap))
+		quit(1, "Failed to calloc stats snapshot");
+	snap->refs = 1;
+	cgtime(&snap->tv_taken);
+
+	rd_lock(&devices_lock);
+	snap->total_devices = total_devices;
+	snap->devices = calloc(total_devices ?: 1, sizeof(*snap->devices));
+	for (i = 0; i < total_devices; ++i)
+		snap->devices[i].cgpu = devices[i];
+	rd_unlock(&devices_lock);
+
+	snap->total_pools = total_pools;
+	snap->pools = calloc(total_pools ?: 1, sizeof(*snap->pools));
+	if (unlikely(!(snap->devices && snap->pools)))
+		quit(1, "Failed to calloc stats snapshot");
+	for (i = 0; i < snap->total_pools; ++i)
+		snap->pools[i].pool = pools[i];
+
+	for (i = 0; i < snap->total_devices; ++i)
+	{
+		ds = &snap->devices[i];
+		cgpu = ds->cgpu;
+		ds->deven = cgpu->deven;
+		ds->status = cgpu->status;
+		ds->temp = cgpu->temp;
+		ds->runtime = cgpu_runtime(cgpu);
+		ds->last_share_pool = cgpu->last_share_pool;
+		ds->last_share_pool_time = cgpu->last_share_pool_time;
+		ds->last_share_diff = cgpu->last_share_diff;
+		latency_snapshot_take(ds->latency, cgpu->cgminer_stats.latency);
+	}
+
+	for (i = 0; i < snap->total_pools; ++i)
+	{
+		ps = &snap->pools[i];
+		pool = ps->pool;
+		ps->works = pool->works;
+		ps->getwork_requested = pool->getwork_requested;
+		ps->discarded_work = pool->discarded_work;
+		ps->getfail_occasions = pool->getfail_occasions;
+		ps->remotefail_occasions = pool->remotefail_occasions;
+		ps->last_share_time = pool->last_share_time;
+		ps->last_share_diff = pool->last_share_diff;
+		ps->best_diff = pool->best_diff;
+		latency_snapshot_take(ps->latency, pool->cgminer_stats.latency);
+	}
+
+	mutex_lock(&hash_lock);
+	snap->total_secs = total_secs;
+	snap->total_mhashes_done = total_mhashes_done;
+	snap->total_rolling = total_rolling;
+	for (i = 0; i < snap->total_devices; ++i)
+	{
+		ds = &snap->devices[i];
+		ds->total_mhashes = ds->cgpu->total_mhashes;
+		ds->rolling = ds->cgpu->rolling;
+	}
+	mutex_unlock(&hash_lock);
+
+	mutex_lock(&stats_lock);
+	snap->total_accepted = total_accepted;
+	snap->total_rejected = total_rejected;
+	snap->total_stale = total_stale;
+	snap->hw_errors = hw_errors;
+	snap->total_diff1 = total_diff1;
+	snap->total_bad_diff1 = total_bad_diff1;
+	snap->total_diff_accepted = total_diff_accepted;
+	snap->total_diff_rejected = total_diff_rejected;
+	snap->total_diff_stale = total_diff_stale;
+	for (i = 0; i < snap->total_devices; ++i)
+	{
+		ds = &snap->devices[i];
+		cgpu = ds->cgpu;
+		ds->accepted = cgpu->accepted;
+		ds->rejected = cgpu->rejected;
+		ds->stale = cgpu->stale;
+		ds->hw_errors = cgpu->hw_errors;
+		ds->diff1 = cgpu->diff1;
+		ds->bad_diff1 = cgpu->bad_diff1;
+		ds->diff_accepted = cgpu->diff_accepted;
+		ds->diff_rejected = cgpu->diff_rejected;
+		ds->diff_stale = cgpu->diff_stale;
+		ds->last_device_valid_work = cgpu->last_device_valid_work;
+	}
+	for (i = 0; i < snap->total_pools; ++i)
+	{
+		ps = &snap->pools[i];
+		pool = ps->pool;
+		ps->accepted = pool->accepted;
+		ps->rejected = pool->rejected;
+		ps->stale_shares = pool->stale_shares;
+		ps->diff1 = pool->diff1;
+		ps->diff_accepted = pool->diff_accepted;
+		ps->diff_rejected = pool->diff_rejected;
+		ps->diff_stale = pool->diff_stale;
+	}
+	mutex_unlock(&stats_lock);
+
+	snap->found_blocks = found_blocks;
+	snap->total_getworks = total_getworks;
+	snap->total_discarded = total_discarded;
+	snap->total_go = total_go;
+	snap->local_work = local_work;
+	snap->total_ro = total_ro;
+	snap->new_blocks = new_blocks;
+	snap->best_diff = best_diff;
+	snap->last_getwork = last_getwork;
+	snap->staged = total_staged();
+
+	for (i = 0; i < snap->total_devices; ++i)
+	{
+		ds = &snap->devices[i];
+		ds->utility = ds->accepted / ds->runtime * 60;
+	}
+
+	mutex_lock(&stats_snapshot_lock);
+	old = cur_stats_snapshot;
+	cur_stats_snapshot = snap;
+	mutex_unlock(&stats_snapshot_lock);
+
+	if (old)
+		stats_snapshot_put(old);
+}
+
+// Returns the latest snapshot, which stays valid until given to stats_snapshot_put
+struct stats_snapshot *stats_snapshot_get(void)
+{
+	struct stats_snapshot *snap;
+
+	mutex_lock(&stats_snapshot_lock);
+	snap = cur_stats_snapshot;
+	if (snap)
+		++snap->refs;
+	mutex_unlock(&stats_snapshot_lock);
+
+	if (unlikely(!snap))
+	{
+		stats_snapshot_publish();
+		return stats_snapshot_get();
+	}
+	return snap;
+}
+
+void stats_snapshot_put(struct stats_snapshot * const snap)
+{
+	bool last;
+
+	mutex_lock(&stats_snapshot_lock);
+	last = !--snap->refs;
+	mutex_unlock(&stats_snapshot_lock);
+
+	if (last)
+		stats_snapshot_free(snap);
+}
+
 #ifdef HAVE_CURSES
 static
 void loginput_mode(const int size)
@@ -6971,6 +7472,36 @@ static const char *summary_detail_level_str(void)
 	return "devices";
 }
 
+static void display_lock_stats(void)
+{
+	struct lock_stats_snapshot locks[0x10];
+	struct thread_role_snapshot roles[0x40];
+	int i, n;
+
+	clear_logwin();
+	if (!opt_lock_stats)
+		wlogprint("Lock statistics are only collected with --lock-stats\n");
+	else
+	{
+		n = lock_stats_get(locks, sizeof(locks) / sizeof(*locks));
+		wlogprint("%-16s %12s %10s %10s %9s\n", "Lock", "Acquired", "Waits", "Waited(s)", "Max(ms)");
+		for (i = 0; i < n; ++i)
+			wlogprint("%-16s %12"PRIu64" %10"PRIu64" %10.3f %9.3f\n",
+			          locks[i].name, locks[i].acquisitions, locks[i].waits,
+			          locks[i].wait_secs, locks[i].max_wait_secs * 1000);
+		n = thread_role_stats_get(roles, sizeof(roles) / sizeof(*roles));
+		wlogprint("\n%-16s %7s %10s\n", "Thread role", "Threads", "CPU(s)");
+		for (i = 0; i < n; ++i)
+			if (roles[i].cpu_secs < 0)
+				wlogprint("%-16s %7d %10s\n", roles[i].role, roles[i].threads, "?");
+			else
+				wlogprint("%-16s %7d %10.2f\n", roles[i].role, roles[i].threads, roles[i].cpu_secs);
+	}
+	wlogprint("Press any key to return\n");
+	logwin_update();
+	getch();
+}
+
 static void display_options(void)
 {
 	int selected;
@@ -6983,7 +7514,7 @@ retry:
 	wlogprint("[N]ormal [C]lear [S]ilent mode (disable all output)\n");
 	wlogprint("[D]ebug:%s\n[P]er-device:%s\n[Q]uiet:%s\n[V]erbose:%s\n"
 		  "[R]PC debug:%s\n[W]orkTime details:%s\nsu[M]mary detail level:%s\n"
-		  "[L]og interval:%d\nS[T]atistical counts: %s\n[Z]ero statistics\n",
+		  "[L]og interval:%d\nS[T]atistical counts: %s\n[Z]ero statistics\nLoc[K] statistics\n",
 		opt_debug_console ? "on" : "off",
 	        want_per_device_stats? "on" : "off",
 		opt_quiet ? "on" : "off",
@@ -7076,6 +7607,9 @@ retry:
 	} else if (!strncasecmp(&input, "z", 1)) {
 		zero_stats();
 		goto retry;
+	} else if (!strncasecmp(&input, "k", 1)) {
+		display_lock_stats();
+		goto retry;
 	}
 
 	immedok(logwin, false);
@@ -7271,6 +7805,15 @@ refresh:
 	if (drv->proc_wlogprint_status && likely(cgpu->status != LIFE_INIT))
 		drv->proc_wlogprint_status(cgpu);
 	
+	if (cgpu->cgminer_stats.latency[LATENCY_STAGE_TO_START].count)
+	{
+		char lat[LATENCY_KINDS][32];
+		for (int i = LATENCY_STAGE_TO_START; i < LATENCY_KINDS; ++i)
+			latency_str(lat[i], sizeof(lat[i]), &cgpu->cgminer_stats.latency[i]);
+		wlogprint("Latency p50/p99 ms: Start %s  Submit %s  Reply %s\n",
+		          lat[LATENCY_STAGE_TO_START], lat[LATENCY_FOUND_TO_SUBMIT], lat[LATENCY_SUBMIT_TO_REPLY]);
+	}
+	
 	wlogprint("\n");
 	// TODO: Last share at TIMESTAMP on pool N
 	// TODO: Custom device info/commands
@@ -7803,26 +8346,25 @@ static void stratum_share_result(json_t *val, json_t *res_val, json_t *err_val,
 				 struct stratum_share *sshare)
 {
 	struct work *work = sshare->work;
+	struct cgpu_info * const cgpu = get_thr_cgpu(work->thr_id);
+	struct timeval tv_reply;
+
+	cgtime(&tv_reply);
+	record_latency(cgpu, work->pool, LATENCY_FOUND_TO_SUBMIT, &work->tv_work_found, &sshare->tv_submit);
+	record_latency(cgpu, work->pool, LATENCY_SUBMIT_TO_REPLY, &sshare->tv_submit, &tv_reply);
 
 	share_result(val, res_val, err_val, work, false, "");
 }
 
 /* Parses stratum json responses and tries to find the id that the request
  * matched to and treat it accordingly. */
-bool parse_stratum_response(struct pool *pool, char *s)
+bool parse_stratum_response(struct pool *pool, json_t *val)
 {
-	json_t *val = NULL, *err_val, *res_val, *id_val;
+	json_t *err_val, *res_val, *id_val;
 	struct stratum_share *sshare;
-	json_error_t err;
 	bool ret = false;
 	int id;
 
-	val = JSON_LOADS(s, &err);
-	if (!val) {
-		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
-		goto out;
-	}
-
 	res_val = json_object_get(val, "result");
 	err_val = json_object_get(val, "error");
 	id_val = json_object_get(val, "id");
@@ -7929,9 +8471,6 @@ fishy:
 
 	ret = true;
 out:
-	if (val)
-		json_decref(val);
-
 	return ret;
 }
 
@@ -8041,9 +8580,17 @@ static void clear_pool_work(struct pool *pool)
 	int cleared = 0;
 
 	mutex_lock(stgd_lock);
-	HASH_ITER(hh, staged_work, work, tmp) {
+	DL_FOREACH_SAFE(staged_work, work, tmp) {
+		if (work->pool == pool) {
+			__unstage_work(work);
+			free_work(work);
+			cleared++;
+			staged_full = false;
+		}
+	}
+	DL_FOREACH_SAFE(staged_rollable_work, work, tmp) {
 		if (work->pool == pool) {
-			HASH_DEL(staged_work, work);
+			__unstage_work(work);
 			free_work(work);
 			cleared++;
 			staged_full = false;
@@ -8114,6 +8661,10 @@ static bool cnx_needed(struct pool *pool)
 static void wait_lpcurrent(struct pool *pool);
 static void pool_resus(struct pool *pool);
 static void gen_stratum_work(struct pool *pool, struct work *work);
+static void gen_stratum_works(struct pool *, struct work **, int count);
+
+/* Maximum number of stratum work items the getwork scheduler generates at once */
+#define STRATUM_WORK_BATCH_MAX  0x10
 
 static void stratum_resumed(struct pool *pool)
 {
@@ -8154,8 +8705,10 @@ static void *stratum_thread(void *userdata)
 
 	while (42) {
 		struct timeval timeout;
+		json_error_t err;
 		int sel_ret;
 		fd_set rd;
+		json_t *val;
 		char *s;
 		int sock;
 
@@ -8242,9 +8795,20 @@ static void *stratum_thread(void *userdata)
 		 * has not had its idle flag cleared */
 		stratum_resumed(pool);
 
-		if (!parse_method(pool, s) && !parse_stratum_response(pool, s))
-			applog(LOG_INFO, "Unknown stratum msg: %s", s);
-		free(s);
+		/* The line is parsed straight out of the receive buffer, once, and
+		 * the handlers only ever see the result */
+		val = JSON_LOADS(s, &err);
+		if (!val)
+			applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
+		else {
+			if (!parse_method(pool, val) && !parse_stratum_response(pool, val)) {
+				// Handlers may reconnect, reusing the receive buffer
+				char * const ss = json_dumps(val, JSON_COMPACT);
+				applog(LOG_INFO, "Unknown stratum msg: %s", ss);
+				free(ss);
+			}
+			json_decref(val);
+		}
 		if (pool->swork.clean) {
 			struct work *work = make_work();
 
@@ -8510,15 +9074,17 @@ static void pool_resus(struct pool *pool)
 		applog(LOG_INFO, "Pool %d %s alive", pool->pool_no, pool->rpc_url);
 }
 
-static struct work *hash_pop(void)
+/* If notify_thr is NULL, blocks until work is staged; otherwise, returns NULL
+ * when nothing is staged, and notify_thr's work_restart_notifier is woken once
+ * something is */
+static struct work *hash_pop(struct thr_info * const notify_thr)
 {
-	struct work *work = NULL, *tmp;
-	int hc;
+	struct work *work = NULL;
 	struct timespec ts;
 
 retry:
 	mutex_lock(stgd_lock);
-	while (!HASH_COUNT(staged_work))
+	while (!staged_count)
 	{
 		if (unlikely(staged_full))
 		{
@@ -8532,6 +9098,18 @@ retry:
 			staged_full = false;  // Let it fill up before triggering an underrun again
 			no_work = true;
 		}
+		if (notify_thr)
+		{
+			if (!notify_thr->_work_waiter)
+			{
+				notify_thr->_work_waiter = true;
+				notify_thr->_next_work_waiter = work_waiters;
+				work_waiters = notify_thr;
+			}
+			pthread_cond_signal(&gws_cond);
+			mutex_unlock(stgd_lock);
+			return NULL;
+		}
 		ts = (struct timespec){ .tv_sec = opt_log_interval, };
 		pthread_cond_signal(&gws_cond);
 		if (ETIMEDOUT == pthread_cond_timedwait(&getq->cond, stgd_lock, &ts))
@@ -8544,15 +9122,11 @@ retry:
 	
 	no_work = false;
 
-	hc = HASH_COUNT(staged_work);
-	/* Find clone work if possible, to allow masters to be reused */
-	if (hc > staged_rollable) {
-		HASH_ITER(hh, staged_work, work, tmp) {
-			if (!work_rollable(work))
-				break;
-		}
-	} else
+	/* Take clone work if possible, to allow masters to be reused */
+	if (staged_work)
 		work = staged_work;
+	else
+		work = staged_rollable_work;
 	
 	if (can_roll(work) && should_roll(work))
 	{
@@ -8562,9 +9136,7 @@ retry:
 		goto retry;
 	}
 	
-	HASH_DEL(staged_work, work);
-	if (work_rollable(work))
-		staged_rollable--;
+	__unstage_work(work);
 
 	/* Signal the getwork scheduler to look for more work */
 	pthread_cond_signal(&gws_cond);
@@ -8669,93 +9241,113 @@ void set_target(unsigned char *dest_target, double diff)
 void stratum_work_cpy(struct stratum_work * const dst, const struct stratum_work * const src)
 {
 	*dst = *src;
-	dst->job_id = strdup(src->job_id);
+	dst->job_id = rcstr_ref(src->job_id);
 	bytes_cpy(&dst->coinbase, &src->coinbase);
 	bytes_cpy(&dst->merkle_bin, &src->merkle_bin);
 }
 
 void stratum_work_clean(struct stratum_work * const swork)
 {
-	free(swork->job_id);
+	rcstr_free(swork->job_id);
 	bytes_free(&swork->coinbase);
 	bytes_free(&swork->merkle_bin);
 }
 
-/* Generates stratum based work based on the most recent notify information
- * from the pool. This will keep generating work while a pool is down so we use
- * other means to detect when the pool has died in stratum_thread */
-static void gen_stratum_work(struct pool *pool, struct work *work)
+/* Precomputes the SHA256 midstate for the part of the coinbase preceding
+ * nonce2, so each work item only needs to hash the remaining tail */
+void stratum_work_prepare_midstate(struct stratum_work * const swork)
 {
-	clean_work(work);
-	
-	cg_wlock(&pool->data_lock);
-	pool->swork.data_lock_p = &pool->data_lock;
-	
-	bytes_resize(&work->nonce2, pool->n2size);
-	if (pool->nonce2sz < pool->n2size)
-		memset(&bytes_buf(&work->nonce2)[pool->nonce2sz], 0, pool->n2size - pool->nonce2sz);
-	memcpy(bytes_buf(&work->nonce2),
-#ifdef WORDS_BIGENDIAN
-	// NOTE: On big endian, the most significant bits are stored at the end, so skip the LSBs
-	       &((char*)&pool->nonce2)[pool->nonce2off],
-#else
-	       &pool->nonce2,
-#endif
-	       pool->nonce2sz);
-	pool->nonce2++;
-	
-	work->pool = pool;
-	work->work_restart_id = work->pool->work_restart_id;
-	gen_stratum_work2(work, &pool->swork, pool->nonce1);
-	
-	cgtime(&work->tv_staged);
+	const size_t prefix_len = swork->nonce2_offset - (swork->nonce2_offset % SHA256_BLOCK_SIZE);
+	sha256_ctx ctx;
+
+	swork->coinbase_midstate_len = 0;
+	if (!prefix_len)
+		return;
+	sha256_init(&ctx);
+	sha256_update(&ctx, bytes_buf(&swork->coinbase), prefix_len);
+	memcpy(swork->coinbase_midstate, ctx.h, sizeof(swork->coinbase_midstate));
+	swork->coinbase_midstate_len = prefix_len;
 }
 
-void gen_stratum_work2(struct work *work, struct stratum_work *swork, const char *nonce1)
+/* Must be called with at least a read lock on the swork
+ * Generates the data for count works at once, walking the merkle branches for
+ * all of them together through the multi-lane SHA256 engine */
+static void __gen_stratum_works_data(struct work * const * const works, const int count, struct stratum_work * const swork, char * const nonce1)
 {
-	unsigned char *coinbase, merkle_root[32], merkle_sha[64];
+	const size_t midstate_len = swork->coinbase_midstate_len;
+	const size_t tail_len = bytes_len(&swork->coinbase) - midstate_len;
+	unsigned char tail[tail_len], hash1[count][32], merkle_root[count][32], merkle_sha[count][64];
+	const unsigned char *pin[count];
+	unsigned char *pout[count];
+	struct work *work;
 	uint8_t *merkle_bin;
 	uint32_t *data32, *swap32;
-	int i;
-
-	/* Generate coinbase */
-	coinbase = bytes_buf(&swork->coinbase);
-	memcpy(&coinbase[swork->nonce2_offset], bytes_buf(&work->nonce2), bytes_len(&work->nonce2));
-
-	/* Downgrade to a read lock to read off the variables */
-	if (swork->data_lock_p)
-		cg_dwlock(swork->data_lock_p);
+	sha256_ctx ctx;
+	int i, j;
 
-	/* Generate merkle root */
-	gen_hash(coinbase, merkle_root, bytes_len(&swork->coinbase));
-	memcpy(merkle_sha, merkle_root, 32);
+	memcpy(tail, &bytes_buf(&swork->coinbase)[midstate_len], tail_len);
+	for (j = 0; j < count; ++j)
+	{
+		work = works[j];
+		
+		/* Generate coinbase tail, with our nonce2 */
+		memcpy(&tail[swork->nonce2_offset - midstate_len], bytes_buf(&work->nonce2), bytes_len(&work->nonce2));
+		
+		/* Hash the coinbase, resuming from the cached coinbase midstate */
+		sha256_init(&ctx);
+		if (midstate_len)
+		{
+			memcpy(ctx.h, swork->coinbase_midstate, sizeof(ctx.h));
+			ctx.tot_len = midstate_len;
+		}
+		sha256_update(&ctx, tail, tail_len);
+		sha256_final(&ctx, hash1[j]);
+		pin[j] = hash1[j];
+		pout[j] = merkle_root[j];
+	}
+	
+	/* Generate merkle roots */
+	sha256_multi(pin, 32, pout, count);
+	for (j = 0; j < count; ++j)
+	{
+		memcpy(merkle_sha[j], merkle_root[j], 32);
+		pin[j] = merkle_sha[j];
+	}
 	merkle_bin = bytes_buf(&swork->merkle_bin);
 	for (i = 0; i < swork->merkles; ++i, merkle_bin += 32) {
-		memcpy(merkle_sha + 32, merkle_bin, 32);
-		gen_hash(merkle_sha, merkle_root, 64);
-		memcpy(merkle_sha, merkle_root, 32);
-	}
-	data32 = (uint32_t *)merkle_sha;
-	swap32 = (uint32_t *)merkle_root;
-	flip32(swap32, data32);
-	
-	memcpy(&work->data[0], swork->header1, 36);
-	memcpy(&work->data[36], merkle_root, 32);
-	*((uint32_t*)&work->data[68]) = htobe32(swork->ntime + timer_elapsed(&swork->tv_received, NULL));
-	memcpy(&work->data[72], swork->diffbits, 4);
-	memset(&work->data[76], 0, 4);  // nonce
-	memcpy(&work->data[80], workpadding_bin, 48);
-
-	/* Store the stratum work diff to check it still matches the pool's
-	 * stratum diff when submitting shares */
-	work->sdiff = swork->diff;
-
-	/* Copy parameters required for share submission */
-	work->job_id = strdup(swork->job_id);
-	work->nonce1 = strdup(nonce1);
-	if (swork->data_lock_p)
-		cg_runlock(swork->data_lock_p);
+		for (j = 0; j < count; ++j)
+			memcpy(merkle_sha[j] + 32, merkle_bin, 32);
+		sha256d_multi(pin, 64, pout, count);
+		for (j = 0; j < count; ++j)
+			memcpy(merkle_sha[j], merkle_root[j], 32);
+	}
+	
+	for (j = 0; j < count; ++j)
+	{
+		work = works[j];
+		data32 = (uint32_t *)merkle_sha[j];
+		swap32 = (uint32_t *)merkle_root[j];
+		flip32(swap32, data32);
+		
+		memcpy(&work->data[0], swork->header1, 36);
+		memcpy(&work->data[36], merkle_root[j], 32);
+		*((uint32_t*)&work->data[68]) = htobe32(swork->ntime + timer_elapsed(&swork->tv_received, NULL));
+		memcpy(&work->data[72], swork->diffbits, 4);
+		memset(&work->data[76], 0, 4);  // nonce
+		memcpy(&work->data[80], workpadding_bin, 48);
+
+		/* Store the stratum work diff to check it still matches the pool's
+		 * stratum diff when submitting shares */
+		work->sdiff = swork->diff;
 
+		/* Copy parameters required for share submission */
+		work->job_id = rcstr_ref(swork->job_id);
+		work->nonce1 = rcstr_ref(nonce1);
+	}
+}
+
+static void gen_stratum_work_finish(struct work * const work)
+{
 	if (opt_debug)
 	{
 		char header[161];
@@ -8781,6 +9373,73 @@ void gen_stratum_work2(struct work *work, struct stratum_work *swork, const char
 	calc_diff(work, 0);
 }
 
+/* Generates stratum based work based on the most recent notify information
+ * from the pool, for count consecutive nonce2 values at once. This will keep
+ * generating work while a pool is down so we use other means to detect when
+ * the pool has died in stratum_thread */
+static void gen_stratum_works(struct pool * const pool, struct work ** const works, const int count)
+{
+	struct work *work;
+	int i;
+
+	for (i = 0; i < count; ++i)
+		_clean_work(works[i], true);
+	
+	cg_wlock(&pool->data_lock);
+	pool->swork.data_lock_p = &pool->data_lock;
+	
+	for (i = 0; i < count; ++i)
+	{
+		work = works[i];
+		bytes_resize(&work->nonce2, pool->n2size);
+		if (pool->nonce2sz < pool->n2size)
+			memset(&bytes_buf(&work->nonce2)[pool->nonce2sz], 0, pool->n2size - pool->nonce2sz);
+		memcpy(bytes_buf(&work->nonce2),
+#ifdef WORDS_BIGENDIAN
+		// NOTE: On big endian, the most significant bits are stored at the end, so skip the LSBs
+		       &((char*)&pool->nonce2)[pool->nonce2off],
+#else
+		       &pool->nonce2,
+#endif
+		       pool->nonce2sz);
+		pool->nonce2++;
+		
+		work->pool = pool;
+		work->work_restart_id = work->pool->work_restart_id;
+	}
+	
+	/* Downgrade to a read lock to read off the variables */
+	cg_dwlock(&pool->data_lock);
+	__gen_stratum_works_data(works, count, &pool->swork, pool->nonce1);
+	cg_runlock(&pool->data_lock);
+	
+	for (i = 0; i < count; ++i)
+	{
+		work = works[i];
+		gen_stratum_work_finish(work);
+		cgtime(&work->tv_staged);
+	}
+}
+
+static void gen_stratum_work(struct pool *pool, struct work *work)
+{
+	gen_stratum_works(pool, &work, 1);
+}
+
+void gen_stratum_work2(struct work *work, struct stratum_work *swork, char *nonce1)
+{
+	/* Downgrade to a read lock to read off the variables */
+	if (swork->data_lock_p)
+		cg_dwlock(swork->data_lock_p);
+
+	__gen_stratum_works_data(&work, 1, swork, nonce1);
+
+	if (swork->data_lock_p)
+		cg_runlock(swork->data_lock_p);
+
+	gen_stratum_work_finish(work);
+}
+
 void request_work(struct thr_info *thr)
 {
 	struct cgpu_info *cgpu = thr->cgpu;
@@ -8801,8 +9460,8 @@ void request_work(struct thr_info *thr)
 	cgtime(&dev_stats->_get_start);
 }
 
-// FIXME: Make this non-blocking (and remove HACK above)
-struct work *get_work(struct thr_info *thr)
+static
+struct work *_get_work(struct thr_info * const thr, struct thr_info * const notify_thr)
 {
 	const int thr_id = thr->id;
 	struct cgpu_info *cgpu = thr->cgpu;
@@ -8813,7 +9472,12 @@ struct work *get_work(struct thr_info *thr)
 
 	applog(LOG_DEBUG, "%"PRIpreprv": Popping work from get queue to get work", cgpu->proc_repr);
 	while (!work) {
-		work = hash_pop();
+		work = hash_pop(notify_thr);
+		if (unlikely(!work))
+		{
+			applog(LOG_DEBUG, "%"PRIpreprv": No work staged yet", cgpu->proc_repr);
+			return NULL;
+		}
 		if (stale_work(work, false)) {
 			staged_full = false;  // It wasn't really full, since it was stale :(
 			discard_work(work);
@@ -8874,6 +9538,30 @@ struct work *get_work(struct thr_info *thr)
 	return work;
 }
 
+// FIXME: Remove HACK above once all minerloops use try_get_work
+struct work *get_work(struct thr_info *thr)
+{
+	return _get_work(thr, NULL);
+}
+
+/* Like get_work, but never blocks: if nothing is staged, returns NULL and
+ * wakes notify_thr's work_restart_notifier once new work has been staged */
+struct work *try_get_work(struct thr_info * const thr, struct thr_info * const notify_thr)
+{
+	return _get_work(thr, notify_thr);
+}
+
+// Whether notify_thr is still waiting for try_get_work to wake it
+bool try_get_work_waiting(struct thr_info * const notify_thr)
+{
+	bool rv;
+
+	mutex_lock(stgd_lock);
+	rv = notify_thr->_work_waiter;
+	mutex_unlock(stgd_lock);
+	return rv;
+}
+
 static
 void _submit_work_async(struct work *work)
 {
@@ -8899,6 +9587,7 @@ static void submit_work_async2(struct work *work, struct timeval *tv_work_found)
 void inc_hw_errors3(struct thr_info *thr, const struct work *work, const uint32_t *bad_nonce_p, float nonce_diff)
 {
 	struct cgpu_info * const cgpu = thr->cgpu;
+	char repr_json[API_EVENT_STR_SIZE];
 	
 	if (bad_nonce_p)
 	{
@@ -8920,15 +9609,16 @@ void inc_hw_errors3(struct thr_info *thr, const struct work *work, const uint32_
 	}
 	mutex_unlock(&stats_lock);
 
+	api_event(API_EVENT_HWERROR, "\"device\":%s,\"hw_errors\":%d",
+	          api_event_str(repr_json, sizeof(repr_json), cgpu->proc_repr), cgpu->hw_errors);
+
 	if (thr->cgpu->drv->hw_error)
 		thr->cgpu->drv->hw_error(thr);
 }
 
-enum test_nonce2_result hashtest2(struct work *work, bool checktarget)
+static enum test_nonce2_result hashtest2_check(const struct work * const work, const unsigned char * const hash, const bool checktarget)
 {
-	uint32_t *hash2_32 = (uint32_t *)&work->hash[0];
-
-	hash_data(work->hash, work->data);
+	const uint32_t *hash2_32 = (const uint32_t *)hash;
 
 	if (hash2_32[7] != 0)
 		return TNR_BAD;
@@ -8936,12 +9626,19 @@ enum test_nonce2_result hashtest2(struct work *work, bool checktarget)
 	if (!checktarget)
 		return TNR_GOOD;
 
-	if (!hash_target_check_v(work->hash, work->target))
+	if (!hash_target_check_v(hash, work->target))
 		return TNR_HIGH;
 
 	return TNR_GOOD;
 }
 
+enum test_nonce2_result hashtest2(struct work *work, bool checktarget)
+{
+	hash_data(work->hash, work->data);
+
+	return hashtest2_check(work, work->hash, checktarget);
+}
+
 enum test_nonce2_result _test_nonce2(struct work *work, uint32_t nonce, bool checktarget)
 {
 	uint32_t *work_nonce = (uint32_t *)(work->data + 64 + 12);
@@ -8956,36 +9653,73 @@ enum test_nonce2_result _test_nonce2(struct work *work, uint32_t nonce, bool che
 	return hashtest2(work, checktarget);
 }
 
+/* Tests count nonces against the same work at once, using the multi-lane
+ * SHA256 engine. Afterward, work->data and work->hash reflect the last nonce,
+ * just like after calling _test_nonce2 for each in turn. */
+void _test_nonces2(struct work * const work, const uint32_t * const nonces, const unsigned count, const bool checktarget, enum test_nonce2_result * const results)
+{
+	uint32_t *work_nonce = (uint32_t *)(work->data + 64 + 12);
+	uint32_t le_nonce;
+	unsigned i;
+
+	if (unlikely(!count))
+		return;
+
+#ifdef USE_SCRYPT
+	if (opt_scrypt)
+	{
+		for (i = 0; i < count; ++i)
+			results[i] = _test_nonce2(work, nonces[i], checktarget);
+		return;
+	}
+#endif
+
+	unsigned char blkheaders[count][80], hashes[count][32];
+	const unsigned char *pblkheaders[count];
+	unsigned char *phashes[count];
+
+	swap32yes(blkheaders[0], work->data, 80 / 4);
+	for (i = 0; i < count; ++i)
+	{
+		if (i)
+			memcpy(blkheaders[i], blkheaders[0], 76);
+		le_nonce = htole32(nonces[i]);
+		swap32yes(&blkheaders[i][76], &le_nonce, 1);
+		pblkheaders[i] = blkheaders[i];
+		phashes[i] = hashes[i];
+	}
+	sha256d_multi(pblkheaders, 80, phashes, count);
+
+	for (i = 0; i < count; ++i)
+		results[i] = hashtest2_check(work, hashes[i], checktarget);
+
+	*work_nonce = htole32(nonces[count - 1]);
+	memcpy(work->hash, hashes[count - 1], 32);
+}
+
 /* Returns true if nonce for work was a valid share */
 bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
 {
 	return submit_noffset_nonce(thr, work, nonce, 0);
 }
 
-/* Allows drivers to submit work items where the driver has changed the ntime
- * value by noffset. Must be only used with a work protocol that does not ntime
- * roll itself intrinsically to generate work (eg stratum). We do not touch
- * the original work struct, but the copy of it only. */
-bool submit_noffset_nonce(struct thr_info *thr, struct work *work_in, uint32_t nonce,
-			  int noffset)
+static struct work *submit_nonce_prepare(struct thr_info * const thr, struct work * const work_in, const uint32_t nonce, const int noffset)
 {
 	struct work *work = make_work();
 	_copy_work(work, work_in, noffset);
 	
 	uint32_t *work_nonce = (uint32_t *)(work->data + 64 + 12);
-	struct timeval tv_work_found;
-	enum test_nonce2_result res;
-	bool ret = true;
-
-	thread_reportout(thr);
-
-	cgtime(&tv_work_found);
 	*work_nonce = htole32(nonce);
 	work->thr_id = thr->id;
+	
+	return work;
+}
 
-	/* Do one last check before attempting to submit the work */
-	/* Side effect: sets work->data for us */
-	res = test_nonce2(work, nonce);
+/* Accounts for and (if it meets the target) submits a tested nonce, taking
+ * ownership of work */
+static bool submit_tested_nonce(struct thr_info * const thr, struct work *work, const uint32_t nonce, const enum test_nonce2_result res, struct timeval * const tv_work_found)
+{
+	bool ret = true;
 	
 	if (unlikely(res == TNR_BAD))
 		{
@@ -9003,6 +9737,7 @@ bool submit_noffset_nonce(struct thr_info *thr, struct work *work_in, uint32_t n
 	
 	if (noncelog_file)
 		noncelog(work);
+	share_journal_nonce(work);
 	
 	if (res == TNR_HIGH)
 	{
@@ -9013,16 +9748,127 @@ bool submit_noffset_nonce(struct thr_info *thr, struct work *work_in, uint32_t n
 			goto out;
 	}
 	
-	submit_work_async2(work, &tv_work_found);
+	submit_work_async2(work, tv_work_found);
 	work = NULL;  // Taken by submit_work_async2
 out:
 	if (work)
 		free_work(work);
+
+	return ret;
+}
+
+/* Allows drivers to submit work items where the driver has changed the ntime
+ * value by noffset. Must be only used with a work protocol that does not ntime
+ * roll itself intrinsically to generate work (eg stratum). We do not touch
+ * the original work struct, but the copy of it only. */
+bool submit_noffset_nonce(struct thr_info *thr, struct work *work_in, uint32_t nonce,
+			  int noffset)
+{
+	struct work *work;
+	struct timeval tv_work_found;
+	enum test_nonce2_result res;
+	bool ret;
+
+	thread_reportout(thr);
+
+	cgtime(&tv_work_found);
+	work = submit_nonce_prepare(thr, work_in, nonce, noffset);
+
+	/* Do one last check before attempting to submit the work */
+	/* Side effect: sets work->data for us */
+	res = test_nonce2(work, nonce);
+	
+	ret = submit_tested_nonce(thr, work, nonce, res, &tv_work_found);
 	thread_reportin(thr);
 
 	return ret;
 }
 
+/* Like submit_nonce, but the caller decides the test result; the nonce is
+ * still hashed so verification costs the same.  Only for simulated devices,
+ * whose "shares" are accepted by nothing but a stand-in pool */
+bool submit_simulated_nonce(struct thr_info * const thr, struct work * const work_in, const uint32_t nonce, const enum test_nonce2_result res)
+{
+	struct work *work;
+	struct timeval tv_work_found;
+	bool ret;
+
+	thread_reportout(thr);
+
+	cgtime(&tv_work_found);
+	work = submit_nonce_prepare(thr, work_in, nonce, 0);
+	test_nonce2(work, nonce);
+
+	ret = submit_tested_nonce(thr, work, nonce, res, &tv_work_found);
+	thread_reportin(thr);
+
+	return ret;
+}
+
+static void _submit_nonces(struct thr_info * const * const thrs, struct work * const * const works_in, const uint32_t * const nonces, unsigned char * const * const hashes, const unsigned count, bool * const results)
+{
+	struct timeval tv_work_found;
+	enum test_nonce2_result res;
+	unsigned i;
+	bool ret;
+
+	if (unlikely(!count))
+		return;
+
+	struct work *works[count];
+	const unsigned char *pdatas[count];
+	unsigned char *phashes[count];
+
+	cgtime(&tv_work_found);
+	for (i = 0; i < count; ++i)
+	{
+		thread_reportout(thrs[i]);
+		works[i] = submit_nonce_prepare(thrs[i], works_in[i], nonces[i], 0);
+		pdatas[i] = works[i]->data;
+		phashes[i] = works[i]->hash;
+	}
+
+#ifdef USE_SCRYPT
+	if (!opt_scrypt)
+#endif
+	{
+		if (hashes)
+			for (i = 0; i < count; ++i)
+				memcpy(phashes[i], hashes[i], 32);
+		else
+			hash_data_multi(phashes, pdatas, count);
+	}
+
+	for (i = 0; i < count; ++i)
+	{
+#ifdef USE_SCRYPT
+		if (opt_scrypt)
+			res = test_nonce2(works[i], nonces[i]);
+		else
+#endif
+			res = hashtest2_check(works[i], works[i]->hash, true);
+		ret = submit_tested_nonce(thrs[i], works[i], nonces[i], res, &tv_work_found);
+		if (results)
+			results[i] = ret;
+		thread_reportin(thrs[i]);
+	}
+}
+
+/* Submits count nonces found by a single device poll, each for its own thread
+ * and work, verifying them together in one multi-lane hashing pass.
+ * results[i] (if results is not NULL) is set as submit_nonce would return. */
+void submit_nonces(struct thr_info * const * const thrs, struct work * const * const works_in, const uint32_t * const nonces, const unsigned count, bool * const results)
+{
+	_submit_nonces(thrs, works_in, nonces, NULL, count, results);
+}
+
+/* Like submit_nonces, for callers that have already hashed the nonces (with
+ * hash_data_multi) for checks of their own */
+void submit_hashed_nonces(struct thr_info * const * const thrs, struct work * const * const works_in, const uint32_t * const nonces, unsigned char * const * const hashes, const unsigned count, bool * const results)
+{
+	_submit_nonces(thrs, works_in, nonces, hashes, count, results);
+}
+
 bool abandon_work(struct work *work, struct timeval *wdiff, uint64_t hashes)
 {
 	if (wdiff->tv_sec > opt_scantime ||
@@ -9098,6 +9944,11 @@ static void fill_queue(struct thr_info *mythr, struct cgpu_info *cgpu, struct de
 /* Add a work item to a cgpu's queued hashlist */
 void __add_queued(struct cgpu_info *cgpu, struct work *work)
 {
+	struct timeval tv_now;
+
+	// Queued work is as good as started, since the driver hands it to the device itself
+	timer_set_now(&tv_now);
+	record_latency(cgpu, work->pool, LATENCY_STAGE_TO_START, &work->tv_staged, &tv_now);
 	cgpu->queued_count++;
 	HASH_ADD_INT(cgpu->queued_work, id, work);
 }
@@ -9832,6 +10683,7 @@ static void *watchdog_thread(void __maybe_unused *userdata)
 		discard_stale();
 
 		hashmeter(-1, &zero_tv, 0);
+		stats_snapshot_publish();
 
 #ifdef HAVE_CURSES
 		const int ts = total_staged();
@@ -9904,6 +10756,7 @@ void bfg_watchdog(struct cgpu_info * const cgpu, struct timeval * const tvp_now)
 			struct thr_info *thr = cgpu->thr[0];
 			enum dev_enable *denable;
 			char *dev_str = cgpu->proc_repr;
+			char repr_json[API_EVENT_STR_SIZE];
 			int gpu;
 
 			if (likely(drv_ready(cgpu)))
@@ -9990,12 +10843,15 @@ void bfg_watchdog(struct cgpu_info * const cgpu, struct timeval * const tvp_now)
 			if (cgpu->status != LIFE_WELL && (tvp_now->tv_sec - thr->last.tv_sec < WATCHDOG_SICK_TIME)) {
 				if (likely(cgpu->status != LIFE_INIT && cgpu->status != LIFE_INIT2))
 				applog(LOG_ERR, "%s: Recovered, declaring WELL!", dev_str);
+				if (likely(cgpu->status != LIFE_INIT && cgpu->status != LIFE_INIT2))
+					api_event(API_EVENT_DEVICE, "\"device\":%s,\"status\":\"Alive\"", api_event_str(repr_json, sizeof(repr_json), dev_str));
 				cgpu->status = LIFE_WELL;
 				cgpu->device_last_well = time(NULL);
 			} else if (cgpu->status == LIFE_WELL && (tvp_now->tv_sec - thr->last.tv_sec > WATCHDOG_SICK_TIME)) {
 				thr->rolling = cgpu->rolling = 0;
 				cgpu->status = LIFE_SICK;
 				applog(LOG_ERR, "%s: Idle for more than 60 seconds, declaring SICK!", dev_str);
+				api_event(API_EVENT_DEVICE, "\"device\":%s,\"status\":\"Sick\"", api_event_str(repr_json, sizeof(repr_json), dev_str));
 				cgtime(&thr->sick);
 
 				dev_error(cgpu, REASON_DEV_SICK_IDLE_60);
@@ -10014,6 +10870,7 @@ void bfg_watchdog(struct cgpu_info * const cgpu, struct timeval * const tvp_now)
 			} else if (cgpu->status == LIFE_SICK && (tvp_now->tv_sec - thr->last.tv_sec > WATCHDOG_DEAD_TIME)) {
 				cgpu->status = LIFE_DEAD;
 				applog(LOG_ERR, "%s: Not responded for more than 10 minutes, declaring DEAD!", dev_str);
+				api_event(API_EVENT_DEVICE, "\"device\":%s,\"status\":\"Dead\"", api_event_str(repr_json, sizeof(repr_json), dev_str));
 				cgtime(&thr->sick);
 
 				dev_error(cgpu, REASON_DEV_DEAD_IDLE_600);
@@ -10170,6 +11027,7 @@ void _bfg_clean_up(bool restarting)
 #ifdef WIN32
 	timeEndPeriod(1);
 #endif
+	logging_stop();
 	if (!restarting) {
 		/* Attempting to disable curses or print a summary during a
 		 * restart can lead to a deadlock. */
@@ -10192,6 +11050,9 @@ void _bfg_clean_up(bool restarting)
 
 void _quit(int status)
 {
+	// Output anything still queued, before exit or the deliberate segfault
+	logging_stop();
+
 	if (status) {
 		const char *ev = getenv("__BFGMINER_SEGFAULT_ERRQUIT");
 		if (unlikely(ev && ev[0] && ev[0] != '0')) {
@@ -10506,6 +11367,7 @@ void register_device(struct cgpu_info *cgpu)
 #endif
 
 	rwlock_init(&cgpu->qlock);
+	lock_stats_register(&cgpu->qlock, "qlock");
 	cgpu->queued_work = NULL;
 }
 
@@ -11307,7 +12169,8 @@ int main(int argc, char *argv[])
 	mutex_init(&console_lock);
 	cglock_init(&control_lock);
 	mutex_init(&stats_lock);
-	mutex_init(&sharelog_lock);
+	lock_stats_register_cglock(&control_lock, "control_lock");
+	lock_stats_register(&stats_lock, "stats_lock");
 	cglock_init(&ch_lock);
 	mutex_init(&sshare_lock);
 	rwlock_init(&blk_lock);
@@ -11379,6 +12242,7 @@ int main(int argc, char *argv[])
 	strcpy(current_block, block->hash);
 
 	mutex_init(&submitting_lock);
+	lock_stats_register(&submitting_lock, "submitting_lock");
 
 #ifdef HAVE_OPENCL
 	memset(gpus, 0, sizeof(gpus));
@@ -11515,6 +12379,11 @@ int main(int argc, char *argv[])
 		set_scrypt_algo(&opt_algo);
 	else
 #endif
+	if (opt_benchmark_algos) {
+		cpu_benchmark_algos();
+		exit(0);
+	}
+	else
 	if (0 <= opt_bench_algo) {
 		double rate = bench_algo_stage3(opt_bench_algo);
 
@@ -11662,6 +12531,9 @@ int main(int argc, char *argv[])
 			fork_monitor();
 	#endif // defined(unix)
 
+	logging_start();
+	stratum_replay_start();
+
 	mining_thr = calloc(mining_threads, sizeof(thr));
 	if (!mining_thr)
 		quit(1, "Failed to calloc mining_thr");
@@ -11683,6 +12555,7 @@ int main(int argc, char *argv[])
 		quit(1, "Failed to create getq");
 	/* We use the getq mutex as the staged lock */
 	stgd_lock = &getq->mutex;
+	lock_stats_register(stgd_lock, "stgd_lock");
 
 	if (opt_benchmark)
 		goto begin_bench;
@@ -11906,9 +12779,20 @@ retry:
 				pool = altpool;
 				goto retry;
 			}
-			gen_stratum_work(pool, work);
-			applog(LOG_DEBUG, "Generated stratum work");
-			stage_work(work);
+			int batch = max_staged + 1 - ts;
+			if (batch > STRATUM_WORK_BATCH_MAX)
+				batch = STRATUM_WORK_BATCH_MAX;
+			else
+			if (batch < 1)
+				batch = 1;
+			struct work *works[batch];
+			works[0] = work;
+			for (int i = 1; i < batch; ++i)
+				works[i] = make_work();
+			gen_stratum_works(pool, works, batch);
+			applog(LOG_DEBUG, "Generated %d stratum work", batch);
+			for (int i = 0; i < batch; ++i)
+				stage_work(works[i]);
 			continue;
 		}
 
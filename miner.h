@@ -403,6 +403,17 @@ enum {
 	MSG_POOLPRIO	= 73,
 };
 
+// Stages of a share's life timed in each cgminer_stats
+enum latency_kind {
+	LATENCY_GETWORK,          // work request to reply (pools only)
+	LATENCY_STAGE_TO_START,   // work staged to a processor starting it
+	LATENCY_FOUND_TO_SUBMIT,  // nonce found to share sent
+	LATENCY_SUBMIT_TO_REPLY,  // share sent to pool's response
+	LATENCY_KINDS
+};
+
+extern const char * const latency_kind_names[LATENCY_KINDS];
+
 struct cgminer_stats {
 	struct timeval start_tv;
 	
@@ -412,6 +423,8 @@ struct cgminer_stats {
 	struct timeval getwork_wait_min;
 
 	struct timeval _get_start;
+
+	struct latency_hist latency[LATENCY_KINDS];
 };
 
 // Just the actual network getworks to the pool
@@ -660,6 +673,12 @@ struct thr_info {
 	struct work *work_list;
 	bool queue_full;
 
+	// Used by try_get_work (protected by stgd_lock)
+	bool _work_waiter;
+	struct thr_info *_next_work_waiter;
+	// Set by minerloop_async while waiting for try_get_work to succeed
+	bool _work_wanted;
+
 	bool	work_restart;
 	notifier_t work_restart_notifier;
 };
@@ -757,8 +776,18 @@ extern void bfg_watchdog(struct cgpu_info *, struct timeval *tvp_now);
 
 extern void _quit(int status);
 
+/* With --lock-stats, locks registered with lock_stats_register are timed
+ * whenever they have to be waited for */
+extern bool opt_lock_stats;
+extern void _lock_stats_mutex_lock(pthread_mutex_t *);
+extern void _lock_stats_wr_lock(pthread_rwlock_t *);
+extern void _lock_stats_rd_lock(pthread_rwlock_t *);
+
 static inline void mutex_lock(pthread_mutex_t *lock)
 {
+	if (unlikely(opt_lock_stats))
+		_lock_stats_mutex_lock(lock);
+	else
 	if (unlikely(pthread_mutex_lock(lock)))
 		quit(1, "WTF MUTEX ERROR ON LOCK!");
 }
@@ -782,12 +811,18 @@ static inline int mutex_trylock(pthread_mutex_t *lock)
 
 static inline void wr_lock(pthread_rwlock_t *lock)
 {
+	if (unlikely(opt_lock_stats))
+		_lock_stats_wr_lock(lock);
+	else
 	if (unlikely(pthread_rwlock_wrlock(lock)))
 		quit(1, "WTF WRLOCK ERROR ON LOCK!");
 }
 
 static inline void rd_lock(pthread_rwlock_t *lock)
 {
+	if (unlikely(opt_lock_stats))
+		_lock_stats_rd_lock(lock);
+	else
 	if (unlikely(pthread_rwlock_rdlock(lock)))
 		quit(1, "WTF RDLOCK ERROR ON LOCK!");
 }
@@ -924,6 +959,29 @@ static inline void cg_wunlock(cglock_t *lock)
 	mutex_unlock(&lock->mutex);
 }
 
+extern void lock_stats_register(const void *lock, const char *name);
+extern void lock_stats_register_cglock(cglock_t *, const char *name);
+
+struct lock_stats_snapshot {
+	const char *name;
+	uint64_t acquisitions;
+	uint64_t waits;
+	double wait_secs;
+	double max_wait_secs;
+};
+
+struct thread_role_snapshot {
+	char role[0x10];
+	int threads;
+	// Negative where per-thread CPU clocks are not available
+	double cpu_secs;
+};
+
+extern int lock_stats_get(struct lock_stats_snapshot *, int max);
+extern int thread_role_stats_get(struct thread_role_snapshot *, int max);
+extern void lock_stats_zero(void);
+extern void thread_role_start(const char *name);
+
 struct pool;
 
 #define API_MCAST_CODE "FTW"
@@ -931,6 +989,7 @@ struct pool;
 
 extern bool opt_protocol;
 extern bool opt_dev_protocol;
+extern bool opt_benchmark;
 extern char *opt_coinbase_sig;
 extern char *request_target_str;
 extern bool have_longpoll;
@@ -948,6 +1007,13 @@ extern bool have_libusb;
 #endif
 extern int httpsrv_port;
 extern int stratumsrv_port;
+extern int opt_stratumsrv_threads;
+extern int opt_stratumsrv_verify_threads;
+extern int opt_stratumsrv_xnonce1_size;
+extern int opt_stratumsrv_loadtest_clients;
+extern float opt_stratumsrv_share_rate;
+extern float opt_stratumsrv_loadtest_rate;
+extern void stratumsrv_loadtest_start(void);
 extern char *opt_api_allow;
 extern bool opt_api_mcast;
 extern char *opt_api_mcast_addr;
@@ -1057,6 +1123,27 @@ extern int set_memoryclock(int gpu, int iMemoryClock);
 
 extern void api(int thr_id);
 
+// Events pushed to API clients that used the "subscribe" command
+enum api_event_type {
+	API_EVENT_SHARE    = 1 << 0,
+	API_EVENT_BLOCK    = 1 << 1,
+	API_EVENT_POOL     = 1 << 2,
+	API_EVENT_DEVICE   = 1 << 3,
+	API_EVENT_HWERROR  = 1 << 4,
+};
+
+// Types someone is subscribed to; nothing is formatted for the rest
+extern volatile unsigned api_event_mask;
+// Quotes and escapes str as a JSON string, cut short to fit bufsz (at least 3)
+#define API_EVENT_STR_SIZE  0x40
+extern const char *api_event_str(char *buf, size_t bufsz, const char *str);
+extern void _api_event(enum api_event_type, const char *fmt, ...) FORMAT_SYNTAX_CHECK(printf, 2, 3);
+// fmt gives the JSON members following "event" and "when"; strings go through api_event_str
+#define api_event(type, ...)  do {  \
+	if (unlikely(api_event_mask & (type)))  \
+		_api_event(type, __VA_ARGS__);  \
+} while (0)
+
 extern struct pool *current_pool(void);
 extern int enabled_pools;
 extern bool get_intrange(const char *arg, int *val1, int *val2);
@@ -1143,6 +1230,102 @@ extern double current_diff;
 extern uint64_t best_diff;
 extern time_t block_time;
 
+/* Point-in-time copy of the counters reported by the API, published
+ * periodically so readers need not take hash_lock or stats_lock */
+// Cumulative histogram of a latency_hist, at the bounds in latency_snapshot_bounds_us
+#define LATENCY_SNAPSHOT_BOUNDS  17
+extern const uint64_t latency_snapshot_bounds_us[LATENCY_SNAPSHOT_BOUNDS];
+
+struct latency_snapshot {
+	uint64_t count;
+	double sum_secs;
+	uint64_t le[LATENCY_SNAPSHOT_BOUNDS];
+};
+
+struct cgpu_snapshot {
+	struct cgpu_info *cgpu;
+	enum dev_enable deven;
+	enum alive status;
+	float temp;
+	double runtime;
+	double total_mhashes;
+	double rolling;
+	double utility;
+	int accepted;
+	int rejected;
+	int stale;
+	int hw_errors;
+	double diff1;
+	double bad_diff1;
+	double diff_accepted;
+	double diff_rejected;
+	double diff_stale;
+	int last_share_pool;
+	time_t last_share_pool_time;
+	double last_share_diff;
+	time_t last_device_valid_work;
+	struct latency_snapshot latency[LATENCY_KINDS];
+};
+
+struct pool_snapshot {
+	struct pool *pool;
+	int accepted;
+	int rejected;
+	int works;
+	unsigned int getwork_requested;
+	unsigned int discarded_work;
+	unsigned int stale_shares;
+	unsigned int getfail_occasions;
+	unsigned int remotefail_occasions;
+	time_t last_share_time;
+	double diff1;
+	double diff_accepted;
+	double diff_rejected;
+	double diff_stale;
+	double last_share_diff;
+	uint64_t best_diff;
+	struct latency_snapshot latency[LATENCY_KINDS];
+};
+
+struct stats_snapshot {
+	int refs;
+	struct timeval tv_taken;
+
+	double total_secs;
+	double total_mhashes_done;
+	double total_rolling;
+	unsigned int found_blocks;
+	int total_getworks;
+	int total_accepted;
+	int total_rejected;
+	int hw_errors;
+	int total_discarded;
+	int total_stale;
+	unsigned int total_go;
+	unsigned int local_work;
+	unsigned int total_ro;
+	unsigned int new_blocks;
+	double total_diff1;
+	double total_bad_diff1;
+	double total_diff_accepted;
+	double total_diff_rejected;
+	double total_diff_stale;
+	uint64_t best_diff;
+	time_t last_getwork;
+	int staged;
+
+	// Indexed by cgminer_id
+	int total_devices;
+	struct cgpu_snapshot *devices;
+	// Indexed by pool_no
+	int total_pools;
+	struct pool_snapshot *pools;
+};
+
+extern void stats_snapshot_publish(void);
+extern struct stats_snapshot *stats_snapshot_get(void);
+extern void stats_snapshot_put(struct stats_snapshot *);
+
 #ifdef HAVE_OPENCL
 typedef struct {
 	cl_uint ctx_a; cl_uint ctx_b; cl_uint ctx_c; cl_uint ctx_d;
@@ -1207,6 +1390,10 @@ struct stratum_work {
 	int merkles;
 	bytes_t merkle_bin;
 	
+	// SHA256 state after the first coinbase_midstate_len bytes of coinbase
+	uint32_t coinbase_midstate[8];
+	size_t coinbase_midstate_len;
+	
 	uint8_t header1[36];
 	uint8_t diffbits[4];
 	uint32_t ntime;
@@ -1308,6 +1495,10 @@ struct pool {
 	SOCKETTYPE sock;
 	char *sockbuf;
 	size_t sockbuf_size;
+	size_t sockbuf_off;      /* start of unread data in sockbuf */
+	size_t sockbuf_len;      /* length of unread data */
+	size_t sockbuf_scanned;  /* unread bytes known to have no newline */
+	bytes_t sendbuf;
 	char *sockaddr_url; /* stripped url used for sockaddr */
 	char *nonce1;
 	size_t n1_len;
@@ -1399,7 +1590,7 @@ struct work {
 	struct timeval	tv_work_found;
 	char		getwork_mode;
 
-	/* Used to queue shares in submit_waiting */
+	/* Used to queue work in the staging lists, and shares in submit_waiting */
 	struct work *prev;
 	struct work *next;
 };
@@ -1408,8 +1599,22 @@ extern void get_datestamp(char *, size_t, time_t);
 #define get_now_datestamp(buf, bufsz)  get_datestamp(buf, bufsz, INVALID_TIMESTAMP)
 extern void stratum_work_cpy(struct stratum_work *dst, const struct stratum_work *src);
 extern void stratum_work_clean(struct stratum_work *);
-extern void gen_stratum_work2(struct work *, struct stratum_work *, const char *nonce1);
+extern void stratum_work_prepare_midstate(struct stratum_work *);
+extern void gen_stratum_work2(struct work *, struct stratum_work *, char *nonce1);
+extern uint64_t work_pool_allocs, work_pool_reuses, work_pool_frees;
+extern int work_pool_size(void);
 extern void inc_hw_errors3(struct thr_info *thr, const struct work *work, const uint32_t *bad_nonce_p, float nonce_diff);
+extern bool opt_share_journal_nonces;
+extern char *share_journal_open(const char *path);
+extern void share_journal_share(const char *disposition, const struct work *);
+extern void share_journal_nonce(const struct work *);
+extern void share_journal_pools_renumbered(void);
+extern FILE *stratum_record_file;
+extern float opt_stratum_replay_speed;
+extern void stratum_record(const struct pool *, const char *line);
+extern char *stratum_replay_prepare(const char *path, int *out_port);
+extern void stratum_replay_start(void);
+extern bool stratum_replay_active(void);
 static inline
 void inc_hw_errors2(struct thr_info * const thr, const struct work * const work, const uint32_t *bad_nonce_p)
 {
@@ -1430,9 +1635,13 @@ enum test_nonce2_result {
 extern enum test_nonce2_result _test_nonce2(struct work *, uint32_t nonce, bool checktarget);
 #define test_nonce(work, nonce, checktarget)  (_test_nonce2(work, nonce, checktarget) == TNR_GOOD)
 #define test_nonce2(work, nonce)  (_test_nonce2(work, nonce, true))
+extern void _test_nonces2(struct work *, const uint32_t *nonces, unsigned count, bool checktarget, enum test_nonce2_result *results);
 extern bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce);
 extern bool submit_noffset_nonce(struct thr_info *thr, struct work *work, uint32_t nonce,
 			  int noffset);
+extern bool submit_simulated_nonce(struct thr_info *, struct work *, uint32_t nonce, enum test_nonce2_result);
+extern void submit_nonces(struct thr_info * const *thrs, struct work * const *works, const uint32_t *nonces, unsigned count, bool *results);
+extern void submit_hashed_nonces(struct thr_info * const *thrs, struct work * const *works, const uint32_t *nonces, unsigned char * const *hashes, unsigned count, bool *results);
 extern void __add_queued(struct cgpu_info *cgpu, struct work *work);
 extern struct work *get_queued(struct cgpu_info *cgpu);
 extern void add_queued(struct cgpu_info *cgpu, struct work *work);
@@ -1463,6 +1672,7 @@ extern void remove_pool(struct pool *pool);
 extern void write_config(FILE *fcfg);
 extern void zero_bestshare(void);
 extern void zero_stats(void);
+extern void record_latency(struct cgpu_info *, struct pool *, enum latency_kind, const struct timeval *tvp_from, const struct timeval *tvp_to);
 extern void default_save_file(char *filename);
 extern bool _log_curses_only(int prio, const char *datetime, const char *str);
 extern void clear_logwin(void);
@@ -35,6 +35,12 @@
 #include <stdint.h>
 #include <string.h>
 
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+#include "scrypt.h"
+
 typedef struct SHA256Context {
 	uint32_t state[8];
 	uint32_t buf[16];
@@ -354,6 +360,105 @@ salsa20_8(uint32_t B[16], const uint32_t Bx[16])
 	B[15] += x15;
 }
 
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define USE_SCRYPT_MULTI
+typedef uint32_t scrypt_v4 __attribute__((vector_size(16)));
+#if defined(__x86_64__) || defined(__i386__)
+#define USE_SCRYPT_AVX2
+typedef uint32_t scrypt_v8 __attribute__((vector_size(32)));
+#endif
+#endif
+
+#define SCRYPT_MAX_LANES  8
+
+#ifdef USE_SCRYPT_MULTI
+/* salsa20/8 and scrypt_1024_1_1_256_sp for several nonces at once, with each
+ * vector holding the same word of every lane (ie, lane-interleaved) */
+
+#define SROTL(x, n)  (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define SALSA20_8_MULTI_FUNC(name, vec_t, attr)  \
+attr  \
+static inline  \
+void name(vec_t * const B, const vec_t * const Bx)  \
+{  \
+	vec_t x[16];  \
+	int i;  \
+	  \
+	for (i = 0; i < 16; ++i)  \
+		x[i] = (B[i] ^= Bx[i]);  \
+	for (i = 0; i < 8; i += 2) {  \
+		/* Operate on columns. */  \
+		x[ 4] ^= SROTL(x[ 0] + x[12],  7);  x[ 9] ^= SROTL(x[ 5] + x[ 1],  7);  \
+		x[14] ^= SROTL(x[10] + x[ 6],  7);  x[ 3] ^= SROTL(x[15] + x[11],  7);  \
+		x[ 8] ^= SROTL(x[ 4] + x[ 0],  9);  x[13] ^= SROTL(x[ 9] + x[ 5],  9);  \
+		x[ 2] ^= SROTL(x[14] + x[10],  9);  x[ 7] ^= SROTL(x[ 3] + x[15],  9);  \
+		x[12] ^= SROTL(x[ 8] + x[ 4], 13);  x[ 1] ^= SROTL(x[13] + x[ 9], 13);  \
+		x[ 6] ^= SROTL(x[ 2] + x[14], 13);  x[11] ^= SROTL(x[ 7] + x[ 3], 13);  \
+		x[ 0] ^= SROTL(x[12] + x[ 8], 18);  x[ 5] ^= SROTL(x[ 1] + x[13], 18);  \
+		x[10] ^= SROTL(x[ 6] + x[ 2], 18);  x[15] ^= SROTL(x[11] + x[ 7], 18);  \
+		  \
+		/* Operate on rows. */  \
+		x[ 1] ^= SROTL(x[ 0] + x[ 3],  7);  x[ 6] ^= SROTL(x[ 5] + x[ 4],  7);  \
+		x[11] ^= SROTL(x[10] + x[ 9],  7);  x[12] ^= SROTL(x[15] + x[14],  7);  \
+		x[ 2] ^= SROTL(x[ 1] + x[ 0],  9);  x[ 7] ^= SROTL(x[ 6] + x[ 5],  9);  \
+		x[ 8] ^= SROTL(x[11] + x[10],  9);  x[13] ^= SROTL(x[12] + x[15],  9);  \
+		x[ 3] ^= SROTL(x[ 2] + x[ 1], 13);  x[ 4] ^= SROTL(x[ 7] + x[ 6], 13);  \
+		x[ 9] ^= SROTL(x[ 8] + x[11], 13);  x[14] ^= SROTL(x[13] + x[12], 13);  \
+		x[ 0] ^= SROTL(x[ 3] + x[ 2], 18);  x[ 5] ^= SROTL(x[ 4] + x[ 7], 18);  \
+		x[10] ^= SROTL(x[ 9] + x[ 8], 18);  x[15] ^= SROTL(x[14] + x[13], 18);  \
+	}  \
+	for (i = 0; i < 16; ++i)  \
+		B[i] += x[i];  \
+}
+
+/* V must have room for 1024 * 32 vectors */
+#define SCRYPT_MULTI_FUNC(name, salsa, vec_t, lanes, attr)  \
+attr  \
+static  \
+void name(const uint32_t (* const input)[20], vec_t * const V, uint32_t (* const ostate)[8])  \
+{  \
+	vec_t X[32];  \
+	uint32_t Xs[32];  \
+	uint32_t i, j, k, l;  \
+	  \
+	for (l = 0; l < lanes; ++l) {  \
+		PBKDF2_SHA256_80_128(input[l], Xs);  \
+		for (k = 0; k < 32; ++k)  \
+			X[k][l] = Xs[k];  \
+	}  \
+	  \
+	for (i = 0; i < 1024; ++i) {  \
+		memcpy(&V[i * 32], X, sizeof(X));  \
+		salsa(&X[0], &X[16]);  \
+		salsa(&X[16], &X[0]);  \
+	}  \
+	for (i = 0; i < 1024; ++i) {  \
+		for (l = 0; l < lanes; ++l) {  \
+			j = X[16][l] & 1023;  \
+			for (k = 0; k < 32; ++k)  \
+				X[k][l] ^= V[j * 32 + k][l];  \
+		}  \
+		salsa(&X[0], &X[16]);  \
+		salsa(&X[16], &X[0]);  \
+	}  \
+	  \
+	for (l = 0; l < lanes; ++l) {  \
+		for (k = 0; k < 32; ++k)  \
+			Xs[k] = X[k][l];  \
+		PBKDF2_SHA256_80_128_32(input[l], Xs, ostate[l]);  \
+	}  \
+}
+
+SALSA20_8_MULTI_FUNC(salsa20_8_4way, scrypt_v4, )
+SCRYPT_MULTI_FUNC(scrypt_1024_1_1_256_4way, salsa20_8_4way, scrypt_v4, 4, )
+
+#ifdef USE_SCRYPT_AVX2
+SALSA20_8_MULTI_FUNC(salsa20_8_8way, scrypt_v8, __attribute__((target("avx2"))))
+SCRYPT_MULTI_FUNC(scrypt_1024_1_1_256_8way, salsa20_8_8way, scrypt_v8, 8, __attribute__((target("avx2"))))
+#endif
+#endif  /* USE_SCRYPT_MULTI */
+
 /* cpu and memory intensive function to transform a 80 byte buffer into a 32 byte output
    scratchpad size needs to be at least 63 + (128 * r * p) + (256 * r + 64) + (128 * r * N) bytes
  */
@@ -446,6 +551,85 @@ int scrypt_test(unsigned char *pdata, const unsigned char *ptarget, uint32_t non
 	return 1;
 }
 
+bool opt_scrypt_hugepages;
+
+struct scrypt_scratchpad {
+	void *buf;
+	size_t sz;
+	bool hugepages;
+};
+
+/* Scratchpads are allocated once per mining thread (kept in thr->cgpu_data)
+ * and reused by every scanhash_scrypt call */
+static void *scrypt_get_scratchpad(struct thr_info * const thr, const size_t sz)
+{
+	struct scrypt_scratchpad *sp = thr->cgpu_data;
+
+	if (likely(sp && sp->sz >= sz))
+		return sp->buf;
+
+	scrypt_free_scratchpad(thr);
+	sp = calloc(1, sizeof(*sp));
+	if (unlikely(!sp))
+		return NULL;
+
+#ifdef MAP_HUGETLB
+	if (opt_scrypt_hugepages)
+	{
+		const size_t hsz = (sz + 0x1fffff) & ~(size_t)0x1fffff;
+		void * const p = mmap(NULL, hsz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED)
+		{
+			sp->buf = p;
+			sp->sz = hsz;
+			sp->hugepages = true;
+			thr->cgpu_data = sp;
+			return p;
+		}
+		applog(LOG_WARNING, "Failed to allocate scrypt scratchpad from huge pages, using normal memory");
+	}
+#endif
+
+	sp->buf = malloc(sz);
+	if (unlikely(!sp->buf))
+	{
+		free(sp);
+		return NULL;
+	}
+	sp->sz = sz;
+	thr->cgpu_data = sp;
+	return sp->buf;
+}
+
+void scrypt_free_scratchpad(struct thr_info * const thr)
+{
+	struct scrypt_scratchpad * const sp = thr->cgpu_data;
+
+	if (!sp)
+		return;
+#ifdef MAP_HUGETLB
+	if (sp->hugepages)
+		munmap(sp->buf, sp->sz);
+	else
+#endif
+		free(sp->buf);
+	free(sp);
+	thr->cgpu_data = NULL;
+}
+
+static int scrypt_lanes(void)
+{
+#ifdef USE_SCRYPT_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		return 8;
+#endif
+#ifdef USE_SCRYPT_MULTI
+	return 4;
+#else
+	return 1;
+#endif
+}
+
 bool scanhash_scrypt(struct thr_info *thr, const unsigned char __maybe_unused *pmidstate,
 		     unsigned char *pdata, unsigned char __maybe_unused *phash1,
 		     unsigned char __maybe_unused *phash, const unsigned char *ptarget,
@@ -453,33 +637,60 @@ bool scanhash_scrypt(struct thr_info *thr, const unsigned char __maybe_unused *p
 {
 	uint32_t *nonce = (uint32_t *)(pdata + 76);
 	char *scratchbuf;
-	uint32_t data[20];
+	uint32_t data[SCRYPT_MAX_LANES][20];
+	uint32_t ostate[SCRYPT_MAX_LANES][8];
 	uint32_t tmp_hash7;
 	uint32_t Htarg = le32toh(((const uint32_t *)ptarget)[7]);
+	const int lanes = scrypt_lanes();
+	int i;
 	bool ret = false;
 
-	be32enc_vect(data, (const uint32_t *)pdata, 19);
+	be32enc_vect(data[0], (const uint32_t *)pdata, 19);
+	for (i = 1; i < lanes; ++i)
+		memcpy(data[i], data[0], 19 * 4);
 
-	scratchbuf = malloc(SCRATCHBUF_SIZE);
+	if (lanes > 1)
+		// Multi-lane V, plus room to align it
+		scratchbuf = scrypt_get_scratchpad(thr, (lanes * 1024 * 128) + 63);
+	else
+		scratchbuf = scrypt_get_scratchpad(thr, SCRATCHBUF_SIZE);
 	if (unlikely(!scratchbuf)) {
 		applog(LOG_ERR, "Failed to malloc scratchbuf in scanhash_scrypt");
 		return ret;
 	}
 
 	while(1) {
-		uint32_t ostate[8];
-
-		*nonce = ++n;
-		data[19] = htobe32(n);
-		scrypt_1024_1_1_256_sp(data, scratchbuf, ostate);
-		tmp_hash7 = be32toh(ostate[7]);
+		for (i = 0; i < lanes; ++i)
+			data[i][19] = htobe32(n + 1 + i);
+
+		switch (lanes)
+		{
+#ifdef USE_SCRYPT_AVX2
+			case 8:
+				scrypt_1024_1_1_256_8way((const uint32_t (*)[20])data, (void *)(((uintptr_t)(scratchbuf) + 63) & ~(uintptr_t)63), ostate);
+				break;
+#endif
+#ifdef USE_SCRYPT_MULTI
+			case 4:
+				scrypt_1024_1_1_256_4way((const uint32_t (*)[20])data, (void *)(((uintptr_t)(scratchbuf) + 63) & ~(uintptr_t)63), ostate);
+				break;
+#endif
+			default:
+				scrypt_1024_1_1_256_sp(data[0], scratchbuf, ostate[0]);
+		}
 
-		if (unlikely(tmp_hash7 <= Htarg)) {
-			((uint32_t *)pdata)[19] = htobe32(n);
-			*last_nonce = n;
-			ret = true;
-			break;
+		for (i = 0; i < lanes; ++i)
+		{
+			++n;
+			tmp_hash7 = be32toh(ostate[i][7]);
+			if (unlikely(tmp_hash7 <= Htarg)) {
+				*nonce = n;
+				((uint32_t *)pdata)[19] = htobe32(n);
+				*last_nonce = n;
+				return true;
+			}
 		}
+		*nonce = n;
 
 		if (unlikely((n >= max_nonce) || thr->work_restart)) {
 			*last_nonce = n;
@@ -487,6 +698,5 @@ bool scanhash_scrypt(struct thr_info *thr, const unsigned char __maybe_unused *p
 		}
 	}
 
-	free(scratchbuf);;
 	return ret;
 }
@@ -9,6 +9,9 @@
 extern int scrypt_test(unsigned char *pdata, const unsigned char *ptarget,
 			uint32_t nonce);
 extern void scrypt_regenhash(struct work *work);
+extern void scrypt_free_scratchpad(struct thr_info *);
+
+extern bool opt_scrypt_hugepages;
 
 #else /* USE_SCRYPT */
 static inline int scrypt_test(__maybe_unused unsigned char *pdata,
@@ -96,6 +96,13 @@ void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
 
     int j;
 
+#ifdef USE_SHA256_SHANI
+    if (sha256_shani_available()) {
+        sha256_shani_transf(ctx->h, message, block_nb);
+        return;
+    }
+#endif
+
     for (i = 0; i < (int) block_nb; i++) {
         sub_block = message + (i << 6);
 
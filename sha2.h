@@ -34,6 +34,7 @@
 
 #include "config.h"
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "miner.h"
@@ -70,4 +71,19 @@ void sha256_final(sha256_ctx *ctx, unsigned char *digest);
 void sha256(const unsigned char *message, unsigned int len,
             unsigned char *digest);
 
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && __GNUC__ >= 5
+#define USE_SHA256_SHANI
+/* SHA extensions block transform (sha256_shani.c), used by sha256_transf when
+ * the CPU supports it */
+bool sha256_shani_available(void);
+void sha256_shani_transf(uint32_t *h, const unsigned char *message,
+                         unsigned int block_nb);
+#endif
+
+/* Multi-lane hashing of count equal-length messages (sha256_multi.c) */
+void sha256_multi(const unsigned char * const *messages, unsigned int len,
+                  unsigned char * const *digests, unsigned int count);
+void sha256d_multi(const unsigned char * const *messages, unsigned int len,
+                   unsigned char * const *digests, unsigned int count);
+
 #endif /* !SHA2_H */
@@ -0,0 +1,229 @@
+/*
+ * Copyright 2026 agent
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+// 8-way AVX2 and 16-way AVX-512 SHA-256 scanhash
+
+#include "config.h"
+
+#include "driver-cpu.h"
+
+#if defined(WANT_AVX2_8WAY) || defined(WANT_AVX512_16WAY)
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "miner.h"
+#include "util.h"
+
+extern uint32_t sha256_k[64];
+
+static const uint32_t sha256_avx_init_state[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+/* Work constant for every nonce scanned, precalculated once per call in the
+ * same way as precalc_hash (findnonce.c) does for OpenCL kernels */
+struct sha256_avx_precalc {
+	uint32_t midstate[8];
+	uint32_t state3[8];  // state after the nonce-independent rounds 0-2
+	uint32_t T1_3;       // round 3 T1, less the nonce
+	uint32_t W[18];      // chunk 2 message schedule (W3 is the nonce)
+};
+
+#define AROTR(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+#define ACH(x, y, z)   ((z) ^ ((x) & ((y) ^ (z))))
+#define AMAJ(x, y, z)  (((x) & (y)) | ((z) & ((x) | (y))))
+#define ASUM0(x)  (AROTR(x,  2) ^ AROTR(x, 13) ^ AROTR(x, 22))
+#define ASUM1(x)  (AROTR(x,  6) ^ AROTR(x, 11) ^ AROTR(x, 25))
+#define ASIG0(x)  (AROTR(x,  7) ^ AROTR(x, 18) ^ ((x) >>  3))
+#define ASIG1(x)  (AROTR(x, 17) ^ AROTR(x, 19) ^ ((x) >> 10))
+
+#define AROUND(a, b, c, d, e, f, g, h, i, w)  do {  \
+	T1 = h + ASUM1(e) + ACH(e, f, g) + sha256_k[i] + (w);  \
+	d += T1;  \
+	h = T1 + ASUM0(a) + AMAJ(a, b, c);  \
+} while (0)
+
+#define AROUNDS8(i, W)  do {  \
+	AROUND(a, b, c, d, e, f, g, h, (i) + 0, W[(i) + 0]);  \
+	AROUND(h, a, b, c, d, e, f, g, (i) + 1, W[(i) + 1]);  \
+	AROUND(g, h, a, b, c, d, e, f, (i) + 2, W[(i) + 2]);  \
+	AROUND(f, g, h, a, b, c, d, e, (i) + 3, W[(i) + 3]);  \
+	AROUND(e, f, g, h, a, b, c, d, (i) + 4, W[(i) + 4]);  \
+	AROUND(d, e, f, g, h, a, b, c, (i) + 5, W[(i) + 5]);  \
+	AROUND(c, d, e, f, g, h, a, b, (i) + 6, W[(i) + 6]);  \
+	AROUND(b, c, d, e, f, g, h, a, (i) + 7, W[(i) + 7]);  \
+} while (0)
+
+static
+void sha256_avx_precalc(struct sha256_avx_precalc * const pre, const uint32_t * const midstate, const uint32_t * const data)
+{
+	uint32_t a, b, c, d, e, f, g, h, T1;
+	int i;
+
+	memcpy(pre->midstate, midstate, sizeof(pre->midstate));
+	for (i = 0; i < 16; ++i)
+		pre->W[i] = data[i];
+	pre->W[16] = ASIG1(pre->W[14]) + pre->W[ 9] + ASIG0(pre->W[1]) + pre->W[0];
+	pre->W[17] = ASIG1(pre->W[15]) + pre->W[10] + ASIG0(pre->W[2]) + pre->W[1];
+
+	a = midstate[0];  b = midstate[1];  c = midstate[2];  d = midstate[3];
+	e = midstate[4];  f = midstate[5];  g = midstate[6];  h = midstate[7];
+	AROUND(a, b, c, d, e, f, g, h, 0, pre->W[0]);
+	AROUND(h, a, b, c, d, e, f, g, 1, pre->W[1]);
+	AROUND(g, h, a, b, c, d, e, f, 2, pre->W[2]);
+	pre->state3[0] = a;  pre->state3[1] = b;  pre->state3[2] = c;  pre->state3[3] = d;
+	pre->state3[4] = e;  pre->state3[5] = f;  pre->state3[6] = g;  pre->state3[7] = h;
+
+	// Round 3 is AROUND(f, g, h, a, b, c, d, e, 3, nonce)
+	pre->T1_3 = e + ASUM1(b) + ACH(b, c, d) + sha256_k[3];
+}
+
+/* Double-SHA256s the lanes of nonces, leaving the final state in out. Unless
+ * full is set, only out[7] is produced: the last 3 rounds don't affect it, and
+ * it is all we need to rule out a share. */
+#define SHA256_AVX_HASH_FUNC(name, vec_t, attr)  \
+attr  \
+static inline  \
+void name(vec_t * const out, const struct sha256_avx_precalc * const pre, const vec_t nonces, const bool full)  \
+{  \
+	vec_t W[64], a, b, c, d, e, f, g, h, T1;  \
+	int i;  \
+	  \
+	/* First hash: second chunk of the block header, resuming at round 3 */  \
+	for (i = 0; i < 18; ++i)  \
+		W[i] = (vec_t){0} + pre->W[i];  \
+	W[3] = nonces;  \
+	for (i = 18; i < 64; ++i)  \
+		W[i] = ASIG1(W[i - 2]) + W[i - 7] + ASIG0(W[i - 15]) + W[i - 16];  \
+	a = (vec_t){0} + pre->state3[0];  b = (vec_t){0} + pre->state3[1];  \
+	c = (vec_t){0} + pre->state3[2];  d = (vec_t){0} + pre->state3[3];  \
+	e = (vec_t){0} + pre->state3[4];  f = (vec_t){0} + pre->state3[5];  \
+	g = (vec_t){0} + pre->state3[6];  h = (vec_t){0} + pre->state3[7];  \
+	T1 = nonces + pre->T1_3;  \
+	a += T1;  \
+	e = T1 + ASUM0(f) + AMAJ(f, g, h);  \
+	AROUND(e, f, g, h, a, b, c, d, 4, W[4]);  \
+	AROUND(d, e, f, g, h, a, b, c, 5, W[5]);  \
+	AROUND(c, d, e, f, g, h, a, b, 6, W[6]);  \
+	AROUND(b, c, d, e, f, g, h, a, 7, W[7]);  \
+	for (i = 8; i < 64; i += 8)  \
+		AROUNDS8(i, W);  \
+	  \
+	/* Second hash: the first digest, padded */  \
+	W[0] = a + pre->midstate[0];  W[1] = b + pre->midstate[1];  \
+	W[2] = c + pre->midstate[2];  W[3] = d + pre->midstate[3];  \
+	W[4] = e + pre->midstate[4];  W[5] = f + pre->midstate[5];  \
+	W[6] = g + pre->midstate[6];  W[7] = h + pre->midstate[7];  \
+	W[8] = (vec_t){0} + 0x80000000;  \
+	for (i = 9; i < 15; ++i)  \
+		W[i] = (vec_t){0};  \
+	W[15] = (vec_t){0} + 0x100;  \
+	for (i = 16; i < 61; ++i)  \
+		W[i] = ASIG1(W[i - 2]) + W[i - 7] + ASIG0(W[i - 15]) + W[i - 16];  \
+	a = (vec_t){0} + sha256_avx_init_state[0];  b = (vec_t){0} + sha256_avx_init_state[1];  \
+	c = (vec_t){0} + sha256_avx_init_state[2];  d = (vec_t){0} + sha256_avx_init_state[3];  \
+	e = (vec_t){0} + sha256_avx_init_state[4];  f = (vec_t){0} + sha256_avx_init_state[5];  \
+	g = (vec_t){0} + sha256_avx_init_state[6];  h = (vec_t){0} + sha256_avx_init_state[7];  \
+	for (i = 0; i < 56; i += 8)  \
+		AROUNDS8(i, W);  \
+	AROUND(a, b, c, d, e, f, g, h, 56, W[56]);  \
+	AROUND(h, a, b, c, d, e, f, g, 57, W[57]);  \
+	AROUND(g, h, a, b, c, d, e, f, 58, W[58]);  \
+	AROUND(f, g, h, a, b, c, d, e, 59, W[59]);  \
+	AROUND(e, f, g, h, a, b, c, d, 60, W[60]);  \
+	/* h is now final */  \
+	out[7] = h + sha256_avx_init_state[7];  \
+	if (!full)  \
+		return;  \
+	  \
+	for (i = 61; i < 64; ++i)  \
+		W[i] = ASIG1(W[i - 2]) + W[i - 7] + ASIG0(W[i - 15]) + W[i - 16];  \
+	AROUND(d, e, f, g, h, a, b, c, 61, W[61]);  \
+	AROUND(c, d, e, f, g, h, a, b, 62, W[62]);  \
+	AROUND(b, c, d, e, f, g, h, a, 63, W[63]);  \
+	out[0] = a + sha256_avx_init_state[0];  out[1] = b + sha256_avx_init_state[1];  \
+	out[2] = c + sha256_avx_init_state[2];  out[3] = d + sha256_avx_init_state[3];  \
+	out[4] = e + sha256_avx_init_state[4];  out[5] = f + sha256_avx_init_state[5];  \
+	out[6] = g + sha256_avx_init_state[6];  \
+}
+
+#define SHA256_AVX_SCANHASH_FUNC(name, hashfunc, vec_t, lanes, attr)  \
+attr  \
+bool name(struct thr_info * const thr, const unsigned char *pmidstate,  \
+	unsigned char *pdata,  \
+	unsigned char * const phash1, unsigned char * const phash,  \
+	const unsigned char * const ptarget,  \
+	const uint32_t max_nonce, uint32_t * const last_nonce,  \
+	uint32_t nonce)  \
+{  \
+	uint32_t * const hash32 = (uint32_t *)phash;  \
+	uint32_t * const nNonce_p = (uint32_t *)(pdata + 76);  \
+	struct sha256_avx_precalc pre;  \
+	vec_t nonces, out[8];  \
+	int i, j;  \
+	  \
+	pdata += 64;  \
+	  \
+	/* Midstate and data are stored in little endian */  \
+	LOCAL_swap32le(unsigned char, pmidstate, 32/4)  \
+	LOCAL_swap32le(unsigned char, pdata, 64/4)  \
+	sha256_avx_precalc(&pre, (const uint32_t *)pmidstate, (const uint32_t *)pdata);  \
+	  \
+	for (j = 0; j < lanes; ++j)  \
+		nonces[j] = nonce + j;  \
+	  \
+	for (;;)  \
+	{  \
+		hashfunc(out, &pre, nonces, false);  \
+		for (j = 0; j < lanes; ++j)  \
+		{  \
+			if (likely(out[7][j]))  \
+				continue;  \
+			hashfunc(out, &pre, nonces, true);  \
+			for (i = 0; i < 8; ++i)  \
+				hash32[i] = out[i][j];  \
+			if (fulltest(phash, ptarget))  \
+			{  \
+				nonce += j;  \
+				*last_nonce = nonce;  \
+				*nNonce_p = htole32(nonce);  \
+				return true;  \
+			}  \
+		}  \
+		  \
+		if ((nonce >= max_nonce) || thr->work_restart)  \
+		{  \
+			*last_nonce = nonce;  \
+			*nNonce_p = htole32(nonce);  \
+			return false;  \
+		}  \
+		  \
+		nonce += lanes;  \
+		nonces += lanes;  \
+	}  \
+}
+
+#ifdef WANT_AVX2_8WAY
+typedef uint32_t sha256_avx2_vec __attribute__((vector_size(32)));
+
+SHA256_AVX_HASH_FUNC(sha256_avx2_8way_hash, sha256_avx2_vec, __attribute__((target("avx2"))))
+SHA256_AVX_SCANHASH_FUNC(scanhash_avx2_8way, sha256_avx2_8way_hash, sha256_avx2_vec, 8, __attribute__((target("avx2"))))
+#endif
+
+#ifdef WANT_AVX512_16WAY
+typedef uint32_t sha256_avx512_vec __attribute__((vector_size(64)));
+
+SHA256_AVX_HASH_FUNC(sha256_avx512_16way_hash, sha256_avx512_vec, __attribute__((target("avx512f"))))
+SHA256_AVX_SCANHASH_FUNC(scanhash_avx512_16way, sha256_avx512_16way_hash, sha256_avx512_vec, 16, __attribute__((target("avx512f"))))
+#endif
+
+#endif  /* WANT_AVX2_8WAY || WANT_AVX512_16WAY */
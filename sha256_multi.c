@@ -0,0 +1,220 @@
+/*
+ * Copyright 2026 agent
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Multi-lane SHA-256 for hashing many independent, equal-length messages at
+ * once (host-side work generation and nonce verification).  Lanes are
+ * implemented with GCC vector extensions, which compile to SSE2 (4 lanes) or
+ * AVX2 (8 lanes, selected at runtime); anything else falls back to sha256() */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sha2.h"
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#  define USE_SHA256_MULTI_VECTOR
+#  if defined(__x86_64__) || defined(__i386__)
+#    define USE_SHA256_MULTI_AVX2
+#  endif
+#endif
+
+extern uint32_t sha256_h0[8];
+
+#ifdef USE_SHA256_MULTI_VECTOR
+
+typedef uint32_t sha256_v4 __attribute__((vector_size(16)));
+#ifdef USE_SHA256_MULTI_AVX2
+typedef uint32_t sha256_v8 __attribute__((vector_size(32)));
+#endif
+
+#define MSHR(x, n)   ((x) >> (n))
+#define MROTR(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+#define MCH(x, y, z)   (((x) & (y)) ^ (~(x) & (z)))
+#define MMAJ(x, y, z)  (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define MSUM0(x)  (MROTR(x,  2) ^ MROTR(x, 13) ^ MROTR(x, 22))
+#define MSUM1(x)  (MROTR(x,  6) ^ MROTR(x, 11) ^ MROTR(x, 25))
+#define MSIG0(x)  (MROTR(x,  7) ^ MROTR(x, 18) ^ MSHR(x,  3))
+#define MSIG1(x)  (MROTR(x, 17) ^ MROTR(x, 19) ^ MSHR(x, 10))
+
+// One SHA-256 compression of block W (expanded in place) into state s
+#define SHA256_MULTI_COMPRESS(vec_t, s, W)  do {  \
+	vec_t a_ = s[0], b_ = s[1], c_ = s[2], d_ = s[3];  \
+	vec_t e_ = s[4], f_ = s[5], g_ = s[6], h_ = s[7];  \
+	vec_t t1_, t2_;  \
+	int i_;  \
+	for (i_ = 16; i_ < 64; ++i_)  \
+		W[i_] = MSIG1(W[i_ - 2]) + W[i_ - 7] + MSIG0(W[i_ - 15]) + W[i_ - 16];  \
+	for (i_ = 0; i_ < 64; ++i_)  \
+	{  \
+		t1_ = h_ + MSUM1(e_) + MCH(e_, f_, g_) + sha256_k[i_] + W[i_];  \
+		t2_ = MSUM0(a_) + MMAJ(a_, b_, c_);  \
+		h_ = g_;  g_ = f_;  f_ = e_;  e_ = d_ + t1_;  \
+		d_ = c_;  c_ = b_;  b_ = a_;  a_ = t1_ + t2_;  \
+	}  \
+	s[0] += a_;  s[1] += b_;  s[2] += c_;  s[3] += d_;  \
+	s[4] += e_;  s[5] += f_;  s[6] += g_;  s[7] += h_;  \
+} while (0)
+
+// Runs the (double) hash of up to lanes messages through vectors of vec_t
+#define SHA256_MULTI_BODY(vec_t, lanes)  do {  \
+	vec_t s_[8], W_[64];  \
+	uint32_t w_[16 * lanes];  \
+	const unsigned nblocks_ = (len + 9 + 63) / 64;  \
+	unsigned blk_, i_, j_;  \
+	for (i_ = 0; i_ < 8; ++i_)  \
+		s_[i_] = (vec_t){0} + sha256_h0[i_];  \
+	for (blk_ = 0; blk_ < nblocks_; ++blk_)  \
+	{  \
+		sha256_multi_load_block(w_, lanes, msgs, len, blk_, nblocks_);  \
+		memcpy(W_, w_, sizeof(w_));  \
+		SHA256_MULTI_COMPRESS(vec_t, s_, W_);  \
+	}  \
+	if (twice)  \
+	{  \
+		/* The first digest is exactly the state words, already big endian */  \
+		for (i_ = 0; i_ < 8; ++i_)  \
+		{  \
+			W_[i_] = s_[i_];  \
+			s_[i_] = (vec_t){0} + sha256_h0[i_];  \
+		}  \
+		W_[8] = (vec_t){0} + 0x80000000;  \
+		for (i_ = 9; i_ < 15; ++i_)  \
+			W_[i_] = (vec_t){0};  \
+		W_[15] = (vec_t){0} + 0x100;  \
+		SHA256_MULTI_COMPRESS(vec_t, s_, W_);  \
+	}  \
+	for (j_ = 0; j_ < lanes; ++j_)  \
+		for (i_ = 0; i_ < 8; ++i_)  \
+			sha256_multi_store32be(&digests[j_][i_ * 4], s_[i_][j_]);  \
+} while (0)
+
+static inline
+void sha256_multi_store32be(unsigned char * const out, const uint32_t v)
+{
+	out[0] = v >> 0x18;
+	out[1] = v >> 0x10;
+	out[2] = v >>    8;
+	out[3] = v;
+}
+
+/* Fills w with block blkno of every lane's padded message, transposed so each
+ * word index holds one value per lane */
+static
+void sha256_multi_load_block(uint32_t * const w, const unsigned lanes, const unsigned char * const * const msgs, const unsigned len, const unsigned blkno, const unsigned nblocks)
+{
+	const unsigned off = blkno * SHA256_BLOCK_SIZE;
+	unsigned char buf[SHA256_BLOCK_SIZE];
+	unsigned i, j;
+
+	for (j = 0; j < lanes; ++j)
+	{
+		memset(buf, 0, sizeof(buf));
+		if (off < len)
+			memcpy(buf, &msgs[j][off], (len - off < sizeof(buf)) ? (len - off) : sizeof(buf));
+		if (len >= off && len - off < sizeof(buf))
+			buf[len - off] = 0x80;
+		if (blkno == nblocks - 1)
+		{
+			const uint64_t bitlen = (uint64_t)len * 8;
+			for (i = 0; i < 8; ++i)
+				buf[56 + i] = bitlen >> (56 - (i * 8));
+		}
+		for (i = 0; i < 16; ++i)
+			w[(i * lanes) + j] = ((uint32_t)buf[i * 4] << 0x18) | ((uint32_t)buf[i * 4 + 1] << 0x10) | ((uint32_t)buf[i * 4 + 2] << 8) | buf[i * 4 + 3];
+	}
+}
+
+static
+void sha256_multi_4way(const unsigned char * const * const msgs, const unsigned len, unsigned char * const * const digests, const bool twice)
+{
+	SHA256_MULTI_BODY(sha256_v4, 4);
+}
+
+#ifdef USE_SHA256_MULTI_AVX2
+__attribute__((target("avx2")))
+static
+void sha256_multi_8way(const unsigned char * const * const msgs, const unsigned len, unsigned char * const * const digests, const bool twice)
+{
+	SHA256_MULTI_BODY(sha256_v8, 8);
+}
+
+static
+bool sha256_multi_have_avx2(void)
+{
+	static int have_avx2 = -1;
+	if (have_avx2 < 0)
+	{
+		__builtin_cpu_init();
+		have_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+	}
+	return have_avx2;
+}
+#endif
+
+#endif  /* USE_SHA256_MULTI_VECTOR */
+
+static
+void sha256_multi_1way(const unsigned char * const msg, const unsigned len, unsigned char * const digest, const bool twice)
+{
+	unsigned char hash1[SHA256_DIGEST_SIZE];
+
+	if (!twice)
+	{
+		sha256(msg, len, digest);
+		return;
+	}
+	sha256(msg, len, hash1);
+	sha256(hash1, sizeof(hash1), digest);
+}
+
+static
+void _sha256_multi(const unsigned char * const *msgs, const unsigned len, unsigned char * const *digests, unsigned count, const bool twice)
+{
+#ifdef USE_SHA256_MULTI_VECTOR
+#  ifdef USE_SHA256_MULTI_AVX2
+	if (count > 4 && sha256_multi_have_avx2())
+	{
+		for ( ; count >= 8; count -= 8, msgs += 8, digests += 8)
+			sha256_multi_8way(msgs, len, digests, twice);
+	}
+#  endif
+	for ( ; count >= 4; count -= 4, msgs += 4, digests += 4)
+		sha256_multi_4way(msgs, len, digests, twice);
+	if (count > 1)
+	{
+		// Pad a partial group with duplicate lanes, discarding their output
+		const unsigned char *pmsgs[4];
+		unsigned char scratch[4][SHA256_DIGEST_SIZE], *pdigests[4];
+		unsigned i;
+
+		for (i = 0; i < 4; ++i)
+		{
+			pmsgs[i] = msgs[(i < count) ? i : 0];
+			pdigests[i] = (i < count) ? digests[i] : scratch[i];
+		}
+		sha256_multi_4way(pmsgs, len, pdigests, twice);
+		return;
+	}
+#endif
+	for ( ; count; --count, ++msgs, ++digests)
+		sha256_multi_1way(msgs[0], len, digests[0], twice);
+}
+
+void sha256_multi(const unsigned char * const *messages, unsigned int len, unsigned char * const *digests, unsigned int count)
+{
+	_sha256_multi(messages, len, digests, count, false);
+}
+
+void sha256d_multi(const unsigned char * const *messages, unsigned int len, unsigned char * const *digests, unsigned int count)
+{
+	_sha256_multi(messages, len, digests, count, true);
+}
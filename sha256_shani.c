@@ -0,0 +1,192 @@
+/*
+ * Copyright 2026 agent
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* SHA-256 using the x86 SHA extensions: a drop-in block transform for
+ * sha2.c (host-side hashing) and, for CPU mining, scanhash_shani */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sha2.h"
+
+#ifdef USE_SHA256_SHANI
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#include "driver-cpu.h"
+#include "miner.h"
+
+bool sha256_shani_available(void)
+{
+	static int have_shani = -1;
+	unsigned int eax, ebx, ecx, edx;
+
+	if (likely(have_shani >= 0))
+		return have_shani;
+
+	have_shani = 0;
+	if (__get_cpuid_max(0, NULL) >= 7)
+	{
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+		// EBX bit 29 is SHA
+		if (ebx & (1 << 29))
+		{
+			// SSSE3 and SSE4.1 are used to load and store the state
+			__cpuid(1, eax, ebx, ecx, edx);
+			if ((ecx & bit_SSSE3) && (ecx & bit_SSE4_1))
+				have_shani = 1;
+		}
+	}
+	return have_shani;
+}
+
+#define SHANI_ROUNDS4(M, i)  do {  \
+	MSG = _mm_add_epi32(M, _mm_loadu_si128((const __m128i *)&sha256_k[i]));  \
+	STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);  \
+	MSG = _mm_shuffle_epi32(MSG, 0x0e);  \
+	STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);  \
+} while (0)
+
+// Extends the message schedule by 4 words into M0, from the last 16
+#define SHANI_SCHEDULE(M0, M1, M2, M3)  do {  \
+	M0 = _mm_sha256msg1_epu32(M0, M1);  \
+	M0 = _mm_add_epi32(M0, _mm_alignr_epi8(M3, M2, 4));  \
+	M0 = _mm_sha256msg2_epu32(M0, M3);  \
+} while (0)
+
+/* Runs block_nb blocks through state h; if bswap is false, message is taken
+ * to be 32-bit words already in native endian (as the CPU miner keeps them) */
+__attribute__((target("sha,sse4.1")))
+static inline
+void _sha256_shani_transf(uint32_t * const h, const unsigned char *message, unsigned int block_nb, const bool bswap)
+{
+	const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i STATE0, STATE1, ABEF_SAVE, CDGH_SAVE, MSG, TMP;
+	__m128i M0, M1, M2, M3;
+	int i;
+
+	// Shuffle the state from ABCD EFGH to the ABEF CDGH the instructions use
+	TMP = _mm_loadu_si128((const __m128i *)&h[0]);
+	STATE1 = _mm_loadu_si128((const __m128i *)&h[4]);
+	TMP = _mm_shuffle_epi32(TMP, 0xb1);
+	STATE1 = _mm_shuffle_epi32(STATE1, 0x1b);
+	STATE0 = _mm_alignr_epi8(TMP, STATE1, 8);
+	STATE1 = _mm_blend_epi16(STATE1, TMP, 0xf0);
+
+	for ( ; block_nb; --block_nb, message += SHA256_BLOCK_SIZE)
+	{
+		ABEF_SAVE = STATE0;
+		CDGH_SAVE = STATE1;
+
+		M0 = _mm_loadu_si128((const __m128i *)&message[0x00]);
+		M1 = _mm_loadu_si128((const __m128i *)&message[0x10]);
+		M2 = _mm_loadu_si128((const __m128i *)&message[0x20]);
+		M3 = _mm_loadu_si128((const __m128i *)&message[0x30]);
+		if (bswap)
+		{
+			M0 = _mm_shuffle_epi8(M0, MASK);
+			M1 = _mm_shuffle_epi8(M1, MASK);
+			M2 = _mm_shuffle_epi8(M2, MASK);
+			M3 = _mm_shuffle_epi8(M3, MASK);
+		}
+
+		for (i = 0; i < 48; i += 16)
+		{
+			SHANI_ROUNDS4(M0, i +  0);
+			SHANI_SCHEDULE(M0, M1, M2, M3);
+			SHANI_ROUNDS4(M1, i +  4);
+			SHANI_SCHEDULE(M1, M2, M3, M0);
+			SHANI_ROUNDS4(M2, i +  8);
+			SHANI_SCHEDULE(M2, M3, M0, M1);
+			SHANI_ROUNDS4(M3, i + 12);
+			SHANI_SCHEDULE(M3, M0, M1, M2);
+		}
+		SHANI_ROUNDS4(M0, 48);
+		SHANI_ROUNDS4(M1, 52);
+		SHANI_ROUNDS4(M2, 56);
+		SHANI_ROUNDS4(M3, 60);
+
+		STATE0 = _mm_add_epi32(STATE0, ABEF_SAVE);
+		STATE1 = _mm_add_epi32(STATE1, CDGH_SAVE);
+	}
+
+	// Back to ABCD EFGH
+	TMP = _mm_shuffle_epi32(STATE0, 0x1b);
+	STATE1 = _mm_shuffle_epi32(STATE1, 0xb1);
+	STATE0 = _mm_blend_epi16(TMP, STATE1, 0xf0);
+	STATE1 = _mm_alignr_epi8(STATE1, TMP, 8);
+	_mm_storeu_si128((__m128i *)&h[0], STATE0);
+	_mm_storeu_si128((__m128i *)&h[4], STATE1);
+}
+
+__attribute__((target("sha,sse4.1")))
+void sha256_shani_transf(uint32_t * const h, const unsigned char * const message, const unsigned int block_nb)
+{
+	_sha256_shani_transf(h, message, block_nb, true);
+}
+
+#if defined(WANT_CPUMINE) && defined(WANT_SHANI)
+static const uint32_t sha256_shani_init_state[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+__attribute__((target("sha,sse4.1")))
+bool scanhash_shani(struct thr_info * const thr, const unsigned char *midstate, unsigned char *data,
+	unsigned char * const phash1, unsigned char * const hash,
+	const unsigned char * const target,
+	const uint32_t max_nonce, uint32_t * const last_nonce,
+	uint32_t n)
+{
+	uint32_t * const hash32 = (uint32_t *)hash;
+	uint32_t * const nonce = (uint32_t *)(data + 76);
+	uint32_t hash1[16] = {
+		0,0,0,0,0,0,0,0,
+		0x80000000,
+		  0,0,0,0,0,0,
+		          0x100,
+	};
+
+	data += 64;
+
+	// Midstate and data are stored in little endian
+	LOCAL_swap32le(unsigned char, midstate, 32/4)
+	LOCAL_swap32le(unsigned char, data, 64/4)
+	uint32_t *nonce_w = (uint32_t *)(data + 12);
+
+	while (1) {
+		*nonce_w = n;
+
+		memcpy(hash1, midstate, 32);
+		_sha256_shani_transf(hash1, data, 1, false);
+		memcpy(hash32, sha256_shani_init_state, 32);
+		_sha256_shani_transf(hash32, (const unsigned char *)hash1, 1, false);
+
+		if (unlikely((hash32[7] == 0) && fulltest(hash, target))) {
+			*nonce = htole32(n);
+			*last_nonce = n;
+			return true;
+		}
+
+		if ((n >= max_nonce) || thr->work_restart) {
+			*nonce = htole32(n);
+			*last_nonce = n;
+			return false;
+		}
+
+		n++;
+	}
+}
+#endif  /* WANT_CPUMINE && WANT_SHANI */
+
+#endif  /* USE_SHA256_SHANI */
@@ -0,0 +1,495 @@
+/*
+ * Copyright 2026 agent
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* bfgminer-journal: filters and summarises share journals written with
+ * --share-journal, without needing bfgminer itself */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "share-journal.h"
+
+struct sj_agg {
+	char *key;
+	uint64_t count[SJD_COUNT];
+	double diff[SJD_COUNT];
+	uint64_t first_us, last_us;
+};
+
+enum sj_group_by {
+	SJG_NONE,
+	SJG_DEVICE,
+	SJG_POOL,
+};
+
+static uint64_t opt_from_us, opt_to_us = UINT64_MAX;
+static const char *opt_device;
+static const char *opt_pool;
+static unsigned opt_dispositions;
+static enum sj_group_by opt_group_by;
+static bool opt_list;
+
+static struct sj_agg total;
+static struct sj_agg *groups;
+static int groups_count;
+
+// Names for the current session, by id
+static char **names[2];
+static size_t names_sz[2];
+
+static
+void usage(const char * const argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <journal>...\n"
+		"  --from <time>        Only records at or after time (Unix time, or -N for N seconds ago)\n"
+		"  --to <time>          Only records before time\n"
+		"  --device <name>      Only records from this device or processor (eg, \"BFL 0\" or \"BFL 0a\")\n"
+		"  --pool <n|url>       Only records for this pool number or URL\n"
+		"  --disposition <d>    Only records with this disposition (may be repeated): ",
+		argv0);
+	for (int i = 0; i < SJD_COUNT; ++i)
+		fprintf(stderr, "%s%s", i ? "/" : "", sj_disposition_names[i]);
+	fprintf(stderr, "\n"
+		"  --by <device|pool>   Aggregate per device or per pool\n"
+		"  --list               Print matching records as CSV:\n"
+		"                       time,disposition,reason,pool,dev,thr,workdiff,sharediff,data\n"
+	);
+	exit(1);
+}
+
+static
+uint64_t parse_time(const char * const s)
+{
+	long long t = strtoll(s, NULL, 0);
+	if (t < 0)
+		t += time(NULL);
+	return (uint64_t)t * 1000000;
+}
+
+static
+void name_set(const struct sj_name * const n)
+{
+	char ***tbl;
+	size_t oldsz;
+
+	if (n->kind > SJN_POOL)
+		return;
+	tbl = &names[n->kind];
+	if (n->id >= names_sz[n->kind])
+	{
+		oldsz = names_sz[n->kind];
+		names_sz[n->kind] = n->id + 0x10;
+		*tbl = realloc(*tbl, names_sz[n->kind] * sizeof(**tbl));
+		memset(&(*tbl)[oldsz], 0, (names_sz[n->kind] - oldsz) * sizeof(**tbl));
+	}
+	free((*tbl)[n->id]);
+	(*tbl)[n->id] = strdup(n->name);
+}
+
+static
+const char *name_get(const enum sj_name_kind kind, const uint16_t id)
+{
+	if (id < names_sz[kind] && names[kind][id])
+		return names[kind][id];
+	return "?";
+}
+
+static
+void names_reset(void)
+{
+	for (int kind = 0; kind < 2; ++kind)
+		for (size_t i = 0; i < names_sz[kind]; ++i)
+		{
+			free(names[kind][i]);
+			names[kind][i] = NULL;
+		}
+}
+
+// A device name matches its own processors too
+static
+bool device_match(const char * const procname)
+{
+	const size_t len = strlen(opt_device);
+	if (strncmp(procname, opt_device, len))
+		return false;
+	return !procname[len] || (procname[len] >= 'a' && procname[len] <= 'z');
+}
+
+static
+bool pool_match(const struct sj_share * const s)
+{
+	char *end;
+	const long n = strtol(opt_pool, &end, 10);
+	if (!*end)
+		return n == s->pool;
+	return !strcmp(opt_pool, name_get(SJN_POOL, s->pool));
+}
+
+static
+void agg_add(struct sj_agg * const agg, const int disposition, const uint64_t count, const double diff, const uint64_t first_us, const uint64_t last_us)
+{
+	agg->count[disposition] += count;
+	agg->diff[disposition] += diff;
+	if (!agg->first_us || first_us < agg->first_us)
+		agg->first_us = first_us;
+	if (last_us > agg->last_us)
+		agg->last_us = last_us;
+}
+
+static
+struct sj_agg *group_get(const char * const key)
+{
+	for (int i = 0; i < groups_count; ++i)
+		if (!strcmp(groups[i].key, key))
+			return &groups[i];
+	groups = realloc(groups, sizeof(*groups) * (groups_count + 1));
+	memset(&groups[groups_count], 0, sizeof(*groups));
+	groups[groups_count].key = strdup(key);
+	return &groups[groups_count++];
+}
+
+static
+void format_time(char * const buf, const size_t bufsz, const uint64_t time_us)
+{
+	const time_t t = time_us / 1000000;
+	struct tm *tm = localtime(&t);
+	if (!tm)
+	{
+		snprintf(buf, bufsz, "%lld", (long long)t);
+		return;
+	}
+	strftime(buf, bufsz, "%Y-%m-%d %H:%M:%S", tm);
+}
+
+// Quotes s as a CSV field if it contains anything that would break the row
+static
+void csv_field(const char *s)
+{
+	if (!s[strcspn(s, ",\"\r\n")])
+	{
+		fputs(s, stdout);
+		return;
+	}
+	putchar('"');
+	for ( ; s[0]; ++s)
+	{
+		if (s[0] == '"')
+			putchar('"');
+		putchar(s[0]);
+	}
+	putchar('"');
+}
+
+static
+void share_process(const uint8_t * const rec)
+{
+	struct sj_share s;
+	const char *devname;
+	char hex[(SJ_DATA_SIZE * 2) + 1];
+
+	sj_share_unpack(&s, rec);
+	if (s.time_us < opt_from_us || s.time_us >= opt_to_us)
+		return;
+	if (s.disposition >= SJD_COUNT || !(opt_dispositions & (1 << s.disposition)))
+		return;
+	devname = name_get(SJN_DEVICE, s.device);
+	if (opt_device && !device_match(devname))
+		return;
+	if (opt_pool && !pool_match(&s))
+		return;
+
+	if (opt_list)
+	{
+		for (int i = 0; i < SJ_DATA_SIZE; ++i)
+			sprintf(&hex[i * 2], "%02x", s.data[i]);
+		printf("%llu.%06u,%s,",
+		       (unsigned long long)(s.time_us / 1000000), (unsigned)(s.time_us % 1000000),
+		       sj_disposition_names[s.disposition]);
+		csv_field(s.reason);
+		putchar(',');
+		csv_field(name_get(SJN_POOL, s.pool));
+		putchar(',');
+		csv_field(devname);
+		printf(",%u,%.17g,%llu,%s\n",
+		       (unsigned)s.thr_id, s.work_diff, (unsigned long long)s.share_diff, hex);
+	}
+
+	agg_add(&total, s.disposition, 1, s.work_diff, s.time_us, s.time_us);
+	switch (opt_group_by)
+	{
+		case SJG_DEVICE:
+			agg_add(group_get(devname), s.disposition, 1, s.work_diff, s.time_us, s.time_us);
+			break;
+		case SJG_POOL:
+			agg_add(group_get(name_get(SJN_POOL, s.pool)), s.disposition, 1, s.work_diff, s.time_us, s.time_us);
+			break;
+		case SJG_NONE:
+			break;
+	}
+}
+
+static
+void record_process(const uint8_t * const rec)
+{
+	struct sj_name n;
+
+	switch (rec[0])
+	{
+		case SJR_SESSION:
+			names_reset();
+			break;
+		case SJR_NAME:
+			sj_name_unpack(&n, rec);
+			name_set(&n);
+			break;
+		case SJR_SHARE:
+			share_process(rec);
+			break;
+	}
+}
+
+/* Uses a block's index to skip or summarise it without reading its records;
+ * returns false if the block must be scanned */
+static
+bool block_from_index(const uint8_t * const rec)
+{
+	struct sj_index idx;
+	uint64_t n = 0;
+	int i;
+
+	if (rec[0] != SJR_INDEX)
+		return false;
+	sj_index_unpack(&idx, rec);
+	if (idx.covered_from || (idx.flags & SJI_HAS_META))
+		return false;
+	for (i = 0; i < SJD_COUNT; ++i)
+		n += idx.count[i];
+	if (!n || idx.last_us < opt_from_us || idx.first_us >= opt_to_us)
+		return true;
+
+	// Only the totals are in the index
+	if (opt_list || opt_device || opt_pool || opt_group_by != SJG_NONE)
+		return false;
+	if (idx.first_us < opt_from_us || idx.last_us >= opt_to_us)
+		return false;
+	for (i = 0; i < SJD_COUNT; ++i)
+		if (idx.count[i] && (opt_dispositions & (1 << i)))
+			agg_add(&total, i, idx.count[i], idx.diff[i], idx.first_us, idx.last_us);
+	return true;
+}
+
+static
+bool journal_process(const char * const path, const uint8_t * const buf, const size_t len)
+{
+	const size_t nslots = len / SJ_RECORD_SIZE;
+	size_t blk, slot, end;
+
+	if (!nslots || !sj_header_check(buf))
+	{
+		fprintf(stderr, "%s: not a share journal (or an incompatible version)\n", path);
+		return false;
+	}
+
+	names_reset();
+	for (blk = 0; blk < nslots; blk += SJ_INDEX_INTERVAL)
+	{
+		end = blk + SJ_INDEX_INTERVAL;
+		if (end <= nslots && block_from_index(&buf[(end - 1) * SJ_RECORD_SIZE]))
+			continue;
+		if (end > nslots)
+			end = nslots;
+		for (slot = blk ?: 1; slot < end; ++slot)
+			record_process(&buf[slot * SJ_RECORD_SIZE]);
+	}
+	return true;
+}
+
+static
+bool journal_load(const char * const path)
+{
+	bool rv;
+#ifndef WIN32
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st))
+	{
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+	if (!st.st_size)
+	{
+		close(fd);
+		return journal_process(path, NULL, 0);
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map != MAP_FAILED)
+	{
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+		rv = journal_process(path, map, st.st_size);
+		munmap(map, st.st_size);
+		return rv;
+	}
+#endif
+	FILE *fp = fopen(path, "rb");
+	uint8_t *buf = NULL;
+	size_t len = 0, sz = 0, r;
+
+	if (!fp)
+	{
+		perror(path);
+		return false;
+	}
+	do {
+		if (len == sz)
+		{
+			sz = sz ? (sz * 2) : 0x10000;
+			buf = realloc(buf, sz);
+		}
+		r = fread(&buf[len], 1, sz - len, fp);
+		len += r;
+	} while (r);
+	fclose(fp);
+	rv = journal_process(path, buf, len);
+	free(buf);
+	return rv;
+}
+
+static
+void format_hashrate(char * const buf, const size_t bufsz, double hps)
+{
+	static const char units[] = " kMGTPE";
+	int i;
+
+	for (i = 0; hps >= 1000 && units[i + 1]; ++i)
+		hps /= 1000;
+	snprintf(buf, bufsz, "%.2f %ch/s", hps, units[i]);
+}
+
+static
+void agg_print(const struct sj_agg * const agg)
+{
+	const double secs = (agg->last_us - agg->first_us) / 1e6;
+	char first[0x20], last[0x20], rate[0x20];
+	int i;
+
+	format_time(first, sizeof(first), agg->first_us);
+	format_time(last, sizeof(last), agg->last_us);
+	printf("  From %s to %s (%.0f seconds)\n", first, last, secs);
+	printf("  %-12s %10s %16s %10s\n", "Disposition", "Count", "Difficulty", "Per min");
+	for (i = 0; i < SJD_COUNT; ++i)
+	{
+		if (!agg->count[i])
+			continue;
+		printf("  %-12s %10llu %16.0f %10.2f\n", sj_disposition_names[i],
+		       (unsigned long long)agg->count[i], agg->diff[i],
+		       (secs > 0) ? (agg->count[i] * 60 / secs) : 0.);
+	}
+	if (secs > 0 && agg->diff[SJD_ACCEPT])
+	{
+		format_hashrate(rate, sizeof(rate), agg->diff[SJD_ACCEPT] * 4294967296. / secs);
+		printf("  Accepted hashrate: %s\n", rate);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int i, nfiles = 0;
+	bool ok = true;
+
+	for (i = 1; i < argc; ++i)
+	{
+		const char * const arg = argv[i];
+		if (arg[0] != '-' || !arg[1])
+		{
+			argv[++nfiles] = argv[i];
+			continue;
+		}
+		if (!strcmp(arg, "--list"))
+			opt_list = true;
+		else
+		if (i + 1 >= argc)
+			usage(argv[0]);
+		else
+		if (!strcmp(arg, "--from"))
+			opt_from_us = parse_time(argv[++i]);
+		else
+		if (!strcmp(arg, "--to"))
+			opt_to_us = parse_time(argv[++i]);
+		else
+		if (!strcmp(arg, "--device"))
+			opt_device = argv[++i];
+		else
+		if (!strcmp(arg, "--pool"))
+			opt_pool = argv[++i];
+		else
+		if (!strcmp(arg, "--disposition"))
+		{
+			const char * const d = argv[++i];
+			int j;
+			for (j = 0; j < SJD_COUNT && strcmp(d, sj_disposition_names[j]); ++j)
+				{}
+			if (j == SJD_COUNT)
+				usage(argv[0]);
+			opt_dispositions |= 1 << j;
+		}
+		else
+		if (!strcmp(arg, "--by"))
+		{
+			const char * const by = argv[++i];
+			if (!strcmp(by, "device"))
+				opt_group_by = SJG_DEVICE;
+			else
+			if (!strcmp(by, "pool"))
+				opt_group_by = SJG_POOL;
+			else
+				usage(argv[0]);
+		}
+		else
+			usage(argv[0]);
+	}
+	if (!nfiles)
+		usage(argv[0]);
+	if (!opt_dispositions)
+		opt_dispositions = ~0U;
+
+	for (i = 1; i <= nfiles; ++i)
+		ok &= journal_load(argv[i]);
+
+	if (opt_list)
+		return ok ? 0 : 1;
+
+	printf("Total:\n");
+	agg_print(&total);
+	for (i = 0; i < groups_count; ++i)
+	{
+		printf("%s:\n", groups[i].key);
+		agg_print(&groups[i]);
+	}
+	return ok ? 0 : 1;
+}
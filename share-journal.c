@@ -0,0 +1,252 @@
+/*
+ * Copyright 2026 agent
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Writer for the binary share journal (see share-journal.h); records go out
+ * through the logging thread like the CSV share log */
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "logging.h"
+#include "miner.h"
+#include "share-journal.h"
+#include "util.h"
+
+bool opt_share_journal_nonces;
+
+static pthread_mutex_t sj_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *sj_file;
+static uint64_t sj_slot;
+static struct sj_index sj_idx;
+
+// Whether each device/pool id has been named yet this session
+static bool *sj_named[2];
+static size_t sj_named_sz[2];
+
+static
+char *sj_error(const char * const fmt, const char * const path)
+{
+	const size_t errbufsz = 0x100;
+	char * const err = malloc(errbufsz);
+	snprintf(err, errbufsz, fmt, path);
+	return err;
+}
+
+static
+void sj_index_reset(const uint16_t covered_from)
+{
+	memset(&sj_idx, 0, sizeof(sj_idx));
+	sj_idx.covered_from = covered_from;
+}
+
+// Writes one slot, preceded by the block's index if that is due; caller holds sj_lock
+static
+void sj_emit(const uint8_t * const buf)
+{
+	uint8_t idxbuf[SJ_RECORD_SIZE];
+
+	if (sj_slot % SJ_INDEX_INTERVAL == SJ_INDEX_INTERVAL - 1)
+	{
+		sj_index_pack(idxbuf, &sj_idx);
+		log_file_write(sj_file, idxbuf, SJ_RECORD_SIZE);
+		++sj_slot;
+		sj_index_reset(0);
+	}
+	if (!log_file_write(sj_file, buf, SJ_RECORD_SIZE))
+		applog(LOG_ERR, "Share journal write error");
+	++sj_slot;
+}
+
+static
+void sj_emit_meta(const uint8_t * const buf)
+{
+	sj_emit(buf);
+	sj_idx.flags |= SJI_HAS_META;
+}
+
+static
+void sj_need_name(const enum sj_name_kind kind, const int id, const char * const name, const uint64_t time_us)
+{
+	uint8_t buf[SJ_RECORD_SIZE];
+	struct sj_name n;
+	size_t oldsz;
+
+	if ((size_t)id >= sj_named_sz[kind])
+	{
+		oldsz = sj_named_sz[kind];
+		sj_named_sz[kind] = id + 0x10;
+		sj_named[kind] = realloc(sj_named[kind], sj_named_sz[kind] * sizeof(*sj_named[kind]));
+		if (unlikely(!sj_named[kind]))
+			quit(1, "Failed to realloc %s", "sj_named");
+		memset(&sj_named[kind][oldsz], 0, (sj_named_sz[kind] - oldsz) * sizeof(*sj_named[kind]));
+	}
+	if (sj_named[kind][id])
+		return;
+
+	n = (struct sj_name){
+		.kind = kind,
+		.id = id,
+		.time_us = time_us,
+	};
+	snprintf(n.name, sizeof(n.name), "%s", name);
+	sj_name_pack(buf, &n);
+	sj_emit_meta(buf);
+	sj_named[kind][id] = true;
+}
+
+char *share_journal_open(const char * const path)
+{
+	uint8_t buf[SJ_RECORD_SIZE];
+	struct timeval tv;
+	FILE *fp;
+	long sz;
+
+	fp = fopen(path, "a+b");
+	if (!fp)
+		return sj_error("Failed to open %s for share journal", path);
+	if (fseek(fp, 0, SEEK_END) || (sz = ftell(fp)) < 0)
+	{
+		fclose(fp);
+		return sj_error("Share journal %s is not seekable", path);
+	}
+
+	if (sz)
+	{
+		rewind(fp);
+		if (fread(buf, SJ_RECORD_SIZE, 1, fp) != 1 || !sj_header_check(buf))
+		{
+			fclose(fp);
+			return sj_error("%s is not a share journal (or is an incompatible version)", path);
+		}
+		fseek(fp, 0, SEEK_END);
+		if (sz % SJ_RECORD_SIZE)
+		{
+			// Complete a record cut short by a crash, so slots stay aligned
+			const size_t padsz = SJ_RECORD_SIZE - (sz % SJ_RECORD_SIZE);
+			memset(buf, 0, padsz);
+			fwrite(buf, padsz, 1, fp);
+			sz += padsz;
+		}
+	}
+	else
+	{
+		sj_header_pack(buf);
+		fwrite(buf, SJ_RECORD_SIZE, 1, fp);
+		sz = SJ_RECORD_SIZE;
+	}
+	if (fflush(fp))
+	{
+		fclose(fp);
+		return sj_error("Failed to write share journal %s", path);
+	}
+
+	mutex_lock(&sj_lock);
+	if (sj_file)
+		fclose(sj_file);
+	sj_file = fp;
+	sj_slot = sz / SJ_RECORD_SIZE;
+	// A new file's header is part of the first block's coverage
+	sj_index_reset((sj_slot == 1) ? 0 : (sj_slot % SJ_INDEX_INTERVAL));
+	memset(sj_named[SJN_DEVICE], 0, sj_named_sz[SJN_DEVICE] * sizeof(*sj_named[SJN_DEVICE]));
+	memset(sj_named[SJN_POOL], 0, sj_named_sz[SJN_POOL] * sizeof(*sj_named[SJN_POOL]));
+	bfg_gettimeofday(&tv);
+	sj_session_pack(buf, ((uint64_t)tv.tv_sec * 1000000) + tv.tv_usec);
+	sj_emit_meta(buf);
+	mutex_unlock(&sj_lock);
+
+	return NULL;
+}
+
+static
+void share_journal_add(const enum sj_disposition disposition, const char * const reason, const struct work * const work)
+{
+	const struct cgpu_info * const cgpu = get_thread(work->thr_id)->cgpu;
+	const struct pool * const pool = work->pool;
+	uint8_t buf[SJ_RECORD_SIZE];
+	struct timeval tv;
+	struct sj_share s;
+
+	bfg_gettimeofday(&tv);
+	s = (struct sj_share){
+		.disposition = disposition,
+		.device = cgpu->cgminer_id,
+		.thr_id = work->thr_id,
+		.time_us = ((uint64_t)tv.tv_sec * 1000000) + tv.tv_usec,
+		.work_diff = work->work_difficulty,
+		.share_diff = work->share_diff,
+	};
+	memcpy(s.data, work->data, SJ_DATA_SIZE);
+	if (reason)
+		snprintf(s.reason, sizeof(s.reason), "%s", reason);
+
+	mutex_lock(&sj_lock);
+	// Read with the name, so a renumbering can't come between them
+	s.pool = pool->pool_no;
+	sj_share_pack(buf, &s);
+	sj_need_name(SJN_DEVICE, cgpu->cgminer_id, cgpu->proc_repr_ns, s.time_us);
+	sj_need_name(SJN_POOL, s.pool, pool->rpc_url, s.time_us);
+	sj_emit(buf);
+	++sj_idx.count[disposition];
+	sj_idx.diff[disposition] += s.work_diff;
+	if (!sj_idx.first_us || s.time_us < sj_idx.first_us)
+		sj_idx.first_us = s.time_us;
+	if (s.time_us > sj_idx.last_us)
+		sj_idx.last_us = s.time_us;
+	mutex_unlock(&sj_lock);
+}
+
+// Takes the same disposition strings as the CSV share log
+void share_journal_share(const char * const disposition, const struct work * const work)
+{
+	static const enum sj_disposition known[] = {
+		SJD_ACCEPT, SJD_REJECT, SJD_DISCARD, SJD_DISCONNECT,
+	};
+	const char *reason;
+	size_t len;
+	int i;
+
+	if (!sj_file)
+		return;
+
+	reason = strchr(disposition, ':');
+	len = reason ? (size_t)(reason++ - disposition) : strlen(disposition);
+	for (i = 0; i < sizeof(known) / sizeof(*known); ++i)
+	{
+		const char * const name = sj_disposition_names[known[i]];
+		if (len == strlen(name) && !strncmp(disposition, name, len))
+		{
+			share_journal_add(known[i], reason, work);
+			return;
+		}
+	}
+	share_journal_add(SJD_OTHER, disposition, work);
+}
+
+// Pool numbers now name different pools, so name them again before their next records
+void share_journal_pools_renumbered(void)
+{
+	mutex_lock(&sj_lock);
+	if (sj_named[SJN_POOL])
+		memset(sj_named[SJN_POOL], 0, sj_named_sz[SJN_POOL] * sizeof(*sj_named[SJN_POOL]));
+	mutex_unlock(&sj_lock);
+}
+
+void share_journal_nonce(const struct work * const work)
+{
+	if (!(sj_file && opt_share_journal_nonces))
+		return;
+	share_journal_add(SJD_NONCE, NULL, work);
+}
@@ -0,0 +1,266 @@
+/*
+ * Copyright 2026 agent
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef BFG_SHARE_JOURNAL_H
+#define BFG_SHARE_JOURNAL_H
+
+/* Binary share journal: a header slot followed by fixed-size records, all
+ * little endian.  Every SJ_INDEX_INTERVAL'th slot (counting the header) is an
+ * index record summarising the slots before it in the same block.  This file
+ * is shared with the bfgminer-journal reader, so it only depends on libc */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SJ_MAGIC  "BFGSJRNL"
+#define SJ_VERSION  1
+#define SJ_RECORD_SIZE  0x80
+#define SJ_INDEX_INTERVAL  0x100
+#define SJ_DATA_SIZE  80
+#define SJ_REASON_SIZE  16
+#define SJ_NAME_SIZE  (SJ_RECORD_SIZE - 0x10)
+
+enum sj_record_type {
+	// A partial record left by a crash is padded with zeros
+	SJR_PAD     = 0,
+	// Starts a run of bfgminer: device and pool ids are reset
+	SJR_SESSION = 1,
+	// Names a device or pool id for the rest of the session
+	SJR_NAME    = 2,
+	SJR_SHARE   = 3,
+	SJR_INDEX   = 4,
+};
+
+enum sj_disposition {
+	SJD_ACCEPT,
+	SJD_REJECT,
+	SJD_DISCARD,
+	SJD_DISCONNECT,
+	SJD_NONCE,
+	SJD_OTHER,
+	SJD_COUNT,
+};
+
+static const char * const sj_disposition_names[SJD_COUNT] = {
+	"accept",
+	"reject",
+	"discard",
+	"disconnect",
+	"nonce",
+	"other",
+};
+
+enum sj_name_kind {
+	SJN_DEVICE,
+	SJN_POOL,
+};
+
+// Index flag: the block has SESSION or NAME records, so readers can't skip it
+#define SJI_HAS_META  1
+
+struct sj_share {
+	uint8_t disposition;
+	uint16_t device;
+	uint16_t pool;
+	uint16_t thr_id;
+	uint64_t time_us;
+	double work_diff;
+	uint64_t share_diff;
+	uint8_t data[SJ_DATA_SIZE];
+	char reason[SJ_REASON_SIZE + 1];
+};
+
+struct sj_name {
+	uint8_t kind;
+	uint16_t id;
+	uint64_t time_us;
+	char name[SJ_NAME_SIZE + 1];
+};
+
+struct sj_index {
+	uint8_t flags;
+	// Slot within the block where this index's coverage starts; only an index with 0 describes the whole block
+	uint16_t covered_from;
+	uint64_t first_us;
+	uint64_t last_us;
+	uint32_t count[SJD_COUNT];
+	double diff[SJD_COUNT];
+};
+
+static inline
+void sj_put16(uint8_t * const p, const uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static inline
+void sj_put32(uint8_t * const p, const uint32_t v)
+{
+	sj_put16(&p[0], v);
+	sj_put16(&p[2], v >> 16);
+}
+
+static inline
+void sj_put64(uint8_t * const p, const uint64_t v)
+{
+	sj_put32(&p[0], v);
+	sj_put32(&p[4], v >> 32);
+}
+
+static inline
+void sj_putdouble(uint8_t * const p, const double d)
+{
+	uint64_t v;
+	memcpy(&v, &d, sizeof(v));
+	sj_put64(p, v);
+}
+
+static inline
+uint16_t sj_get16(const uint8_t * const p)
+{
+	return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+}
+
+static inline
+uint32_t sj_get32(const uint8_t * const p)
+{
+	return (uint32_t)sj_get16(&p[0]) | ((uint32_t)sj_get16(&p[2]) << 16);
+}
+
+static inline
+uint64_t sj_get64(const uint8_t * const p)
+{
+	return (uint64_t)sj_get32(&p[0]) | ((uint64_t)sj_get32(&p[4]) << 32);
+}
+
+static inline
+double sj_getdouble(const uint8_t * const p)
+{
+	const uint64_t v = sj_get64(p);
+	double d;
+	memcpy(&d, &v, sizeof(d));
+	return d;
+}
+
+static inline
+void sj_header_pack(uint8_t * const buf)
+{
+	memset(buf, 0, SJ_RECORD_SIZE);
+	memcpy(buf, SJ_MAGIC, 8);
+	sj_put32(&buf[0x08], SJ_VERSION);
+	sj_put32(&buf[0x0c], SJ_RECORD_SIZE);
+	sj_put32(&buf[0x10], SJ_INDEX_INTERVAL);
+}
+
+static inline
+bool sj_header_check(const uint8_t * const buf)
+{
+	return !memcmp(buf, SJ_MAGIC, 8)
+	    && sj_get32(&buf[0x08]) == SJ_VERSION
+	    && sj_get32(&buf[0x0c]) == SJ_RECORD_SIZE
+	    && sj_get32(&buf[0x10]) == SJ_INDEX_INTERVAL;
+}
+
+static inline
+void sj_session_pack(uint8_t * const buf, const uint64_t time_us)
+{
+	memset(buf, 0, SJ_RECORD_SIZE);
+	buf[0] = SJR_SESSION;
+	sj_put64(&buf[0x08], time_us);
+}
+
+static inline
+void sj_name_pack(uint8_t * const buf, const struct sj_name * const n)
+{
+	memset(buf, 0, SJ_RECORD_SIZE);
+	buf[0] = SJR_NAME;
+	buf[1] = n->kind;
+	sj_put16(&buf[0x02], n->id);
+	sj_put64(&buf[0x08], n->time_us);
+	strncpy((char *)&buf[0x10], n->name, SJ_NAME_SIZE);
+}
+
+static inline
+void sj_name_unpack(struct sj_name * const n, const uint8_t * const buf)
+{
+	n->kind = buf[1];
+	n->id = sj_get16(&buf[0x02]);
+	n->time_us = sj_get64(&buf[0x08]);
+	memcpy(n->name, &buf[0x10], SJ_NAME_SIZE);
+	n->name[SJ_NAME_SIZE] = '\0';
+}
+
+static inline
+void sj_share_pack(uint8_t * const buf, const struct sj_share * const s)
+{
+	memset(buf, 0, SJ_RECORD_SIZE);
+	buf[0] = SJR_SHARE;
+	buf[1] = s->disposition;
+	sj_put16(&buf[0x02], s->device);
+	sj_put16(&buf[0x04], s->pool);
+	sj_put16(&buf[0x06], s->thr_id);
+	sj_put64(&buf[0x08], s->time_us);
+	sj_putdouble(&buf[0x10], s->work_diff);
+	sj_put64(&buf[0x18], s->share_diff);
+	memcpy(&buf[0x20], s->data, SJ_DATA_SIZE);
+	strncpy((char *)&buf[0x70], s->reason, SJ_REASON_SIZE);
+}
+
+static inline
+void sj_share_unpack(struct sj_share * const s, const uint8_t * const buf)
+{
+	s->disposition = buf[1];
+	s->device = sj_get16(&buf[0x02]);
+	s->pool = sj_get16(&buf[0x04]);
+	s->thr_id = sj_get16(&buf[0x06]);
+	s->time_us = sj_get64(&buf[0x08]);
+	s->work_diff = sj_getdouble(&buf[0x10]);
+	s->share_diff = sj_get64(&buf[0x18]);
+	memcpy(s->data, &buf[0x20], SJ_DATA_SIZE);
+	memcpy(s->reason, &buf[0x70], SJ_REASON_SIZE);
+	s->reason[SJ_REASON_SIZE] = '\0';
+}
+
+static inline
+void sj_index_pack(uint8_t * const buf, const struct sj_index * const idx)
+{
+	int i;
+
+	memset(buf, 0, SJ_RECORD_SIZE);
+	buf[0] = SJR_INDEX;
+	buf[1] = idx->flags;
+	sj_put16(&buf[0x02], idx->covered_from);
+	sj_put64(&buf[0x08], idx->first_us);
+	sj_put64(&buf[0x10], idx->last_us);
+	for (i = 0; i < SJD_COUNT; ++i)
+	{
+		sj_put32(&buf[0x18 + (i * 4)], idx->count[i]);
+		sj_putdouble(&buf[0x30 + (i * 8)], idx->diff[i]);
+	}
+}
+
+static inline
+void sj_index_unpack(struct sj_index * const idx, const uint8_t * const buf)
+{
+	int i;
+
+	idx->flags = buf[1];
+	idx->covered_from = sj_get16(&buf[0x02]);
+	idx->first_us = sj_get64(&buf[0x08]);
+	idx->last_us = sj_get64(&buf[0x10]);
+	for (i = 0; i < SJD_COUNT; ++i)
+	{
+		idx->count[i] = sj_get32(&buf[0x18 + (i * 4)]);
+		idx->diff[i] = sj_getdouble(&buf[0x30 + (i * 8)]);
+	}
+}
+
+#endif
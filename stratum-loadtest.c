@@ -0,0 +1,336 @@
+/*
+ * Copyright 2026 agent
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Load test for the stratum server (--stratum-loadtest): connects many local
+ * miners to --stratum-port, which subscribe and authorize as "loadtest", and
+ * optionally submit random (so rejected, but fully checked) shares at a fixed
+ * rate.  Clients that fail or are dropped are reconnected.  Connection counts,
+ * notify fanout delay and submit reply latency are logged periodically */
+
+#include "config.h"
+
+#ifndef WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#else
+#include <winsock2.h>
+#endif
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include <jansson.h>
+
+#include "logging.h"
+#include "miner.h"
+#include "util.h"
+
+#define SLT_CONNECTS_PER_TICK  0x40
+#define SLT_TICK_MS  100
+#define SLT_REPORT_SECS  10
+#define SLT_MAX_PENDING_SUBMITS  0x10
+
+enum stratum_loadtest_id {
+	SLT_ID_SUBSCRIBE = 1,
+	SLT_ID_AUTHORIZE = 2,
+	SLT_ID_SUBMIT    = 3,
+};
+
+struct stratum_loadtest_client {
+	struct bufferevent *bev;
+	bool connected;
+	bool subscribed;
+	char job_id[0x40];
+	char ntime[9];
+	int xnonce2sz;
+	uint64_t xnonce2;
+	float submit_credit;
+
+	// Send times of submits still awaiting a reply, oldest first
+	struct timeval tv_submits[SLT_MAX_PENDING_SUBMITS];
+	int submits_head;
+	int submits_pending;
+};
+
+static struct stratum_loadtest_client *slt_clients;
+static int slt_clients_started;
+static struct event_base *slt_evbase;
+static struct timeval tv_slt_report;
+
+static int slt_connected, slt_subscribed, slt_failed, slt_refused;
+static unsigned long slt_notifies, slt_submits, slt_accepted, slt_rejected;
+static unsigned long slt_replies_timed;
+static uint64_t slt_reply_us;
+
+// How long the most recent job took to reach every subscribed client
+static char slt_job_id[0x40];
+static struct timeval tv_slt_job;
+static int slt_job_clients;
+static bool slt_job_reached_all;
+static double slt_job_fanout_ms;
+
+static
+void stratum_loadtest_submit(struct stratum_loadtest_client * const client)
+{
+	char buf[0x100], xnonce2x[(sizeof(client->xnonce2) * 2) + 1];
+	uint64_t xnonce2_le;
+	int bufsz;
+
+	if (client->submits_pending < SLT_MAX_PENDING_SUBMITS)
+	{
+		const int i = (client->submits_head + client->submits_pending) % SLT_MAX_PENDING_SUBMITS;
+		timer_set_now(&client->tv_submits[i]);
+		++client->submits_pending;
+	}
+
+	xnonce2_le = htole64(client->xnonce2++);
+	bin2hex(xnonce2x, &xnonce2_le, client->xnonce2sz);
+	bufsz = snprintf(buf, sizeof(buf), "{\"params\":[\"loadtest\",\"%s\",\"%s\",\"%s\",\"%08lx\"],\"id\":%d,\"method\":\"mining.submit\"}\n",
+	                 client->job_id, xnonce2x, client->ntime, (unsigned long)(uint32_t)rand(), SLT_ID_SUBMIT);
+	bufferevent_write(client->bev, buf, bufsz);
+	++slt_submits;
+}
+
+static
+void stratum_loadtest_notify(struct stratum_loadtest_client * const client, json_t * const params)
+{
+	const char * const job_id = __json_array_string(params, 0);
+	const char * const ntime = __json_array_string(params, 7);
+
+	if (!(job_id && ntime && strlen(job_id) < sizeof(client->job_id) && strlen(ntime) == 8))
+		return;
+
+	strcpy(client->job_id, job_id);
+	strcpy(client->ntime, ntime);
+	++slt_notifies;
+
+	if (strcmp(job_id, slt_job_id))
+	{
+		strcpy(slt_job_id, job_id);
+		timer_set_now(&tv_slt_job);
+		slt_job_clients = 0;
+		slt_job_reached_all = false;
+	}
+	// Clients may drop meanwhile, so this is when every one still subscribed has it
+	if (++slt_job_clients >= slt_subscribed && !slt_job_reached_all)
+	{
+		slt_job_fanout_ms = timer_elapsed_us(&tv_slt_job, NULL) / 1e3;
+		slt_job_reached_all = true;
+	}
+}
+
+static
+void stratum_loadtest_reply(struct stratum_loadtest_client * const client, const int id, json_t * const json)
+{
+	json_t * const res = json_object_get(json, "result");
+
+	switch (id)
+	{
+		case SLT_ID_SUBSCRIBE:
+			if (!(json_is_array(res) && json_is_integer(json_array_get(res, 2))))
+			{
+				++slt_refused;
+				break;
+			}
+			client->xnonce2sz = json_integer_value(json_array_get(res, 2));
+			if (client->xnonce2sz > sizeof(client->xnonce2))
+				client->xnonce2sz = sizeof(client->xnonce2);
+			client->subscribed = true;
+			++slt_subscribed;
+			break;
+		case SLT_ID_AUTHORIZE:
+			break;
+		case SLT_ID_SUBMIT:
+			if (json_is_true(res))
+				++slt_accepted;
+			else
+				++slt_rejected;
+			// Replies come back in the order the submits were sent
+			if (client->submits_pending)
+			{
+				slt_reply_us += timer_elapsed_us(&client->tv_submits[client->submits_head], NULL);
+				++slt_replies_timed;
+				client->submits_head = (client->submits_head + 1) % SLT_MAX_PENDING_SUBMITS;
+				--client->submits_pending;
+			}
+			break;
+	}
+}
+
+static
+void stratum_loadtest_read(struct bufferevent * const bev, void * const p)
+{
+	struct stratum_loadtest_client * const client = p;
+	struct evbuffer * const input = bufferevent_get_input(bev);
+	const char *method;
+	json_t *json, *id;
+	char *ln;
+
+	while ( (ln = evbuffer_readln(input, NULL, EVBUFFER_EOL_ANY)) )
+	{
+		json = JSON_LOADS(ln, NULL);
+		free(ln);
+		if (!json)
+			continue;
+		method = bfg_json_obj_string(json, "method", NULL);
+		id = json_object_get(json, "id");
+		if (method)
+		{
+			if (!strcasecmp(method, "mining.notify"))
+				stratum_loadtest_notify(client, json_object_get(json, "params"));
+		}
+		else
+		if (json_is_integer(id))
+			stratum_loadtest_reply(client, json_integer_value(id), json);
+		json_decref(json);
+	}
+}
+
+static
+void stratum_loadtest_event(struct bufferevent * const bev, const short events, void * const p)
+{
+	struct stratum_loadtest_client * const client = p;
+	static const char subscribe_authorize[] =
+		"{\"params\":[\"bfgminer-loadtest\"],\"id\":1,\"method\":\"mining.subscribe\"}\n"
+		"{\"params\":[\"loadtest\",\"x\"],\"id\":2,\"method\":\"mining.authorize\"}\n";
+
+	if (events & BEV_EVENT_CONNECTED)
+	{
+		client->connected = true;
+		++slt_connected;
+		bufferevent_write(bev, subscribe_authorize, sizeof(subscribe_authorize) - 1);
+		return;
+	}
+
+	if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+	{
+		if (client->subscribed)
+			--slt_subscribed;
+		if (client->connected)
+			--slt_connected;
+		++slt_failed;
+		bufferevent_free(bev);
+		memset(client, 0, sizeof(*client));
+	}
+}
+
+static
+void stratum_loadtest_connect(struct stratum_loadtest_client * const client)
+{
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+		.sin_port = htons(stratumsrv_port),
+	};
+
+	client->bev = bufferevent_socket_new(slt_evbase, -1, BEV_OPT_CLOSE_ON_FREE);
+	bufferevent_setcb(client->bev, stratum_loadtest_read, NULL, stratum_loadtest_event, client);
+	bufferevent_enable(client->bev, EV_READ | EV_WRITE);
+	if (bufferevent_socket_connect(client->bev, (struct sockaddr *)&sin, sizeof(sin)))
+	{
+		++slt_failed;
+		bufferevent_free(client->bev);
+		client->bev = NULL;
+	}
+}
+
+static
+void stratum_loadtest_report(void)
+{
+	const double secs = timer_elapsed_us(&tv_slt_report, NULL) / 1e6;
+
+	applog(LOG_NOTICE, "Stratum load test: %d/%d clients subscribed (%d connected, %d refused, %d failures reconnected); "
+	       "%lu notifies, last reached all clients in %.1f ms; "
+	       "%.1f submits/s, %lu accepted, %lu rejected, average reply in %.2f ms",
+	       slt_subscribed, opt_stratumsrv_loadtest_clients, slt_connected, slt_refused, slt_failed,
+	       slt_notifies, slt_job_fanout_ms,
+	       secs > 0 ? (slt_submits / secs) : 0., slt_accepted, slt_rejected,
+	       slt_replies_timed ? (slt_reply_us / 1e3 / slt_replies_timed) : 0.);
+
+	slt_notifies = slt_submits = slt_accepted = slt_rejected = slt_replies_timed = 0;
+	slt_reply_us = 0;
+	timer_set_now(&tv_slt_report);
+}
+
+static
+void stratum_loadtest_tick(__maybe_unused evutil_socket_t fd, __maybe_unused short what, __maybe_unused void *p)
+{
+	const float credit = opt_stratumsrv_loadtest_rate * SLT_TICK_MS / 1000;
+	struct stratum_loadtest_client *client;
+	int i, connects = 0;
+
+	// Ramp up connections, rather than overflowing the listen backlog
+	for ( ; connects < SLT_CONNECTS_PER_TICK && slt_clients_started < opt_stratumsrv_loadtest_clients; ++connects)
+		stratum_loadtest_connect(&slt_clients[slt_clients_started++]);
+	// Then reconnect any that failed or were dropped, so the load stays up
+	for (i = 0; i < slt_clients_started && connects < SLT_CONNECTS_PER_TICK; ++i)
+		if (!slt_clients[i].bev)
+		{
+			stratum_loadtest_connect(&slt_clients[i]);
+			++connects;
+		}
+
+	if (credit > 0)
+		for (i = 0; i < slt_clients_started; ++i)
+		{
+			client = &slt_clients[i];
+			if (!(client->subscribed && client->job_id[0]))
+				continue;
+			for (client->submit_credit += credit; client->submit_credit >= 1; client->submit_credit -= 1)
+				stratum_loadtest_submit(client);
+		}
+
+	if (timer_elapsed(&tv_slt_report, NULL) >= SLT_REPORT_SECS)
+		stratum_loadtest_report();
+}
+
+static
+void *stratum_loadtest_thread(__maybe_unused void * const userp)
+{
+	const struct timeval tv_tick = {
+		.tv_usec = SLT_TICK_MS * 1000,
+	};
+	struct event *ev_tick;
+
+	RenameThread("stratum_loadtest");
+
+	applog(LOG_NOTICE, "Stratum load test: connecting %d clients to port %d, submitting %g shares/s each",
+	       opt_stratumsrv_loadtest_clients, stratumsrv_port, opt_stratumsrv_loadtest_rate);
+
+	ev_tick = event_new(slt_evbase, -1, EV_PERSIST, stratum_loadtest_tick, NULL);
+	event_add(ev_tick, &tv_tick);
+	timer_set_now(&tv_slt_report);
+	event_base_dispatch(slt_evbase);
+
+	return NULL;
+}
+
+void stratumsrv_loadtest_start(void)
+{
+	pthread_t pth;
+
+	if (slt_evbase)
+		return;
+	slt_clients = calloc(opt_stratumsrv_loadtest_clients, sizeof(*slt_clients));
+	if (unlikely(!slt_clients))
+		quit(1, "Failed to calloc %s", "slt_clients");
+	slt_evbase = event_base_new();
+	if (unlikely(pthread_create(&pth, NULL, stratum_loadtest_thread, NULL)))
+		quit(1, "stratum load test thread create failed");
+	pthread_detach(pth);
+}
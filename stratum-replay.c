@@ -0,0 +1,376 @@
+/*
+ * Copyright 2026 agent
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Recording of stratum sessions (--stratum-record), and a local stratum
+ * server that plays a recording back to this miner (--stratum-replay).
+ *
+ * A recording is one received line per line of text:
+ *   <unix time>.<microseconds> <pool number> <line as received>
+ * The server answers subscribe, authorize and submit requests itself, and
+ * sends the recorded notifications of the first pool in the recording at
+ * their original spacing divided by --stratum-replay-speed */
+
+#include "config.h"
+
+#ifdef WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <jansson.h>
+
+#include "logging.h"
+#include "miner.h"
+#include "util.h"
+
+FILE *stratum_record_file;
+float opt_stratum_replay_speed = 1.;
+
+struct stratum_replay_line {
+	long long time_us;
+	char *line;
+	size_t len;
+};
+
+static struct stratum_replay_line *sr_lines;
+static size_t sr_lines_count;
+static char *sr_xnonce1;
+static int sr_xnonce2sz = 4;
+static SOCKETTYPE sr_listener = INVSOCK;
+
+void stratum_record(const struct pool * const pool, const char * const line)
+{
+	bytes_t buf = BYTES_INIT;
+	struct timeval tv;
+	char prefix[0x40];
+	int len;
+
+	bfg_gettimeofday(&tv);
+	len = snprintf(prefix, sizeof(prefix), "%lu.%06lu %d ",
+	               (unsigned long)tv.tv_sec, (unsigned long)tv.tv_usec, pool->pool_no);
+	bytes_append(&buf, prefix, len);
+	bytes_append(&buf, line, strlen(line));
+	bytes_append(&buf, "\n", 1);
+	if (!log_file_write(stratum_record_file, bytes_buf(&buf), bytes_len(&buf)))
+		applog(LOG_ERR, "Stratum recording write error");
+	bytes_free(&buf);
+}
+
+// Keeps a recorded line if it is something the server should replay
+static
+void stratum_replay_consider(const long long time_us, const char * const line)
+{
+	json_t *val, *res, *method;
+	const char *s;
+
+	val = JSON_LOADS(line, NULL);
+	if (!val)
+		return;
+
+	method = json_object_get(val, "method");
+	if (method && !json_is_null(method))
+	{
+		s = json_string_value(method);
+		// Reconnecting would only take the miner away from the replay
+		if (s && strcasecmp(s, "client.reconnect"))
+		{
+			sr_lines = realloc(sr_lines, sizeof(*sr_lines) * (sr_lines_count + 1));
+			if (unlikely(!sr_lines))
+				quit(1, "Failed to realloc %s", "sr_lines");
+			sr_lines[sr_lines_count++] = (struct stratum_replay_line){
+				.time_us = time_us,
+				.line = strdup(line),
+				.len = strlen(line),
+			};
+		}
+	}
+	else
+	if (!sr_xnonce1)
+	{
+		// The first subscribe response provides the extranonce to hand out
+		res = json_object_get(val, "result");
+		if (json_is_array(res) && json_array_size(res) >= 3
+		 && json_is_string(json_array_get(res, 1)) && json_is_integer(json_array_get(res, 2)))
+		{
+			sr_xnonce1 = strdup(json_string_value(json_array_get(res, 1)));
+			sr_xnonce2sz = json_integer_value(json_array_get(res, 2));
+		}
+	}
+	json_decref(val);
+}
+
+/* Loads a recording and opens the listener the replay pool will connect to;
+ * returns an error message, or NULL with *out_port set */
+char *stratum_replay_prepare(const char * const path, int * const out_port)
+{
+	struct sockaddr_in sa;
+	socklen_t salen = sizeof(sa);
+	char *line = NULL, *p;
+	size_t linesz = 0;
+	long long time_us;
+	unsigned long sec, usec;
+	int pool_no, first_pool = -1, n;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return "Failed to open stratum recording";
+	line = malloc(linesz = 0x10000);
+	if (unlikely(!line))
+		quit(1, "Failed to malloc %s", "line");
+	while (fgets(line, linesz, fp))
+	{
+		while (!strchr(line, '\n') && !feof(fp))
+		{
+			// Notifications with long merkle branches can exceed the buffer
+			line = realloc(line, linesz * 2);
+			if (unlikely(!line))
+				quit(1, "Failed to realloc %s", "line");
+			if (!fgets(&line[linesz - 1], linesz + 1, fp))
+				break;
+			linesz *= 2;
+		}
+		if (sscanf(line, "%lu.%lu %d %n", &sec, &usec, &pool_no, &n) < 3)
+			continue;
+		if (first_pool < 0)
+			first_pool = pool_no;
+		if (pool_no != first_pool)
+			continue;
+		p = &line[n];
+		p[strcspn(p, "\r\n")] = '\0';
+		time_us = ((long long)sec * 1000000) + usec;
+		stratum_replay_consider(time_us, p);
+	}
+	free(line);
+	fclose(fp);
+
+	if (!sr_lines_count)
+		return "No stratum notifications found in recording";
+	if (!sr_xnonce1)
+		sr_xnonce1 = strdup("00000000");
+
+	sr_listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sr_listener == INVSOCK)
+		return "Failed to create stratum replay socket";
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sa.sin_port = 0;
+	if (SOCKETFAIL(bind(sr_listener, (struct sockaddr *)&sa, sizeof(sa)))
+	 || SOCKETFAIL(listen(sr_listener, 1))
+	 || SOCKETFAIL(getsockname(sr_listener, (struct sockaddr *)&sa, &salen)))
+	{
+		CLOSESOCKET(sr_listener);
+		sr_listener = INVSOCK;
+		return "Failed to listen for stratum replay";
+	}
+
+	*out_port = ntohs(sa.sin_port);
+	return NULL;
+}
+
+static
+bool stratum_replay_send(const SOCKETTYPE fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len)
+	{
+		n = send(fd, buf, len, 0);
+		if (SOCKETFAIL(n))
+			return false;
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+struct stratum_replay_conn {
+	SOCKETTYPE fd;
+	bytes_t rbuf;
+	bool started;
+	struct timeval tv_start;
+	size_t pos;
+	unsigned long submits;
+};
+
+// Answers a request from the miner; returns false if the connection should close
+static
+bool stratum_replay_request(struct stratum_replay_conn * const conn, const char * const line)
+{
+	json_t *val, *id, *reply, *res;
+	const char *method;
+	char *s;
+	bool rv;
+
+	val = JSON_LOADS(line, NULL);
+	if (!val)
+		return true;
+	id = json_object_get(val, "id");
+	method = json_string_value(json_object_get(val, "method"));
+	if (!method || !id || json_is_null(id))
+	{
+		json_decref(val);
+		return true;
+	}
+
+	if (!strcasecmp(method, "mining.subscribe"))
+	{
+		res = json_pack("[[[ss]]si]", "mining.notify", "replay", sr_xnonce1, sr_xnonce2sz);
+		if (!conn->started)
+		{
+			conn->started = true;
+			cgtime(&conn->tv_start);
+		}
+	}
+	else
+	{
+		if (!strcasecmp(method, "mining.submit"))
+			++conn->submits;
+		res = json_true();
+	}
+
+	reply = json_pack("{sOsosn}", "id", id, "result", res, "error");
+	s = json_dumps(reply, JSON_COMPACT);
+	rv = s && stratum_replay_send(conn->fd, s, strlen(s)) && stratum_replay_send(conn->fd, "\n", 1);
+	free(s);
+	json_decref(reply);
+	json_decref(val);
+	return rv;
+}
+
+// Microseconds until the next recorded line is due, or -1 if none is pending
+static
+long long stratum_replay_due_us(const struct stratum_replay_conn * const conn)
+{
+	long long due;
+
+	if (!conn->started || conn->pos >= sr_lines_count)
+		return -1;
+	if (opt_stratum_replay_speed <= 0)
+		return 0;
+	due = (sr_lines[conn->pos].time_us - sr_lines[0].time_us) / opt_stratum_replay_speed;
+	due -= timer_elapsed_us(&conn->tv_start, NULL);
+	return (due > 0) ? due : 0;
+}
+
+static
+void stratum_replay_serve(struct stratum_replay_conn * const conn)
+{
+	struct timeval tv, *tvp;
+	long long due;
+	ssize_t n, eol;
+	fd_set rfds;
+
+	while (true)
+	{
+		while ((due = stratum_replay_due_us(conn)) == 0)
+		{
+			const struct stratum_replay_line * const rl = &sr_lines[conn->pos++];
+			if (!(stratum_replay_send(conn->fd, rl->line, rl->len) && stratum_replay_send(conn->fd, "\n", 1)))
+				return;
+			if (conn->pos == sr_lines_count)
+			{
+				const double secs = timer_elapsed_us(&conn->tv_start, NULL) / 1e6;
+				applog(LOG_NOTICE, "Stratum replay finished: %lu lines in %.3f seconds, %lu shares submitted (%.2f/s)",
+				       (unsigned long)sr_lines_count, secs, conn->submits, secs > 0 ? (conn->submits / secs) : 0.);
+			}
+		}
+
+		tvp = NULL;
+		if (due > 0)
+		{
+			tv.tv_sec = due / 1000000;
+			tv.tv_usec = due % 1000000;
+			tvp = &tv;
+		}
+		FD_ZERO(&rfds);
+		FD_SET(conn->fd, &rfds);
+		if (select(conn->fd + 1, &rfds, NULL, NULL, tvp) < 0)
+			return;
+		if (!FD_ISSET(conn->fd, &rfds))
+			continue;
+
+		n = recv(conn->fd, bytes_preappend(&conn->rbuf, 0x1000), 0x1000, 0);
+		if (n <= 0)
+			return;
+		bytes_postappend(&conn->rbuf, n);
+		while ((eol = bytes_find(&conn->rbuf, '\n')) >= 0)
+		{
+			bytes_buf(&conn->rbuf)[eol] = '\0';
+			if (!stratum_replay_request(conn, (char *)bytes_buf(&conn->rbuf)))
+				return;
+			bytes_shift(&conn->rbuf, eol + 1);
+		}
+	}
+}
+
+static
+void *stratum_replay_thread(__maybe_unused void * const userp)
+{
+	struct stratum_replay_conn conn;
+
+	RenameThread("stratum_replay");
+
+	while (true)
+	{
+		conn = (struct stratum_replay_conn){
+			.fd = accept(sr_listener, NULL, NULL),
+			.rbuf = BYTES_INIT,
+		};
+		if (conn.fd == INVSOCK)
+		{
+			applog(LOG_ERR, "Stratum replay accept failed: %s", SOCKERRMSG);
+			cgsleep_ms(1000);
+			continue;
+		}
+		applog(LOG_NOTICE, "Stratum replay: serving %lu recorded lines at %gx speed",
+		       (unsigned long)sr_lines_count, opt_stratum_replay_speed);
+
+		stratum_replay_serve(&conn);
+
+		// Each new connection starts the recording over
+		applog(LOG_NOTICE, "Stratum replay: connection closed after %lu of %lu lines",
+		       (unsigned long)conn.pos, (unsigned long)sr_lines_count);
+		CLOSESOCKET(conn.fd);
+		bytes_free(&conn.rbuf);
+	}
+
+	return NULL;
+}
+
+// Whether --stratum-replay is in use, once options are parsed
+bool stratum_replay_active(void)
+{
+	return sr_listener != INVSOCK;
+}
+
+void stratum_replay_start(void)
+{
+	pthread_t pth;
+
+	if (sr_listener == INVSOCK)
+		return;
+	if (unlikely(pthread_create(&pth, NULL, stratum_replay_thread, NULL)))
+		quit(1, "stratum replay thread create failed");
+	pthread_detach(pth);
+}
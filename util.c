@@ -25,6 +25,7 @@
 #include <curl/curl.h>
 #include <time.h>
 #include <errno.h>
+#include <math.h>
 #include <unistd.h>
 #include <sys/types.h>
 #ifdef HAVE_SYS_PRCTL_H
@@ -58,6 +59,7 @@
 #include "miner.h"
 #include "compat.h"
 #include "util.h"
+#include "sha2.h"
 
 #define DEFAULT_SOCKWAIT 60
 
@@ -677,9 +679,32 @@ char *absolute_uri(char *uri, const char *ref)
 
 static const char _hexchars[0x10] = "0123456789abcdef";
 
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#  define USE_BIN2HEX_VECTOR
+typedef uint8_t bin2hex_v16 __attribute__((vector_size(16)));
+#endif
+
 void bin2hex(char *out, const void *in, size_t len)
 {
 	const unsigned char *p = in;
+#ifdef USE_BIN2HEX_VECTOR
+	// 16 bytes at a time: 'a'-'9'-1 is added to the digits of nibbles above 9
+	static const bin2hex_v16 lo_order = {0,16,1,17,2,18,3,19,4,20,5,21,6,22,7,23};
+	static const bin2hex_v16 hi_order = {8,24,9,25,10,26,11,27,12,28,13,29,14,30,15,31};
+	bin2hex_v16 v, hi, lo;
+	for ( ; len >= sizeof(v); len -= sizeof(v), p += sizeof(v), out += sizeof(v) * 2)
+	{
+		memcpy(&v, p, sizeof(v));
+		hi = v >> 4;
+		lo = v & 0xf;
+		hi += '0' + ((bin2hex_v16)(hi > 9) & 39);
+		lo += '0' + ((bin2hex_v16)(lo > 9) & 39);
+		v = __builtin_shuffle(hi, lo, lo_order);
+		memcpy(out, &v, sizeof(v));
+		v = __builtin_shuffle(hi, lo, hi_order);
+		memcpy(&out[sizeof(v)], &v, sizeof(v));
+	}
+#endif
 	while (len--)
 	{
 		(out++)[0] = _hexchars[p[0] >> 4];
@@ -769,6 +794,22 @@ void hash_data(unsigned char *out_hash, const unsigned char *data)
 	gen_hash(blkheader, out_hash, 80);
 }
 
+// Same as hash_data for count headers at once, using the multi-lane SHA256 engine
+void hash_data_multi(unsigned char * const *out_hashes, const unsigned char * const *datas, const unsigned count)
+{
+	unsigned char blkheaders[count ?: 1][80];
+	const unsigned char *pblkheaders[count ?: 1];
+	unsigned i;
+	
+	for (i = 0; i < count; ++i)
+	{
+		swap32yes(blkheaders[i], datas[i], 80 / 4);
+		pblkheaders[i] = blkheaders[i];
+	}
+	
+	sha256d_multi(pblkheaders, 80, out_hashes, count);
+}
+
 // Example output: 0000000000000000000000000000000000000000000000000000ffff00000000 (bdiff 1)
 void real_block_target(unsigned char *target, const unsigned char *data)
 {
@@ -1560,36 +1601,55 @@ enum send_ret {
 	SEND_INACTIVE
 };
 
+#ifdef __APPLE__
+#	define STRATUM_SEND_FLAGS  SO_NOSIGPIPE
+#elif defined(WIN32)
+#	define STRATUM_SEND_FLAGS  0
+#else
+#	define STRATUM_SEND_FLAGS  MSG_NOSIGNAL
+#endif
+#ifdef MSG_DONTWAIT
+#	define STRATUM_SEND_NONBLOCK  MSG_DONTWAIT
+#else
+#	define STRATUM_SEND_NONBLOCK  0
+#endif
+
+static bool socket_writable(SOCKETTYPE sock, int wait)
+{
+	struct timeval timeout = {wait, 0};
+	fd_set wd;
+
+	FD_ZERO(&wd);
+	FD_SET(sock, &wd);
+	return (select(sock + 1, NULL, &wd, NULL, &timeout) > 0);
+}
+
 /* Send a single command across a socket, appending \n to it. This should all
- * be done under stratum lock except when first establishing the socket */
-static enum send_ret __stratum_send(struct pool *pool, char *s, ssize_t len)
+ * be done under stratum lock except when first establishing the socket.
+ * Sends never block; we only wait (up to a second at a time) for the socket
+ * when its send buffer is actually full */
+static enum send_ret __stratum_send(struct pool *pool, const char *s, ssize_t len)
 {
 	SOCKETTYPE sock = pool->sock;
+	bytes_t * const sendbuf = &pool->sendbuf;
 	ssize_t ssent = 0;
 
-	strcat(s, "\n");
-	len++;
+	// Line and newline go out together, without touching the caller's buffer
+	bytes_reset(sendbuf);
+	bytes_append(sendbuf, s, len);
+	bytes_append(sendbuf, "\n", 1);
+	len = bytes_len(sendbuf);
 
 	while (len > 0 ) {
-		struct timeval timeout = {1, 0};
 		ssize_t sent;
-		fd_set wd;
 
-		FD_ZERO(&wd);
-		FD_SET(sock, &wd);
-		if (select(sock + 1, NULL, &wd, NULL, &timeout) < 1)
-			return SEND_SELECTFAIL;
-#ifdef __APPLE__
-		sent = send(pool->sock, s + ssent, len, SO_NOSIGPIPE);
-#elif WIN32
-		sent = send(pool->sock, s + ssent, len, 0);
-#else
-		sent = send(pool->sock, s + ssent, len, MSG_NOSIGNAL);
-#endif
+		sent = send(sock, (void *)&bytes_buf(sendbuf)[ssent], len, STRATUM_SEND_FLAGS | STRATUM_SEND_NONBLOCK);
 		if (sent < 0) {
 			if (!sock_blocks())
 				return SEND_SENDFAIL;
-			sent = 0;
+			if (!socket_writable(sock, 1))
+				return SEND_SELECTFAIL;
+			continue;
 		}
 		ssent += sent;
 		len -= sent;
@@ -1602,7 +1662,7 @@ static enum send_ret __stratum_send(struct pool *pool, char *s, ssize_t len)
 	return SEND_OK;
 }
 
-bool _stratum_send(struct pool *pool, char *s, ssize_t len, bool force)
+bool _stratum_send(struct pool *pool, const char *s, ssize_t len, bool force)
 {
 	enum send_ret ret = SEND_INACTIVE;
 
@@ -1657,7 +1717,7 @@ static bool socket_full(struct pool *pool, int wait)
 /* Check to see if Santa's been good to you */
 bool sock_full(struct pool *pool)
 {
-	if (strlen(pool->sockbuf))
+	if (pool->sockbuf_len)
 		return true;
 
 	return (socket_full(pool, 0));
@@ -1665,7 +1725,7 @@ bool sock_full(struct pool *pool)
 
 static void clear_sockbuf(struct pool *pool)
 {
-	strcpy(pool->sockbuf, "");
+	pool->sockbuf_off = pool->sockbuf_len = pool->sockbuf_scanned = 0;
 }
 
 static void clear_sock(struct pool *pool)
@@ -1684,36 +1744,64 @@ static void clear_sock(struct pool *pool)
 	clear_sockbuf(pool);
 }
 
-/* Make sure the pool sockbuf is large enough to cope with any coinbase size
- * by reallocing it to a large enough size rounded up to a multiple of RBUFSIZE
- * and zeroing the new memory */
+/* Make sure the pool sockbuf has room for len more bytes after its unread
+ * data, moving that to the start of the buffer if needed, and otherwise
+ * reallocing it to a large enough size rounded up to a multiple of RBUFSIZE */
 static void recalloc_sock(struct pool *pool, size_t len)
 {
-	size_t old, new;
+	size_t new;
 
-	old = strlen(pool->sockbuf);
-	new = old + len + 1;
-	if (new < pool->sockbuf_size)
+	if (pool->sockbuf_off + pool->sockbuf_len + len <= pool->sockbuf_size)
 		return;
+	if (pool->sockbuf_off) {
+		memmove(pool->sockbuf, &pool->sockbuf[pool->sockbuf_off], pool->sockbuf_len);
+		pool->sockbuf_off = 0;
+		if (pool->sockbuf_len + len <= pool->sockbuf_size)
+			return;
+	}
+	new = pool->sockbuf_len + len;
 	new = new + (RBUFSIZE - (new % RBUFSIZE));
 	// Avoid potentially recursive locking
 	// applog(LOG_DEBUG, "Recallocing pool sockbuf to %lu", (unsigned long)new);
 	pool->sockbuf = realloc(pool->sockbuf, new);
 	if (!pool->sockbuf)
 		quithere(1, "Failed to realloc pool sockbuf");
-	memset(pool->sockbuf + old, 0, new - old);
 	pool->sockbuf_size = new;
 }
 
-/* Peeks at a socket to find the first end of line and then reads just that
- * from the socket and returns that as a malloced char */
+/* Finds the end of the first line of unread data, skipping blank lines and
+ * only searching bytes that arrived since the last look */
+static char *sockbuf_eol(struct pool *pool)
+{
+	char *buf, *eol;
+
+	while (pool->sockbuf_len) {
+		buf = &pool->sockbuf[pool->sockbuf_off];
+		eol = memchr(&buf[pool->sockbuf_scanned], '\n', pool->sockbuf_len - pool->sockbuf_scanned);
+		if (!eol) {
+			pool->sockbuf_scanned = pool->sockbuf_len;
+			return NULL;
+		}
+		if (eol != buf)
+			return eol;
+		++pool->sockbuf_off;
+		--pool->sockbuf_len;
+	}
+	clear_sockbuf(pool);
+	return NULL;
+}
+
+/* Returns the next line from the pool's socket, waiting for it if needed. The
+ * line is NUL terminated in place in the pool sockbuf, so it must not be freed
+ * and is only valid until the next recv_line or reconnect of this pool */
 char *recv_line(struct pool *pool)
 {
-	char *tok, *sret = NULL;
-	ssize_t len, buflen;
+	char *eol, *sret = NULL;
+	size_t len;
 	int waited = 0;
 
-	if (!strstr(pool->sockbuf, "\n")) {
+	eol = sockbuf_eol(pool);
+	if (!eol) {
 		struct timeval rstart, now;
 
 		cgtime(&rstart);
@@ -1723,12 +1811,10 @@ char *recv_line(struct pool *pool)
 		}
 
 		do {
-			char s[RBUFSIZE];
-			size_t slen;
 			ssize_t n;
 
-			memset(s, 0, RBUFSIZE);
-			n = recv(pool->sock, s, RECVSIZE, 0);
+			recalloc_sock(pool, RECVSIZE);
+			n = recv(pool->sock, &pool->sockbuf[pool->sockbuf_off + pool->sockbuf_len], RECVSIZE, 0);
 			if (!n) {
 				applog(LOG_DEBUG, "Socket closed waiting in recv_line");
 				suspend_stratum(pool);
@@ -1746,28 +1832,25 @@ char *recv_line(struct pool *pool)
 					break;
 				}
 			} else {
-				slen = strlen(s);
-				recalloc_sock(pool, slen);
-				strcat(pool->sockbuf, s);
+				pool->sockbuf_len += n;
+				eol = sockbuf_eol(pool);
 			}
-		} while (waited < DEFAULT_SOCKWAIT && !strstr(pool->sockbuf, "\n"));
-	}
+		} while (waited < DEFAULT_SOCKWAIT && !eol);
 
-	buflen = strlen(pool->sockbuf);
-	tok = strtok(pool->sockbuf, "\n");
-	if (!tok) {
-		applog(LOG_DEBUG, "Failed to parse a \\n terminated string in recv_line");
-		goto out;
+		if (!eol) {
+			applog(LOG_DEBUG, "Failed to parse a \\n terminated string in recv_line");
+			goto out;
+		}
 	}
-	sret = strdup(tok);
-	len = strlen(sret);
 
-	/* Copy what's left in the buffer after the \n, including the
-	 * terminating \0 */
-	if (buflen > len + 1)
-		memmove(pool->sockbuf, pool->sockbuf + len + 1, buflen - len + 1);
-	else
-		strcpy(pool->sockbuf, "");
+	sret = &pool->sockbuf[pool->sockbuf_off];
+	len = eol - sret;
+	*eol = '\0';
+	pool->sockbuf_off += len + 1;
+	pool->sockbuf_len -= len + 1;
+	pool->sockbuf_scanned = 0;
+	if (!pool->sockbuf_len)
+		pool->sockbuf_off = 0;
 
 	pool->cgminer_pool_stats.times_received++;
 	pool->cgminer_pool_stats.bytes_received += len;
@@ -1777,8 +1860,12 @@ char *recv_line(struct pool *pool)
 out:
 	if (!sret)
 		clear_sock(pool);
-	else if (opt_protocol)
-		applog(LOG_DEBUG, "Pool %u: RECV: %s", pool->pool_no, sret);
+	else {
+		if (opt_protocol)
+			applog(LOG_DEBUG, "Pool %u: RECV: %s", pool->pool_no, sret);
+		if (unlikely(stratum_record_file))
+			stratum_record(pool, sret);
+	}
 	return sret;
 }
 
@@ -1873,7 +1960,7 @@ void stratum_probe_transparency(struct pool *pool)
 static bool parse_notify(struct pool *pool, json_t *val)
 {
 	const char *prev_hash, *coinbase1, *coinbase2, *bbversion, *nbit, *ntime;
-	char *job_id;
+	const char *job_id;
 	bool clean, ret = false;
 	int merkles, i;
 	size_t cb1_len, cb2_len;
@@ -1899,14 +1986,14 @@ static bool parse_notify(struct pool *pool, json_t *val)
 	if (!prev_hash || !coinbase1 || !coinbase2 || !bbversion || !nbit || !ntime)
 		goto out;
 	
-	job_id = json_array_string(val, 0);
+	job_id = __json_array_string(val, 0);
 	if (!job_id)
 		goto out;
 
 	cg_wlock(&pool->data_lock);
 	cgtime(&pool->swork.tv_received);
-	free(pool->swork.job_id);
-	pool->swork.job_id = job_id;
+	rcstr_free(pool->swork.job_id);
+	pool->swork.job_id = rcstr_dup(job_id);
 	pool->submit_old = !clean;
 	pool->swork.clean = true;
 	
@@ -1931,6 +2018,7 @@ static bool parse_notify(struct pool *pool, json_t *val)
 	for (i = 0; i < merkles; i++)
 		hex2bin(&bytes_buf(&pool->swork.merkle_bin)[i * 32], json_string_value(json_array_get(arr, i)), 32);
 	pool->swork.merkles = merkles;
+	stratum_work_prepare_midstate(&pool->swork);
 	pool->nonce2 = 0;
 	cg_wunlock(&pool->data_lock);
 
@@ -2066,21 +2154,14 @@ static bool stratum_show_message(struct pool *pool, json_t *val, json_t *params)
 	return true;
 }
 
-bool parse_method(struct pool *pool, char *s)
+bool parse_method(struct pool *pool, json_t *val)
 {
-	json_t *val = NULL, *method, *err_val, *params;
-	json_error_t err;
+	json_t *method, *err_val, *params;
 	bool ret = false;
 	const char *buf;
 
-	if (!s)
-		goto out;
-
-	val = JSON_LOADS(s, &err);
-	if (!val) {
-		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
+	if (!val)
 		goto out;
-	}
 
 	method = json_object_get(val, "method");
 	if (!method)
@@ -2135,13 +2216,10 @@ bool parse_method(struct pool *pool, char *s)
 		goto out;
 	}
 out:
-	if (val)
-		json_decref(val);
-
 	return ret;
 }
 
-extern bool parse_stratum_response(struct pool *, char *s);
+extern bool parse_stratum_response(struct pool *, json_t *val);
 
 bool auth_stratum(struct pool *pool)
 {
@@ -2161,14 +2239,17 @@ bool auth_stratum(struct pool *pool)
 		sret = recv_line(pool);
 		if (!sret)
 			goto out;
-		if (parse_method(pool, sret))
-			free(sret);
-		else
+		val = JSON_LOADS(sret, &err);
+		if (!val) {
+			applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
+			goto out;
+		}
+		if (!parse_method(pool, val))
 			break;
+		json_decref(val);
+		val = NULL;
 	}
 
-	val = JSON_LOADS(sret, &err);
-	free(sret);
 	res_val = json_object_get(val, "result");
 	err_val = json_object_get(val, "error");
 
@@ -2225,8 +2306,7 @@ static bool setup_stratum_curl(struct pool *pool)
 	pool->stratum_curl = curl_easy_init();
 	if (unlikely(!pool->stratum_curl))
 		quithere(1, "Failed to curl_easy_init");
-	if (pool->sockbuf)
-		pool->sockbuf[0] = '\0';
+	clear_sockbuf(pool);
 
 	curl = pool->stratum_curl;
 
@@ -2392,7 +2472,6 @@ resend:
 		goto out;
 
 	val = JSON_LOADS(sret, &err);
-	free(sret);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
 		goto out;
@@ -2437,9 +2516,10 @@ resend:
 	cg_wlock(&pool->data_lock);
 	free(pool->sessionid);
 	pool->sessionid = sessionid;
-	free(pool->nonce1);
-	pool->nonce1 = nonce1;
+	rcstr_free(pool->nonce1);
+	pool->nonce1 = rcstr_dup(nonce1);
 	pool->n1_len = strlen(nonce1) / 2;
+	free(nonce1);
 	pool->n2size = n2size;
 	pool->nonce2sz  = (n2size > sizeof(pool->nonce2)) ? sizeof(pool->nonce2) : n2size;
 #ifdef WORDS_BIGENDIAN
@@ -2626,6 +2706,7 @@ void RenameThread(const char* name)
 	// Prevent warnings for unused parameters...
 	(void)name;
 #endif
+	thread_role_start(name);
 }
 
 static pthread_key_t key_bfgtls;
@@ -2939,6 +3020,130 @@ void _bytes_alloc_failure(size_t sz)
 }
 
 
+static
+unsigned latency_hist_bucket(const uint64_t usecs)
+{
+	unsigned bits;
+
+	if (usecs < LATENCY_HIST_SUB)
+		return usecs;
+	// Position of the top bit picks the group, the next few the bucket in it
+	bits = 63 - __builtin_clzll(usecs);
+	return ((bits - LATENCY_HIST_SUB_BITS + 1) * LATENCY_HIST_SUB) + ((usecs >> (bits - LATENCY_HIST_SUB_BITS)) - LATENCY_HIST_SUB);
+}
+
+static
+uint64_t latency_hist_bucket_start(const unsigned bucket)
+{
+	const unsigned group = bucket / LATENCY_HIST_SUB;
+
+	if (!group)
+		return bucket;
+	return (uint64_t)(LATENCY_HIST_SUB + (bucket % LATENCY_HIST_SUB)) << (group - 1);
+}
+
+void latency_hist_add(struct latency_hist * const hist, const uint64_t usecs)
+{
+	if (usecs >> LATENCY_HIST_MAX_BITS)
+		__sync_fetch_and_add(&hist->overflow, 1);
+	else
+		__sync_fetch_and_add(&hist->buckets[latency_hist_bucket(usecs)], 1);
+	__sync_fetch_and_add(&hist->sum_us, usecs);
+	__sync_fetch_and_add(&hist->count, 1);
+}
+
+uint64_t latency_hist_cumulative(const struct latency_hist * const hist, const uint64_t * const bounds_us, const unsigned nbounds, uint64_t * const counts)
+{
+	uint64_t seen = 0;
+	unsigned i, j = 0;
+
+	for (i = 0; i < LATENCY_HIST_BUCKETS; ++i)
+	{
+		// A bucket only counts towards a bound it lies wholly within
+		while (j < nbounds && latency_hist_bucket_start(i + 1) > bounds_us[j] + 1)
+			counts[j++] = seen;
+		seen += hist->buckets[i];
+	}
+	while (j < nbounds)
+		counts[j++] = seen;
+	// Overflowed durations are past every bound that can be told apart
+	return seen + hist->overflow;
+}
+
+uint64_t latency_hist_percentile(const struct latency_hist * const hist, const double pct)
+{
+	const uint32_t count = hist->count;
+	uint64_t want, seen = 0;
+	unsigned i;
+
+	if (!count)
+		return 0;
+	want = (uint64_t)ceil(count * pct / 100.);
+	if (want < 1)
+		want = 1;
+	for (i = 0; i < LATENCY_HIST_BUCKETS; ++i)
+	{
+		seen += hist->buckets[i];
+		if (seen >= want)
+			break;
+	}
+	// Beyond what the buckets cover, so all that is known is the lower bound
+	if (i == LATENCY_HIST_BUCKETS)
+		return (uint64_t)1 << LATENCY_HIST_MAX_BITS;
+	// Middle of the bucket
+	return (latency_hist_bucket_start(i) + latency_hist_bucket_start(i + 1)) / 2;
+}
+
+
+struct rcstr {
+	unsigned refcount;
+	char s[];
+};
+
+static pthread_mutex_t rcstr_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline
+struct rcstr *_rcstr(const char * const s)
+{
+	return (void*)(s - offsetof(struct rcstr, s));
+}
+
+char *rcstr_dup(const char * const s)
+{
+	const size_t sz = strlen(s) + 1;
+	struct rcstr * const rcs = malloc(sizeof(*rcs) + sz);
+	if (unlikely(!rcs))
+		quit(1, "%s: Failed to allocate %lu bytes", __func__, (unsigned long)sz);
+	rcs->refcount = 1;
+	memcpy(rcs->s, s, sz);
+	return rcs->s;
+}
+
+char *rcstr_ref(char * const s)
+{
+	if (!s)
+		return NULL;
+	mutex_lock(&rcstr_lock);
+	++_rcstr(s)->refcount;
+	mutex_unlock(&rcstr_lock);
+	return s;
+}
+
+void rcstr_free(char * const s)
+{
+	bool free_me;
+	
+	if (!s)
+		return;
+	struct rcstr * const rcs = _rcstr(s);
+	mutex_lock(&rcstr_lock);
+	free_me = !--rcs->refcount;
+	mutex_unlock(&rcstr_lock);
+	if (free_me)
+		free(rcs);
+}
+
+
 void *cmd_thread(void *cmdp)
 {
 	const char *cmd = cmdp;
@@ -123,6 +123,7 @@ extern char *ucs2_to_utf8_dup(uint16_t *in, size_t sz);
 
 extern void gen_hash(unsigned char *data, unsigned char *hash, int len);
 extern void hash_data(unsigned char *out_hash, const unsigned char *data);
+extern void hash_data_multi(unsigned char * const *out_hashes, const unsigned char * const *datas, unsigned count);
 extern void real_block_target(unsigned char *target, const unsigned char *data);
 extern bool hash_target_check(const unsigned char *hash, const unsigned char *target);
 extern bool hash_target_check_v(const unsigned char *hash, const unsigned char *target);
@@ -157,11 +158,11 @@ int cgtimer_to_ms(cgtimer_t *cgt)
 #define cgtimer_sub(a, b, res)  timersub(a, b, res)
 double us_tdiff(struct timeval *end, struct timeval *start);
 double tdiff(struct timeval *end, struct timeval *start);
-bool _stratum_send(struct pool *pool, char *s, ssize_t len, bool force);
+bool _stratum_send(struct pool *pool, const char *s, ssize_t len, bool force);
 #define stratum_send(pool, s, len)  _stratum_send(pool, s, len, false)
 bool sock_full(struct pool *pool);
 char *recv_line(struct pool *pool);
-bool parse_method(struct pool *pool, char *s);
+bool parse_method(struct pool *pool, json_t *val);
 bool extract_sockaddr(char *url, char **sockaddr_url, char **sockaddr_port);
 bool auth_stratum(struct pool *pool);
 bool initiate_stratum(struct pool *pool);
@@ -336,6 +337,12 @@ void bytes_free(bytes_t *b)
 }
 
 
+// Reference-counted strings, for sharing (eg, stratum job ids) between work items
+extern char *rcstr_dup(const char *);
+extern char *rcstr_ref(char *);  // Returns its argument, for convenience
+extern void rcstr_free(char *);
+
+
 static inline
 void set_maxfd(int *p_maxfd, int fd)
 {
@@ -424,6 +431,39 @@ bool timer_passed(const struct timeval *tvp_timer, const struct timeval *tvp_now
 	return timercmp(tvp_timer, _tvp_now, <);
 }
 
+
+/* Log-linear histogram of durations in microseconds (HDR style): exact below
+ * 32us, then 16 buckets per power of two, so within about 6% up to 2^32us
+ * (~71 min); anything longer is only counted, in overflow */
+#define LATENCY_HIST_SUB_BITS  4
+#define LATENCY_HIST_SUB  (1 << LATENCY_HIST_SUB_BITS)
+#define LATENCY_HIST_MAX_BITS  32
+#define LATENCY_HIST_BUCKETS  (LATENCY_HIST_SUB * (LATENCY_HIST_MAX_BITS - LATENCY_HIST_SUB_BITS + 1))
+
+struct latency_hist {
+	uint32_t count;
+	uint64_t sum_us;
+	uint32_t buckets[LATENCY_HIST_BUCKETS];
+	uint32_t overflow;
+};
+
+// Safe to call from any thread without locking
+extern void latency_hist_add(struct latency_hist *, uint64_t usecs);
+// Duration value at the given percentile (0-100), in microseconds; 2^32 if it is in overflow, as a lower bound
+extern uint64_t latency_hist_percentile(const struct latency_hist *, double pct);
+// Counts of durations up to each of the ascending bounds (to bucket precision), returning the total including overflow
+extern uint64_t latency_hist_cumulative(const struct latency_hist *, const uint64_t *bounds_us, unsigned nbounds, uint64_t *counts);
+
+static inline
+void latency_hist_add_tv(struct latency_hist * const hist, const struct timeval * const tvp_from, const struct timeval * const tvp_to)
+{
+	if (!(timer_isset(tvp_from) && timer_isset(tvp_to)))
+		return;
+	if (timercmp(tvp_to, tvp_from, <))
+		return;
+	latency_hist_add(hist, timer_elapsed_us(tvp_from, tvp_to));
+}
+
 #if defined(WIN32) && !defined(HAVE_POOR_GETTIMEOFDAY)
 #define HAVE_POOR_GETTIMEOFDAY
 #endif